@@ -0,0 +1,283 @@
+/*
+ * Huffman entropy coder for lzjody blocks
+ *
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * Released under The MIT License
+ *
+ * Codes a buffer of bytes (the commands and literals of a compressed
+ * block) with a canonical Huffman code of at most HUFF_MAX_BITS bits per
+ * symbol. The buffer is cut into four equal quarters, each coded as its
+ * own bit stream, so the decoder can work on all four at once and is not
+ * held up waiting for one long chain of dependent table lookups.
+ *
+ * Coded data layout:
+ * - last symbol with a code (one byte)
+ * - code lengths for symbols 0 to last, two 4-bit lengths per byte with
+ *   the even symbol in the high half; 0 means no code
+ * - byte sizes of streams 0-3, big-endian, 2 bytes each (3 if wide)
+ * - streams 0-3; each is MSB-first and padded with zero bits to a byte
+ * The coded data says where it ends, so more data can follow it.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "huffman.h"
+
+/* Longest code; the decoder's lookup table has 1 << HUFF_MAX_BITS entries */
+#define HUFF_MAX_BITS 11
+#define HUFF_TABLE (1 << HUFF_MAX_BITS)
+#define HUFF_STREAMS 4
+
+/* Bit stream being decoded; reads past the end are fed zero bytes */
+struct huff_stream {
+	const unsigned char *in;
+	unsigned int pos;
+	unsigned int end;
+	uint64_t buf;	/* Unconsumed bits, next bit in the top position */
+	unsigned int bits;	/* Number of valid bits in buf */
+};
+
+static int key_compare(const void * const a, const void * const b)
+{
+	const uint32_t ka = *(const uint32_t *)a;
+	const uint32_t kb = *(const uint32_t *)b;
+
+	return (ka > kb) - (ka < kb);
+}
+
+
+/* Find code lengths for the symbol counts in freq
+ * Counts are halved until the longest code fits in HUFF_MAX_BITS */
+static void huff_lengths(const uint32_t * const freq, unsigned char * const len)
+{
+	uint32_t key[256], weight[512];
+	uint16_t parent[512];
+	unsigned char depth[512];
+	unsigned int n, i, leaf, node, next, pick[2], k, shift = 0;
+
+	memset(len, 0, 256);
+	for (;;) {
+		/* Sort the used symbols by weight (the low 8 bits keep ties stable) */
+		n = 0;
+		for (i = 0; i < 256; i++) if (freq[i] != 0)
+			key[n++] = ((((freq[i] >> shift) | 1) & 0xffffffU) << 8) | i;
+		if (n == 1) {
+			len[key[0] & 0xff] = 1;
+			return;
+		}
+		qsort(key, n, sizeof(uint32_t), key_compare);
+		for (i = 0; i < n; i++) weight[i] = key[i] >> 8;
+
+		/* Leaves and merged nodes both come out in weight order, so the
+		 * two lightest nodes are always at the head of one of the lists */
+		leaf = 0; node = n;
+		for (next = n; next < (n * 2) - 1; next++) {
+			for (k = 0; k < 2; k++) {
+				if (leaf < n && (node == next || weight[leaf] <= weight[node]))
+					pick[k] = leaf++;
+				else pick[k] = node++;
+			}
+			weight[next] = weight[pick[0]] + weight[pick[1]];
+			parent[pick[0]] = (uint16_t)next;
+			parent[pick[1]] = (uint16_t)next;
+		}
+
+		/* Parents always come after their children */
+		depth[(n * 2) - 2] = 0;
+		k = 0;
+		for (i = (n * 2) - 2; i > 0; i--) {
+			depth[i - 1] = (unsigned char)(depth[parent[i - 1]] + 1);
+			if (i - 1 < n && depth[i - 1] > k) k = depth[i - 1];
+		}
+		if (k <= HUFF_MAX_BITS) break;
+		shift++;
+	}
+	for (i = 0; i < n; i++) len[key[i] & 0xff] = depth[i];
+	return;
+}
+
+
+/* Assign canonical codes: shorter codes first, then in symbol order */
+static int huff_codes(const unsigned char * const len, uint16_t * const code)
+{
+	unsigned int count[HUFF_MAX_BITS + 1];
+	unsigned int next[HUFF_MAX_BITS + 1];
+	unsigned int i;
+
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < 256; i++) count[len[i]]++;
+	count[0] = 0;
+	next[0] = 0;
+	for (i = 1; i <= HUFF_MAX_BITS; i++) {
+		next[i] = (next[i - 1] + count[i - 1]) << 1;
+		/* A set of lengths that overfills the code space is invalid */
+		if (next[i] + count[i] > (1U << i)) return -1;
+	}
+	for (i = 0; i < 256; i++) if (len[i] != 0) code[i] = (uint16_t)next[len[i]]++;
+	return 0;
+}
+
+
+/* Huffman code length bytes of in into out
+ * Returns the coded size, or -1 if it would be larger than limit */
+extern int huffman_encode(const unsigned char * const in, const unsigned int length,
+		unsigned char * const out, const unsigned int limit, const int wide)
+{
+	uint32_t freq[256];
+	unsigned char len[256];
+	uint16_t code[256];
+	const unsigned int sw = wide ? 3 : 2;	/* Stream size field width */
+	const unsigned int quarter = (length + HUFF_STREAMS - 1) / HUFF_STREAMS;
+	unsigned int last, head, pos, i, s, start, end, n, field;
+	uint64_t bits = 0, acc;
+
+	if (length == 0) return -1;
+	memset(freq, 0, sizeof(freq));
+	for (i = 0; i < length; i++) freq[*(in + i)]++;
+	huff_lengths(freq, len);
+	if (huff_codes(len, code) < 0) return -1;
+
+	/* Size the output exactly (give or take stream padding) first */
+	last = 255;
+	while (len[last] == 0) last--;
+	head = 1 + (last + 2) / 2 + HUFF_STREAMS * sw;
+	for (i = 0; i < 256; i++) bits += (uint64_t)freq[i] * len[i];
+	if (head + (bits >> 3) + HUFF_STREAMS > limit) return -1;
+
+	*out = (unsigned char)last;
+	for (i = 0; i <= last; i += 2)
+		*(out + 1 + i / 2) = (unsigned char)((len[i] << 4) | (i < 255 ? len[i + 1] : 0));
+
+	pos = head;
+	field = 1 + (last + 2) / 2;
+	for (s = 0; s < HUFF_STREAMS; s++) {
+		end = (s + 1) * quarter;
+		if (end > length) end = length;
+		acc = 0; n = 0;
+		start = pos;
+		for (i = s * quarter; i < end; i++) {
+			acc = (acc << len[*(in + i)]) | code[*(in + i)];
+			n += len[*(in + i)];
+			while (n >= 8) {
+				n -= 8;
+				*(out + pos) = (unsigned char)(acc >> n);
+				pos++;
+			}
+		}
+		if (n != 0) {
+			*(out + pos) = (unsigned char)(acc << (8 - n));
+			pos++;
+		}
+		n = pos - start;
+		if (wide) {
+			*(out + field) = (unsigned char)(n >> 16);
+			field++;
+		}
+		*(out + field) = (unsigned char)(n >> 8);
+		*(out + field + 1) = (unsigned char)n;
+		field += 2;
+	}
+	return (int)pos;
+}
+
+
+/* Refill a stream's bit buffer to at least 57 bits */
+#define HUFF_REFILL(a) do { \
+	while ((a).bits <= 56) { \
+		(a).buf |= (uint64_t)((a).pos < (a).end ? *((a).in + (a).pos) : 0) << (56 - (a).bits); \
+		(a).pos++; \
+		(a).bits += 8; \
+	} } while (0)
+
+/* Decode one symbol from a stream into a byte; unassigned codes fail */
+#define HUFF_DECODE(a, b) do { \
+	e = table[(a).buf >> (64 - HUFF_MAX_BITS)]; \
+	if ((e >> 8) == 0) goto error_code; \
+	(b) = (unsigned char)e; \
+	(a).buf <<= (e >> 8); \
+	(a).bits -= (e >> 8); \
+	} while (0)
+
+/* Decode coded data from the first size bytes of in into length bytes
+ * of out. Returns the size of the coded data or -1 for bad data */
+extern int huffman_decode(const unsigned char * const in, const unsigned int size,
+		unsigned char * const out, const unsigned int length, const int wide)
+{
+	uint16_t table[HUFF_TABLE];
+	unsigned char len[256];
+	uint16_t code[256];
+	struct huff_stream st[HUFF_STREAMS];
+	unsigned char *dst[HUFF_STREAMS];
+	unsigned int count[HUFF_STREAMS];
+	const unsigned int sw = wide ? 3 : 2;
+	const unsigned int quarter = (length + HUFF_STREAMS - 1) / HUFF_STREAMS;
+	unsigned int last, pos, i, j, s, first, span, n;
+	unsigned int e;
+
+	if (size == 0) return -1;
+	last = *in;
+	pos = 1 + (last + 2) / 2;
+	if (pos + HUFF_STREAMS * sw > size) return -1;
+	memset(len, 0, sizeof(len));
+	for (i = 0; i <= last; i++) {
+		len[i] = (i & 1) ? (*(in + 1 + i / 2) & 0x0f) : (*(in + 1 + i / 2) >> 4);
+		if (len[i] > HUFF_MAX_BITS) return -1;
+	}
+	if (huff_codes(len, code) < 0) return -1;
+
+	/* Every code of n bits fills 2^(HUFF_MAX_BITS - n) table entries */
+	memset(table, 0, sizeof(table));
+	for (i = 0; i < 256; i++) if (len[i] != 0) {
+		first = (unsigned int)code[i] << (HUFF_MAX_BITS - len[i]);
+		span = 1U << (HUFF_MAX_BITS - len[i]);
+		for (j = 0; j < span; j++) table[first + j] = (uint16_t)(i | (len[i] << 8));
+	}
+
+	/* Find the streams */
+	n = pos + HUFF_STREAMS * sw;
+	for (s = 0; s < HUFF_STREAMS; s++) {
+		st[s].in = in;
+		st[s].pos = n;
+		span = 0;
+		for (j = 0; j < sw; j++) span = (span << 8) | *(in + pos + j);
+		pos += sw;
+		if (span > size - n) return -1;
+		n += span;
+		st[s].end = n;
+		st[s].buf = 0;
+		st[s].bits = 0;
+		HUFF_REFILL(st[s]);
+		first = s * quarter;
+		if (first > length) first = length;
+		dst[s] = out + first;
+		count[s] = (first + quarter > length) ? length - first : quarter;
+	}
+
+	/* The last quarter is never longer than the others; decode all four
+	 * streams in step for that long, then finish the first three */
+	for (i = 0; i < count[HUFF_STREAMS - 1]; i++) {
+		HUFF_DECODE(st[0], *(dst[0] + i));
+		HUFF_DECODE(st[1], *(dst[1] + i));
+		HUFF_DECODE(st[2], *(dst[2] + i));
+		HUFF_DECODE(st[3], *(dst[3] + i));
+		HUFF_REFILL(st[0]);
+		HUFF_REFILL(st[1]);
+		HUFF_REFILL(st[2]);
+		HUFF_REFILL(st[3]);
+	}
+	for (s = 0; s < HUFF_STREAMS - 1; s++) {
+		for (j = i; j < count[s]; j++) {
+			HUFF_DECODE(st[s], *(dst[s] + j));
+			HUFF_REFILL(st[s]);
+		}
+	}
+
+	/* A stream must not have used any of the zero bytes past its end */
+	for (s = 0; s < HUFF_STREAMS; s++)
+		if (st[s].pos > st[s].end && (st[s].pos - st[s].end) * 8 > st[s].bits) return -1;
+	return (int)n;
+
+error_code:
+	return -1;
+}
@@ -0,0 +1,17 @@
+/*
+ * Huffman entropy coder for lzjody blocks
+ *
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ *
+ * See huffman.c for more information.
+ */
+
+#ifndef HUFFMAN_H
+#define HUFFMAN_H
+
+extern int huffman_encode(const unsigned char * const, const unsigned int,
+		unsigned char * const, const unsigned int, const int);
+extern int huffman_decode(const unsigned char * const, const unsigned int,
+		unsigned char * const, const unsigned int, const int);
+
+#endif	/* HUFFMAN_H */
@@ -7,8 +7,20 @@
 
 #include <stdio.h>
 #include <stdint.h>
-#include "byteplane_xfrm.h"
+#include <inttypes.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef LZJODY_STATS
+ #include <time.h>
+#endif
+#ifdef THREADED
+ #include <pthread.h>
+#endif
+#include "huffman.h"
 #include "lzjody.h"
+#include "lzjody_simd.h"
 
 /* Debugging stuff */
 #ifndef DLOG
@@ -24,8 +36,9 @@
  * 7 6 5 4 3 2 1 0
  * | | | | | | \-+-- Sequential compression (8/16/32)
  * | | | | | \------ Byte plane transformation applied
- * | | | | \-------- Not used
- * | | | \---------- LZ match length is 16 bits wide, not 8 bits
+ * | | | | \-------- Extended: LZ repeat (wide format: 3-byte long form)
+ *                   (extended 0x0c: entropy coded segment)
+ * | | | \---------- LZ match length is 16 (wide: 24) bits, not 8 bits
  * | \-+------------ LZ/RLE/literal compression
  * \---------------- Short control byte form
  */
@@ -35,11 +48,30 @@
 #define P_LIT	0x20	/* Literal values */
 #define P_LZL	0x10	/* LZ match flag: size > 255 */
 #define P_EXT	0x00	/* Extended algorithms (ignore 0x10 and P_SHORT) */
+#define P_WIDE	0x08	/* Wide format: long control value is 19 bits */
+#define P_XWIDE	0x10	/* Wide format: extended command value is 24 bits */
+#define P_REP	0x08	/* LZ match at the distance of the previous match */
 #define P_PLANE 0x04	/* Byte plane transform */
+#define P_HUFF	0x0c	/* Entropy coded segment: Huffman coded commands */
 #define P_SEQ32	0x03	/* Sequential 32-bit values */
 #define P_SEQ16	0x02	/* Sequential 16-bit values */
 #define P_SEQ8	0x01	/* Sequential 8-bit values */
 
+/* Internal option: LZ commands store distances whatever the block size
+ * (preset dictionary blocks need values that reach into the dictionary) */
+#define O_LZ_DIST 0x8000
+/* Internal option: wide format commands whatever the block size
+ * (reference window blocks reach back more than 4 KiB) */
+#define O_WIDE_CMD 0x10000
+/* Internal option: decoding the commands of a byte plane or entropy coded
+ * segment, which can't be entropy coded again */
+#define O_SUB_BLOCK 0x20000
+/* Internal option: decoding the commands of a byte plane, which can't
+ * hold another byte plane */
+#define O_PLANE_CMDS 0x40000
+/* Largest LZ offset or distance of the 4 KiB format */
+#define LZ_LEGACY_MAX 0xfff
+
 /* Control bits masking value */
 #define P_MASK	0x60	/* LZ, RLE, literal (no short) */
 #define P_XMASK 0x0f	/* Extended command */
@@ -48,6 +80,9 @@
 /* Maximum length of a short element */
 #define P_SHORT_MAX 0x0f
 #define P_SHORT_XMAX 0xff
+/* Maximum value of a two-byte wide format element */
+#define P_WIDE_MAX 0x7ff
+#define P_XWIDE_MAX 0xffff
 
 /* Minimum sizes for compression
  * These sizes are roughly calculated as follows:
@@ -60,13 +95,27 @@
  * algorithms to expand data and fail in some cases!
  */
 #define MIN_LZ_MATCH 3
-#define MAX_LZ_MATCH LZJODY_BSIZE - 1
+#define MAX_LZ_MATCH(a) ((a)->bsize - 1)
 #define MIN_RLE_LENGTH 3
 /* Sequence lengths are not byte counts, they are word counts! */
 #define MIN_SEQ32_LENGTH 2
 #define MIN_SEQ16_LENGTH 3
 #define MIN_SEQ8_LENGTH 5
 #define MIN_PLANE_LENGTH 8
+/* Blocks shorter than this don't pay for a Huffman code length table */
+#define MIN_HUFF_LENGTH 64
+/* Largest byte plane and entropy coded segment (uncoded command bytes);
+ * the decoder joins and decodes them in buffers on its stack, so it never
+ * allocates memory and in-place decoding never rereads its output */
+#define PLANE_MAX 8192
+#define HUFF_SEG_MAX 16384
+/* Reference window matches this long move the first LZ candidate */
+#define MIN_REF_FOLLOW 32
+
+/* Number of recent blocks remembered for repeat block detection */
+#ifndef DEDUP_SLOTS
+ #define DEDUP_SLOTS 64
+#endif
 
 /* If a byte occurs more times than this in a block, use linear scanning */
 #ifndef MAX_LZ_BYTE_SCANS
@@ -76,6 +125,45 @@
 #define BSWAP32(a) (((a & 0xff000000U) >> 24) | ((a & 0x00ff0000U) >> 8) | ((a & 0x0000ff00U) << 8) | ((a & 0x000000ffU) << 24))
 #define BSWAP16(a) (((a & 0xff00U) >> 8) | ((a & 0x00ffU) << 8))
 
+/* The compressor's finders are templates over the options they test; each
+ * specialized scan loop inlines its own copy with the options folded in
+ * NOINLINE keeps a helper's stack buffer out of its caller's frame */
+#ifdef __GNUC__
+ #define ALWAYS_INLINE inline __attribute__((always_inline))
+ #define NOINLINE __attribute__((noinline))
+#else
+ #define ALWAYS_INLINE inline
+ #define NOINLINE
+#endif
+
+/* Compressor statistics (STATS=1); the macros vanish in normal builds */
+#ifdef LZJODY_STATS
+static __thread struct lzjody_stats stats;
+
+static inline uint64_t stat_ticks(void)
+{
+ #if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	return __builtin_ia32_rdtsc();
+ #else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000U + (uint64_t)ts.tv_nsec;
+ #endif
+}
+ #define STAT_ADD(a, b) stats.a += (b)
+ #define STAT_CALL(a) stats.calls[a]++
+ #define STAT_HIT(a, b) do { stats.hits[a]++; stats.bytes[a] += (b); } while (0)
+ #define STAT_START(a) const uint64_t a = stat_ticks()
+ #define STAT_STOP(a, b) stats.ticks[a] += stat_ticks() - (b)
+#else
+ #define STAT_ADD(a, b) do { } while (0)
+ #define STAT_CALL(a) do { } while (0)
+ #define STAT_HIT(a, b) do { } while (0)
+ #define STAT_START(a)
+ #define STAT_STOP(a, b) do { } while (0)
+#endif
+
 
 struct comp_data_t {
 	const unsigned char *in;
@@ -85,69 +173,89 @@ struct comp_data_t {
 	unsigned int literals;
 	unsigned int literal_start;
 	unsigned int length;	/* Length of input data */
+	unsigned int bsize;	/* Block size selected by options */
+	unsigned int wide;	/* 1 = wide format control bytes */
+	unsigned int dist;	/* 1 = LZ values are distances, not offsets */
+	unsigned int dict_len;	/* Preset dictionary bytes before the block */
+	unsigned int ref_dist;	/* Distance back to the likeliest match in a reference window */
+	unsigned int last_dist;	/* Distance of the previous LZ match (0 = none yet) */
 	int options;	/* 0=exhaustive search, 1=stop at first match */
+	struct comp_work_t *work;	/* Scratch space (NULL for byte plane passes) */
+};
+
+/* Jump list positions must be able to address the largest block
+ * plus a preset dictionary or a reference window (two blocks) */
+#if (LZJODY_MAX_BSIZE + LZJODY_DICT_MAX) > 65536 || (LZJODY_MAX_BSIZE * 3) > 65536
+typedef uint32_t lz_pos_t;
+#else
+typedef uint16_t lz_pos_t;
+#endif
+
+/* Recently compressed block for repeat block detection */
+struct dedup_t {
+	const unsigned char *in;
+	uint64_t hash;
+	unsigned int length;
+	unsigned int block;	/* Block record number */
 };
 
 struct lz_index_t {
-	uint16_t byte[256][MAX_LZ_BYTE_SCANS];	/* Lists of locations of each byte value */
+	lz_pos_t byte[256][MAX_LZ_BYTE_SCANS];	/* Lists of locations of each byte value */
 	uint16_t bytecnt[256];	/* How many offsets exist per byte */
+	unsigned int start;	/* First indexed position */
+	unsigned int end;	/* Position where indexing stopped */
 };
 
-static int lzjody_find_lz(struct comp_data_t * const restrict data,
-		const struct lz_index_t * const restrict idx);
-static int lzjody_find_rle(struct comp_data_t * const restrict data);
-static int lzjody_find_seq32(struct comp_data_t * const restrict data);
-static int lzjody_find_seq16(struct comp_data_t * const restrict data);
-static int lzjody_find_seq8(struct comp_data_t * const restrict data);
-
-static int compress_scan(struct comp_data_t * const restrict data,
-		const struct lz_index_t * const restrict idx)
-{
-	int err;
+/* Heap scratch space for compressing blocks of up to bsize bytes
+ * The LZ indexes are megabytes with wide positions, too big for the stack
+ * of a library caller's thread; work_get() keeps one per thread */
+struct comp_work_t {
+	struct lz_index_t idx;	/* Index of the block being compressed */
+	struct lz_index_t plane_idx;	/* Index of byte plane transformed literals */
+	unsigned int bsize;
+	unsigned char *lit_in;	/* Byte plane transformed literals */
+	unsigned char *lit_out;	/* Their compressed form */
+	unsigned char *coded;	/* Entropy coded block */
+	unsigned char *page;	/* Compressed page of a batch */
+};
 
-	while (data->ipos < data->length) {
-		/* Scan for compressible items
-		 * Try each compressor in sequence; if none works,
-		 * just add the byte to the literal stream */
-		DLOG("[c_scan] ipos: 0x%x, opos: 0x%x\n", data->ipos, data->opos);
+/* Extra room in the work buffers for command overhead */
+#define WORK_SLACK 16
 
-		if (!(data->options & O_NO_RLE)) {
-			err = lzjody_find_rle(data);
-			if (err < 0) return err;
-			if (err > 0) continue;
-		}
+/* Preset dictionary with its LZ index built once */
+struct lzjody_dict {
+	unsigned char *data;
+	unsigned int length;
+	struct lz_index_t idx;
+};
 
-		if (!(data->options & O_NO_SEQ)) {
-			err = lzjody_find_seq8(data);
-			if (err < 0) return err;
-			if (err > 0) continue;
-			err = lzjody_find_seq16(data);
-			if (err < 0) return err;
-			if (err > 0) continue;
-			err = lzjody_find_seq32(data);
-			if (err < 0) return err;
-			if (err > 0) continue;
-		}
+/* Slot of the reference block index (block 0 marks an empty slot) */
+struct ref_slot_t {
+	uint32_t tag;	/* High bits of the block hash */
+	uint32_t block;	/* Reference block number + 1 */
+};
 
-		if (!(data->options & O_NO_LZ)) {
-			err = lzjody_find_lz(data, idx);
-			if (err < 0) return err;
-			if (err > 0) continue;
-		}
+/* Reference image with a hash index of its full blocks */
+struct lzjody_ref {
+	const unsigned char *data;
+	uint64_t size;
+	unsigned int bsize;
+	uint64_t mask;	/* Index slots - 1 */
+	struct ref_slot_t *slot;
+};
 
-		/* Nothing compressed; add to literal bytes */
-		if (data->literals == 0) data->literal_start = data->ipos;
-		data->literals++;
-		data->ipos++;
-	}
-	return 0;
-}
+static int compress_scan(struct comp_data_t * const restrict data,
+		struct lz_index_t * const restrict idx);
+static int index_bytes(const struct comp_data_t * const restrict data,
+		struct lz_index_t * const restrict idx, const unsigned int start);
+static int block_out_len(const unsigned char * const, const unsigned int,
+		const unsigned int, const unsigned int, int * const);
 
 /* Build an array of byte values for faster LZ matching */
 static int index_bytes(const struct comp_data_t * const restrict data,
-		struct lz_index_t * const restrict idx)
+		struct lz_index_t * const restrict idx, const unsigned int start)
 {
-	unsigned int pos = 0;
+	unsigned int pos = start;
 	unsigned char c;
 
 	/* Clear any existing index */
@@ -165,6 +273,9 @@ static int index_bytes(const struct comp_data_t * const restrict data,
 		pos++;
 		if (idx->bytecnt[c] == MAX_LZ_BYTE_SCANS) break;
 	}
+	if (pos < (data->length - MIN_LZ_MATCH)) STAT_ADD(index_full, 1);
+	idx->start = start;
+	idx->end = pos;
 	return 0;
 
 error_index:
@@ -172,20 +283,53 @@ error_index:
 	return -1;
 }
 
+/* Start from the dictionary's index and add the block that follows it */
+static int index_dict_bytes(const struct comp_data_t * const restrict data,
+		struct lz_index_t * const restrict idx,
+		const struct lz_index_t * const restrict dict_idx)
+{
+	unsigned int pos = data->dict_len;
+	unsigned char c;
+
+	/* A dictionary that filled a jump list is indexed with each block */
+	if (dict_idx->end < data->dict_len) return index_bytes(data, idx, 0);
+
+	for (int i = 0; i < 256; i++) {
+		idx->bytecnt[i] = dict_idx->bytecnt[i];
+		memcpy(idx->byte[i], dict_idx->byte[i], dict_idx->bytecnt[i] * sizeof(lz_pos_t));
+	}
+	while (pos < (data->length - MIN_LZ_MATCH)) {
+		c = *(data->in + pos);
+		if (idx->bytecnt[c] == MAX_LZ_BYTE_SCANS) break;
+		idx->byte[c][idx->bytecnt[c]] = pos;
+		idx->bytecnt[c]++;
+		pos++;
+		if (idx->bytecnt[c] == MAX_LZ_BYTE_SCANS) break;
+	}
+	if (pos < (data->length - MIN_LZ_MATCH)) STAT_ADD(index_full, 1);
+	idx->start = 0;
+	idx->end = pos;
+	return 0;
+}
+
 /* Write the control byte(s) that define data
  * type is the P_xxx value that determines the type of the control byte */
 static int lzjody_write_control(struct comp_data_t * const restrict data,
 		const unsigned char type,
-		const uint16_t value)
+		const unsigned int value)
 {
-	if (value > LZJODY_BSIZE) goto error_value_too_large;
+	if (value > data->bsize + data->dict_len) goto error_value_too_large;
 	DLOG("control: (i 0x%x, o 0x%x) t 0x%x, val 0x%x: ",
 			data->ipos, data->opos, type, value);
 	/* Extended control bytes */
 	if ((type & P_MASK) == P_EXT) {
 		if (value > P_SHORT_XMAX) {
 			/* Full size control bytes */
-			*(data->out + data->opos) = type;
+			if (data->wide && value > P_XWIDE_MAX) {
+				*(data->out + data->opos) = type | P_XWIDE;
+				data->opos++;
+				*(data->out + data->opos) = (value >> 16);
+			} else *(data->out + data->opos) = type;
 			data->opos++;
 			DLOG("t0x%x ", type);
 			*(data->out + data->opos) = (value >> 8);
@@ -207,6 +351,18 @@ static int lzjody_write_control(struct comp_data_t * const restrict data,
 	}
 	/* Standard control bytes */
 	else if (value > P_SHORT_MAX) {
+		if (data->wide && value > P_WIDE_MAX) {
+			/* Wide form packs bits 16-18 into the command byte */
+			*(unsigned char *)(data->out + data->opos) = (type | P_WIDE | (unsigned char)(value >> 16));
+			data->opos++;
+			*(unsigned char *)(data->out + data->opos) = (unsigned char)(value >> 8);
+			data->opos++;
+			DLOG("t+vH 0x%x, vM 0x%x, vL 0x%x\n", *(data->out + data->opos - 2),
+					*(data->out + data->opos - 1), (unsigned char)value);
+			*(unsigned char *)(data->out + data->opos) = (unsigned char)value;
+			data->opos++;
+			return 0;
+		}
 		DLOG("t: %x, ", type | (unsigned char)(value >> 8));
 		*(unsigned char *)(data->out + data->opos) = (type | (unsigned char)(value >> 8));
 		data->opos++;
@@ -222,7 +378,8 @@ static int lzjody_write_control(struct comp_data_t * const restrict data,
 	return 0;
 
 error_value_too_large:
-	fprintf(stderr, "error: lzjody_write_control: value 0x%x > 0x1000\n", value);
+	fprintf(stderr, "error: lzjody_write_control: value 0x%x > 0x%x\n",
+			value, data->bsize + data->dict_len);
 	return -1;
 }
 
@@ -234,7 +391,7 @@ static int lzjody_really_flush_literals(struct comp_data_t * const restrict data
 
 	if (data->literals == 0) return 0;
 	DLOG("really_flush_literals: 0x%x (opos 0x%x)\n", data->literals, data->opos);
-	if ((data->opos + data->literals) > (LZJODY_BSIZE + 4)) goto error_opos;
+	if ((data->opos + data->literals) > (data->bsize + LZJODY_MAX_EXPAND(data->options))) goto error_opos;
 	/* First write the control byte... */
 	err = lzjody_write_control(data, P_LIT, data->literals);
 	if (err < 0) return err;
@@ -251,57 +408,51 @@ static int lzjody_really_flush_literals(struct comp_data_t * const restrict data
 
 error_opos:
 	fprintf(stderr, "error: final output position will overflow: 0x%x > 0x%x\n",
-			data->opos + data->literals, LZJODY_BSIZE + 4);
+			data->opos + data->literals,
+			data->bsize + LZJODY_MAX_EXPAND(data->options));
 	return -1;
 }
 
-/* Intercept a stream of literals and try byte plane transformation */
-static int lzjody_flush_literals(struct comp_data_t * const restrict data)
+/* Byte plane transform and compress length literals at src; the result
+ * is left in the lit_out scratch buffer. Returns its length, 0 if that is
+ * not enough of an improvement or negative on error */
+static int plane_try(struct comp_data_t * const restrict data,
+		const unsigned char * const src, const unsigned int length)
 {
-	unsigned char lit_in[LZJODY_BSIZE];
-	unsigned char lit_out[LZJODY_BSIZE + 4];
-	unsigned int i;
+	unsigned char * const lit_in = data->work->lit_in;
+	struct lz_index_t * const idx = &data->work->plane_idx;
 	int err;
 	struct comp_data_t d2;
-	struct lz_index_t idx;
-
-	/* For zero literals we'll just do nothing. */
-	if (data->literals == 0) return 0;
-
-	/* Handle blocking of recursive calls or very short literal runs */
-	if ((data->literals < MIN_PLANE_LENGTH)
-			|| (data->options & O_REALFLUSH)) {
-		err = lzjody_really_flush_literals(data);
-		if (err < 0) return err;
-		return 0;
-	}
-
 
+	STAT_ADD(plane_tried, 1);
 	d2.in = lit_in;
-	d2.out = lit_out;
+	d2.out = data->work->lit_out;
 	d2.ipos = 0;
 	d2.opos = 0;
 	d2.literals = 0;
 	d2.literal_start = 0;
-	d2.length = data->literals;
+	d2.length = length;
+	d2.bsize = data->bsize;
+	d2.wide = data->wide;
+	d2.dist = data->dist;
+	d2.dict_len = 0;
+	d2.ref_dist = 0;
+	d2.last_dist = 0;
+	d2.work = NULL;
 	/* Don't allow recursive passes or compressed data size prefix */
 	d2.options = (data->options | O_REALFLUSH | O_NOPREFIX);
 
-	DLOG("flush_literals: 0x%x\n", data->literals);
-
 	/* Try to compress a literal run further */
-	DLOG("compress further: 0x%x @ 0x%x\n", data->literals, data->literal_start);
+	DLOG("compress further: 0x%x\n", length);
 	/* Make a transformed copy of the data */
-	err = byteplane_transform((data->in + data->literal_start),
-			lit_in, data->literals, 4);
-	if (err < 0) return err;
+	lzjody_kern.plane_split(src, lit_in, length);
 
 	/* Load arrays for match speedup */
-	err = index_bytes(&d2, &idx);
+	err = index_bytes(&d2, idx, 0);
 	if (err < 0) return err;
 
 	/* Try to compress the data again */
-	err = compress_scan(&d2, &idx);
+	err = compress_scan(&d2, idx);
 	if (err < 0) return err;
 	err = lzjody_really_flush_literals(&d2);
 	if (err < 0) return err;
@@ -311,30 +462,112 @@ static int lzjody_flush_literals(struct comp_data_t * const restrict data)
 		DLOG("[bp] No improvement, skipping (0x%x >= 0x%x)\n",
 				d2.opos,
 				d2.length);
-		err = lzjody_really_flush_literals(data);
-		if (err < 0) return err;
 		return 0;
 	}
-
-	/* Dump the newly compressed data as a literal stream */
 	DLOG("Improvement: 0x%x -> 0x%x\n", d2.length, d2.opos);
-	err = lzjody_write_control(data, P_PLANE, d2.opos);
-	if (err < 0) return err;
+	return (int)d2.opos;
+}
 
-	i = 0;
-	while (i < d2.opos) {
-		*(data->out + data->opos) = *(d2.out + i);
-		data->opos++;
-		i++;
+/* Try byte plane transformation on a stream of literals
+ * Runs longer than PLANE_MAX are transformed a piece at a time, and
+ * pieces that don't improve are written together as one literal run */
+static int lzjody_plane_literals(struct comp_data_t * const restrict data)
+{
+	const unsigned int start = data->literal_start;
+	const unsigned int total = data->literals;
+	unsigned int pos, piece, raw = 0, i;
+	int len, err;
+	STAT_START(plane_start);
+
+	DLOG("flush_literals: 0x%x @ 0x%x\n", total, start);
+	for (pos = 0; pos < total; pos += piece) {
+		piece = (total - pos < PLANE_MAX) ? total - pos : PLANE_MAX;
+		len = 0;
+		if (piece >= MIN_PLANE_LENGTH) {
+			len = plane_try(data, data->in + start + pos, piece);
+			if (len < 0) return len;
+			/* A plane inside a longer run also splits its literal run,
+			 * which can cost two more control bytes of up to 3 bytes */
+			if (piece < total && (unsigned int)len + 6 >= piece) len = 0;
+		}
+		if (len == 0) {
+			raw += piece;
+			continue;
+		}
+
+		/* Write the literals before this piece, then the plane */
+		data->literal_start = start + pos - raw;
+		data->literals = raw;
+		err = lzjody_really_flush_literals(data);
+		if (err < 0) return err;
+		raw = 0;
+		err = lzjody_write_control(data, P_PLANE, (unsigned int)len);
+		if (err < 0) return err;
+		for (i = 0; i < (unsigned int)len; i++) {
+			*(data->out + data->opos) = *(data->work->lit_out + i);
+			data->opos++;
+		}
+		STAT_ADD(plane_used, 1);
 	}
-	/* Reset literal counter*/
-	data->literals = 0;
-	return 0;
+	data->literal_start = start + total - raw;
+	data->literals = raw;
+	err = lzjody_really_flush_literals(data);
+	STAT_STOP(LZJODY_STAGE_PLANE, plane_start);
+	return err;
+}
+
+/* Intercept a stream of literals and try byte plane transformation */
+static ALWAYS_INLINE int flush_literals_opt(struct comp_data_t * const restrict data,
+		const int options)
+{
+	/* For zero literals we'll just do nothing. */
+	if (data->literals == 0) return 0;
+
+	/* Handle blocking of recursive calls or very short literal runs */
+	if ((data->literals < MIN_PLANE_LENGTH) || (options & O_REALFLUSH))
+		return lzjody_really_flush_literals(data);
+	return lzjody_plane_literals(data);
+}
+
+static int lzjody_flush_literals(struct comp_data_t * const restrict data)
+{
+	return flush_literals_opt(data, data->options);
+}
+
+/* Value stored in an LZ command: offset into the block, or the
+ * distance back from the current position in the wide format */
+#define LZ_VALUE(a, b) ((a)->dist ? ((a)->ipos - (b)) : (b))
+
+/* Extra control bytes needed to store an LZ value */
+static inline unsigned int lz_value_cost(const struct comp_data_t * const restrict data,
+		const unsigned int value)
+{
+	if (value <= P_SHORT_MAX) return 0;
+	if (data->wide && value > P_WIDE_MAX) return 2;
+	return 1;
+}
+
+/* Most LZ candidates differ within a few bytes, so compare the first
+ * word inline and only call the kernel for longer matches */
+static inline unsigned int match_len(const unsigned char * const a,
+		const unsigned char * const b, const unsigned int limit)
+{
+#if defined __GNUC__ && defined __BYTE_ORDER__ && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	uint64_t wa, wb;
+
+	if (limit < 8) return lzjody_kern.match_len(a, b, limit);
+	memcpy(&wa, a, 8);
+	memcpy(&wb, b, 8);
+	if (wa != wb) return (unsigned int)__builtin_ctzll(wa ^ wb) >> 3;
+	return 8 + lzjody_kern.match_len(a + 8, b + 8, limit - 8);
+#else
+	return lzjody_kern.match_len(a, b, limit);
+#endif
 }
 
 /* Find best LZ data match for current input position */
-static int lzjody_find_lz(struct comp_data_t * const restrict data,
-		const struct lz_index_t * const restrict idx)
+static ALWAYS_INLINE int lzjody_find_lz(struct comp_data_t * const restrict data,
+		struct lz_index_t * const restrict idx, const int options)
 {
 	unsigned int scan = 0;
 	const unsigned char *m0, *m1, *m2;	/* pointers for matches */
@@ -343,10 +576,17 @@ static int lzjody_find_lz(struct comp_data_t * const restrict data,
 	unsigned int remain;	/* remaining matches possible */
 	int done = 0;	/* Used to terminate matching */
 	unsigned int best_lz = 0;
-	int best_lz_start = 0;
-	unsigned int total_scans;
+	unsigned int best_lz_start = 0;
+	unsigned int rep_lz = 0;	/* match length at the previous distance */
+	/* No match may run past the input or the largest length */
+	const unsigned int lz_limit = (in_remain < MAX_LZ_MATCH(data)) ? in_remain : MAX_LZ_MATCH(data);
+	unsigned int limit;
+	unsigned int total_scans = 0;
 	unsigned int offset;
 	unsigned int min_lz_match = MIN_LZ_MATCH;
+	/* 4 KiB format distances can't reach past LZ_LEGACY_MAX */
+	const unsigned int lz_floor = (data->dist && !data->wide && data->ipos > LZ_LEGACY_MAX) ?
+		data->ipos - LZ_LEGACY_MAX : 0;
 	int err;
 
 	/* If literal count > short form constraints, avoid data expansion */
@@ -354,14 +594,47 @@ static int lzjody_find_lz(struct comp_data_t * const restrict data,
 
 	if (data->ipos >= (data->length - min_lz_match)) return 0;
 
+	/* A wide block (or a dictionary) can fill the jump lists long before
+	 * the end of the block, so slide the index forward once the input
+	 * position passes it */
+	if (data->dist && (data->ipos > idx->end)
+			&& (idx->end < (data->length - MIN_LZ_MATCH))) {
+		err = index_bytes(data, idx, data->ipos - ((idx->end - idx->start) >> 1));
+		if (err < 0) return err;
+	}
+
 	m0 = data->in + data->ipos;
+
+	/* A match at the previous distance needs no offset, so try it first */
+	if (data->last_dist != 0 && data->ipos >= data->last_dist) {
+		STAT_CALL(LZJODY_STAT_LZ_REP);
+		length = match_len(m0, m0 - data->last_dist, lz_limit);
+		if (length >= min_lz_match) {
+			rep_lz = length;
+			if (options & O_FAST_LZ) goto end_lz_matches;
+			if (length == lz_limit) goto end_lz_matches;
+		}
+	}
+
+	/* Try the reference window data that last matched before the index */
+	if (data->ref_dist != 0 && data->ref_dist != data->last_dist
+			&& data->ipos >= data->ref_dist) {
+		length = match_len(m0, m0 - data->ref_dist, lz_limit);
+		if (length >= (min_lz_match + lz_value_cost(data, data->ref_dist))) {
+			best_lz_start = data->ipos - data->ref_dist;
+			best_lz = length;
+			if (length == lz_limit) goto end_lz_matches;
+		}
+	}
+
 	total_scans = idx->bytecnt[*m0];
 
 	/* If the byte value does not exist anywhere, give up */
-	if (!total_scans) return 0;
+	if (!total_scans) goto end_lz_matches;
 
 	/* Use linear matches if a byte happens too frequently */
 	if (total_scans >= MAX_LZ_BYTE_SCANS) goto lz_linear_match;
+	STAT_CALL(LZJODY_STAT_LZ_JUMP);
 
 	while (scan < total_scans) {
 		/* Get offset of next byte */
@@ -374,10 +647,14 @@ static int lzjody_find_lz(struct comp_data_t * const restrict data,
 			scan = total_scans;
 			goto end_lz_jump_match;
 		}
+		if (offset < lz_floor) {
+			scan++;
+			continue;
+		}
 
 		remain = data->length - data->ipos;
 		/* Handle underflow */
-		if (remain > LZJODY_BSIZE) goto err_remain_underflow;
+		if (remain > data->bsize) goto err_remain_underflow;
 
 /*		DLOG("LZ remain 0x%x at offset 0x%x ipos 0x%x\n", remain, offset, data->ipos); */
 
@@ -388,49 +665,41 @@ static int lzjody_find_lz(struct comp_data_t * const restrict data,
 /*		DLOG("LZ: offset 0x%x, remain 0x%x, scan 0x%x, total_scans 0x%x\n",
 			offset, remain, scan, total_scans); */
 
-		/* Try to reject the match quickly */
-		if (*(m1 + min_lz_match - 1) != *(m2 + min_lz_match - 1)) goto end_lz_matches;
-
-		while (*m1 == *m2) {
-/*			DLOG("LZ: m1 0x%lx == m2 0x%lx (remain %x)\n",
-					(long)((uintptr_t)m1 - (uintptr_t)(data->in)),
-					(long)((uintptr_t)m2 - (uintptr_t)(data->in)),
-					remain
-					); */
-			length++;
-			m1++; m2++;
-			remain--;
-			if (!remain) {
-				DLOG("LZ: hit end of data\n");
-				done = 1;
-				break;
-			}
-			if (length >= MAX_LZ_MATCH) {
-				DLOG("LZ: maximum length reached\n");
-				done = 1;
-				break;
-			}
+		/* Try to reject the match quickly; dictionary positions come
+		 * first in the lists and must not end the search */
+		if (*(m1 + min_lz_match - 1) != *(m2 + min_lz_match - 1)) {
+			if (offset < data->dict_len) goto end_lz_jump_match;
+			goto end_lz_matches;
+		}
+
+		limit = (remain < MAX_LZ_MATCH(data)) ? remain : MAX_LZ_MATCH(data);
+		length = match_len(m1, m2, limit);
+		if (length == limit) {
+			DLOG("LZ: hit end of data or maximum length\n");
+			done = 1;
 		}
 end_lz_jump_match:
 		/* If this run was the longest match, record it */
-		if ((length >= min_lz_match) && (length > best_lz)) {
+		if ((length >= min_lz_match) && ((length > best_lz) || (data->dist && length == best_lz))) {
 			/* LZ can't use 4-bit offsets after 0x0f bytes */
-			if ((length == min_lz_match) && (offset > 0x0f)) {
+			if (length < (min_lz_match + lz_value_cost(data, LZ_VALUE(data, offset)))) {
 				scan++;
 				continue;
 			}
 			DLOG("LZ match: 0x%x : 0x%x (j)\n", offset, length);
 			best_lz_start = offset;
 			best_lz = length;
-			if (data->options & O_FAST_LZ) break;	/* Accept first LZ match */
+			if (options & O_FAST_LZ) break;	/* Accept first LZ match */
 			if (done) break;
-			if (length >= MAX_LZ_MATCH) break;
+			if (length >= MAX_LZ_MATCH(data)) break;
 		}
 		scan++;
 	}
 	goto end_lz_matches;
 
 lz_linear_match:
+	STAT_CALL(LZJODY_STAT_LZ_LINEAR);
+	scan = (idx->start < lz_floor) ? lz_floor : idx->start;
 	while (scan < data->ipos) {
 		m1 = data->in + scan;
 		m2 = data->in + data->ipos;
@@ -441,65 +710,75 @@ lz_linear_match:
 		if (remain < min_lz_match) goto end_lz_linear_match;
 
 		/* Try to reject the match quickly */
-		if (*(m1 + min_lz_match - 1) != *(m2 + min_lz_match - 1)) goto end_lz_matches;
-
-		if (remain) {
-			while (*m1 == *m2) {
-/*			DLOG("LZ: m1 0x%lx == m2 0x%lx (remain %x)\n",
-					(long)((uintptr_t)m1 - (uintptr_t)(data->in)),
-					(long)((uintptr_t)m2 - (uintptr_t)(data->in)),
-					remain); */
-				length++;
-				m1++; m2++;
-				remain--;
-				if (!remain) {
-					DLOG("LZ: hit end of data\n");
-					done = 1;
-					goto end_lz_linear_match;
-				}
-				if (length >= MAX_LZ_MATCH) {
-					DLOG("LZ: maximum length reached\n");
-					done = 1;
-					goto end_lz_linear_match;
-				}
-			}
+		if (*(m1 + min_lz_match - 1) != *(m2 + min_lz_match - 1)) {
+			if (scan < data->dict_len) goto end_lz_linear_match;
+			goto end_lz_matches;
+		}
+
+		length = match_len(m1, m2, lz_limit);
+		if (length == lz_limit) {
+			DLOG("LZ: hit end of data or maximum length\n");
+			done = 1;
 		}
 end_lz_linear_match:
 		/* If this run was the longest match, record it */
-		if ((length >= min_lz_match) && (length > best_lz)) {
+		if ((length >= min_lz_match) && ((length > best_lz) || (data->dist && length == best_lz))) {
 			/* LZ can't use 4-bit offsets after 0x0f bytes */
-			if ((length == min_lz_match) && (scan > 0x0f)) {
+			if (length < (min_lz_match + lz_value_cost(data, LZ_VALUE(data, scan)))) {
 				scan++;
 				continue;
 			}
 			DLOG("LZ match: 0x%x : 0x%x (l)\n", scan, length);
 			best_lz_start = scan;
 			best_lz = length;
-			if (data->options & O_FAST_LZ) break;	/* Accept first LZ match */
+			if (options & O_FAST_LZ) break;	/* Accept first LZ match */
 			if (done) break;
-			if (length >= MAX_LZ_MATCH) break;
+			if (length >= MAX_LZ_MATCH(data)) break;
 		}
 		scan++;
 	}
 
 end_lz_matches:
+	/* A repeat match wins unless the offset of a longer one pays for itself */
+	if (rep_lz != 0 && (best_lz == 0
+			|| rep_lz + lz_value_cost(data, LZ_VALUE(data, best_lz_start)) >= best_lz)) {
+		DLOG("LZ repeat 0x%x:%x bytes\n", data->last_dist, rep_lz);
+		STAT_HIT(LZJODY_STAT_LZ_REP, rep_lz);
+		err = flush_literals_opt(data, options);
+		if (err < 0) return err;
+		err = lzjody_write_control(data, P_REP, rep_lz);
+		if (err < 0) return err;
+		data->ipos += rep_lz;
+		return 1;
+	}
 	/* Write out the best LZ match, if any */
 	if (best_lz) {
 		DLOG("LZ compressed %x:%x bytes\n", best_lz_start, best_lz);
-		err = lzjody_flush_literals(data);
+		/* Reference window probe hits count as jump list hits */
+		STAT_HIT((total_scans >= MAX_LZ_BYTE_SCANS) ? LZJODY_STAT_LZ_LINEAR : LZJODY_STAT_LZ_JUMP, best_lz);
+		err = flush_literals_opt(data, options);
 		if (err < 0) return err;
 		if (best_lz < 256) {
-			err = lzjody_write_control(data, P_LZ, best_lz_start);
+			err = lzjody_write_control(data, P_LZ, LZ_VALUE(data, best_lz_start));
 			if (err < 0) return err;
 		} else {
-			err = lzjody_write_control(data, (P_LZ | P_LZL), best_lz_start);
+			err = lzjody_write_control(data, (P_LZ | P_LZL), LZ_VALUE(data, best_lz_start));
 			if (err < 0) return err;
+			if (data->wide) {
+				*(data->out + data->opos) = best_lz >> 16;
+				data->opos++;
+			}
 			*(data->out + data->opos) = best_lz >> 8;
 			data->opos++;
 		}
 		/* Write LZ match length low byte */
 		*(data->out + data->opos) = (unsigned char)(best_lz & 0xff);
 		data->opos++;
+		/* Follow data that moved within the reference window */
+		if (data->ref_dist != 0 && best_lz_start < data->dict_len && best_lz >= MIN_REF_FOLLOW)
+			data->ref_dist = data->ipos - best_lz_start;
+		/* Repeats are only probed for once a distance is known */
+		if (data->options & O_LZ_REPEAT) data->last_dist = data->ipos - best_lz_start;
 		/* Skip matched input */
 		data->ipos += best_lz;
 		return 1;
@@ -512,7 +791,8 @@ err_remain_underflow:
 }
 
 /* Find best RLE data match for current input position */
-static int lzjody_find_rle(struct comp_data_t * const restrict data)
+static ALWAYS_INLINE int lzjody_find_rle(struct comp_data_t * const restrict data,
+		const int options)
 {
 	const unsigned char c = *(data->in + data->ipos);
 	unsigned int length = 0;
@@ -521,13 +801,16 @@ static int lzjody_find_rle(struct comp_data_t * const restrict data)
 
 	/* If literal count > short form constraints, avoid data expansion */
 	if (data->literals > P_SHORT_MAX) big_literals = 1;
-	while (((length + data->ipos) < data->length) && (*(data->in + data->ipos + length) == c)) {
-		length++;
-	}
+	STAT_CALL(LZJODY_STAT_RLE);
+	/* Most positions start no run at all; skip the kernel for them */
+	if ((data->length - data->ipos) < (MIN_RLE_LENGTH + big_literals)
+			|| *(data->in + data->ipos + MIN_RLE_LENGTH - 1 + big_literals) != c) return 0;
+	length = lzjody_kern.run_len(data->in + data->ipos, c, data->length - data->ipos);
 	if (length >= (MIN_RLE_LENGTH + big_literals)) {
 		DLOG("RLE: 0x%02x of 0x%02x at i %x, o %x\n",
 				length, c, data->ipos, data->opos);
-		err = lzjody_flush_literals(data);
+		STAT_HIT(LZJODY_STAT_RLE, length);
+		err = flush_literals_opt(data, options);
 		if (err < 0) return err;
 		err = lzjody_write_control(data, P_RLE, length);
 		if (err < 0) return err;
@@ -542,24 +825,29 @@ static int lzjody_find_rle(struct comp_data_t * const restrict data)
 }
 
 /* Find sequential 32-bit values for compression */
-static int lzjody_find_seq32(struct comp_data_t * const restrict data)
+static ALWAYS_INLINE int lzjody_find_seq32(struct comp_data_t * const restrict data,
+		const int options)
 {
 	uint32_t num32;
 	uint32_t *m32 = (uint32_t *)((uintptr_t)data->in + (uintptr_t)data->ipos);
-	const uint32_t num_orig32 = BSWAP32(*m32);
+	uint32_t num_orig32;
 	unsigned int seqcnt;
 	unsigned int big_literals = 0;
 	int err;
 
+	/* Never read past the end of the input */
+	if ((data->length - data->ipos) < (MIN_SEQ32_LENGTH << 2)) return 0;
+	num_orig32 = BSWAP32(*m32);
+
 	/* If literal count > short form constraints, avoid data expansion */
 	if (data->literals > P_SHORT_MAX) big_literals = 1;
 
 	/* 32-bit sequences */
+	STAT_CALL(LZJODY_STAT_SEQ32);
 	seqcnt = 0;
 	num32 = BSWAP32(*m32);
 	/* Loop bounds check compensates for bit width of data elements */
-	while (BSWAP32(*m32) == num32) {
-		if ((data->ipos + seqcnt + 3) >= data->length) break;
+	while (((data->ipos + seqcnt + 3) < data->length) && (BSWAP32(*m32) == num32)) {
 		seqcnt += 4;
 		num32++;
 		m32++;
@@ -568,7 +856,8 @@ static int lzjody_find_seq32(struct comp_data_t * const restrict data)
 
 	if (seqcnt >= (MIN_SEQ32_LENGTH + big_literals)) {
 		DLOG("Seq(32): start 0x%x, 0x%x items\n", num_orig32, seqcnt);
-		err = lzjody_flush_literals(data);
+		STAT_HIT(LZJODY_STAT_SEQ32, seqcnt << 2);
+		err = flush_literals_opt(data, options);
 		if (err < 0) return err;
 		err = lzjody_write_control(data, P_SEQ32, seqcnt);
 		if (err < 0) return err;
@@ -582,23 +871,28 @@ static int lzjody_find_seq32(struct comp_data_t * const restrict data)
 }
 
 /* Find sequential 16-bit values for compression */
-static int lzjody_find_seq16(struct comp_data_t * const restrict data)
+static ALWAYS_INLINE int lzjody_find_seq16(struct comp_data_t * const restrict data,
+		const int options)
 {
 	uint16_t num16;
 	uint16_t *m16 = (uint16_t *)((uintptr_t)data->in + (uintptr_t)data->ipos);
-	const uint16_t num_orig16 = BSWAP16(*m16);
+	uint16_t num_orig16;
 	unsigned int seqcnt;
 	unsigned int big_literals = 0;
 	int err;
 
+	/* Never read past the end of the input */
+	if ((data->length - data->ipos) < (MIN_SEQ16_LENGTH << 1)) return 0;
+	num_orig16 = BSWAP16(*m16);
+
 	/* If literal count > short form constraints, avoid data expansion */
 	if (data->literals > P_SHORT_MAX) big_literals = 1;
 
+	STAT_CALL(LZJODY_STAT_SEQ16);
 	seqcnt = 0;
 	num16 = BSWAP16(*m16);
 	/* Loop bounds check compensates for bit width of data elements */
-	while (BSWAP16(*m16) == num16) {
-		if ((data->ipos + (seqcnt << 1) + 1) >= data->length) break;
+	while (((data->ipos + (seqcnt << 1) + 1) < data->length) && (BSWAP16(*m16) == num16)) {
 		seqcnt++;
 		num16++;
 		m16++;
@@ -606,7 +900,8 @@ static int lzjody_find_seq16(struct comp_data_t * const restrict data)
 
 	if (seqcnt >= (MIN_SEQ16_LENGTH + big_literals)) {
 		DLOG("Seq(16): start 0x%x, 0x%x items\n", num_orig16, seqcnt);
-		err = lzjody_flush_literals(data);
+		STAT_HIT(LZJODY_STAT_SEQ16, seqcnt << 1);
+		err = flush_literals_opt(data, options);
 		if (err < 0) return err;
 		err = lzjody_write_control(data, P_SEQ16, seqcnt);
 		if (err < 0) return err;
@@ -620,32 +915,31 @@ static int lzjody_find_seq16(struct comp_data_t * const restrict data)
 }
 
 /* Find sequential 8-bit values for compression */
-static int lzjody_find_seq8(struct comp_data_t * const restrict data)
+static ALWAYS_INLINE int lzjody_find_seq8(struct comp_data_t * const restrict data,
+		const int options)
 {
-	uint8_t num8;
 	int8_t diff;
-	uint8_t *m8 = (uint8_t *)((uintptr_t)data->in + (uintptr_t)data->ipos);
+	const uint8_t *m8 = data->in + data->ipos;
 	const uint8_t num_orig8 = *m8;
 	unsigned int seqcnt;
 	unsigned int big_literals = 0;
 	int err;
 
+	/* Never read past the end of the input */
+	if ((data->length - data->ipos) < MIN_SEQ8_LENGTH) return 0;
+
 	/* If literal count > short form constraints, avoid data expansion */
 	if (data->literals > P_SHORT_MAX) big_literals = 1;
 
-	seqcnt = 0;
-	num8 = *m8;
-	diff = *(m8 + 1) - num8;
-	while (*m8 == num8) {
-		if ((data->ipos + seqcnt) >= data->length) break;
-		seqcnt++;
-		num8 += diff;
-		m8++;
-	}
+	STAT_CALL(LZJODY_STAT_SEQ8);
+	diff = *(m8 + 1) - num_orig8;
+	if (*(m8 + 2) != (uint8_t)(num_orig8 + diff * 2)) return 0;
+	seqcnt = lzjody_kern.seq8_len(m8, (unsigned char)diff, data->length - data->ipos);
 
 	if (seqcnt >= (MIN_SEQ8_LENGTH + big_literals)) {
 		DLOG("Seq(8): start 0x%x, 0x%x items\n", num_orig8, seqcnt);
-		err = lzjody_flush_literals(data);
+		STAT_HIT(LZJODY_STAT_SEQ8, seqcnt);
+		err = flush_literals_opt(data, options);
 		if (err < 0) return err;
 		err = lzjody_write_control(data, P_SEQ8, seqcnt);
 		if (err < 0) return err;
@@ -659,85 +953,735 @@ static int lzjody_find_seq8(struct comp_data_t * const restrict data)
 }
 
 
-/* Lempel-Ziv compressor by Jody Bruchon (LZJODY)
- * Compresses "blk" data and puts result in "out"
- * out must be at least 2 bytes larger than blk in case
- * the data is not compressible at all.
- * Returns the size of "out" data or returns -1 if the
- * compressed data is not smaller than the original data.
- */
-int lzjody_real_compress(const unsigned char * const blk_in,
-		unsigned char * const blk_out,
-		const unsigned int options,
-		const unsigned int length)
+/* Scan a block for compressible items; options is always a constant */
+static ALWAYS_INLINE int compress_scan_opt(struct comp_data_t * const restrict data,
+		struct lz_index_t * const restrict idx, const int options)
 {
 	int err;
 
-	/* Initialize compression data structure */
-	struct comp_data_t data;
-	struct lz_index_t idx;
-
-	DLOG("Comp: blk len 0x%x\n", length);
+	while (data->ipos < data->length) {
+		/* Scan for compressible items
+		 * Try each compressor in sequence; if none works,
+		 * just add the byte to the literal stream */
+		DLOG("[c_scan] ipos: 0x%x, opos: 0x%x\n", data->ipos, data->opos);
 
-	data.in = blk_in;
-	data.out = blk_out;
-	data.ipos = 0;
-	data.opos = 2;
-	data.literals = 0;
-	data.literal_start = 0;
-	data.length = length;
-	data.options = options;
+		if (!(options & O_NO_RLE)) {
+			err = lzjody_find_rle(data, options);
+			if (err < 0) return err;
+			if (err > 0) continue;
+		}
 
-	if (options & O_NOPREFIX) data.opos = 0;
+		if (!(options & O_NO_SEQ)) {
+			err = lzjody_find_seq8(data, options);
+			if (err < 0) return err;
+			if (err > 0) continue;
+			err = lzjody_find_seq16(data, options);
+			if (err < 0) return err;
+			if (err > 0) continue;
+			err = lzjody_find_seq32(data, options);
+			if (err < 0) return err;
+			if (err > 0) continue;
+		}
 
-	/* Perform sanity checks on data length */
-	if (length == 0) goto error_zero_length;
-	if (length > LZJODY_BSIZE) goto error_large_length;
+		if (!(options & O_NO_LZ)) {
+			err = lzjody_find_lz(data, idx, options);
+			if (err < 0) return err;
+			if (err > 0) continue;
+		}
 
-	/* Nothing under 3 bytes long will compress */
-	if (length < 3) {
-		data.literals = length;
-		goto compress_short;
+		/* Nothing compressed; add to literal bytes */
+		if (data->literals == 0) data->literal_start = data->ipos;
+		data->literals++;
+		data->ipos++;
 	}
+	return 0;
+}
 
-	/* Load arrays for match speedup */
-	err = index_bytes(&data, &idx);
-	if (err < 0) return err;
+/* Options that select a specialized scan loop, packed into a table index:
+ * O_FAST_LZ, O_NO_LZ, O_NO_SEQ and O_NO_RLE are bits 0-3, O_REALFLUSH is bit 4 */
+#define SCAN_INDEX(a) (((a) & 0x0f) | (((a) & O_REALFLUSH) >> 3))
+#define SCAN_OPTIONS(a) (((a) & 0x0f) | (((a) & 0x10) << 3))
 
-	/* Scan through entire block looking for compressible items */
-	err = compress_scan(&data, &idx);
-	if (err < 0) return err;
+#define SCAN_VARIANT(a) \
+static int compress_scan_##a(struct comp_data_t * const restrict data, \
+		struct lz_index_t * const restrict idx) \
+{ \
+	return compress_scan_opt(data, idx, SCAN_OPTIONS(a)); \
+}
+SCAN_VARIANT(0)  SCAN_VARIANT(1)  SCAN_VARIANT(2)
+SCAN_VARIANT(4)  SCAN_VARIANT(5)  SCAN_VARIANT(6)
+SCAN_VARIANT(8)  SCAN_VARIANT(9)  SCAN_VARIANT(10)
+SCAN_VARIANT(12) SCAN_VARIANT(13) SCAN_VARIANT(14)
+SCAN_VARIANT(16) SCAN_VARIANT(17) SCAN_VARIANT(18)
+SCAN_VARIANT(20) SCAN_VARIANT(21) SCAN_VARIANT(22)
+SCAN_VARIANT(24) SCAN_VARIANT(25) SCAN_VARIANT(26)
+SCAN_VARIANT(28) SCAN_VARIANT(29) SCAN_VARIANT(30)
+
+/* O_FAST_LZ means nothing without LZ, so those entries share a loop */
+static int (* const scan_variants[32])(struct comp_data_t * const restrict,
+		struct lz_index_t * const restrict) = {
+	compress_scan_0,  compress_scan_1,  compress_scan_2,  compress_scan_2,
+	compress_scan_4,  compress_scan_5,  compress_scan_6,  compress_scan_6,
+	compress_scan_8,  compress_scan_9,  compress_scan_10, compress_scan_10,
+	compress_scan_12, compress_scan_13, compress_scan_14, compress_scan_14,
+	compress_scan_16, compress_scan_17, compress_scan_18, compress_scan_18,
+	compress_scan_20, compress_scan_21, compress_scan_22, compress_scan_22,
+	compress_scan_24, compress_scan_25, compress_scan_26, compress_scan_26,
+	compress_scan_28, compress_scan_29, compress_scan_30, compress_scan_30
+};
 
-compress_short:
-	/* Flush any remaining literals */
-	err = lzjody_flush_literals(&data);
-	if (err < 0) return err;
+/* Run the scan loop built for this block's options */
+static int compress_scan(struct comp_data_t * const restrict data,
+		struct lz_index_t * const restrict idx)
+{
+	return scan_variants[SCAN_INDEX(data->options)](data, idx);
+}
 
-	/* Write the total length to the data block unless asked not to */
-	if (!(options & O_NOPREFIX)) {
-/* This uncompressed block part isn't working yet */
-#if 0
-		if (data.opos >= length) {
-			/* Flag incompressible data for possible faster decompression */
-			*(unsigned char *)(data.out) =
-				(unsigned char)((((data.opos - 2) & 0x1f00) >> 8) | O_NOCOMPRESS);
-			DLOG("### Incompressible: %x -> %x\n",
-				(unsigned char)(((data.opos - 2) & 0x1f00) >> 8),
-				(unsigned char)(((data.opos - 2) & 0x1f00) >> 8) | O_NOCOMPRESS);
-		} else {
-#endif
-			*(unsigned char *)(data.out) = (unsigned char)(((data.opos - 2) & 0x1f00) >> 8);
-//		}
-		*(unsigned char *)(data.out + 1) = (unsigned char)(data.opos - 2);
+
+/* Write a block prefix: record flags and the length of what follows */
+static inline void write_prefix(unsigned char * const out,
+		const unsigned int options, const unsigned char flags,
+		const unsigned int length)
+{
+	if (options & O_BSIZE_MASK) {
+		/* Wide prefix: 21-bit length */
+		*out = (unsigned char)(flags | ((length & 0x1f0000) >> 16));
+		*(out + 1) = (unsigned char)(length >> 8);
+		*(out + 2) = (unsigned char)length;
+	} else {
+		*out = (unsigned char)(flags | ((length & 0x1f00) >> 8));
+		*(out + 1) = (unsigned char)length;
 	}
+}
 
-	DLOG("compressed length: %x\n\n", data.opos);
-	return data.opos;
+
+/* Write a zero run or repeat record with a big-endian value payload */
+static int write_record(unsigned char * const out,
+		const unsigned int options, const unsigned char flags,
+		const uint64_t value)
+{
+	const int prefix = LZJODY_PREFIX_LEN(options);
+	int bytes = 1;
+
+	while (bytes < 8 && (value >> (bytes << 3))) bytes++;
+	write_prefix(out, options, flags, bytes);
+	for (int i = 0; i < bytes; i++)
+		*(out + prefix + i) = (unsigned char)(value >> ((bytes - i - 1) << 3));
+	DLOG("record 0x%x: 0x%llx (%d bytes)\n", flags, (unsigned long long)value, bytes);
+	return prefix + bytes;
+}
+
+
+/* CRC32C of a buffer, using the crc32 instruction if the CPU has it */
+extern uint32_t lzjody_crc32c(const unsigned char * const data, const size_t length)
+{
+	return lzjody_kern.crc32c(0xffffffffU, data, length) ^ 0xffffffffU;
+}
+
+
+/* Copy the calling thread's compressor statistics
+ * Returns -1 if the library was built without them */
+extern int lzjody_stats_get(struct lzjody_stats * const out)
+{
+#ifdef LZJODY_STATS
+	*out = stats;
+	return 0;
+#else
+	memset(out, 0, sizeof(struct lzjody_stats));
+	return -1;
+#endif
+}
+
+/* Clear the calling thread's compressor statistics */
+extern void lzjody_stats_reset(void)
+{
+#ifdef LZJODY_STATS
+	memset(&stats, 0, sizeof(struct lzjody_stats));
+#endif
+	return;
+}
+
+
+/* Append the checksum of a block's data to its record if enabled
+ * Returns the number of bytes written */
+static int write_check(unsigned char * const out, const unsigned int options,
+		const unsigned char * const in, const unsigned int length)
+{
+	uint32_t crc;
+
+	if (!(options & O_CHECKSUM) || (options & O_NOPREFIX)) return 0;
+	STAT_START(start);
+	crc = lzjody_crc32c(in, length);
+	STAT_STOP(LZJODY_STAGE_CHECK, start);
+	*out = (unsigned char)(crc >> 24);
+	*(out + 1) = (unsigned char)(crc >> 16);
+	*(out + 2) = (unsigned char)(crc >> 8);
+	*(out + 3) = (unsigned char)crc;
+	return LZJODY_CHECK_LEN;
+}
+
+
+/* Length of the checksum that follows a record of the given type */
+#define CHECK_LEN(options, type) ((((options) & O_CHECKSUM) && (type) != O_ZERORUN) ? LZJODY_CHECK_LEN : 0)
+
+/* Read a record's big-endian checksum */
+static inline uint32_t read_check(const unsigned char * const in)
+{
+	return ((uint32_t)*in << 24) | ((uint32_t)*(in + 1) << 16)
+		| ((uint32_t)*(in + 2) << 8) | (uint32_t)*(in + 3);
+}
+
+
+/* Hash a whole block for repeat block detection */
+static uint64_t block_hash(const unsigned char * const in, const unsigned int length)
+{
+	uint64_t h0 = 0x9e3779b97f4a7c15ULL, h1 = 0xc2b2ae3d27d4eb4fULL;
+	uint64_t h2 = 0x165667b19e3779f9ULL, h3 = length;
+	uint64_t w0, w1, w2, w3;
+	unsigned int i = 0;
+
+	/* Four independent lanes keep the multipliers busy */
+	for (; (i + 32) <= length; i += 32) {
+		memcpy(&w0, in + i, 8);
+		memcpy(&w1, in + i + 8, 8);
+		memcpy(&w2, in + i + 16, 8);
+		memcpy(&w3, in + i + 24, 8);
+		h0 = (h0 ^ w0) * 0xff51afd7ed558ccdULL;
+		h1 = (h1 ^ w1) * 0xff51afd7ed558ccdULL;
+		h2 = (h2 ^ w2) * 0xff51afd7ed558ccdULL;
+		h3 = (h3 ^ w3) * 0xff51afd7ed558ccdULL;
+		h0 ^= h0 >> 32; h1 ^= h1 >> 32; h2 ^= h2 >> 32; h3 ^= h3 >> 32;
+	}
+	for (; i < length; i++) h0 = (h0 ^ *(in + i)) * 0x100000001b3ULL;
+	h0 ^= (h1 << 17 | h1 >> 47) ^ (h2 << 31 | h2 >> 33) ^ (h3 << 47 | h3 >> 17);
+	h0 ^= h0 >> 29;
+	return h0 * 0xc4ceb9fe1a85ec53ULL;
+}
+
+
+/* Size of the uncoded command at p, its payload included */
+static unsigned int command_size(const unsigned char * const p, const unsigned int wide)
+{
+	const unsigned char c = *p;
+	unsigned int n, control;
+
+	if ((c & P_MASK) == P_EXT) {
+		if (c & P_SHORT) {
+			control = *(p + 1);
+			n = 2;
+		} else if (wide && (c & P_XWIDE)) {
+			control = ((unsigned int)*(p + 1) << 16) | ((unsigned int)*(p + 2) << 8) | *(p + 3);
+			n = 4;
+		} else {
+			control = ((unsigned int)*(p + 1) << 8) | *(p + 2);
+			n = 3;
+		}
+		switch (c & P_XMASK) {
+			case P_PLANE: return n + control;
+			case P_SEQ32: return n + 4;
+			case P_SEQ16: return n + 2;
+			case P_SEQ8: return n + 2;
+			default: return n;
+		}
+	}
+
+	if (c & P_SHORT) {
+		control = c & P_SHORT_MAX;
+		n = 1;
+	} else if (wide) {
+		control = ((unsigned int)(c & (P_SHORT_MAX & ~P_WIDE)) << 8) | *(p + 1);
+		n = 2;
+		if (c & P_WIDE) {
+			control = (control << 8) | *(p + 2);
+			n = 3;
+		}
+	} else {
+		if (c & (P_RLE | P_LZL)) control = (unsigned int)(c & (P_LZL | P_SHORT_MAX)) << 8;
+		else control = (unsigned int)(c & P_SHORT_MAX) << 8;
+		control |= *(p + 1);
+		n = 2;
+	}
+	switch (c & P_MASK) {
+		case P_LZ: return n + 1 + ((c & P_LZL) ? (wide ? 2 : 1) : 0);
+		case P_RLE: return n + 1;
+		default: return n + control;
+	}
+}
+
+
+/* Replace the commands of a compressed block starting at start with
+ * Huffman coded segments where that is smaller (O_ENTROPY); a segment
+ * holds whole commands, up to HUFF_SEG_MAX bytes of them */
+static void entropy_code_block(struct comp_data_t * const restrict data,
+		const unsigned int start)
+{
+	unsigned char * const coded = data->work->coded;
+	unsigned int ipos = start, opos = start, end, next, raw, head;
+	int len;
+
+	if (data->opos - start > data->work->bsize + WORK_SLACK) return;
+	while (ipos < data->opos) {
+		for (end = next = ipos; end < data->opos; end = next) {
+			next = end + command_size(data->out + end, data->wide);
+			if (next > data->opos || next - ipos > HUFF_SEG_MAX) break;
+		}
+		/* A command too big for a segment stays as it is */
+		if (end == ipos) end = (next < data->opos) ? next : data->opos;
+		raw = end - ipos;
+		len = -1;
+		if (raw >= MIN_HUFF_LENGTH && raw <= HUFF_SEG_MAX) {
+			/* The command holds the uncoded length like other extended commands */
+			if (raw <= P_SHORT_XMAX) {
+				coded[0] = P_HUFF | P_SHORT;
+				head = 1;
+			} else {
+				coded[0] = P_HUFF;
+				coded[1] = (unsigned char)(raw >> 8);
+				head = 2;
+			}
+			coded[head] = (unsigned char)raw;
+			head++;
+			len = huffman_encode(data->out + ipos, raw, coded + head, raw - head - 1, data->wide);
+		}
+		if (len < 0) {
+			memmove(data->out + opos, data->out + ipos, raw);
+			opos += raw;
+		} else {
+			DLOG("Entropy coded 0x%x -> 0x%x\n", raw, head + len);
+			memcpy(data->out + opos, coded, head + (unsigned int)len);
+			opos += head + (unsigned int)len;
+		}
+		ipos = end;
+	}
+	data->opos = opos;
+	return;
+}
+
+
+/* Allocate compressor scratch space for blocks of up to bsize bytes */
+static struct comp_work_t *work_alloc(const unsigned int bsize)
+{
+	const size_t buf = (size_t)bsize + WORK_SLACK;
+	struct comp_work_t *work;
+
+	work = (struct comp_work_t *)malloc(sizeof(struct comp_work_t) + buf * 4);
+	if (work == NULL) return NULL;
+	work->bsize = bsize;
+	work->lit_in = (unsigned char *)(work + 1);
+	work->lit_out = work->lit_in + buf;
+	work->coded = work->lit_out + buf;
+	work->page = work->coded + buf;
+	return work;
+}
+
+
+/* Each thread keeps its scratch space for later calls; threaded builds
+ * free it when the thread exits */
+static __thread struct comp_work_t *thread_work;
+#ifdef THREADED
+static pthread_key_t thread_work_key;
+static pthread_once_t thread_work_once = PTHREAD_ONCE_INIT;
+
+static void thread_work_key_create(void)
+{
+	pthread_key_create(&thread_work_key, free);
+}
+#endif
+
+/* This thread's scratch space for blocks of up to bsize bytes,
+ * grown if an earlier call used a smaller block size */
+static struct comp_work_t *work_get(const unsigned int bsize)
+{
+	if (thread_work != NULL && thread_work->bsize >= bsize) return thread_work;
+	free(thread_work);
+	thread_work = work_alloc(bsize);
+#ifdef THREADED
+	pthread_once(&thread_work_once, thread_work_key_create);
+	pthread_setspecific(thread_work_key, thread_work);
+#endif
+	return thread_work;
+}
+
+
+/* Lempel-Ziv compressor by Jody Bruchon (LZJODY)
+ * Compresses "blk" data and puts result in "out"
+ * out must be at least 2 bytes larger than blk in case
+ * the data is not compressible at all.
+ * Returns the size of "out" data or returns -1 if the
+ * compressed data is not smaller than the original data.
+ * work is scratch space from work_get() for at least the block size
+ * With a preset dictionary or reference window, blk_in holds dict_len
+ * bytes of it followed by length bytes of block data; dict_idx is the
+ * dictionary's prebuilt index or NULL to index everything here
+ * For a reference window, *ref_dist is the distance of the first LZ
+ * candidate and is updated to where matching left off (NULL if unused)
+ */
+static int compress_block(const unsigned char * const blk_in,
+		unsigned char * const blk_out,
+		const unsigned int options,
+		const unsigned int length,
+		struct comp_work_t * const restrict work,
+		const unsigned int dict_len,
+		const struct lz_index_t * const restrict dict_idx,
+		unsigned int * const ref_dist)
+{
+	int err;
+
+	/* Initialize compression data structure */
+	struct comp_data_t data;
+	unsigned int start;
+	int lead;
+
+	DLOG("Comp: blk len 0x%x\n", length);
+
+	data.in = blk_in;
+	data.out = blk_out;
+	data.ipos = 0;
+	data.opos = LZJODY_PREFIX_LEN(options);
+	data.literals = 0;
+	data.literal_start = 0;
+	data.length = length;
+	data.bsize = LZJODY_BSIZE_OF(options);
+	data.wide = (options & (O_BSIZE_MASK | O_WIDE_CMD)) ? 1 : 0;
+	data.dist = (options & (O_BSIZE_MASK | O_LZ_DIST | O_WIDE_CMD)) ? 1 : 0;
+	data.dict_len = dict_len;
+	data.ref_dist = (ref_dist != NULL) ? *ref_dist : 0;
+	data.last_dist = 0;
+	data.options = options;
+	data.work = work;
+
+	if (options & O_NOPREFIX) data.opos = 0;
+	data.ipos = dict_len;
+	data.literal_start = dict_len;
+	data.length = dict_len + length;
+
+	/* Perform sanity checks on data length */
+	if (length == 0) goto error_zero_length;
+	if (data.bsize > LZJODY_MAX_BSIZE || data.bsize > work->bsize) goto error_bsize;
+	if (length > data.bsize) goto error_large_length;
+
+	STAT_ADD(blocks, 1);
+	STAT_ADD(bytes_in, length);
+
+	/* Nothing under 3 bytes long will compress */
+	if (length < 3) {
+		data.literals = length;
+		goto compress_short;
+	}
+
+	/* Load arrays for match speedup */
+	STAT_START(index_start);
+	if (dict_idx != NULL) err = index_dict_bytes(&data, &work->idx, dict_idx);
+	else err = index_bytes(&data, &work->idx, 0);
+	if (err < 0) return err;
+	STAT_STOP(LZJODY_STAGE_INDEX, index_start);
+
+	/* Scan through entire block looking for compressible items */
+	STAT_START(scan_start);
+	err = compress_scan(&data, &work->idx);
+	if (err < 0) return err;
+	STAT_STOP(LZJODY_STAGE_SCAN, scan_start);
+
+compress_short:
+	/* Flush any remaining literals */
+	err = lzjody_flush_literals(&data);
+	if (err < 0) return err;
+
+	/* Every block must decode in place in its decompressed size plus
+	 * LZJODY_INPLACE_MARGIN; one whose output runs too far ahead of its
+	 * input is stored as literals instead */
+	start = (options & O_NOPREFIX) ? 0 : LZJODY_PREFIX_LEN(options);
+	err = block_out_len(data.out + start, data.opos - start, options, dict_len, &lead);
+	if (err != (int)length) goto error_walk;
+	if (lead + (data.opos - start) > length + LZJODY_INPLACE_MARGIN(options)) {
+		DLOG("In-place lead 0x%x too long; storing block\n", lead);
+		data.opos = start;
+		data.literals = length;
+		data.literal_start = dict_len;
+		err = lzjody_really_flush_literals(&data);
+		if (err < 0) return err;
+	}
+
+	if (options & O_ENTROPY) {
+		STAT_START(entropy_start);
+		entropy_code_block(&data, start);
+		STAT_STOP(LZJODY_STAGE_ENTROPY, entropy_start);
+	}
+
+	/* Write the total length to the data block unless asked not to */
+	if (!(options & O_NOPREFIX) && (options & O_BSIZE_MASK)) {
+		write_prefix(data.out, options, 0, data.opos - 3);
+	} else if (!(options & O_NOPREFIX)) {
+/* This uncompressed block part isn't working yet */
+#if 0
+		if (data.opos >= length) {
+			/* Flag incompressible data for possible faster decompression */
+			*(unsigned char *)(data.out) =
+				(unsigned char)((((data.opos - 2) & 0x1f00) >> 8) | O_NOCOMPRESS);
+			DLOG("### Incompressible: %x -> %x\n",
+				(unsigned char)(((data.opos - 2) & 0x1f00) >> 8),
+				(unsigned char)(((data.opos - 2) & 0x1f00) >> 8) | O_NOCOMPRESS);
+		} else {
+#endif
+			*(unsigned char *)(data.out) = (unsigned char)(((data.opos - 2) & 0x1f00) >> 8);
+//		}
+		*(unsigned char *)(data.out + 1) = (unsigned char)(data.opos - 2);
+	}
+
+	if (ref_dist != NULL) *ref_dist = data.ref_dist;
+	DLOG("compressed length: %x\n\n", data.opos);
+	return data.opos;
 
 error_large_length:
 	fprintf(stderr, "liblzjody: error: block length %d larger than maximum of %d\n",
-			length, LZJODY_BSIZE);
+			length, data.bsize);
+	return -1;
+error_bsize:
+	fprintf(stderr, "liblzjody: error: block size %d not supported (maximum %d)\n",
+			data.bsize, LZJODY_MAX_BSIZE);
+	return -1;
+error_zero_length:
+	fprintf(stderr, "liblzjody: error: cannot compress a zero-length block\n");
+	return -2;
+error_walk:
+	fprintf(stderr, "liblzjody: error: compressed block decodes to %d bytes, not %u\n",
+			err, length);
+	return -1;
+}
+
+
+int lzjody_real_compress(const unsigned char * const blk_in,
+		unsigned char * const blk_out,
+		const unsigned int options,
+		const unsigned int length)
+{
+	struct comp_work_t *work;
+
+	work = work_get(LZJODY_BSIZE_OF(options));
+	if (work == NULL) goto error_oom;
+	return compress_block(blk_in, blk_out, options, length, work, 0, NULL, NULL);
+
+error_oom:
+	fprintf(stderr, "liblzjody: error: out of memory\n");
 	return -1;
+}
+
+
+/* Wide format LZ distances are 19 bits */
+#define WIDE_REACH 0x80000
+/* Largest reference window for a block size */
+#define REF_WINDOW_MAX(a) ((((a) << 1) < (WIDE_REACH - (a))) ? ((a) << 1) : (WIDE_REACH - (a)))
+/* No reference block matches */
+#define REF_NONE UINT64_MAX
+/* Strings from a block that are looked for to resync a reference window */
+#define REF_ANCHOR 32
+#define REF_ANCHORS 4
+#define REF_HASH_MUL 0x01000193U
+
+/* Reference state for compress_dedup() in delta mode */
+struct ref_work_t {
+	const struct lzjody_ref *ref;
+	uint64_t offset;	/* Stream offset of the first input byte */
+	int64_t shift;	/* How far data had moved since the reference at the last match */
+	unsigned char *work;	/* Reference window followed by the block */
+	unsigned char *alt;	/* Reference window compression result */
+};
+
+
+/* Find the reference window of the block at stream offset pos: up to two
+ * blocks centered on it, so data moved by small insertions or deletions
+ * is still in reach. Returns the window start; *wlen is 0 if the window
+ * is past the end of the reference */
+static uint64_t ref_window(const uint64_t ref_size, const unsigned int bsize,
+		const uint64_t pos, unsigned int * const wlen)
+{
+	const unsigned int max = REF_WINDOW_MAX(bsize);
+	const unsigned int lead = (max - bsize) >> 1;
+	const uint64_t start = (pos > lead) ? pos - lead : 0;
+
+	*wlen = 0;
+	if (start < ref_size) *wlen = (ref_size - start < max) ? (unsigned int)(ref_size - start) : max;
+	return start;
+}
+
+
+/* Find a reference block identical to a full input block at stream
+ * offset pos; the block at the same offset is tried first */
+static uint64_t ref_find(const struct lzjody_ref * const ref,
+		const unsigned char * const in, const uint64_t pos,
+		const uint64_t hash)
+{
+	const unsigned int bsize = ref->bsize;
+
+	if ((pos % bsize) == 0 && ref->size >= bsize && ref->size - bsize >= pos
+			&& memcmp(ref->data + pos, in, bsize) == 0) return pos / bsize;
+	if (ref->slot == NULL) return REF_NONE;
+	for (uint64_t i = hash & ref->mask; ref->slot[i].block != 0; i = (i + 1) & ref->mask) {
+		if (ref->slot[i].tag == (uint32_t)(hash >> 32) && memcmp(in,
+				ref->data + (uint64_t)(ref->slot[i].block - 1) * bsize, bsize) == 0)
+			return ref->slot[i].block - 1;
+	}
+	return REF_NONE;
+}
+
+
+/* Find how far a block moved since the reference: look for a few anchor
+ * strings from the block with a rolling hash of the window and return the
+ * distance back to the hit that most anchors agree with, preferring the
+ * one closest to the expected distance (0 if there is no hit) */
+static unsigned int ref_resync(const unsigned char * const work,
+		const unsigned int wlen, const unsigned int size,
+		const unsigned int expect)
+{
+	const unsigned char * const in = work + wlen;
+	uint32_t want[REF_ANCHORS], h, top = 1;
+	unsigned int at[REF_ANCHORS], best = 0, best_err = UINT32_MAX, d, err;
+	int score, best_score = 0;
+
+	if (size < REF_ANCHOR || wlen < REF_ANCHOR) return 0;
+	for (int i = 0; i < REF_ANCHOR - 1; i++) top *= REF_HASH_MUL;
+	for (int i = 0; i < REF_ANCHORS; i++) {
+		at[i] = (size - REF_ANCHOR) / (REF_ANCHORS - 1) * (unsigned int)i;
+		want[i] = 0;
+		for (int j = 0; j < REF_ANCHOR; j++) want[i] = want[i] * REF_HASH_MUL + *(in + at[i] + j);
+	}
+
+	h = 0;
+	for (int j = 0; j < REF_ANCHOR - 1; j++) h = h * REF_HASH_MUL + *(work + j);
+	for (unsigned int p = 0; p + REF_ANCHOR <= wlen; p++) {
+		h = h * REF_HASH_MUL + *(work + p + REF_ANCHOR - 1);
+		for (int i = 0; i < REF_ANCHORS; i++) {
+			if (h != want[i] || memcmp(work + p, in + at[i], REF_ANCHOR) != 0) continue;
+			d = wlen + at[i] - p;
+			if (d == best) continue;
+			score = 0;
+			for (int j = 0; j < REF_ANCHORS; j++)
+				if (d <= wlen + at[j] && memcmp(work + wlen + at[j] - d, in + at[j], REF_ANCHOR) == 0) score++;
+			err = (d > expect) ? d - expect : expect - d;
+			if (score > best_score || (score == best_score && err < best_err)) {
+				best = d;
+				best_err = err;
+				best_score = score;
+			}
+		}
+		/* Drop the byte leaving the hash */
+		h -= *(work + p) * top;
+	}
+	return best;
+}
+
+
+/* Compress a block with its reference window as a dictionary, keeping the
+ * plain compressed block instead if the window did not help much */
+static int compress_ref_block(const unsigned char * const in,
+		unsigned char * const out,
+		const unsigned int options,
+		const unsigned int size,
+		const uint64_t pos,
+		struct comp_work_t * const work,
+		struct ref_work_t * const rw)
+{
+	unsigned int wlen, ref_dist = 0;
+	const uint64_t start = ref_window(rw->ref->size, LZJODY_BSIZE_OF(options), pos, &wlen);
+	/* Distance back to the same stream offset in the window */
+	const int64_t same = (int64_t)wlen - (int64_t)(pos - start);
+	int64_t dist;
+	int err, alt_size;
+
+	if (wlen == 0) return compress_block(in, out, options, size, work, 0, NULL, NULL);
+	/* Data that moved in earlier blocks has probably moved here too */
+	dist = same + rw->shift;
+	if (dist <= 0 || dist > wlen) dist = same;
+	if (dist > 0 && dist <= wlen) ref_dist = (unsigned int)dist;
+	memcpy(rw->work, rw->ref->data + start, wlen);
+	memcpy(rw->work + wlen, in, size);
+	if (size >= REF_ANCHOR && (ref_dist == 0
+			|| memcmp(rw->work + wlen - ref_dist, in, REF_ANCHOR) != 0)) {
+		dist = ref_resync(rw->work, wlen, size, (same > 0) ? (unsigned int)same : 0);
+		if (dist != 0) ref_dist = (unsigned int)dist;
+	}
+	alt_size = compress_block(rw->work, rw->alt, options | O_WIDE_CMD, size,
+			work, wlen, NULL, &ref_dist);
+	if (alt_size < 0) return alt_size;
+	if (ref_dist != 0) rw->shift = (int64_t)ref_dist - same;
+
+	/* Mostly new data may compress better on its own */
+	if ((unsigned int)alt_size > (size >> 2)) {
+		err = compress_block(in, out, options, size, work, 0, NULL, NULL);
+		if (err <= alt_size) return err;
+	}
+	memcpy(out, rw->alt, (size_t)alt_size);
+	*out |= O_REFWINDOW;
+	return alt_size;
+}
+
+
+/* Compress blocks, replacing zero blocks with zero run records and
+ * recently seen blocks with repeat records
+ * In delta mode (rw not NULL) blocks found in the reference become
+ * reference block records and others may match into the reference */
+static int compress_dedup(const unsigned char * const blk_in,
+		unsigned char * const blk_out,
+		const unsigned int options,
+		const unsigned int length,
+		struct comp_work_t * const work,
+		struct ref_work_t * const rw)
+{
+	struct dedup_t seen[DEDUP_SLOTS];
+	struct dedup_t *e;
+	const unsigned int bsize = LZJODY_BSIZE_OF(options);
+	const unsigned int window = LZJODY_REPEAT_BLOCKS(options);
+	const unsigned char *in = blk_in;
+	unsigned int size, block = 0;
+	uint64_t zeroes = 0, hash, ref_block;
+	int err, out_size = 0;
+
+	if (length == 0) goto error_zero_length;
+	for (int i = 0; i < DEDUP_SLOTS; i++) seen[i].length = 0;
+
+	for (unsigned int i = 0; i < length; i += size, in += size) {
+		size = length - i;
+		if (size > bsize) size = bsize;
+
+		if (lzjody_kern.is_zero(in, size)) {
+			zeroes += size;
+			continue;
+		}
+		if (zeroes != 0) {
+			out_size += write_record(blk_out + out_size, options, O_ZERORUN, zeroes);
+			zeroes = 0;
+		}
+
+		hash = block_hash(in, size);
+		if (rw != NULL && size == bsize
+				&& (ref_block = ref_find(rw->ref, in, rw->offset + i, hash)) != REF_NONE) {
+			out_size += write_record(blk_out + out_size, options, O_REFBLOCK, ref_block);
+			out_size += write_check(blk_out + out_size, options, in, size);
+			block++;
+			continue;
+		}
+		e = seen + (hash % DEDUP_SLOTS);
+		if (e->length == size && e->hash == hash && (block - e->block) <= window
+				&& memcmp(e->in, in, size) == 0) {
+			out_size += write_record(blk_out + out_size, options, O_REPEAT, block - e->block);
+			out_size += write_check(blk_out + out_size, options, in, size);
+		} else {
+			if (rw != NULL) err = compress_ref_block(in, blk_out + out_size, options, size, rw->offset + i, work, rw);
+			else err = compress_block(in, blk_out + out_size, options, size, work, 0, NULL, NULL);
+			if (err < 0) return err;
+			out_size += err;
+			out_size += write_check(blk_out + out_size, options, in, size);
+			e->in = in;
+			e->hash = hash;
+			e->length = size;
+		}
+		/* Refer to the latest copy to keep distances short */
+		e->block = block;
+		block++;
+	}
+	if (zeroes != 0) out_size += write_record(blk_out + out_size, options, O_ZERORUN, zeroes);
+	return out_size;
+
 error_zero_length:
 	fprintf(stderr, "liblzjody: error: cannot compress a zero-length block\n");
 	return -2;
@@ -753,30 +1697,127 @@ extern int lzjody_compress(const unsigned char * const blk_in,
 	int err, size, out_size;
 	const unsigned char *in = blk_in;
 	unsigned char *out = blk_out;
-
-	if (length <= LZJODY_BSIZE) return lzjody_real_compress(blk_in, blk_out, options, length);
+	const int bsize = LZJODY_BSIZE_OF(options);
+	struct comp_work_t *work;
+
+	work = work_get((unsigned int)bsize);
+	if (work == NULL) goto error_oom;
+	if ((options & O_DEDUP) && !(options & O_NOPREFIX))
+		return compress_dedup(blk_in, blk_out, options, length, work, NULL);
+	if (length <= (unsigned int)bsize) {
+		out_size = compress_block(blk_in, blk_out, options, length, work, 0, NULL, NULL);
+		if (out_size >= 0) out_size += write_check(blk_out + out_size, options, blk_in, length);
+		return out_size;
+	}
 
 	out_size = 0;
 	for (unsigned int i = 0; i < length; i += size, out_size += err, in += size, out += err) {
 		size = length - i;
-		if (size > LZJODY_BSIZE) size = LZJODY_BSIZE;
-		err = lzjody_real_compress(in, out, options, size);
+		if (size > bsize) size = bsize;
+		err = compress_block(in, out, options, (unsigned int)size, work, 0, NULL, NULL);
 		if (err < 0) return err;
+		err += write_check(out + err, options, in, (unsigned int)size);
 	}
 	return out_size;
+
+error_oom:
+	fprintf(stderr, "liblzjody: error: out of memory\n");
+	return -1;
 }
 
 
-/* LZJODY decompressor */
-extern int lzjody_decompress(const unsigned char * const in,
+/* Most LZ matches and literal runs are short; copy those inline and
+ * leave longer ones to the copy kernel */
+#define COPY_INLINE_MAX 16
+static inline void copy_bytes(unsigned char * const dst, const unsigned char * const src,
+		const unsigned int length)
+{
+	if (length > COPY_INLINE_MAX) {
+		lzjody_kern.copy(dst, src, length);
+		return;
+	}
+	for (unsigned int i = 0; i < length; i++) *(dst + i) = *(src + i);
+	return;
+}
+
+
+static int decode_commands(const unsigned char * const, unsigned char * const,
+		const unsigned int, const unsigned int, const unsigned int,
+		const unsigned char * const, const unsigned int, const unsigned int,
+		unsigned int * const);
+
+/* Decode a byte plane's commands into a buffer on the stack and join the
+ * planes into out; returns the joined length or negative on error */
+static NOINLINE int decompress_plane(const unsigned char * const in,
 		unsigned char * const out,
 		const unsigned int size,
+		const unsigned int cap,
 		const unsigned int options)
+{
+	unsigned char planes[PLANE_MAX];
+	unsigned int last_dist = 0;
+	int length;
+
+	length = decode_commands(in, planes, size, (cap < PLANE_MAX) ? cap : PLANE_MAX,
+			options | O_SUB_BLOCK | O_PLANE_CMDS, NULL, 0, 0, &last_dist);
+	if (length < 0) return length;
+	lzjody_kern.plane_join(planes, out, (unsigned int)length);
+	return length;
+}
+
+/* Decode an entropy coded segment into a buffer on the stack and run its
+ * raw bytes of commands on from output position opos; *used gets the
+ * coded size. Returns the new output position or negative on error */
+static NOINLINE int decompress_huff(const unsigned char * const in,
+		const unsigned int size,
+		const unsigned int raw,
+		unsigned char * const out,
+		const unsigned int cap,
+		const unsigned int options,
+		const unsigned char * const dict,
+		const unsigned int dict_len,
+		const unsigned int opos,
+		unsigned int * const last_dist,
+		unsigned int * const used)
+{
+	unsigned char cmds[HUFF_SEG_MAX];
+	int err;
+
+	if (raw > HUFF_SEG_MAX) goto error_huff;
+	err = huffman_decode(in, size, cmds, raw, options & (O_BSIZE_MASK | O_WIDE_CMD));
+	if (err < 0) goto error_huff;
+	*used = (unsigned int)err;
+	DLOG("%04x: Entropy coded segment 0x%x -> 0x%x\n", opos, *used, raw);
+	return decode_commands(cmds, out, raw, cap, options | O_SUB_BLOCK,
+			dict, dict_len, opos, last_dist);
+
+error_huff:
+	fprintf(stderr, "liblzjody: data error: bad entropy coded segment (length 0x%x)\n", raw);
+	return -12;
+}
+
+/* LZJODY decompressor
+ * Never reads past size bytes of input or writes past cap bytes of output
+ * LZ matches may reach back into a preset dictionary of dict_len bytes
+ * Decoding starts at output position start with the previous LZ match
+ * distance in *last, which gets the distance left at the end */
+static int decode_commands(const unsigned char * const in,
+		unsigned char * const out,
+		const unsigned int size,
+		const unsigned int cap,
+		const unsigned int options,
+		const unsigned char * const dict,
+		const unsigned int dict_len,
+		const unsigned int start,
+		unsigned int * const last)
 {
 	unsigned int mode;
 	register unsigned int ipos = 0;
-	register unsigned int opos = 0;
+	register unsigned int opos = start;
 	unsigned int offset;
+	unsigned int last_dist = *last;	/* distance of the previous LZ match */
+	unsigned int used;	/* coded bytes of an entropy coded segment */
+	unsigned int dict_part;	/* bytes of an LZ match taken from the dictionary */
 	register unsigned int length = 0;
 	unsigned int sl;	/* short/long */
 	unsigned int control = 0;
@@ -795,13 +1836,14 @@ extern int lzjody_decompress(const unsigned char * const in,
 		uint8_t num8;
 	} num;
 	unsigned int seqbits = 0;
-	unsigned char *bp_out;
-	unsigned int bp_length;
-	unsigned char bp_temp[LZJODY_BSIZE];
-	int err;
+	int bp_length;
+	const unsigned int bsize = LZJODY_BSIZE_OF(options);
+	const unsigned int wide = options & (O_BSIZE_MASK | O_WIDE_CMD);
+	const unsigned int dist = options & (O_BSIZE_MASK | O_LZ_DIST | O_WIDE_CMD);
 
 	/* Cannot decompress a zero-length block */
 	if (size == 0) return -1;
+	if (bsize > LZJODY_MAX_BSIZE) goto error_bsize;
 
 	while (ipos < size) {
 		c = *(in + ipos);
@@ -814,15 +1856,23 @@ extern int lzjody_decompress(const unsigned char * const in,
 			/* Change mode to the extended command instead */
 			mode = c & P_XMASK;
 			DLOG("X-mode: %x\n", mode);
-			/* Initializer for sequence/byteplane commands */
-			if (mode & (P_SMASK | P_PLANE)) {
+			/* Initializer for sequence/byteplane/repeat/entropy commands */
+			if (mode & (P_SMASK | P_PLANE | P_REP)) {
+				if (ipos + (sl ? 1 : ((wide && (c & P_XWIDE)) ? 3 : 2)) > size) goto error_input;
 				length = *(in + ipos);
 #ifdef DEBUG
 				if (mode & P_SMASK) { DLOG("Seq%u length: %x\n", 4 << (mode & P_SMASK), length); }
-				if (mode & P_PLANE) { DLOG("Byte plane length: %x\n", length); }
+				if (mode == P_PLANE) { DLOG("Byte plane length: %x\n", length); }
+				if (mode == P_REP) { DLOG("LZ repeat length: %x\n", length); }
+				if (mode == P_HUFF) { DLOG("Entropy coded length: %x\n", length); }
 #endif /* DEBUG */
 				ipos++;
-				/* Long form has a high byte */
+				/* Long form has a high byte (two for wide) */
+				if (!sl && wide && (c & P_XWIDE)) {
+					length <<= 8;
+					length += (uint16_t)*(in + ipos);
+					ipos++;
+				}
 				if (!sl) {
 					length <<= 8;
 					length += (uint16_t)*(in + ipos);
@@ -831,15 +1881,28 @@ extern int lzjody_decompress(const unsigned char * const in,
 						(uint16_t)*(in + ipos) << 8);
 					ipos++;
 				}
-				if (length > LZJODY_BSIZE) goto error_length;
+				if (length > bsize + ((mode == P_HUFF) ? LZJODY_MAX_EXPAND(options) : 0))
+					goto error_length;
 			}
 		}
 		/* Handle short/long standard commands */
 		else if (sl) {
 			control = c & P_SHORT_MAX;
 			DLOG("Short control: 0x%x\n", control);
+		} else if (wide) {
+			if (ipos + ((c & P_WIDE) ? 2 : 1) > size) goto error_input;
+			control = (unsigned int)(c & (P_SHORT_MAX & ~P_WIDE)) << 8;
+			control += *(in + ipos);
+			ipos++;
+			if (c & P_WIDE) {
+				control <<= 8;
+				control += *(in + ipos);
+				ipos++;
+			}
+			DLOG("Long control: 0x%x\n", control);
 		} else {
-			if (c & (P_RLE | P_LZL)) 
+			if (ipos >= size) goto error_input;
+			if (c & (P_RLE | P_LZL))
 				control = (unsigned int)(c & (P_LZL | P_SHORT_MAX)) << 8;
 			else control = (unsigned int)(c & P_SHORT_MAX) << 8;
 			control += *(in + ipos);
@@ -850,59 +1913,89 @@ extern int lzjody_decompress(const unsigned char * const in,
 		/* Based on the command, select a decompressor */
 		switch (mode) {
 			case P_PLANE:
-				/* Byte plane transformation handler */
+				/* Byte plane transformation handler; the planes are
+				 * decoded off to the side, so nothing is read back from
+				 * output that may overlap the input */
 				DLOG("%04x:%04x:  Byte plane c_len 0x%x\n", ipos, opos, length);
-				bp_out = out + opos;
-				bp_length = lzjody_decompress((in + ipos), bp_out, length, 0);
-
-				err = byteplane_transform(bp_out, bp_temp, bp_length, -4);
-				if (err < 0) return err;
-
+				if (options & O_PLANE_CMDS) goto error_plane;
+				if (length > size - ipos) goto error_input;
+				bp_length = decompress_plane(in + ipos, out + opos, length, cap - opos, options);
+				if (bp_length < 0) return bp_length;
 				DLOG("Byte plane transform len 0x%x done\n", bp_length);
 				ipos += length;
-				opos += bp_length;
-				if (opos > LZJODY_BSIZE) goto error_bp_length;
-				length = 0;
-				/* memcpy sucks, we can do it ourselves */
-				while(length < bp_length) {
-					*(bp_out + length) = *(bp_temp + length);
-					length++;
-				}
+				opos += (unsigned int)bp_length;
 				break;
 			case P_LZ:
 				/* LZ (dictionary-based) compression */
-				offset = control & 0xfff;
+				/* Wide format LZ stores a distance, not an offset
+				 * Offsets count from the start of any dictionary */
+				if (dist) {
+					if (!wide) control &= LZ_LEGACY_MAX;
+					if (control == 0 || control > opos + dict_len) goto error_lz_distance;
+					offset = opos + dict_len - control;
+				} else offset = control & 0xfff;
+				if (ipos + 1 + ((c & P_LZL) ? (wide ? 2 : 1) : 0) > size) goto error_input;
 				length = *(in + ipos);
 				ipos++;
-				if (c & P_LZL) {
+				if ((c & P_LZL) && wide) {
 					length <<= 8;
 					length += *(in + ipos);
 					ipos++;
 				}
-				DLOG("%04x:%04x: LZ block (%x:%x)\n",
+				if (c & P_LZL) {
+					length <<= 8;
+					length += *(in + ipos);
+					ipos++;
+				}
+				DLOG("%04x:%04x: LZ block (%x:%x)\n",
 						ipos, opos, offset, length);
 				/* memcpy/memmove do not handle the overlap
-				 * correctly when it happens, so we copy the
-				 * data manually.  */
-				if (offset >= opos) goto error_lz_offset;
-				mem1 = out + offset;
+				 * correctly when it happens, so the copy kernel
+				 * works like a forward byte loop */
+				if (offset >= opos + dict_len) goto error_lz_offset;
+				last_dist = opos + dict_len - offset;
+lz_copy:
 				mem2 = out + opos;
 				opos += length;
-				if (opos > LZJODY_BSIZE) goto error_lz_length;
-				while (length != 0) {
-					*mem2 = *mem1;
-					mem1++; mem2++;
-					length--;
-				}
+				if (opos > cap) goto error_lz_length;
+				/* A match can start in the dictionary and run into the block */
+				if (offset < dict_len) {
+					dict_part = (length < dict_len - offset) ? length : dict_len - offset;
+					copy_bytes(mem2, dict + offset, dict_part);
+					mem2 += dict_part;
+					length -= dict_part;
+					mem1 = out;
+				} else mem1 = out + offset - dict_len;
+				copy_bytes(mem2, mem1, length);
+				break;
+
+			case P_HUFF:
+				/* Entropy coded segment: its commands are decoded before
+				 * any of them run, then decoding carries on after it */
+				if (options & O_SUB_BLOCK) goto error_huff;
+				bp_length = decompress_huff(in + ipos, size - ipos, length, out, cap,
+						options, dict, dict_len, opos, &last_dist, &used);
+				if (bp_length < 0) return bp_length;
+				ipos += used;
+				opos = (unsigned int)bp_length;
 				break;
 
+			case P_REP:
+				/* LZ match at the distance of the previous match */
+				if (last_dist == 0) goto error_lz_repeat;
+				offset = opos + dict_len - last_dist;
+				DLOG("%04x:%04x: LZ repeat (%x:%x)\n",
+						ipos, opos, offset, length);
+				goto lz_copy;
+
 			case P_RLE:
 				/* Run-length encoding */
 				length = control;
+				if (ipos >= size) goto error_input;
 				c = *(in + ipos);
 				ipos++;
 				DLOG("%04x:%04x: RLE run 0x%x\n", ipos, opos, length);
-				if (opos + length > LZJODY_BSIZE) goto error_rle_length;
+				if (opos + length > cap) goto error_rle_length;
 				while (length > 0) {
 					*(out + opos) = c;
 					opos++;
@@ -913,17 +2006,11 @@ extern int lzjody_decompress(const unsigned char * const in,
 			case P_LIT:
 				/* Literal byte sequence */
 				DLOG("%04x:%04x: 0x%x literal bytes\n", ipos, opos, control);
-				length = control;
-				mem1 = (const unsigned char *)(in + ipos);
-				mem2 = (unsigned char *)(out + opos);
-				while (length != 0) {
-					*mem2 = *mem1;
-					mem1++; mem2++;
-					length--;
-				}
+				if (control > size - ipos) goto error_input;
+				if (opos + control > cap) goto error_lit_length;
+				copy_bytes(out + opos, in + ipos, control);
 				ipos += control;
 				opos += control;
-				if (opos > LZJODY_BSIZE) goto error_lit_length;
 				break;
 
 			case P_SEQ32:
@@ -931,12 +2018,13 @@ extern int lzjody_decompress(const unsigned char * const in,
 				/* Sequential increment compression (32-bit) */
 				DLOG("%04x:%04x: Seq(32) 0x%x\n", ipos, opos, length);
 				/* Get sequence start number */
+				if (ipos + sizeof(uint32_t) > size) goto error_input;
 				num.num32 = *(uint32_t *)((uintptr_t)in + (uintptr_t)ipos);
 				ipos += sizeof(uint32_t);
 				/* Get sequence start position */
 				mem.m32 = (uint32_t *)((uintptr_t)out + (uintptr_t)opos);
 				opos += (length << 2);
-				if (opos > LZJODY_BSIZE) goto error_seq;
+				if (opos > cap) goto error_seq;
 				DLOG("opos = 0x%x, length = 0x%x\n", opos, length);
 				while (length > 0) {
 					*mem.m32 = BSWAP32(num.num32);
@@ -950,13 +2038,14 @@ extern int lzjody_decompress(const unsigned char * const in,
 				/* Sequential increment compression (16-bit) */
 				DLOG("%04x:%04x: Seq(16) 0x%x\n", ipos, opos, length);
 				/* Get sequence start number */
+				if (ipos + sizeof(uint16_t) > size) goto error_input;
 				num.num16 = *(uint16_t *)((uintptr_t)in + (uintptr_t)ipos);
 				ipos += sizeof(uint16_t);
 				/* Get sequence start position */
 				mem.m16 = (uint16_t *)((uintptr_t)out + (uintptr_t)opos);
 				DLOG("opos = 0x%x, length = 0x%x\n", opos, length);
 				opos += (length << 1);
-				if (opos > LZJODY_BSIZE) goto error_seq;
+				if (opos > cap) goto error_seq;
 				while (length > 0) {
 					*mem.m16 = BSWAP16(num.num16);
 					mem.m16++; num.num16++;
@@ -969,13 +2058,14 @@ extern int lzjody_decompress(const unsigned char * const in,
 				/* Sequential increment compression (8-bit) */
 				DLOG("%04x:%04x: Seq(8) 0x%x\n", ipos, opos, length);
 				/* Get sequence start number */
+				if (ipos + sizeof(uint8_t) * 2 > size) goto error_input;
 				num.num8 = *(uint8_t *)((uintptr_t)in + (uintptr_t)ipos);
 				diff = *(int8_t *)((uintptr_t)in + (uintptr_t)ipos + 1);
 				ipos += sizeof(uint8_t) * 2;
 				/* Get sequence start position */
 				mem.m8 = (uint8_t *)((uintptr_t)out + (uintptr_t)opos);
 				opos += length;
-				if (opos > LZJODY_BSIZE) goto error_seq;
+				if (opos > cap) goto error_seq;
 				while (length > 0) {
 					*mem.m8 = num.num8;
 					mem.m8++; num.num8 += diff;
@@ -988,39 +2078,1659 @@ extern int lzjody_decompress(const unsigned char * const in,
 		}
 	}
 
-	if (opos > LZJODY_BSIZE) goto error_opos;
+	if (opos > cap) goto error_opos;
+	*last = last_dist;
 	return opos;
 
+error_input:
+	fprintf(stderr, "liblzjody: data error: command at 0x%x runs past end of input 0x%x\n",
+			ipos - 1, size);
+	return -11;
+
 error_opos:
-	fprintf(stderr, "liblzjody: error: output pos %d higher than maximum %d)\n", opos, LZJODY_BSIZE);
+	fprintf(stderr, "liblzjody: error: output pos %d higher than maximum %d)\n", opos, cap);
 	return -1;
-error_bp_length:
-	fprintf(stderr, "liblzjody: error: byte plane length overflows output pos (%d > %d)\n",
-			opos, LZJODY_BSIZE);
+error_plane:
+	fprintf(stderr, "liblzjody: data error: byte plane inside a byte plane at 0x%x\n", ipos - 1);
 	return -2;
 error_rle_length:
 	fprintf(stderr, "liblzjody: error: RLE length overflows output pos (%d > %d)\n",
-			opos + length, LZJODY_BSIZE);
+			opos + length, cap);
 	return -3;
 error_lit_length:
 	fprintf(stderr, "liblzjody: error: literal length overflows output pos (%d > %d)\n",
-			opos, LZJODY_BSIZE);
+			opos + control, cap);
 	return -4;
 error_lz_length:
 	fprintf(stderr, "liblzjody: error: LZ length overflows output pos (%d > %d)\n",
-			opos, LZJODY_BSIZE);
+			opos, cap);
 	return -5;
 error_lz_offset:
-	fprintf(stderr, "liblzjody: data error: LZ offset 0x%x >= output pos 0x%x)\n", offset, opos);
+	fprintf(stderr, "liblzjody: data error: LZ offset 0x%x >= output pos 0x%x)\n",
+			offset, opos + dict_len);
+	return -6;
+error_lz_distance:
+	fprintf(stderr, "liblzjody: data error: LZ distance 0x%x > output pos 0x%x)\n",
+			control, opos + dict_len);
+	return -6;
+error_lz_repeat:
+	fprintf(stderr, "liblzjody: data error: LZ repeat without a previous match at 0x%x\n",
+			ipos - 1);
 	return -6;
+error_huff:
+	fprintf(stderr, "liblzjody: data error: nested entropy coded segment at 0x%x\n", ipos - 1);
+	return -12;
 error_seq:
 	fprintf(stderr, "liblzjody: data error: seq%d overflow (length 0x%x)\n", seqbits, length);
 	return -7;
 error_length:
 	fprintf(stderr, "liblzjody: data error: length 0x%x greater than maximum 0x%x @ 0x%x\n",
-			length, LZJODY_BSIZE, ipos - 1);
+			length, bsize, ipos - 1);
 	return -8;
 error_mode:
 	fprintf(stderr, "liblzjody: error: invalid decompressor mode 0x%x at 0x%x\n", mode, ipos);
 	return -9;
+error_bsize:
+	fprintf(stderr, "liblzjody: error: block size %d not supported (maximum %d)\n",
+			bsize, LZJODY_MAX_BSIZE);
+	return -10;
+}
+
+static int decompress_dict_block(const unsigned char * const in,
+		unsigned char * const out,
+		const unsigned int size,
+		const unsigned int cap,
+		const unsigned int options,
+		const unsigned char * const dict,
+		const unsigned int dict_len)
+{
+	unsigned int last_dist = 0;
+
+	return decode_commands(in, out, size, cap, options, dict, dict_len, 0, &last_dist);
+}
+
+static inline int decompress_block(const unsigned char * const in,
+		unsigned char * const out,
+		const unsigned int size,
+		const unsigned int cap,
+		const unsigned int options)
+{
+	return decompress_dict_block(in, out, size, cap, options, NULL, 0);
+}
+
+
+static int walk_commands(const unsigned char * const, const unsigned int,
+		const unsigned int, const unsigned int, const unsigned int,
+		unsigned int * const, int * const);
+
+/* Walk an entropy coded segment's commands from a buffer on the stack;
+ * *used gets the coded size. Returns the new output position or -1 */
+static NOINLINE int walk_huff(const unsigned char * const in,
+		const unsigned int size, const unsigned int raw,
+		const unsigned int options, const unsigned int dict_len,
+		const unsigned int opos, unsigned int * const last_dist,
+		unsigned int * const used)
+{
+	unsigned char cmds[HUFF_SEG_MAX];
+	int err;
+
+	if (raw > HUFF_SEG_MAX) return -1;
+	err = huffman_decode(in, size, cmds, raw, options & (O_BSIZE_MASK | O_WIDE_CMD));
+	if (err < 0) return -1;
+	*used = (unsigned int)err;
+	return walk_commands(cmds, raw, options | O_SUB_BLOCK, dict_len, opos, last_dist, NULL);
+}
+
+/* Walk a compressed block's commands to find its decompressed size
+ * without decompressing it; returns negative for malformed data
+ * LZ matches are checked as the decoder checks them, including reaches
+ * into a preset dictionary or reference window of dict_len bytes
+ * The walk starts at output position start with the previous LZ match
+ * distance in *last, as decode_commands() does
+ * If lead is not NULL it gets the largest amount by which the output
+ * position runs ahead of the input position after any command; byte
+ * planes and entropy coded segments are decoded aside, so they count as
+ * one command each */
+static int walk_commands(const unsigned char * const in, const unsigned int size,
+		const unsigned int options, const unsigned int dict_len,
+		const unsigned int start, unsigned int * const last, int * const lead)
+{
+	const unsigned int bsize = LZJODY_BSIZE_OF(options);
+	const unsigned int wide = options & (O_BSIZE_MASK | O_WIDE_CMD);
+	const unsigned int dist = options & (O_BSIZE_MASK | O_LZ_DIST | O_WIDE_CMD);
+	unsigned int ipos = 0, opos = start, length = 0, control = 0, mode;
+	unsigned int last_dist = *last, plane_last, used;
+	unsigned char c;
+	int sub, max_lead = 0;
+
+/* Fetch the next command byte, failing if the block ends first */
+#define WALK_BYTE(a) do { if (ipos >= size) return -1; (a) = *(in + ipos); ipos++; } while (0)
+
+	while (ipos < size) {
+		WALK_BYTE(c);
+		mode = c & P_MASK;
+		if (mode == 0) {
+			mode = c & P_XMASK;
+			if (!(mode & (P_SMASK | P_PLANE | P_REP))) return -1;
+			WALK_BYTE(length);
+			if (!(c & P_SHORT) && wide && (c & P_XWIDE)) {
+				WALK_BYTE(control);
+				length = (length << 8) | control;
+			}
+			if (!(c & P_SHORT)) {
+				WALK_BYTE(control);
+				length = (length << 8) | control;
+			}
+			if (length > bsize + ((mode == P_HUFF) ? LZJODY_MAX_EXPAND(options) : 0)) return -1;
+		} else if (c & P_SHORT) control = c & P_SHORT_MAX;
+		else if (wide) {
+			control = (unsigned int)(c & (P_SHORT_MAX & ~P_WIDE)) << 8;
+			WALK_BYTE(length);
+			control |= length;
+			if (c & P_WIDE) {
+				WALK_BYTE(length);
+				control = (control << 8) | length;
+			}
+		} else {
+			if (c & (P_RLE | P_LZL)) control = (unsigned int)(c & (P_LZL | P_SHORT_MAX)) << 8;
+			else control = (unsigned int)(c & P_SHORT_MAX) << 8;
+			WALK_BYTE(length);
+			control |= length;
+		}
+
+		switch (mode) {
+			case P_PLANE:
+				if ((options & O_PLANE_CMDS) || length > size - ipos) return -1;
+				plane_last = 0;
+				sub = walk_commands(in + ipos, length, options | O_SUB_BLOCK | O_PLANE_CMDS,
+						0, 0, &plane_last, NULL);
+				if (sub < 0 || sub > PLANE_MAX) return -1;
+				ipos += length;
+				opos += (unsigned int)sub;
+				break;
+			case P_LZ:
+				if (dist) {
+					if (!wide) control &= LZ_LEGACY_MAX;
+					if (control == 0 || control > opos + dict_len) return -1;
+					last_dist = control;
+				} else {
+					if ((control & 0xfff) >= opos + dict_len) return -1;
+					last_dist = opos + dict_len - (control & 0xfff);
+				}
+				WALK_BYTE(length);
+				if ((c & P_LZL) && wide) {
+					WALK_BYTE(mode);
+					length = (length << 8) | mode;
+				}
+				if (c & P_LZL) {
+					WALK_BYTE(mode);
+					length = (length << 8) | mode;
+				}
+				opos += length;
+				break;
+			case P_HUFF:
+				if (options & O_SUB_BLOCK) return -1;
+				sub = walk_huff(in + ipos, size - ipos, length, options, dict_len,
+						opos, &last_dist, &used);
+				if (sub < 0) return sub;
+				ipos += used;
+				opos = (unsigned int)sub;
+				break;
+			case P_REP:
+				if (last_dist == 0) return -1;
+				opos += length;
+				break;
+			case P_RLE:
+				ipos++;
+				opos += control;
+				break;
+			case P_LIT:
+				ipos += control;
+				opos += control;
+				break;
+			case P_SEQ32:
+				ipos += 4;
+				opos += length << 2;
+				break;
+			case P_SEQ16:
+				ipos += 2;
+				opos += length << 1;
+				break;
+			case P_SEQ8:
+				ipos += 2;
+				opos += length;
+				break;
+			default:
+				return -1;
+		}
+		if (ipos > size || opos > bsize) return -1;
+		if ((int)(opos - ipos) > max_lead) max_lead = (int)(opos - ipos);
+	}
+#undef WALK_BYTE
+	if (lead) *lead = max_lead;
+	*last = last_dist;
+	return (int)opos;
+}
+
+static int block_out_len(const unsigned char * const in, const unsigned int size,
+		const unsigned int options, const unsigned int dict_len, int * const lead)
+{
+	unsigned int last_dist = 0;
+
+	return walk_commands(in, size, options, dict_len, 0, &last_dist, lead);
+}
+
+
+extern int lzjody_decompress(const unsigned char * const in,
+		unsigned char * const out,
+		const unsigned int size,
+		const unsigned int options)
+{
+	return decompress_block(in, out, size, LZJODY_BSIZE_OF(options), options);
+}
+
+
+/* Decompress a block into out without writing past out_cap bytes, so it
+ * can go straight into a buffer sized for the exact decompressed data */
+extern int lzjody_decompress_safe(const unsigned char * const in,
+		const unsigned int in_len,
+		unsigned char * const out,
+		const unsigned int out_cap,
+		const unsigned int options)
+{
+	const unsigned int bsize = LZJODY_BSIZE_OF(options);
+
+	return decompress_block(in, out, in_len, (out_cap < bsize) ? out_cap : bsize, options);
+}
+
+
+/* Decompress a block in place: the compressed data (in_len bytes, without
+ * its prefix) sits at the end of buf and is decoded to the start of buf
+ * A command walk checks that no command overwrites input it has yet to
+ * read. The compressor keeps that true for a buf of the decompressed size
+ * plus LZJODY_INPLACE_MARGIN; nothing is allocated, so a block that needs
+ * more room is refused. Returns the decompressed length */
+extern int lzjody_decompress_inplace(unsigned char * const buf,
+		const unsigned int buf_size,
+		const unsigned int in_len,
+		const unsigned int options)
+{
+	const unsigned char *in;
+	int out_len, lead;
+
+	if (in_len == 0 || in_len > buf_size) goto error_size;
+	in = buf + buf_size - in_len;
+	out_len = block_out_len(in, in_len, options, 0, &lead);
+	if (out_len < 0) goto error_data;
+	if ((unsigned int)out_len > buf_size) goto error_size;
+	if (lead > (int)(buf_size - in_len)) goto error_lead;
+	return decompress_block(in, buf, in_len, (unsigned int)out_len, options);
+
+error_size:
+	fprintf(stderr, "liblzjody: error: in-place buffer too small\n");
+	return -1;
+error_data:
+	fprintf(stderr, "liblzjody: data error: bad block for in-place decompression\n");
+	return -1;
+error_lead:
+	fprintf(stderr, "liblzjody: error: block needs %u bytes of in-place buffer, got %u\n",
+			in_len + (unsigned int)lead, buf_size);
+	return -1;
+}
+
+
+/* Worst-case lzjody_compress() output size for length bytes of input */
+extern unsigned int lzjody_compress_bound(const unsigned int length,
+		const unsigned int options)
+{
+	const unsigned int bsize = LZJODY_BSIZE_OF(options);
+
+	return length + ((length + bsize - 1) / bsize) * LZJODY_MAX_EXPAND(options);
+}
+
+
+/* Sizes are returned as int; refuse input that could compress past INT_MAX */
+static int compress_too_large(const uint64_t length, const unsigned int options)
+{
+	const uint64_t bsize = LZJODY_BSIZE_OF(options);
+
+	if (length + ((length + bsize - 1) / bsize) * LZJODY_MAX_EXPAND(options) <= INT_MAX) return 0;
+	fprintf(stderr, "liblzjody: error: %" PRIu64 " bytes of input may compress to more than %d bytes\n",
+			length, INT_MAX);
+	return 1;
+}
+
+
+/* Write a zero run record for 'length' zero bytes (e.g. a file hole)
+ * Returns the record length; out needs LZJODY_RECORD_MAX bytes */
+extern int lzjody_zero_run(unsigned char * const out, const uint64_t length,
+		const unsigned int options)
+{
+	if (length == 0) return -1;
+	return write_record(out, options, O_ZERORUN, length);
+}
+
+
+/* Write a stream header for the given options; returns header length */
+extern int lzjody_write_header(unsigned char * const out,
+		const unsigned int options)
+{
+	const unsigned int format = options & O_FORMAT_MASK;
+
+	if (LZJODY_BSIZE_OF(options) > LZJODY_MAX_BSIZE) return -1;
+	memcpy(out, LZJODY_MAGIC, 3);
+	*(out + 3) = LZJODY_FORMAT_VER;
+	*(out + 4) = (unsigned char)(format >> 24);
+	*(out + 5) = (unsigned char)(format >> 16);
+	*(out + 6) = (unsigned char)(format >> 8);
+	*(out + 7) = (unsigned char)format;
+	return LZJODY_HEADER_LEN;
+}
+
+
+/* Parse a stream header and return the format options in *options
+ * Returns the header length, 0 for a headerless (version 0) stream,
+ * or negative if the header is from an unsupported format */
+extern int lzjody_read_header(const unsigned char * const in,
+		const unsigned int length, unsigned int * const options)
+{
+	unsigned int format = 0;
+
+	*options = 0;
+	/* Version 0 blocks never have 0x40 set in the first byte */
+	if (length < 1 || *in != (unsigned char)LZJODY_MAGIC[0]) return 0;
+	if (length < LZJODY_HEADER_LEN || memcmp(in, LZJODY_MAGIC, 3) != 0) goto error_header;
+	if (*(in + 3) != LZJODY_FORMAT_VER) goto error_version;
+	format = ((unsigned int)*(in + 4) << 24) | ((unsigned int)*(in + 5) << 16)
+		| ((unsigned int)*(in + 6) << 8) | (unsigned int)*(in + 7);
+	if (format & ~O_FORMAT_MASK) goto error_version;
+	if (LZJODY_BSIZE_OF(format) > LZJODY_MAX_BSIZE) goto error_version;
+	*options = format;
+	return LZJODY_HEADER_LEN;
+
+error_header:
+	fprintf(stderr, "liblzjody: error: bad stream header\n");
+	return -1;
+error_version:
+	fprintf(stderr, "liblzjody: error: unsupported stream format (version %d, options 0x%x)\n",
+			*(in + 3), format);
+	return -2;
+}
+
+
+/* Find the decompressed size of a whole stream without decompressing it
+ * Only block prefixes and compression command headers are read. The table
+ * of decompressed record sizes in scan->sizes is allocated here and must be
+ * freed by the caller. Delta (O_REFERENCE) streams are sized without their
+ * reference. Returns 0 or negative on error */
+extern int lzjody_scan(const unsigned char * const in, const uint64_t size,
+		struct lzjody_scan_t * const scan)
+{
+	unsigned int *ring = NULL;	/* Sizes of recent non-zero-run blocks */
+	unsigned int prefix, window, length, type, ndata = 0;
+	uint64_t ipos, value = 0, alloc = 0, *sizes;
+	int err;
+
+	memset(scan, 0, sizeof(struct lzjody_scan_t));
+	err = lzjody_read_header(in, (size > LZJODY_HEADER_LEN) ? LZJODY_HEADER_LEN : (unsigned int)size,
+			&scan->options);
+	if (err < 0) return err;
+	scan->header_len = (unsigned int)err;
+	prefix = LZJODY_PREFIX_LEN(scan->options);
+	window = LZJODY_REPEAT_BLOCKS(scan->options);
+	ring = (unsigned int *)malloc(window * sizeof(unsigned int));
+	if (ring == NULL) goto error_oom;
+
+	for (ipos = scan->header_len; ipos < size; ipos += length) {
+		if (size - ipos < prefix) goto error_truncated;
+		type = *(in + ipos) & O_RECORD_MASK;
+		length = ((unsigned int)(*(in + ipos) & 0x1f) << 8) | *(in + ipos + 1);
+		if (prefix > 2) length = (length << 8) | *(in + ipos + 2);
+		ipos += prefix;
+		if (length == 0 || size - ipos < length + CHECK_LEN(scan->options, type)) goto error_truncated;
+
+		if (type == O_ZERORUN || type == O_REPEAT || type == O_REFBLOCK) {
+			if (length > 8) goto error_record;
+			value = 0;
+			for (unsigned int i = 0; i < length; i++) value = (value << 8) | *(in + ipos + i);
+		}
+		switch (type) {
+			case 0:
+				err = block_out_len(in + ipos, length, scan->options, 0, NULL);
+				if (err < 0) goto error_record;
+				value = (uint64_t)err;
+				break;
+			case O_REFBLOCK:
+				if (!(scan->options & O_REFERENCE)) goto error_record;
+				value = LZJODY_BSIZE_OF(scan->options);
+				break;
+			case O_REFWINDOW:
+				/* How far back the window reaches depends on the reference
+				 * size, so matches are only checked against the largest one */
+				if (!(scan->options & O_REFERENCE)) goto error_record;
+				err = block_out_len(in + ipos, length, scan->options | O_WIDE_CMD,
+						REF_WINDOW_MAX(LZJODY_BSIZE_OF(scan->options)), NULL);
+				if (err < 0) goto error_record;
+				value = (uint64_t)err;
+				break;
+			case O_ZERORUN:
+				break;
+			case O_REPEAT:
+				if (value == 0 || value > ndata || value > window) goto error_record;
+				value = ring[(ndata - value) % window];
+				break;
+			default:
+				goto error_record;
+		}
+		if (type != O_ZERORUN) {
+			ring[ndata % window] = (unsigned int)value;
+			ndata++;
+		}
+
+		if (scan->blocks == alloc) {
+			alloc = alloc ? alloc * 2 : 256;
+			sizes = (uint64_t *)realloc(scan->sizes, alloc * sizeof(uint64_t));
+			if (sizes == NULL) goto error_oom;
+			scan->sizes = sizes;
+		}
+		scan->sizes[scan->blocks] = value;
+		scan->blocks++;
+		scan->total += value;
+		ipos += CHECK_LEN(scan->options, type);
+	}
+	free(ring);
+	return 0;
+
+error_truncated:
+	fprintf(stderr, "liblzjody: error: stream ends inside a block\n");
+	err = -1;
+	goto error_free;
+error_record:
+	fprintf(stderr, "liblzjody: error: bad block record at 0x%" PRIx64 "\n", ipos);
+	err = -1;
+	goto error_free;
+error_oom:
+	fprintf(stderr, "liblzjody: error: out of memory\n");
+	err = -1;
+error_free:
+	free(ring);
+	free(scan->sizes);
+	memset(scan, 0, sizeof(struct lzjody_scan_t));
+	return err;
+}
+
+
+/**** Preset dictionary API ****/
+
+/* Copy a dictionary and index it once for lzjody_compress_dict()
+ * Returns NULL on error */
+extern struct lzjody_dict *lzjody_dict_create(const unsigned char * const data,
+		const unsigned int length)
+{
+	struct lzjody_dict *dict;
+	struct comp_data_t d;
+
+	if (length == 0 || length > LZJODY_DICT_MAX) goto error_length;
+	dict = (struct lzjody_dict *)malloc(sizeof(struct lzjody_dict));
+	if (dict == NULL) goto error_oom;
+	dict->data = (unsigned char *)malloc(length);
+	if (dict->data == NULL) {
+		free(dict);
+		goto error_oom;
+	}
+	memcpy(dict->data, data, length);
+	dict->length = length;
+
+	/* Index every dictionary position; matches may run on into a block */
+	d.in = dict->data;
+	d.length = length + MIN_LZ_MATCH;
+	if (index_bytes(&d, &dict->idx, 0) < 0) {
+		lzjody_dict_free(dict);
+		return NULL;
+	}
+	return dict;
+
+error_length:
+	fprintf(stderr, "liblzjody: error: dictionary length %u not supported (maximum %d)\n",
+			length, LZJODY_DICT_MAX);
+	return NULL;
+error_oom:
+	fprintf(stderr, "liblzjody: error: out of memory\n");
+	return NULL;
+}
+
+
+extern void lzjody_dict_free(struct lzjody_dict * const dict)
+{
+	if (dict == NULL) return;
+	free(dict->data);
+	free(dict);
+	return;
+}
+
+
+/* Compress blocks as lzjody_compress() does, with the dictionary as a
+ * virtual prefix of every block; zero run and repeat records are not used
+ * LZ commands store distances, so 4 KiB blocks only reach the last
+ * 4 KiB of the dictionary */
+extern int lzjody_compress_dict(const unsigned char * const blk_in,
+		unsigned char * const blk_out,
+		const unsigned int options,
+		const unsigned int length,
+		const struct lzjody_dict * const dict)
+{
+	const unsigned int bsize = LZJODY_BSIZE_OF(options);
+	const unsigned int dict_opts = (options & ~O_DEDUP) | O_LZ_DIST;
+	const unsigned char *in = blk_in;
+	unsigned char *out = blk_out;
+	struct comp_work_t *scratch;
+	unsigned char *work;
+	unsigned int size;
+	int err, out_size = 0;
+
+	if (dict == NULL) goto error_dict;
+	if (length == 0) goto error_zero_length;
+	if (bsize > LZJODY_MAX_BSIZE) return -1;
+	if ((options & O_NOPREFIX) && length > bsize) return -1;
+	scratch = work_get(bsize);
+	work = (unsigned char *)malloc(dict->length + bsize);
+	if (scratch == NULL || work == NULL) goto error_oom;
+	/* Each block is copied in after the dictionary */
+	memcpy(work, dict->data, dict->length);
+
+	for (unsigned int i = 0; i < length; i += size, in += size, out += err) {
+		size = length - i;
+		if (size > bsize) size = bsize;
+		memcpy(work + dict->length, in, size);
+		err = compress_block(work, out, dict_opts, size, scratch, dict->length, &dict->idx, NULL);
+		if (err < 0) goto error_compress;
+		err += write_check(out + err, options, in, size);
+		out_size += err;
+	}
+	free(work);
+	return out_size;
+
+error_compress:
+	free(work);
+	return err;
+error_oom:
+	free(work);
+	fprintf(stderr, "liblzjody: error: out of memory\n");
+	return -1;
+error_dict:
+	fprintf(stderr, "liblzjody: error: no dictionary given\n");
+	return -1;
+error_zero_length:
+	fprintf(stderr, "liblzjody: error: cannot compress a zero-length block\n");
+	return -2;
+}
+
+
+/* Decompress one block made by lzjody_compress_dict() with the same dictionary */
+extern int lzjody_decompress_dict(const unsigned char * const in,
+		unsigned char * const out,
+		const unsigned int size,
+		const unsigned int options,
+		const struct lzjody_dict * const dict)
+{
+	if (dict == NULL) goto error_dict;
+	return decompress_dict_block(in, out, size, LZJODY_BSIZE_OF(options),
+			options | O_LZ_DIST, dict->data, dict->length);
+
+error_dict:
+	fprintf(stderr, "liblzjody: error: no dictionary given\n");
+	return -1;
+}
+
+
+/**** Reference (delta) API ****/
+
+/* Index the full blocks of a reference image for lzjody_compress_ref()
+ * The image is not copied. Returns NULL on error */
+extern struct lzjody_ref *lzjody_ref_create(const unsigned char * const data,
+		const uint64_t size, const unsigned int options)
+{
+	struct lzjody_ref *ref;
+	const unsigned int bsize = LZJODY_BSIZE_OF(options);
+	uint64_t blocks = size / bsize, slots = 1, hash, i;
+	const unsigned char *in;
+
+	if (bsize > LZJODY_MAX_BSIZE) goto error_bsize;
+	ref = (struct lzjody_ref *)malloc(sizeof(struct lzjody_ref));
+	if (ref == NULL) goto error_oom;
+	ref->data = data;
+	ref->size = size;
+	ref->bsize = bsize;
+	ref->mask = 0;
+	ref->slot = NULL;
+	/* Later blocks are still found at their own offset */
+	if (blocks > UINT32_MAX - 1) blocks = UINT32_MAX - 1;
+	if (blocks == 0) return ref;
+
+	while (slots < (blocks << 1)) slots <<= 1;
+	ref->slot = (struct ref_slot_t *)calloc((size_t)slots, sizeof(struct ref_slot_t));
+	if (ref->slot == NULL) {
+		free(ref);
+		goto error_oom;
+	}
+	ref->mask = slots - 1;
+
+	for (uint64_t n = 0; n < blocks; n++) {
+		in = data + n * bsize;
+		/* Zero blocks become zero runs anyway */
+		if (lzjody_kern.is_zero(in, bsize)) continue;
+		hash = block_hash(in, bsize);
+		for (i = hash & ref->mask; ref->slot[i].block != 0; i = (i + 1) & ref->mask) {
+			if (ref->slot[i].tag == (uint32_t)(hash >> 32) && memcmp(in,
+					data + (uint64_t)(ref->slot[i].block - 1) * bsize, bsize) == 0)
+				break;
+		}
+		/* Only the first copy of a repeated block is indexed */
+		if (ref->slot[i].block != 0) continue;
+		ref->slot[i].tag = (uint32_t)(hash >> 32);
+		ref->slot[i].block = (uint32_t)(n + 1);
+	}
+	return ref;
+
+error_bsize:
+	fprintf(stderr, "liblzjody: error: block size %d not supported (maximum %d)\n",
+			bsize, LZJODY_MAX_BSIZE);
+	return NULL;
+error_oom:
+	fprintf(stderr, "liblzjody: error: out of memory\n");
+	return NULL;
+}
+
+
+extern void lzjody_ref_free(struct lzjody_ref * const ref)
+{
+	if (ref == NULL) return;
+	free(ref->slot);
+	free(ref);
+	return;
+}
+
+
+/* Compress blocks as lzjody_compress() does with O_DEDUP, also emitting
+ * reference block records and reference window blocks; offset is the
+ * stream position of blk_in, which decides each block's reference window */
+extern int lzjody_compress_ref(const unsigned char * const blk_in,
+		unsigned char * const blk_out,
+		const unsigned int options,
+		const unsigned int length,
+		const uint64_t offset,
+		const struct lzjody_ref * const ref)
+{
+	const unsigned int bsize = LZJODY_BSIZE_OF(options);
+	struct ref_work_t rw;
+	struct comp_work_t *work;
+	int err;
+
+	if (ref == NULL) goto error_ref;
+	if (ref->bsize != bsize) goto error_ref_bsize;
+	if (options & O_NOPREFIX) return -1;
+	rw.ref = ref;
+	rw.offset = offset;
+	rw.shift = 0;
+	work = work_get(bsize);
+	rw.work = (unsigned char *)malloc((size_t)bsize * 3);
+	/* Wide commands can grow a 4 KiB block by a few more bytes */
+	rw.alt = (unsigned char *)malloc(bsize + 16);
+	if (work == NULL || rw.work == NULL || rw.alt == NULL) goto error_oom;
+
+	err = compress_dedup(blk_in, blk_out, options, length, work, &rw);
+	free(rw.work); free(rw.alt);
+	return err;
+
+error_oom:
+	free(rw.work); free(rw.alt);
+	fprintf(stderr, "liblzjody: error: out of memory\n");
+	return -1;
+error_ref:
+	fprintf(stderr, "liblzjody: error: no reference given\n");
+	return -1;
+error_ref_bsize:
+	fprintf(stderr, "liblzjody: error: reference indexed for %u byte blocks, not %u\n",
+			ref->bsize, bsize);
+	return -1;
+}
+
+
+/* Decompress the payload of one O_REFWINDOW block found at stream offset
+ * offset, given the same reference image the compressor used */
+extern int lzjody_decompress_ref(const unsigned char * const in,
+		unsigned char * const out,
+		const unsigned int size,
+		const unsigned int options,
+		const uint64_t offset,
+		const unsigned char * const ref,
+		const uint64_t ref_size)
+{
+	const unsigned int bsize = LZJODY_BSIZE_OF(options);
+	unsigned int wlen;
+	const uint64_t start = ref_window(ref_size, bsize, offset, &wlen);
+
+	if (ref == NULL || wlen == 0) goto error_ref;
+	return decompress_dict_block(in, out, size, bsize,
+			options | O_WIDE_CMD, ref + start, wlen);
+
+error_ref:
+	fprintf(stderr, "liblzjody: error: block at 0x%" PRIx64 " is past the reference\n", offset);
+	return -1;
+}
+
+
+/**** Batched page API ****/
+
+/* Pull a page toward the cache while the previous one is compressed */
+static inline void prefetch_page(const unsigned char * const page, const unsigned int length)
+{
+#ifdef __GNUC__
+	for (unsigned int i = 0; i < length; i += 64) __builtin_prefetch(page + i, 0, 0);
+#else
+	(void)page; (void)length;
+#endif
+	return;
+}
+
+
+/* Compress n independent pages of the option block size into outs[]
+ * Each out buffer must hold one page. Pages are compressed without block
+ * prefixes; out_lens[i] records how page i was kept:
+ *   0          page is all zeroes and nothing was written
+ *   page size  page did not compress and was stored raw
+ *   otherwise  compressed length
+ * The thread's cached scratch space holds the LZ index and output buffer.
+ * Returns the number of compressed pages or negative on error */
+extern int lzjody_compress_batch(const unsigned char * const * const pages,
+		const unsigned int n,
+		unsigned char * const * const outs,
+		unsigned int * const out_lens,
+		const unsigned int options)
+{
+	const unsigned int bsize = LZJODY_BSIZE_OF(options);
+	const unsigned int page_opts = (options & ~O_DEDUP) | O_NOPREFIX;
+	struct comp_work_t *work;
+	int err, count = 0;
+
+	if (bsize > LZJODY_MAX_BSIZE) return -1;
+	work = work_get(bsize);
+	if (work == NULL) goto error_oom;
+
+	for (unsigned int i = 0; i < n; i++) {
+		if (i + 1 < n) prefetch_page(pages[i + 1], bsize);
+		if (lzjody_kern.is_zero(pages[i], bsize)) {
+			out_lens[i] = 0;
+			continue;
+		}
+		err = compress_block(pages[i], work->page, page_opts, bsize, work, 0, NULL, NULL);
+		if (err < 0) return err;
+		if ((unsigned int)err >= bsize) {
+			memcpy(outs[i], pages[i], bsize);
+			out_lens[i] = bsize;
+		} else {
+			memcpy(outs[i], work->page, (size_t)err);
+			out_lens[i] = (unsigned int)err;
+			count++;
+		}
+	}
+	return count;
+
+error_oom:
+	fprintf(stderr, "liblzjody: error: out of memory\n");
+	return -1;
+}
+
+
+/* Decompress n pages made by lzjody_compress_batch()
+ * Returns 0 or negative if any page fails to decompress to a full page */
+extern int lzjody_decompress_batch(const unsigned char * const * const ins,
+		const unsigned int * const in_lens,
+		const unsigned int n,
+		unsigned char * const * const pages,
+		const unsigned int options)
+{
+	const unsigned int bsize = LZJODY_BSIZE_OF(options);
+	const unsigned int page_opts = (options & ~O_DEDUP) | O_NOPREFIX;
+	int err;
+
+	for (unsigned int i = 0; i < n; i++) {
+		if (i + 1 < n) prefetch_page(ins[i + 1], in_lens[i + 1]);
+		if (in_lens[i] == 0) memset(pages[i], 0, bsize);
+		else if (in_lens[i] == bsize) memcpy(pages[i], ins[i], bsize);
+		else if (in_lens[i] > bsize) goto error_length;
+		else {
+			err = lzjody_decompress(ins[i], pages[i], in_lens[i], page_opts);
+			if (err < 0) return err;
+			if ((unsigned int)err != bsize) goto error_length;
+		}
+	}
+	return 0;
+
+error_length:
+	fprintf(stderr, "liblzjody: error: batch page decompressed to the wrong size\n");
+	return -1;
+}
+
+
+/**** Scatter/gather API ****/
+
+/* Position within an iovec array */
+struct iov_cursor {
+	const struct iovec *iov;
+	int cnt;
+	int seg;
+	size_t pos;
+};
+
+
+/* Move past exhausted segments; returns contiguous bytes available */
+static size_t iov_room(struct iov_cursor * const c)
+{
+	while (c->seg < c->cnt && c->pos >= c->iov[c->seg].iov_len) {
+		c->seg++;
+		c->pos = 0;
+	}
+	if (c->seg >= c->cnt) return 0;
+	return c->iov[c->seg].iov_len - c->pos;
+}
+
+
+static inline unsigned char *iov_ptr(const struct iov_cursor * const c)
+{
+	return (unsigned char *)c->iov[c->seg].iov_base + c->pos;
+}
+
+
+/* Copy len bytes out of (src != NULL) or into (dst != NULL) the segments
+ * at the cursor, or zero them if both are NULL; returns bytes moved */
+static size_t iov_copy(struct iov_cursor * const c, unsigned char *dst,
+		const unsigned char *src, size_t len)
+{
+	size_t done = 0, room;
+
+	while (done < len && (room = iov_room(c)) > 0) {
+		if (room > len - done) room = len - done;
+		if (dst != NULL) memcpy(dst + done, iov_ptr(c), room);
+		else if (src != NULL) memcpy(iov_ptr(c), src + done, room);
+		else memset(iov_ptr(c), 0, room);
+		c->pos += room;
+		done += room;
+	}
+	return done;
+}
+
+
+/* Compress data gathered from in_iov into the out_iov segments
+ * Whole blocks inside one input segment are compressed in place; only
+ * blocks that straddle segments are assembled in a staging buffer. Output
+ * goes straight into the current segment when the worst case fits there
+ * and is otherwise copied across segment boundaries.
+ * Returns the compressed size or negative on error */
+extern int lzjody_compressv(const struct iovec * const in_iov, const int in_cnt,
+		const struct iovec * const out_iov, const int out_cnt,
+		const unsigned int options)
+{
+	struct iov_cursor in = { in_iov, in_cnt, 0, 0 };
+	struct iov_cursor out = { out_iov, out_cnt, 0, 0 };
+	const unsigned int bsize = LZJODY_BSIZE_OF(options);
+	const unsigned int expand = LZJODY_MAX_EXPAND(options);
+	unsigned char *stage, *scratch;
+	const unsigned char *src;
+	size_t left = 0, size, room, worst;
+	int err, out_size = 0;
+
+	if (options & O_NOPREFIX) return -1;
+	if (bsize > LZJODY_MAX_BSIZE) return -1;
+	for (int i = 0; i < in_cnt; i++) left += in_iov[i].iov_len;
+	if (left == 0) return 0;
+	if (compress_too_large(left, options)) return -1;
+
+	stage = (unsigned char *)malloc(bsize);
+	scratch = (unsigned char *)malloc(bsize + expand);
+	if (stage == NULL || scratch == NULL) goto error_oom;
+
+	while (left > 0) {
+		size = iov_room(&in);
+		if (size > left) size = left;
+		if (size < left) size -= size % bsize;
+		if (size > LZJODY_MT_RANGE) size = LZJODY_MT_RANGE;
+		if (size == 0) {
+			/* This block straddles input segments */
+			size = (left < bsize) ? left : bsize;
+			iov_copy(&in, stage, NULL, size);
+			src = stage;
+		} else src = iov_ptr(&in);
+
+		room = iov_room(&out);
+		worst = lzjody_compress_bound((unsigned int)size, options);
+		if (worst > room && src != stage && room / (bsize + expand) > 0) {
+			size = (room / (bsize + expand)) * bsize;
+			worst = room;
+		}
+		if (worst <= room) {
+			err = lzjody_compress(src, iov_ptr(&out), options, (unsigned int)size);
+			if (err < 0) goto error_compress;
+			out.pos += (size_t)err;
+		} else {
+			/* Not enough room for one block; spill across segments */
+			if (size > bsize) size = bsize;
+			err = lzjody_compress(src, scratch, options, (unsigned int)size);
+			if (err < 0) goto error_compress;
+			if (iov_copy(&out, NULL, scratch, (size_t)err) != (size_t)err) goto error_out_full;
+		}
+		if (src != stage) in.pos += size;
+		left -= size;
+		out_size += err;
+	}
+	free(stage); free(scratch);
+	return out_size;
+
+error_out_full:
+	fprintf(stderr, "liblzjody: error: output segments too small\n");
+	err = -1;
+error_compress:
+	free(stage); free(scratch);
+	return err;
+error_oom:
+	free(stage); free(scratch);
+	fprintf(stderr, "liblzjody: error: out of memory\n");
+	return -1;
+}
+
+
+/* Decompress prefixed blocks gathered from in_iov into the out_iov segments
+ * Blocks are decoded in place when they fit in the current segment; repeat
+ * records are copied from earlier output. Returns the decompressed size or
+ * negative on error */
+extern int lzjody_decompressv(const struct iovec * const in_iov, const int in_cnt,
+		const struct iovec * const out_iov, const int out_cnt,
+		const unsigned int options)
+{
+	struct iov_cursor in = { in_iov, in_cnt, 0, 0 };
+	struct iov_cursor out = { out_iov, out_cnt, 0, 0 };
+	struct iov_cursor from;
+	const unsigned int bsize = LZJODY_BSIZE_OF(options);
+	const unsigned int prefix = LZJODY_PREFIX_LEN(options);
+	const unsigned int window = LZJODY_REPEAT_BLOCKS(options);
+	unsigned char *stage, *scratch, hdr[3], check[LZJODY_CHECK_LEN];
+	const unsigned char *src, *data;
+	uint64_t *ring_off;	/* Output offsets of recent blocks */
+	unsigned int *ring_len, length, nblk = 0, slot;
+	uint64_t value = 0, out_size = 0;
+	int err = -1;
+
+	if (options & O_NOPREFIX) return -1;
+	stage = (unsigned char *)malloc(bsize + LZJODY_MAX_EXPAND(options));
+	scratch = (unsigned char *)malloc(bsize);
+	ring_off = (uint64_t *)malloc(window * sizeof(uint64_t));
+	ring_len = (unsigned int *)malloc(window * sizeof(unsigned int));
+	if (stage == NULL || scratch == NULL || ring_off == NULL || ring_len == NULL) goto error_oom;
+
+	while (iov_room(&in) > 0) {
+		if (iov_copy(&in, hdr, NULL, prefix) != prefix) goto error_truncated;
+		length = ((unsigned int)(hdr[0] & 0x1f) << 8) | hdr[1];
+		if (prefix > 2) length = (length << 8) | hdr[2];
+		if (length > bsize + LZJODY_MAX_EXPAND(options)) goto error_record;
+		if (iov_room(&in) >= length) {
+			src = iov_ptr(&in);
+			in.pos += length;
+		} else {
+			if (iov_copy(&in, stage, NULL, length) != length) goto error_truncated;
+			src = stage;
+		}
+		if (CHECK_LEN(options, hdr[0] & O_RECORD_MASK)
+				&& iov_copy(&in, check, NULL, LZJODY_CHECK_LEN) != LZJODY_CHECK_LEN)
+			goto error_truncated;
+
+		if (hdr[0] & (O_ZERORUN | O_REPEAT)) {
+			if (length < 1 || length > 8) goto error_record;
+			value = 0;
+			for (unsigned int i = 0; i < length; i++) value = (value << 8) | src[i];
+		}
+		data = scratch;
+		switch (hdr[0] & O_RECORD_MASK) {
+			case 0:
+				if (iov_room(&out) >= bsize) {
+					data = iov_ptr(&out);
+					err = lzjody_decompress(src, iov_ptr(&out), length, options);
+					if (err < 0) goto error_free;
+					out.pos += (size_t)err;
+				} else {
+					err = lzjody_decompress(src, scratch, length, options);
+					if (err < 0) goto error_free;
+					if (iov_copy(&out, NULL, scratch, (size_t)err) != (size_t)err) goto error_out_full;
+				}
+				break;
+			case O_ZERORUN:
+				if (out_size + value > INT_MAX) goto error_too_large;
+				if (iov_copy(&out, NULL, NULL, value) != value) goto error_out_full;
+				out_size += value;
+				continue;
+			case O_REPEAT:
+				if (value == 0 || value > nblk || value > window) goto error_record;
+				slot = (unsigned int)((nblk - value) % window);
+				from.iov = out_iov; from.cnt = out_cnt; from.seg = 0; from.pos = 0;
+				/* Find the earlier block's segment */
+				for (value = ring_off[slot]; value >= out_iov[from.seg].iov_len; from.seg++)
+					value -= out_iov[from.seg].iov_len;
+				from.pos = (size_t)value;
+				err = (int)ring_len[slot];
+				iov_copy(&from, scratch, NULL, (size_t)err);
+				if (iov_copy(&out, NULL, scratch, (size_t)err) != (size_t)err) goto error_out_full;
+				break;
+			default:
+				goto error_record;
+		}
+		if ((options & O_CHECKSUM) && lzjody_crc32c(data, (size_t)err) != read_check(check))
+			goto error_check;
+		ring_off[nblk % window] = out_size;
+		ring_len[nblk % window] = (unsigned int)err;
+		nblk++;
+		out_size += (unsigned int)err;
+		if (out_size > INT_MAX) goto error_too_large;
+	}
+	free(stage); free(scratch); free(ring_off); free(ring_len);
+	return (int)out_size;
+
+error_too_large:
+	fprintf(stderr, "liblzjody: error: output passes %d bytes\n", INT_MAX);
+	goto error_out;
+error_truncated:
+	fprintf(stderr, "liblzjody: error: input ends inside a block\n");
+	goto error_out;
+error_check:
+	fprintf(stderr, "liblzjody: error: checksum mismatch in block record %u\n", nblk);
+	goto error_out;
+error_record:
+	fprintf(stderr, "liblzjody: error: bad block record\n");
+	goto error_out;
+error_out_full:
+	fprintf(stderr, "liblzjody: error: output segments too small\n");
+error_out:
+	err = -1;
+error_free:
+	free(stage); free(scratch); free(ring_off); free(ring_len);
+	return err;
+error_oom:
+	free(stage); free(scratch); free(ring_off); free(ring_len);
+	fprintf(stderr, "liblzjody: error: out of memory\n");
+	return -1;
+}
+
+
+/**** Multi-threaded API ****/
+
+/* Thread pool; the calling thread always works on tasks too */
+struct lzjody_pool {
+	int nthreads;	/* Worker threads, not counting the caller */
+#ifdef THREADED
+	pthread_t *threads;
+	pthread_mutex_t lock;
+	pthread_mutex_t busy;	/* Serializes jobs from different callers */
+	pthread_cond_t work;
+	pthread_cond_t done;
+	int (*task)(void *, const int);
+	void *arg;
+	int ntasks, next, finished, error;
+	int shutdown;
+#endif
+};
+
+/* A record of a multi-block buffer for lzjody_decompress_mt() */
+struct mt_rec {
+	const unsigned char *in;
+	unsigned int in_len;
+	unsigned int type;	/* O_RECORD_MASK bits of the prefix */
+	unsigned int out_off;
+	unsigned int out_len;
+	unsigned int ref;	/* Source record of a repeat */
+	uint32_t crc;	/* Stored checksum (O_CHECKSUM) */
+};
+
+/* Shared state of one multi-threaded call */
+struct mt_job {
+	const unsigned char *in;
+	unsigned char *out;
+	unsigned int length;
+	unsigned int options;
+	unsigned int range;	/* Input bytes per compression task */
+	unsigned int range_max;	/* Worst-case output of a full range */
+	int *out_len;	/* Compressed length of each task */
+	struct mt_rec *recs;
+	int nrecs;
+	int per_task;	/* Records per decompression task */
+};
+
+
+#ifdef THREADED
+static void *pool_worker(void *arg)
+{
+	struct lzjody_pool * const pool = arg;
+	int task, err;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		while (!pool->shutdown && pool->next >= pool->ntasks)
+			pthread_cond_wait(&pool->work, &pool->lock);
+		if (pool->shutdown) break;
+		task = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+		err = pool->task(pool->arg, task);
+		pthread_mutex_lock(&pool->lock);
+		if (err < 0) pool->error = err;
+		pool->finished++;
+		if (pool->finished == pool->ntasks) pthread_cond_broadcast(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+#endif /* THREADED */
+
+
+/* Create a pool for the multi-threaded API; nthreads <= 0 uses all CPUs
+ * Without THREADED the pool is a placeholder and work runs serially */
+extern struct lzjody_pool *lzjody_pool_create(int nthreads)
+{
+	struct lzjody_pool *pool;
+
+	if (nthreads <= 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+		nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+		if (nthreads <= 0) nthreads = 1;
+	}
+	pool = (struct lzjody_pool *)calloc(1, sizeof(struct lzjody_pool));
+	if (pool == NULL) return NULL;
+#ifdef THREADED
+	pool->threads = (pthread_t *)calloc((size_t)nthreads, sizeof(pthread_t));
+	if (pool->threads == NULL) goto error_free;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_mutex_init(&pool->busy, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	/* The caller is the last thread */
+	for (unsigned int i = 0; i < (unsigned int)nthreads - 1; i++) {
+		if (pthread_create(pool->threads + i, NULL, pool_worker, pool) != 0) break;
+		pool->nthreads++;
+	}
+	return pool;
+
+error_free:
+	free(pool);
+	return NULL;
+#else
+	return pool;
+#endif
+}
+
+
+/* Stop the pool's threads and free it */
+extern void lzjody_pool_destroy(struct lzjody_pool * const pool)
+{
+	if (pool == NULL) return;
+#ifdef THREADED
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for (int i = 0; i < pool->nthreads; i++) pthread_join(pool->threads[i], NULL);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_mutex_destroy(&pool->busy);
+	pthread_cond_destroy(&pool->work);
+	pthread_cond_destroy(&pool->done);
+	free(pool->threads);
+#endif
+	free(pool);
+	return;
+}
+
+
+#ifdef THREADED
+static struct lzjody_pool *internal_pool;
+static pthread_once_t internal_pool_once = PTHREAD_ONCE_INIT;
+
+static void internal_pool_create(void)
+{
+	internal_pool = lzjody_pool_create(0);
+}
+#endif
+
+
+/* Number of threads a pool (NULL = the internal pool) runs work on,
+ * counting the caller; always 1 without THREADED */
+extern int lzjody_pool_threads(const struct lzjody_pool * const pool)
+{
+#ifdef THREADED
+	if (pool == NULL) {
+		pthread_once(&internal_pool_once, internal_pool_create);
+		return (internal_pool == NULL) ? 1 : internal_pool->nthreads + 1;
+	}
+	return pool->nthreads + 1;
+#else
+	(void)pool;
+	return 1;
+#endif
+}
+
+
+/* Run tasks 0..ntasks-1 on a pool (NULL uses an internal pool) */
+static int pool_run(struct lzjody_pool *pool, int (*task)(void *, const int),
+		void * const arg, const int ntasks)
+{
+	int err = 0;
+
+#ifdef THREADED
+	if (pool == NULL) {
+		pthread_once(&internal_pool_once, internal_pool_create);
+		pool = internal_pool;
+	}
+	if (pool != NULL && pool->nthreads > 0 && ntasks > 1) {
+		pthread_mutex_lock(&pool->busy);
+		pthread_mutex_lock(&pool->lock);
+		pool->task = task;
+		pool->arg = arg;
+		pool->ntasks = ntasks;
+		pool->next = 0;
+		pool->finished = 0;
+		pool->error = 0;
+		pthread_cond_broadcast(&pool->work);
+		while (pool->next < pool->ntasks) {
+			int i = pool->next++;
+
+			pthread_mutex_unlock(&pool->lock);
+			err = task(arg, i);
+			pthread_mutex_lock(&pool->lock);
+			if (err < 0) pool->error = err;
+			pool->finished++;
+		}
+		while (pool->finished < pool->ntasks) pthread_cond_wait(&pool->done, &pool->lock);
+		err = pool->error;
+		pthread_mutex_unlock(&pool->lock);
+		pthread_mutex_unlock(&pool->busy);
+		return err;
+	}
+#else
+	(void)pool;
+#endif
+	for (int i = 0; i < ntasks; i++) {
+		err = task(arg, i);
+		if (err < 0) return err;
+	}
+	return 0;
+}
+
+
+/* Compress one input range at its worst-case output position */
+static int mt_compress_task(void *arg, const int task)
+{
+	struct mt_job * const job = arg;
+	const unsigned int start = (unsigned int)task * job->range;
+	unsigned int size = job->length - start;
+
+	if (size > job->range) size = job->range;
+	job->out_len[task] = lzjody_compress(job->in + start,
+			job->out + (size_t)task * job->range_max, job->options, size);
+	return job->out_len[task];
+}
+
+
+/* Compress a large buffer on several threads
+ * The input is split into LZJODY_MT_RANGE pieces that are compressed at
+ * their worst-case output positions and then packed together, so out needs
+ * the same worst-case space as with lzjody_compress() */
+extern int lzjody_compress_mt(const unsigned char * const blk_in,
+		unsigned char * const blk_out,
+		const unsigned int options,
+		const unsigned int length,
+		struct lzjody_pool * const pool)
+{
+	struct mt_job job;
+	const unsigned int bsize = LZJODY_BSIZE_OF(options);
+	int ntasks, err, out_size = 0;
+
+	/* Unprefixed blocks can't be split apart again */
+	if (length <= LZJODY_MT_RANGE || (options & O_NOPREFIX))
+		return lzjody_compress(blk_in, blk_out, options, length);
+	if (bsize > LZJODY_MAX_BSIZE) return -1;
+	if (compress_too_large(length, options)) return -1;
+
+	job.in = blk_in;
+	job.out = blk_out;
+	job.length = length;
+	job.options = options;
+	job.range = LZJODY_MT_RANGE - (LZJODY_MT_RANGE % bsize);
+	job.range_max = job.range + (job.range / bsize) * LZJODY_MAX_EXPAND(options);
+	ntasks = (int)((length + job.range - 1) / job.range);
+	job.out_len = (int *)malloc((size_t)ntasks * sizeof(int));
+	if (job.out_len == NULL) return -1;
+
+	err = pool_run(pool, mt_compress_task, &job, ntasks);
+	if (err < 0) goto out;
+
+	/* Pack the pieces together in order */
+	for (int i = 0; i < ntasks; i++) {
+		if ((size_t)out_size != (size_t)i * job.range_max)
+			memmove(blk_out + out_size, blk_out + (size_t)i * job.range_max, (size_t)job.out_len[i]);
+		out_size += job.out_len[i];
+	}
+	err = out_size;
+out:
+	free(job.out_len);
+	return err;
+}
+
+
+/* Split a prefixed multi-block buffer into records and lay out the output
+ * Returns the record count or negative on error; *recs must be freed */
+static int mt_parse(const unsigned char * const in, const unsigned int size,
+		const unsigned int out_size, const unsigned int options,
+		struct mt_rec ** const recs)
+{
+	const unsigned int prefix = LZJODY_PREFIX_LEN(options);
+	const unsigned int bsize = LZJODY_BSIZE_OF(options);
+	const unsigned int window = LZJODY_REPEAT_BLOCKS(options);
+	struct mt_rec *r;
+	unsigned int *data_recs = NULL;	/* Record index of each non-zero-run block */
+	unsigned int ipos, length, ndata = 0;
+	uint64_t value = 0, out_pos = 0;
+	int n = 0, len, err = -1;
+
+	/* Count records so the tables can be sized once */
+	for (ipos = 0; ipos + prefix <= size; ipos += prefix + length, n++) {
+		length = ((unsigned int)(*(in + ipos) & 0x1f) << 8) | *(in + ipos + 1);
+		if (prefix > 2) length = (length << 8) | *(in + ipos + 2);
+		length += CHECK_LEN(options, *(in + ipos) & O_RECORD_MASK);
+	}
+	if (ipos != size || n == 0) return -1;
+
+	*recs = (struct mt_rec *)malloc((size_t)n * sizeof(struct mt_rec));
+	data_recs = (unsigned int *)malloc((size_t)n * sizeof(unsigned int));
+	if (*recs == NULL || data_recs == NULL) goto out;
+
+	ipos = 0;
+	for (int i = 0; i < n; i++) {
+		r = *recs + i;
+		r->type = *(in + ipos) & O_RECORD_MASK;
+		length = ((unsigned int)(*(in + ipos) & 0x1f) << 8) | *(in + ipos + 1);
+		if (prefix > 2) length = (length << 8) | *(in + ipos + 2);
+		r->in = in + ipos + prefix;
+		r->in_len = length;
+		ipos += prefix + length + CHECK_LEN(options, r->type);
+		if (CHECK_LEN(options, r->type)) r->crc = read_check(r->in + length);
+
+		if (r->type & (O_ZERORUN | O_REPEAT)) {
+			if (length < 1 || length > 8) goto out;
+			value = 0;
+			for (unsigned int j = 0; j < length; j++) value = (value << 8) | *(r->in + j);
+		}
+		switch (r->type) {
+			case 0:
+				if (length > bsize + LZJODY_MAX_EXPAND(options)) goto out;
+				len = block_out_len(r->in, length, options, 0, NULL);
+				if (len < 0) goto out;
+				r->out_len = (unsigned int)len;
+				break;
+			case O_ZERORUN:
+				if (value > out_size) goto out;
+				r->out_len = (unsigned int)value;
+				break;
+			case O_REPEAT:
+				if (value == 0 || value > ndata || value > window) goto out;
+				r->ref = data_recs[ndata - value];
+				r->out_len = (*recs)[r->ref].out_len;
+				break;
+			default:
+				goto out;
+		}
+		if (r->type != O_ZERORUN) data_recs[ndata++] = (unsigned int)i;
+		r->out_off = (unsigned int)out_pos;
+		out_pos += r->out_len;
+		if (out_pos > out_size) goto out;
+	}
+	err = n;
+out:
+	if (err < 0) {
+		fprintf(stderr, "liblzjody: error: bad block record or output too small\n");
+		free(*recs);
+		*recs = NULL;
+		err = -1;
+	}
+	free(data_recs);
+	return err;
+}
+
+
+/* Decompress the compressed blocks and zero runs of one task */
+static int mt_decompress_task(void *arg, const int task)
+{
+	struct mt_job * const job = arg;
+	const struct mt_rec *r;
+	int end = (task + 1) * job->per_task;
+	int err;
+
+	if (end > job->nrecs) end = job->nrecs;
+	for (int i = task * job->per_task; i < end; i++) {
+		r = job->recs + i;
+		if (r->type == 0) {
+			err = lzjody_decompress(r->in, job->out + r->out_off, r->in_len, job->options);
+			if (err < 0) return err;
+			if ((unsigned int)err != r->out_len) return -1;
+			if ((job->options & O_CHECKSUM)
+					&& lzjody_crc32c(job->out + r->out_off, r->out_len) != r->crc)
+				goto error_check;
+		} else if (r->type == O_ZERORUN) memset(job->out + r->out_off, 0, r->out_len);
+	}
+	return 0;
+
+error_check:
+	fprintf(stderr, "liblzjody: error: checksum mismatch in block record %d\n", (int)(r - job->recs));
+	return -1;
+}
+
+
+/* Decompress a buffer of prefixed blocks (lzjody_compress() output) on
+ * several threads; returns the decompressed size or negative on error
+ * Block sizes are found with a fast command walk so every block can be
+ * decoded straight into its final place in out */
+extern int lzjody_decompress_mt(const unsigned char * const in,
+		unsigned char * const out,
+		const unsigned int in_size,
+		const unsigned int out_size,
+		const unsigned int options,
+		struct lzjody_pool * const pool)
+{
+	struct mt_job job;
+	uint64_t total;
+	int ntasks, err;
+
+	if (in_size == 0 || (options & O_NOPREFIX)) return -1;
+	job.nrecs = mt_parse(in, in_size, out_size, options, &job.recs);
+	if (job.nrecs < 0) return job.nrecs;
+	/* The records give the total before anything is decoded */
+	if (job.nrecs > 0) {
+		total = (uint64_t)job.recs[job.nrecs - 1].out_off + job.recs[job.nrecs - 1].out_len;
+		if (total > INT_MAX) goto error_too_large;
+	}
+	job.out = out;
+	job.options = options;
+	/* Around LZJODY_MT_RANGE of output per task */
+	job.per_task = (int)(LZJODY_MT_RANGE / LZJODY_BSIZE_OF(options));
+	ntasks = job.nrecs / job.per_task;
+	if (job.nrecs % job.per_task) ntasks++;
+
+	err = pool_run(pool, mt_decompress_task, &job, ntasks);
+	if (err < 0) goto out;
+
+	/* Repeats may copy other repeats, so they are resolved in order */
+	for (int i = 0; i < job.nrecs; i++) {
+		const struct mt_rec * const r = job.recs + i;
+
+		if (r->type == O_REPEAT) {
+			/* The source block's data was already checked */
+			if ((options & O_CHECKSUM) && r->crc != job.recs[r->ref].crc) goto error_check;
+			memcpy(out + r->out_off, out + job.recs[r->ref].out_off, r->out_len);
+		}
+		err = (int)(r->out_off + r->out_len);
+	}
+	goto out;
+
+error_check:
+	fprintf(stderr, "liblzjody: error: checksum mismatch in repeat record\n");
+	err = -1;
+	goto out;
+error_too_large:
+	fprintf(stderr, "liblzjody: error: output of %" PRIu64 " bytes passes %d bytes\n", total, INT_MAX);
+	err = -1;
+out:
+	free(job.recs);
+	return err;
+}
+
+
+/* Compressed blocks of one lzjody_verify() batch */
+struct verify_job {
+	const unsigned char *base;	/* Start of the stream */
+	const unsigned char **in;
+	unsigned int *in_len;
+	uint32_t *crc;
+	int nrecs;
+	int per_task;
+	unsigned int options;
+};
+
+#define VERIFY_BATCH 16384
+
+
+/* Decode one task's blocks into scratch space and check them */
+static int verify_task(void *arg, const int task)
+{
+	struct verify_job * const job = arg;
+	const unsigned int bsize = LZJODY_BSIZE_OF(job->options);
+	unsigned char *scratch;
+	const int start = task * job->per_task;
+	int count = job->nrecs - start;
+	int err = 0;
+
+	scratch = (unsigned char *)malloc(bsize);
+	if (scratch == NULL) return -1;
+	if (count > job->per_task) count = job->per_task;
+	for (int i = start; count > 0; i++, count--) {
+		err = decompress_block(job->in[i], scratch, job->in_len[i], bsize, job->options);
+		if (err < 0) break;
+		if ((job->options & O_CHECKSUM) && lzjody_crc32c(scratch, (size_t)err) != job->crc[i]) {
+			fprintf(stderr, "liblzjody: error: checksum mismatch in block at 0x%" PRIx64 "\n",
+					(uint64_t)(job->in[i] - job->base));
+			err = -1;
+			break;
+		}
+	}
+	free(scratch);
+	return (err < 0) ? err : 0;
+}
+
+
+/* Check every block of a whole stream on several threads without keeping
+ * any output; streams with O_CHECKSUM also have each block's data checked
+ * against its stored checksum. Returns 0 if the stream is intact */
+extern int lzjody_verify(const unsigned char * const in, const uint64_t size,
+		struct lzjody_pool * const pool)
+{
+	struct verify_job job;
+	unsigned int options, prefix, window, length, type, ndata = 0;
+	uint32_t *ring;	/* Checksums of recent non-zero-run blocks */
+	uint64_t ipos, value = 0;
+	int ntasks, err;
+
+	err = lzjody_read_header(in, (size > LZJODY_HEADER_LEN) ? LZJODY_HEADER_LEN : (unsigned int)size,
+			&options);
+	if (err < 0) return err;
+	if (options & O_REFERENCE) goto error_reference;
+	ipos = (uint64_t)err;
+	prefix = LZJODY_PREFIX_LEN(options);
+	window = LZJODY_REPEAT_BLOCKS(options);
+
+	job.base = in;
+	job.options = options;
+	job.per_task = (int)(LZJODY_MT_RANGE / LZJODY_BSIZE_OF(options));
+	job.nrecs = 0;
+	job.in = (const unsigned char **)malloc(VERIFY_BATCH * sizeof(unsigned char *));
+	job.in_len = (unsigned int *)malloc(VERIFY_BATCH * sizeof(unsigned int));
+	job.crc = (uint32_t *)malloc(VERIFY_BATCH * sizeof(uint32_t));
+	ring = (uint32_t *)malloc(window * sizeof(uint32_t));
+	if (job.in == NULL || job.in_len == NULL || job.crc == NULL || ring == NULL) goto error_oom;
+
+	while (ipos < size || job.nrecs > 0) {
+		if (ipos < size) {
+			if (size - ipos < prefix) goto error_truncated;
+			type = *(in + ipos) & O_RECORD_MASK;
+			length = ((unsigned int)(*(in + ipos) & 0x1f) << 8) | *(in + ipos + 1);
+			if (prefix > 2) length = (length << 8) | *(in + ipos + 2);
+			ipos += prefix;
+			if (length == 0 || size - ipos < length + CHECK_LEN(options, type)) goto error_truncated;
+			if (type & (O_ZERORUN | O_REPEAT)) {
+				if (length > 8) goto error_record;
+				value = 0;
+				for (unsigned int i = 0; i < length; i++) value = (value << 8) | *(in + ipos + i);
+			}
+			switch (type) {
+				case 0:
+					if (length > (unsigned int)(LZJODY_BSIZE_OF(options) + LZJODY_MAX_EXPAND(options)))
+						goto error_record;
+					job.in[job.nrecs] = in + ipos;
+					job.in_len[job.nrecs] = length;
+					if (options & O_CHECKSUM) job.crc[job.nrecs] = read_check(in + ipos + length);
+					job.nrecs++;
+					break;
+				case O_ZERORUN:
+					break;
+				case O_REPEAT:
+					/* The copy must match the block it repeats */
+					if (value == 0 || value > ndata || value > window) goto error_record;
+					if ((options & O_CHECKSUM)
+							&& read_check(in + ipos + length) != ring[(ndata - value) % window])
+						goto error_check;
+					break;
+				default:
+					goto error_record;
+			}
+			if (type != O_ZERORUN) {
+				if (options & O_CHECKSUM) ring[ndata % window] = read_check(in + ipos + length);
+				ndata++;
+			}
+			ipos += length + CHECK_LEN(options, type);
+			if (job.nrecs != VERIFY_BATCH && ipos < size) continue;
+		}
+
+		/* Decode a full batch (or the last one) in parallel */
+		ntasks = job.nrecs / job.per_task;
+		if (job.nrecs % job.per_task) ntasks++;
+		err = pool_run(pool, verify_task, &job, ntasks);
+		if (err < 0) goto error_free;
+		job.nrecs = 0;
+	}
+	err = 0;
+	goto error_free;
+
+error_truncated:
+	fprintf(stderr, "liblzjody: error: stream ends inside a block\n");
+	err = -1;
+	goto error_free;
+error_record:
+	fprintf(stderr, "liblzjody: error: bad block record at 0x%" PRIx64 "\n", ipos);
+	err = -1;
+	goto error_free;
+error_check:
+	fprintf(stderr, "liblzjody: error: checksum mismatch in repeat record at 0x%" PRIx64 "\n", ipos);
+	err = -1;
+	goto error_free;
+error_oom:
+	fprintf(stderr, "liblzjody: error: out of memory\n");
+	err = -1;
+error_free:
+	free(job.in); free(job.in_len); free(job.crc); free(ring);
+	return err;
+error_reference:
+	fprintf(stderr, "liblzjody: error: delta streams can only be read with their reference\n");
+	return -1;
 }
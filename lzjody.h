@@ -8,16 +8,38 @@
 #ifndef LZJODY_H
 #define LZJODY_H
 
+#include <stddef.h>
+#include <stdint.h>
+#if defined _WIN32 && !defined __CYGWIN__
+struct iovec {
+	void *iov_base;
+	size_t iov_len;
+};
+#else
+ #include <sys/uio.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#define LZJODY_VER "0.4"
-#define LZJODY_VERDATE "2023-08-09"
+#define LZJODY_VER "0.5"
+#define LZJODY_VERDATE "development"
 
 /* Maximum amount of data the algorithm can process at a time */
 #define LZJODY_BSIZE 4096
 
+/* Largest block size accepted by the "wide" format (see O_BSIZE_xxx)
+ * Define to 32768 or less to build with 16-bit LZ jump lists */
+#ifndef LZJODY_MAX_BSIZE
+ #define LZJODY_MAX_BSIZE 262144
+#endif
+
+/* Largest preset dictionary (see lzjody_dict_create()) */
+#ifndef LZJODY_DICT_MAX
+ #define LZJODY_DICT_MAX 32768
+#endif
+
 /* Options for the compressor */
 #define O_FAST_LZ   0x01	/* Stop at first LZ match (faster but not recommended) */
 #define O_NO_LZ     0x02	/* Don't use the LZ compressor */
@@ -25,14 +47,174 @@ extern "C" {
 #define O_NO_RLE    0x08	/* Don't use the RLE compressor */
 #define O_NOPREFIX  0x40	/* Don't prefix lzjody_compress() data with the compressed length */
 #define O_REALFLUSH 0x80	/* Make lzjody_flush_literals() flush without question */
+#define O_DEDUP     0x400	/* Emit zero run and repeat block records */
+#define O_CHECKSUM  0x800	/* Follow each block record with a CRC32C of its data */
+#define O_REFERENCE 0x1000	/* Blocks may refer to a reference image (delta mode) */
+#define O_ENTROPY   0x2000	/* Huffman code compressed blocks that get smaller */
+#define O_LZ_REPEAT 0x4000	/* Use LZ repeat commands (not readable by version 0 decoders) */
+
+/* Block size selection (compressor and decompressor)
+ * Anything larger than LZJODY_BSIZE uses the wide format (see README.txt) */
+#define O_BSIZE_4K   0x000
+#define O_BSIZE_16K  0x100
+#define O_BSIZE_64K  0x200
+#define O_BSIZE_256K 0x300
+#define O_BSIZE_MASK 0x300
+#define LZJODY_BSIZE_OF(a) (LZJODY_BSIZE << (((a) & O_BSIZE_MASK) >> 7))
+#define LZJODY_PREFIX_LEN(a) (((a) & O_BSIZE_MASK) ? 3 : 2)
+/* Length of a block checksum (big-endian CRC32C) */
+#define LZJODY_CHECK_LEN 4
+/* Worst-case growth of one incompressible block (prefix and checksum included) */
+#define LZJODY_MAX_EXPAND(a) ((((a) & O_BSIZE_MASK) ? 6 : 4) + (((a) & O_CHECKSUM) ? LZJODY_CHECK_LEN : 0))
+
+/* In-place decompression: every block the compressor writes decodes into
+ * the same buffer if its compressed data ends at least this far past the
+ * end of the output */
+#define LZJODY_INPLACE_MARGIN(a) (LZJODY_MAX_EXPAND(a) * 2)
+
+/* Options that change the data format and must be given to the decompressor */
+#define O_FORMAT_MASK (O_BSIZE_MASK | O_CHECKSUM | O_REFERENCE | O_LZ_REPEAT)
 
 /* Decompressor options (some copied from data block header) */
 #define O_NOCOMPRESS 0x80	/* Incompressible block packing flag */
+#define O_ZERORUN    0x40	/* Zero run record: payload is a big-endian byte count */
+#define O_REPEAT     0x20	/* Repeat record: payload is a big-endian block distance */
+#define O_REFBLOCK   0x60	/* Reference block record: payload is a big-endian block number */
+#define O_REFWINDOW  0xc0	/* Compressed block that matches into the reference near its offset */
+#define O_RECORD_MASK 0xe0
+
+/* Repeat records refer back at most this many bytes worth of blocks
+ * (every block that is not a zero run counts) */
+#define LZJODY_REPEAT_WINDOW 1048576
+#define LZJODY_REPEAT_BLOCKS(a) (LZJODY_REPEAT_WINDOW / LZJODY_BSIZE_OF(a))
+/* Largest possible zero run or repeat record (zero runs have no checksum) */
+#define LZJODY_RECORD_MAX 11
+
+/* Input bytes per task for lzjody_compress_mt()/lzjody_decompress_mt() */
+#ifndef LZJODY_MT_RANGE
+ #define LZJODY_MT_RANGE 1048576
+#endif
+
+/* Stream header: "LZJ", format version, big-endian O_FORMAT_MASK options
+ * Headerless streams are version 0 (4 KiB blocks, no other features) */
+#define LZJODY_MAGIC "LZJ"
+#define LZJODY_FORMAT_VER 1
+#define LZJODY_HEADER_LEN 8
+
+/* Stream layout found by lzjody_scan(); delta (O_REFERENCE) streams are
+ * sized without their reference, so their window matches are only
+ * checked against the largest window a reference could give */
+struct lzjody_scan_t {
+	uint64_t total;	/* Decompressed size of the stream */
+	uint64_t blocks;	/* Number of block records */
+	uint64_t *sizes;	/* Decompressed size of each record (caller frees) */
+	unsigned int options;	/* Format options from the stream header */
+	unsigned int header_len;	/* 0 for a headerless stream */
+};
 
 extern int lzjody_compress(const unsigned char * const, unsigned char * const,
 		const unsigned int, const unsigned int);
 extern int lzjody_decompress(const unsigned char * const, unsigned char * const,
 		const unsigned int, const unsigned int);
+extern int lzjody_decompress_safe(const unsigned char * const, const unsigned int,
+		unsigned char * const, const unsigned int, const unsigned int);
+extern int lzjody_decompress_inplace(unsigned char * const, const unsigned int,
+		const unsigned int, const unsigned int);
+extern unsigned int lzjody_compress_bound(const unsigned int, const unsigned int);
+extern int lzjody_zero_run(unsigned char * const, const uint64_t,
+		const unsigned int);
+extern int lzjody_write_header(unsigned char * const, const unsigned int);
+extern int lzjody_read_header(const unsigned char * const,
+		const unsigned int, unsigned int * const);
+extern int lzjody_scan(const unsigned char * const, const uint64_t,
+		struct lzjody_scan_t * const);
+extern uint32_t lzjody_crc32c(const unsigned char * const, const size_t);
+
+/* Batched API for many independent pages of the option block size */
+extern int lzjody_compress_batch(const unsigned char * const * const,
+		const unsigned int, unsigned char * const * const,
+		unsigned int * const, const unsigned int);
+extern int lzjody_decompress_batch(const unsigned char * const * const,
+		const unsigned int * const, const unsigned int,
+		unsigned char * const * const, const unsigned int);
+
+/* Scatter/gather API (totals must fit in an int, the return value) */
+extern int lzjody_compressv(const struct iovec * const, const int,
+		const struct iovec * const, const int, const unsigned int);
+extern int lzjody_decompressv(const struct iovec * const, const int,
+		const struct iovec * const, const int, const unsigned int);
+
+/* Preset dictionary API: the dictionary is a virtual prefix of every block
+ * and may be shared read-only by any number of threads */
+struct lzjody_dict;
+extern struct lzjody_dict *lzjody_dict_create(const unsigned char * const,
+		const unsigned int);
+extern void lzjody_dict_free(struct lzjody_dict * const);
+extern int lzjody_compress_dict(const unsigned char * const, unsigned char * const,
+		const unsigned int, const unsigned int, const struct lzjody_dict * const);
+extern int lzjody_decompress_dict(const unsigned char * const, unsigned char * const,
+		const unsigned int, const unsigned int, const struct lzjody_dict * const);
+
+/* Reference (delta) API: the reference image is not copied and must stay
+ * mapped while the index is in use; blocks are numbered in the option
+ * block size and offsets are positions in the uncompressed stream */
+struct lzjody_ref;
+extern struct lzjody_ref *lzjody_ref_create(const unsigned char * const,
+		const uint64_t, const unsigned int);
+extern void lzjody_ref_free(struct lzjody_ref * const);
+extern int lzjody_compress_ref(const unsigned char * const, unsigned char * const,
+		const unsigned int, const unsigned int, const uint64_t,
+		const struct lzjody_ref * const);
+extern int lzjody_decompress_ref(const unsigned char * const, unsigned char * const,
+		const unsigned int, const unsigned int, const uint64_t,
+		const unsigned char * const, const uint64_t);
+
+/* Multi-threaded API (threads are only used if built with THREADED;
+ * otherwise work runs serially and lzjody_pool_threads() returns 1)
+ * Totals must fit in an int, the return value */
+struct lzjody_pool;
+extern struct lzjody_pool *lzjody_pool_create(int);
+extern void lzjody_pool_destroy(struct lzjody_pool * const);
+extern int lzjody_pool_threads(const struct lzjody_pool * const);
+extern int lzjody_compress_mt(const unsigned char * const, unsigned char * const,
+		const unsigned int, const unsigned int, struct lzjody_pool * const);
+extern int lzjody_decompress_mt(const unsigned char * const, unsigned char * const,
+		const unsigned int, const unsigned int, const unsigned int,
+		struct lzjody_pool * const);
+extern int lzjody_verify(const unsigned char * const, const uint64_t,
+		struct lzjody_pool * const);
+
+/* Compressor statistics, kept per thread when the library is built with
+ * STATS=1; lzjody_stats_get() returns -1 (and all zeroes) otherwise */
+#define LZJODY_STAT_RLE       0
+#define LZJODY_STAT_SEQ8      1
+#define LZJODY_STAT_SEQ16     2
+#define LZJODY_STAT_SEQ32     3
+#define LZJODY_STAT_LZ_REP    4	/* Match at the previous LZ distance */
+#define LZJODY_STAT_LZ_JUMP   5	/* Match search through the byte jump lists */
+#define LZJODY_STAT_LZ_LINEAR 6	/* Linear search for bytes that filled their list */
+#define LZJODY_STAT_FINDERS   7
+
+#define LZJODY_STAGE_INDEX    0	/* Building the LZ byte index */
+#define LZJODY_STAGE_SCAN     1	/* Finding matches (includes byte plane trials) */
+#define LZJODY_STAGE_PLANE    2	/* Byte plane trials */
+#define LZJODY_STAGE_ENTROPY  3	/* Huffman coding (O_ENTROPY) */
+#define LZJODY_STAGE_CHECK    4	/* Block checksums (O_CHECKSUM) */
+#define LZJODY_STAGES         5
+
+struct lzjody_stats {
+	uint64_t calls[LZJODY_STAT_FINDERS];	/* Positions each finder tried */
+	uint64_t hits[LZJODY_STAT_FINDERS];	/* Commands each finder wrote */
+	uint64_t bytes[LZJODY_STAT_FINDERS];	/* Input bytes those commands cover */
+	uint64_t plane_tried;	/* Literal runs given a byte plane trial */
+	uint64_t plane_used;	/* Trials that were kept */
+	uint64_t index_full;	/* LZ indexes cut short by a full jump list (MAX_LZ_BYTE_SCANS) */
+	uint64_t blocks;	/* Blocks compressed */
+	uint64_t bytes_in;	/* Bytes in those blocks */
+	uint64_t ticks[LZJODY_STAGES];	/* CPU cycles (TSC on x86, else ns) per stage */
+};
+extern int lzjody_stats_get(struct lzjody_stats * const);
+extern void lzjody_stats_reset(void);
 
 #ifdef __cplusplus
 }
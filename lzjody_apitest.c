@@ -0,0 +1,853 @@
+/*
+ * lzjody library API tests
+ *
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * Released under The MIT License
+ *
+ * Round trips the buffer APIs the utility doesn't use on generated data
+ * and checks that they refuse what they should. The data mixes zero runs,
+ * text, repeated clusters and random bytes from a fixed seed, so every
+ * kind of block record shows up. Run with no arguments for every test or
+ * with the names of the tests to run; exits nonzero if any test failed.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lzjody.h"
+
+#define TEST_SEED 0x6170697465737421ULL
+/* Generated data is laid out in filesystem clusters */
+#define CLUSTER 4096
+/* Multi-threaded tests span several LZJODY_MT_RANGE pieces and end
+ * with a partial block */
+#define MT_SIZE ((6U << 20) + 1234)
+#define BATCH_PAGES 64
+/* Scatter/gather tests cover several blocks of the largest size used */
+#define IOV_SIZE ((1U << 20) + 777)
+#define IOV_SEGS 64
+/* Bytes past an output capacity that must never be written */
+#define GUARD 64
+#define GUARD_BYTE 0xa5
+#define SAFE_CORRUPTIONS 2000
+#define INPLACE_BLOCKS 12
+#define DICT_SIZE 32768
+#define DICT_BLOCKS 12
+/* Scanned streams end with a partial block */
+#define SCAN_SIZE ((2U << 20) + 99)
+
+/* xorshift64* generator: same data on every machine */
+static uint64_t rng_next(uint64_t * const state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545f4914f6cdd1dULL;
+}
+
+
+/* Fill a buffer with runs of zero, text, repeated and random clusters */
+static void fill_data(unsigned char * const buf, const size_t size, uint64_t * const rng)
+{
+	static const char text[] = "the quick brown fox jumps over the lazy dog\n";
+	size_t pos = 0, len, src;
+
+	while (pos < size) {
+		len = CLUSTER * (1 + rng_next(rng) % 4);
+		if (len > size - pos) len = size - pos;
+		switch (rng_next(rng) % 4) {
+		case 0:
+			memset(buf + pos, 0, len);
+			break;
+		case 1:
+			for (size_t i = 0; i < len; i++)
+				buf[pos + i] = (unsigned char)text[(i + pos / CLUSTER) % (sizeof(text) - 1)];
+			break;
+		case 2:
+			if (pos >= CLUSTER) {
+				src = (size_t)(rng_next(rng) % (pos / CLUSTER)) * CLUSTER;
+				if (src + len > pos) len = pos - src;
+				memmove(buf + pos, buf + src, len);
+				break;
+			}
+			/* Fall through */
+		default:
+			for (size_t i = 0; i < len; i++) buf[pos + i] = (unsigned char)rng_next(rng);
+			break;
+		}
+		pos += len;
+	}
+	return;
+}
+
+
+/* Report a failed check; returns 1 for the test's failure count */
+static int fail(const char * const test, const char * const what, const unsigned int options)
+{
+	fprintf(stderr, "lzjody-apitest: %s: %s (options 0x%x)\n", test, what, options);
+	return 1;
+}
+
+
+/* Multi-threaded compression and decompression, on a pool and on the
+ * internal pool, against each other and the single-threaded API */
+static int test_mt(void)
+{
+	static const unsigned int opts[] = {
+		O_DEDUP,
+		O_DEDUP | O_CHECKSUM,
+		O_DEDUP | O_CHECKSUM | O_LZ_REPEAT | O_BSIZE_64K
+	};
+	struct lzjody_pool *pool;
+	unsigned char *in, *stream, *out, *dec;
+	uint64_t rng = TEST_SEED;
+	int len, fails = 0;
+
+	in = (unsigned char *)malloc(MT_SIZE);
+	/* Blocks follow a stream header so lzjody_verify() can check them */
+	stream = (unsigned char *)malloc(LZJODY_HEADER_LEN + lzjody_compress_bound(MT_SIZE, O_BSIZE_4K | O_CHECKSUM));
+	out = stream + LZJODY_HEADER_LEN;
+	dec = (unsigned char *)malloc(MT_SIZE);
+	pool = lzjody_pool_create(4);
+	if (in == NULL || stream == NULL || dec == NULL || pool == NULL) goto oom;
+	fill_data(in, MT_SIZE, &rng);
+	printf("mt: pool runs on %d thread(s), internal pool on %d\n",
+			lzjody_pool_threads(pool), lzjody_pool_threads(NULL));
+
+	for (unsigned int i = 0; i < sizeof(opts) / sizeof(opts[0]); i++) {
+		len = lzjody_compress_mt(in, out, opts[i], MT_SIZE, pool);
+		if (len <= 0) {
+			fails += fail("mt", "compression failed", opts[i]);
+			continue;
+		}
+		memset(dec, 0xa5, MT_SIZE);
+		if (lzjody_decompress_mt(out, dec, (unsigned int)len, MT_SIZE, opts[i], pool) != (int)MT_SIZE
+				|| memcmp(in, dec, MT_SIZE) != 0)
+			fails += fail("mt", "pool round trip mismatch", opts[i]);
+		memset(dec, 0xa5, MT_SIZE);
+		if (lzjody_decompress_mt(out, dec, (unsigned int)len, MT_SIZE, opts[i], NULL) != (int)MT_SIZE
+				|| memcmp(in, dec, MT_SIZE) != 0)
+			fails += fail("mt", "internal pool round trip mismatch", opts[i]);
+		if (lzjody_write_header(stream, opts[i]) != LZJODY_HEADER_LEN
+				|| lzjody_verify(stream, (uint64_t)len + LZJODY_HEADER_LEN, pool) != 0)
+			fails += fail("mt", "verify failed on a good buffer", opts[i]);
+
+		/* The single-threaded compressor's output decodes the same way */
+		len = lzjody_compress(in, out, opts[i], MT_SIZE);
+		memset(dec, 0xa5, MT_SIZE);
+		if (len <= 0 || lzjody_decompress_mt(out, dec, (unsigned int)len, MT_SIZE, opts[i], pool) != (int)MT_SIZE
+				|| memcmp(in, dec, MT_SIZE) != 0)
+			fails += fail("mt", "lzjody_compress() output mismatch", opts[i]);
+
+		/* A short output buffer is refused, not overrun */
+		if (len > 0 && lzjody_decompress_mt(out, dec, (unsigned int)len, MT_SIZE - 1, opts[i], pool) >= 0)
+			fails += fail("mt", "short output buffer accepted", opts[i]);
+	}
+
+	lzjody_pool_destroy(pool);
+	free(in); free(stream); free(dec);
+	return fails;
+
+oom:
+	lzjody_pool_destroy(pool);
+	free(in); free(stream); free(dec);
+	return fail("mt", "out of memory", 0);
+}
+
+
+/* Batches of zero, compressible and incompressible pages in several
+ * block sizes, so the cached scratch space is reused and regrown */
+static int test_batch(void)
+{
+	static const unsigned int opts[] = {
+		O_BSIZE_4K,
+		O_BSIZE_16K | O_ENTROPY,
+		O_BSIZE_4K | O_ENTROPY,
+		O_BSIZE_64K
+	};
+	const size_t max_page = 65536;
+	const unsigned char *ins[BATCH_PAGES];
+	unsigned char *pages[BATCH_PAGES], *outs[BATCH_PAGES];
+	unsigned int out_lens[BATCH_PAGES];
+	unsigned char *in, *out, *dec;
+	uint64_t rng = TEST_SEED;
+	unsigned int bsize, kept, zero, raw;
+	int count, fails = 0;
+
+	in = (unsigned char *)malloc(max_page * BATCH_PAGES);
+	out = (unsigned char *)malloc(max_page * BATCH_PAGES);
+	dec = (unsigned char *)malloc(max_page * BATCH_PAGES);
+	if (in == NULL || out == NULL || dec == NULL) goto oom;
+
+	for (unsigned int i = 0; i < sizeof(opts) / sizeof(opts[0]); i++) {
+		bsize = LZJODY_BSIZE_OF(opts[i]);
+		fill_data(in, (size_t)bsize * BATCH_PAGES, &rng);
+		/* Make sure every kind of page is there */
+		memset(in, 0, bsize);
+		for (unsigned int j = 0; j < bsize; j++) in[bsize + j] = (unsigned char)rng_next(&rng);
+		memset(in + bsize * 2, 'x', bsize);
+		for (unsigned int p = 0; p < BATCH_PAGES; p++) {
+			pages[p] = in + (size_t)p * bsize;
+			outs[p] = out + (size_t)p * bsize;
+			ins[p] = outs[p];
+		}
+
+		count = lzjody_compress_batch((const unsigned char * const *)pages, BATCH_PAGES,
+				outs, out_lens, opts[i]);
+		if (count < 0) {
+			fails += fail("batch", "compression failed", opts[i]);
+			continue;
+		}
+		kept = zero = raw = 0;
+		for (unsigned int p = 0; p < BATCH_PAGES; p++) {
+			if (out_lens[p] == 0) zero++;
+			else if (out_lens[p] == bsize) raw++;
+			else if (out_lens[p] < bsize) kept++;
+		}
+		if ((int)kept != count || zero == 0 || raw == 0 || kept == 0 || kept + zero + raw != BATCH_PAGES)
+			fails += fail("batch", "wrong page counts", opts[i]);
+		if (out_lens[0] != 0 || out_lens[1] != bsize)
+			fails += fail("batch", "zero or random page not kept as such", opts[i]);
+
+		memset(dec, 0xa5, (size_t)bsize * BATCH_PAGES);
+		for (unsigned int p = 0; p < BATCH_PAGES; p++) pages[p] = dec + (size_t)p * bsize;
+		if (lzjody_decompress_batch(ins, out_lens, BATCH_PAGES, pages, opts[i]) != 0
+				|| memcmp(in, dec, (size_t)bsize * BATCH_PAGES) != 0)
+			fails += fail("batch", "round trip mismatch", opts[i]);
+
+		/* A compressed page cut short must not decode to a full page */
+		out_lens[2]--;
+		if (lzjody_decompress_batch(ins, out_lens, BATCH_PAGES, pages, opts[i]) == 0)
+			fails += fail("batch", "truncated page accepted", opts[i]);
+	}
+
+	free(in); free(out); free(dec);
+	return fails;
+
+oom:
+	free(in); free(out); free(dec);
+	return fail("batch", "out of memory", 0);
+}
+
+
+/* Cut a buffer into segments of awkward sizes: single bytes, a byte
+ * either side of a block, and odd lengths, so boundaries land inside
+ * blocks, block prefixes and checksums */
+static int split_iov(struct iovec * const iov, unsigned char * const buf,
+		const size_t size, const unsigned int bsize)
+{
+	const size_t lens[] = { 1, 2, bsize - 1, bsize + 1, 3, 5000, 7, bsize * 3 + 11 };
+	size_t pos = 0, len;
+	int cnt = 0;
+
+	while (pos < size && cnt < IOV_SEGS - 1) {
+		len = lens[cnt % (sizeof(lens) / sizeof(lens[0]))];
+		if (len > size - pos) len = size - pos;
+		iov[cnt].iov_base = buf + pos;
+		iov[cnt].iov_len = len;
+		pos += len;
+		cnt++;
+	}
+	if (pos < size) {
+		iov[cnt].iov_base = buf + pos;
+		iov[cnt].iov_len = size - pos;
+		cnt++;
+	}
+	return cnt;
+}
+
+
+/* Scatter/gather round trips through segmented input and output against
+ * the flat buffer API, and refusal of totals that don't fit an int */
+static int test_iov(void)
+{
+	static const unsigned int opts[] = {
+		O_DEDUP,
+		O_DEDUP | O_CHECKSUM,
+		O_DEDUP | O_CHECKSUM | O_LZ_REPEAT | O_BSIZE_16K
+	};
+	struct iovec in_iov[IOV_SEGS], out_iov[IOV_SEGS], *big = NULL;
+	unsigned char *in, *comp, *flat, *dec;
+	uint64_t rng = TEST_SEED;
+	unsigned int bsize, bound;
+	int in_cnt, out_cnt, len, flat_len, fails = 0;
+
+	bound = lzjody_compress_bound(IOV_SIZE, O_BSIZE_4K | O_CHECKSUM);
+	in = (unsigned char *)malloc(IOV_SIZE);
+	comp = (unsigned char *)malloc(bound);
+	flat = (unsigned char *)malloc(bound);
+	dec = (unsigned char *)malloc(IOV_SIZE);
+	if (in == NULL || comp == NULL || flat == NULL || dec == NULL) goto oom;
+	fill_data(in, IOV_SIZE, &rng);
+
+	for (unsigned int i = 0; i < sizeof(opts) / sizeof(opts[0]); i++) {
+		bsize = LZJODY_BSIZE_OF(opts[i]);
+		in_cnt = split_iov(in_iov, in, IOV_SIZE, bsize);
+		out_cnt = split_iov(out_iov, comp, bound, bsize);
+		len = lzjody_compressv(in_iov, in_cnt, out_iov, out_cnt, opts[i]);
+		flat_len = lzjody_compress(in, flat, opts[i], IOV_SIZE);
+		if (len <= 0 || flat_len <= 0) {
+			fails += fail("iov", "compression failed", opts[i]);
+			continue;
+		}
+
+		/* Segmented compressed data, segmented output */
+		memset(dec, 0xa5, IOV_SIZE);
+		in_cnt = split_iov(in_iov, comp, (size_t)len, bsize);
+		out_cnt = split_iov(out_iov, dec, IOV_SIZE, bsize);
+		if (lzjody_decompressv(in_iov, in_cnt, out_iov, out_cnt, opts[i]) != (int)IOV_SIZE
+				|| memcmp(in, dec, IOV_SIZE) != 0)
+			fails += fail("iov", "segmented round trip mismatch", opts[i]);
+
+		/* Either side's streams decode on the other */
+		memset(dec, 0xa5, IOV_SIZE);
+		if (lzjody_decompress_mt(comp, dec, (unsigned int)len, IOV_SIZE, opts[i], NULL) != (int)IOV_SIZE
+				|| memcmp(in, dec, IOV_SIZE) != 0)
+			fails += fail("iov", "lzjody_compressv() stream mismatch", opts[i]);
+		memset(dec, 0xa5, IOV_SIZE);
+		in_cnt = split_iov(in_iov, flat, (size_t)flat_len, bsize);
+		if (lzjody_decompressv(in_iov, in_cnt, out_iov, out_cnt, opts[i]) != (int)IOV_SIZE
+				|| memcmp(in, dec, IOV_SIZE) != 0)
+			fails += fail("iov", "lzjody_compress() stream mismatch", opts[i]);
+
+		/* Short output and input are refused */
+		out_cnt = split_iov(out_iov, dec, IOV_SIZE - 1, bsize);
+		if (lzjody_decompressv(in_iov, in_cnt, out_iov, out_cnt, opts[i]) >= 0)
+			fails += fail("iov", "short output segments accepted", opts[i]);
+		out_cnt = split_iov(out_iov, dec, IOV_SIZE, bsize);
+		in_cnt = split_iov(in_iov, flat, (size_t)flat_len - 1, bsize);
+		if (lzjody_decompressv(in_iov, in_cnt, out_iov, out_cnt, opts[i]) >= 0)
+			fails += fail("iov", "truncated input accepted", opts[i]);
+		out_cnt = split_iov(out_iov, comp, (size_t)len / 2, bsize);
+		in_cnt = split_iov(in_iov, in, IOV_SIZE, bsize);
+		if (lzjody_compressv(in_iov, in_cnt, out_iov, out_cnt, opts[i]) >= 0)
+			fails += fail("iov", "short compressed output segments accepted", opts[i]);
+	}
+
+	/* Totals past INT_MAX are refused before any data is touched: 2 GiB of
+	 * input made of one buffer many times, and a 3 GiB zero run record */
+	big = (struct iovec *)malloc(sizeof(struct iovec) * 2048);
+	if (big == NULL) goto oom;
+	for (int i = 0; i < 2048; i++) {
+		big[i].iov_base = in;
+		big[i].iov_len = IOV_SIZE;
+	}
+	out_iov[0].iov_base = comp;
+	out_iov[0].iov_len = bound;
+	if (lzjody_compressv(big, 2048, out_iov, 1, O_DEDUP) >= 0)
+		fails += fail("iov", "compressed more than INT_MAX bytes", O_DEDUP);
+	len = lzjody_zero_run(comp, 3ULL << 30, O_DEDUP);
+	in_iov[0].iov_base = comp;
+	in_iov[0].iov_len = (size_t)len;
+	out_iov[0].iov_base = dec;
+	out_iov[0].iov_len = IOV_SIZE;
+	if (len <= 0 || lzjody_decompressv(in_iov, 1, out_iov, 1, O_DEDUP) >= 0)
+		fails += fail("iov", "decompressed more than INT_MAX bytes", O_DEDUP);
+	if (lzjody_compress_mt(in, comp, O_DEDUP, 0x90000000U, NULL) >= 0)
+		fails += fail("iov", "lzjody_compress_mt() took more than INT_MAX bytes", O_DEDUP);
+	if (len <= 0 || lzjody_decompress_mt(comp, dec, (unsigned int)len, 0xc0000000U, O_DEDUP, NULL) >= 0)
+		fails += fail("iov", "lzjody_decompress_mt() made more than INT_MAX bytes", O_DEDUP);
+
+	free(in); free(comp); free(flat); free(dec); free(big);
+	return fails;
+
+oom:
+	free(in); free(comp); free(flat); free(dec); free(big);
+	return fail("iov", "out of memory", 0);
+}
+
+
+/* 1 if any of the GUARD bytes at p were written */
+static int guard_hit(const unsigned char * const p)
+{
+	for (unsigned int i = 0; i < GUARD; i++) if (p[i] != GUARD_BYTE) return 1;
+	return 0;
+}
+
+
+/* lzjody_compress_bound() holds for incompressible data in every block
+ * size, and lzjody_decompress_safe() stays within its output capacity
+ * for short capacities and corrupted blocks */
+static int test_safe(void)
+{
+	static const unsigned int bsizes[] = {
+		O_BSIZE_4K, O_BSIZE_16K, O_BSIZE_64K, O_BSIZE_256K
+	};
+	static const unsigned int opts[] = {
+		0, O_CHECKSUM, O_ENTROPY, O_DEDUP | O_LZ_REPEAT | O_CHECKSUM
+	};
+	const unsigned int max_in = LZJODY_MAX_BSIZE * 3 + 5;
+	const unsigned int bad_size = LZJODY_MAX_BSIZE + 16;
+	unsigned char *in, *comp, *bad, *p, *dec;
+	uint64_t rng = TEST_SEED;
+	unsigned int bsize, options, bound, lens[4], cap;
+	int len, got, fails = 0;
+
+	in = (unsigned char *)malloc(max_in);
+	comp = (unsigned char *)malloc(lzjody_compress_bound(max_in, O_BSIZE_4K | O_CHECKSUM) + GUARD);
+	bad = (unsigned char *)malloc(bad_size);
+	dec = (unsigned char *)malloc(LZJODY_MAX_BSIZE + GUARD);
+	if (in == NULL || comp == NULL || bad == NULL || dec == NULL) goto oom;
+
+	for (unsigned int b = 0; b < sizeof(bsizes) / sizeof(bsizes[0]); b++) {
+		bsize = LZJODY_BSIZE_OF(bsizes[b]);
+		lens[0] = 1; lens[1] = bsize - 1; lens[2] = bsize; lens[3] = bsize * 3 + 5;
+
+		/* Random data: nothing to find, so every block is all literals */
+		for (unsigned int i = 0; i < max_in; i++) in[i] = (unsigned char)rng_next(&rng);
+		for (unsigned int o = 0; o < sizeof(opts) / sizeof(opts[0]); o++) {
+			options = bsizes[b] | opts[o];
+			for (unsigned int l = 0; l < 4; l++) {
+				bound = lzjody_compress_bound(lens[l], options);
+				memset(comp + bound, GUARD_BYTE, GUARD);
+				len = lzjody_compress(in, comp, options, lens[l]);
+				if (len < 0 || (unsigned int)len > bound || guard_hit(comp + bound))
+					fails += fail("safe", "incompressible data passed lzjody_compress_bound()", options);
+			}
+		}
+
+		/* One compressible block without its prefix for the decoder */
+		fill_data(in, bsize, &rng);
+		memset(in, 'x', bsize / 8);
+		for (unsigned int o = 0; o < sizeof(opts) / sizeof(opts[0]); o++) {
+			options = (bsizes[b] | opts[o] | O_NOPREFIX) & ~(O_CHECKSUM | O_DEDUP);
+			len = lzjody_compress(in, comp, options, bsize);
+			if (len <= 0) {
+				fails += fail("safe", "compression failed", options);
+				continue;
+			}
+			memset(dec, GUARD_BYTE, bsize + GUARD);
+			if (lzjody_decompress_safe(comp, (unsigned int)len, dec, bsize, options) != (int)bsize
+					|| memcmp(in, dec, bsize) != 0 || guard_hit(dec + bsize))
+				fails += fail("safe", "round trip mismatch", options);
+
+			/* Every capacity short of the block fails without writing past it */
+			for (cap = 0; cap < bsize; cap += (cap < 64) ? 1 : bsize / 61) {
+				memset(dec + cap, GUARD_BYTE, GUARD);
+				if (lzjody_decompress_safe(comp, (unsigned int)len, dec, cap, options) >= 0
+						|| guard_hit(dec + cap)) {
+					fails += fail("safe", "short output capacity overrun or accepted", options);
+					break;
+				}
+			}
+
+			/* Corrupted and truncated blocks may decode to garbage or fail,
+			 * but never past the input or the output capacity; the input
+			 * ends where its allocation does so sanitizers see overreads */
+			for (unsigned int k = 0; k < SAFE_CORRUPTIONS / 4; k++) {
+				unsigned int bad_len = (unsigned int)len;
+
+				if (k & 1) bad_len = 1 + (unsigned int)(rng_next(&rng) % (unsigned int)len);
+				p = bad + bad_size - bad_len;
+				memcpy(p, comp, bad_len);
+				for (unsigned int f = 1 + (unsigned int)(rng_next(&rng) % 3); f > 0; f--)
+					p[rng_next(&rng) % bad_len] ^= (unsigned char)(1 + rng_next(&rng) % 255);
+				cap = (k & 2) ? bsize : (unsigned int)(rng_next(&rng) % bsize);
+				memset(dec + cap, GUARD_BYTE, GUARD);
+				got = lzjody_decompress_safe(p, bad_len, dec, cap, options);
+				if (got > (int)cap || guard_hit(dec + cap)) {
+					fails += fail("safe", "corrupted block written past its capacity", options);
+					break;
+				}
+			}
+		}
+	}
+
+	free(in); free(comp); free(bad); free(dec);
+	return fails;
+
+oom:
+	free(in); free(comp); free(bad); free(dec);
+	return fail("safe", "out of memory", 0);
+}
+
+
+/* Every block lzjody_compress() writes decodes in place in a buffer of
+ * its size plus LZJODY_INPLACE_MARGIN(), and a buffer too small for a
+ * block's layout is refused without writing past it */
+static int test_inplace(void)
+{
+	static const unsigned int opts[] = {
+		O_BSIZE_4K,
+		O_BSIZE_4K | O_ENTROPY,
+		O_BSIZE_16K | O_LZ_REPEAT,
+		O_BSIZE_64K | O_ENTROPY,
+		O_BSIZE_256K | O_ENTROPY | O_LZ_REPEAT
+	};
+	const unsigned int max_margin = LZJODY_INPLACE_MARGIN(O_BSIZE_256K);
+	unsigned char *in, *comp, *buf;
+	uint64_t rng = TEST_SEED;
+	unsigned int bsize, prefix, in_len, size;
+	int len, fails = 0;
+
+	in = (unsigned char *)malloc(LZJODY_MAX_BSIZE);
+	comp = (unsigned char *)malloc(lzjody_compress_bound(LZJODY_MAX_BSIZE, O_BSIZE_256K));
+	buf = (unsigned char *)malloc(LZJODY_MAX_BSIZE + max_margin + GUARD);
+	if (in == NULL || comp == NULL || buf == NULL) goto oom;
+
+	for (unsigned int o = 0; o < sizeof(opts) / sizeof(opts[0]); o++) {
+		bsize = LZJODY_BSIZE_OF(opts[o]);
+		prefix = LZJODY_PREFIX_LEN(opts[o]);
+		for (unsigned int b = 0; b < INPLACE_BLOCKS; b++) {
+			switch (b % 3) {
+			case 0:
+				fill_data(in, bsize, &rng);
+				break;
+			case 1:
+				/* Fixed-size records, which byte planes suit */
+				for (unsigned int i = 0; i < bsize; i += 4) {
+					in[i] = (unsigned char)(i >> 2);
+					in[i + 1] = (unsigned char)(rng_next(&rng) & 0x0f);
+					in[i + 2] = 0x80;
+					in[i + 3] = 0xc9;
+				}
+				break;
+			default:
+				/* A run, then random bytes: the output is furthest ahead
+				 * of the input halfway through */
+				memset(in, 0, bsize / 2);
+				for (unsigned int i = bsize / 2; i < bsize; i++) in[i] = (unsigned char)rng_next(&rng);
+				break;
+			}
+
+			len = lzjody_compress(in, comp, opts[o], bsize);
+			if (len <= (int)prefix) {
+				fails += fail("inplace", "compression failed", opts[o]);
+				break;
+			}
+			in_len = (unsigned int)len - prefix;
+			size = bsize + LZJODY_INPLACE_MARGIN(opts[o]);
+			memcpy(buf + size - in_len, comp + prefix, in_len);
+			memset(buf + size, GUARD_BYTE, GUARD);
+			if (lzjody_decompress_inplace(buf, size, in_len, opts[o]) != (int)bsize
+					|| memcmp(in, buf, bsize) != 0 || guard_hit(buf + size)) {
+				fails += fail("inplace", "round trip mismatch with the margin", opts[o]);
+				break;
+			}
+
+			/* The run block needs more room than its decompressed size */
+			if (b % 3 == 2) {
+				size = bsize;
+				memcpy(buf + size - in_len, comp + prefix, in_len);
+				memset(buf + size, GUARD_BYTE, GUARD);
+				if (lzjody_decompress_inplace(buf, size, in_len, opts[o]) >= 0
+						|| guard_hit(buf + size)) {
+					fails += fail("inplace", "buffer without the margin accepted", opts[o]);
+					break;
+				}
+			}
+		}
+	}
+
+	free(in); free(comp); free(buf);
+	return fails;
+
+oom:
+	free(in); free(comp); free(buf);
+	return fail("inplace", "out of memory", 0);
+}
+
+
+/* Preset dictionary round trips: blocks copied from the dictionary must
+ * come out small, and every block must decode only with its dictionary */
+static int test_dict(void)
+{
+	static const unsigned int opts[] = {
+		O_BSIZE_4K,
+		O_BSIZE_4K | O_LZ_REPEAT | O_CHECKSUM,
+		O_BSIZE_16K | O_ENTROPY,
+		O_BSIZE_64K | O_LZ_REPEAT
+	};
+	struct lzjody_dict *dict = NULL, *other = NULL;
+	unsigned char *dict_data, *in, *comp, *dec;
+	uint64_t rng = TEST_SEED;
+	unsigned int bsize, prefix, length, ipos, opos, size;
+	int len, fails = 0;
+
+	dict_data = (unsigned char *)malloc(DICT_SIZE);
+	in = (unsigned char *)malloc(65536 * DICT_BLOCKS);
+	comp = (unsigned char *)malloc(lzjody_compress_bound(65536 * DICT_BLOCKS, O_BSIZE_4K | O_CHECKSUM));
+	dec = (unsigned char *)malloc(65536);
+	if (dict_data == NULL || in == NULL || comp == NULL || dec == NULL) goto oom;
+	/* Random data is only compressible through the dictionary */
+	for (unsigned int i = 0; i < DICT_SIZE; i++) dict_data[i] = (unsigned char)rng_next(&rng);
+	dict = lzjody_dict_create(dict_data, DICT_SIZE);
+	for (unsigned int i = 0; i < DICT_SIZE; i++) dict_data[i] ^= 0x55;
+	other = lzjody_dict_create(dict_data, DICT_SIZE);
+	for (unsigned int i = 0; i < DICT_SIZE; i++) dict_data[i] ^= 0x55;
+	if (dict == NULL || other == NULL) goto oom;
+
+	for (unsigned int i = 0; i < sizeof(opts) / sizeof(opts[0]); i++) {
+		bsize = LZJODY_BSIZE_OF(opts[i]);
+		prefix = LZJODY_PREFIX_LEN(opts[i]);
+		size = bsize * DICT_BLOCKS;
+		/* Blocks of new data, then blocks made of pieces of the dictionary;
+		 * 4 KiB blocks can only reach its last 4 KiB */
+		fill_data(in, size / 2, &rng);
+		for (unsigned int pos = size / 2; pos < size; pos += length) {
+			length = (bsize == 4096) ? 4000 : 64 + (unsigned int)(rng_next(&rng) % 2000);
+			if (length > size - pos) length = size - pos;
+			if (bsize == 4096) memcpy(in + pos, dict_data + DICT_SIZE - length, length);
+			else memcpy(in + pos, dict_data + rng_next(&rng) % (DICT_SIZE - length), length);
+		}
+
+		len = lzjody_compress_dict(in, comp, opts[i], size, dict);
+		if (len <= 0) {
+			fails += fail("dict", "compression failed", opts[i]);
+			continue;
+		}
+
+		/* Decode the blocks one by one as lzjody_decompress_dict() wants */
+		for (ipos = 0, opos = 0; ipos + prefix < (unsigned int)len && opos < size; opos += bsize) {
+			length = ((unsigned int)(comp[ipos] & 0x1f) << 8) | comp[ipos + 1];
+			if (prefix > 2) length = (length << 8) | comp[ipos + 2];
+			ipos += prefix;
+			if (lzjody_decompress_dict(comp + ipos, dec, length, opts[i], dict) != (int)bsize
+					|| memcmp(in + opos, dec, bsize) != 0) {
+				fails += fail("dict", "round trip mismatch", opts[i]);
+				break;
+			}
+			/* Blocks of dictionary pieces must have used the dictionary */
+			if (opos >= size / 2 + bsize) {
+				if (length > bsize / 4) {
+					fails += fail("dict", "dictionary data did not compress", opts[i]);
+					break;
+				}
+				if (lzjody_decompress_dict(comp + ipos, dec, length, opts[i], other) == (int)bsize
+						&& memcmp(in + opos, dec, bsize) == 0) {
+					fails += fail("dict", "block decoded with the wrong dictionary", opts[i]);
+					break;
+				}
+			}
+			ipos += length + ((opts[i] & O_CHECKSUM) ? LZJODY_CHECK_LEN : 0);
+		}
+		if (opos != size || ipos != (unsigned int)len)
+			fails += fail("dict", "wrong block layout", opts[i]);
+	}
+
+	lzjody_dict_free(dict); lzjody_dict_free(other);
+	free(dict_data); free(in); free(comp); free(dec);
+	return fails;
+
+oom:
+	fail("dict", "out of memory", 0);
+	lzjody_dict_free(dict); lzjody_dict_free(other);
+	free(dict_data); free(in); free(comp); free(dec);
+	return 1;
+}
+
+
+/* Decode a stream record by record as the utility does, checking each
+ * decoded size against the scan; ref is NULL for plain streams. Counts
+ * the records of each type in seen[] and returns the decoded length */
+static int64_t scan_decode(const unsigned char * const stream, const uint64_t len,
+		const struct lzjody_scan_t * const scan, unsigned char * const out,
+		const uint64_t cap, const unsigned char * const ref,
+		const uint64_t ref_size, unsigned int * const seen)
+{
+	const unsigned int options = scan->options;
+	const unsigned int bsize = LZJODY_BSIZE_OF(options);
+	const unsigned int prefix = LZJODY_PREFIX_LEN(options);
+	const unsigned int nslots = LZJODY_REPEAT_BLOCKS(options);
+	uint64_t ipos = scan->header_len, opos = 0, value = 0, rec = 0, ndata = 0;
+	uint64_t *ring_off = NULL;
+	int *ring_len = NULL;
+	unsigned int length, type, slot;
+	int got;
+
+	ring_off = (uint64_t *)malloc(nslots * sizeof(uint64_t));
+	ring_len = (int *)malloc(nslots * sizeof(int));
+	if (ring_off == NULL || ring_len == NULL) goto error;
+	while (ipos < len) {
+		type = stream[ipos] & O_RECORD_MASK;
+		length = ((unsigned int)(stream[ipos] & 0x1f) << 8) | stream[ipos + 1];
+		if (prefix > 2) length = (length << 8) | stream[ipos + 2];
+		ipos += prefix;
+		if (type == O_ZERORUN || type == O_REPEAT || type == O_REFBLOCK) {
+			value = 0;
+			for (unsigned int i = 0; i < length; i++) value = (value << 8) | stream[ipos + i];
+		}
+		if (rec >= scan->blocks || (type != O_ZERORUN && cap - opos < bsize)) goto error;
+		switch (type) {
+		case 0:
+			got = lzjody_decompress(stream + ipos, out + opos, length, options);
+			break;
+		case O_ZERORUN:
+			if (value > cap - opos) goto error;
+			memset(out + opos, 0, (size_t)value);
+			got = (int)value;
+			break;
+		case O_REPEAT:
+			if (value == 0 || value > ndata || value > nslots) goto error;
+			slot = (unsigned int)((ndata - value) % nslots);
+			memcpy(out + opos, out + ring_off[slot], (size_t)ring_len[slot]);
+			got = ring_len[slot];
+			break;
+		case O_REFBLOCK:
+			if (ref == NULL || value >= ref_size / bsize) goto error;
+			memcpy(out + opos, ref + value * bsize, bsize);
+			got = (int)bsize;
+			break;
+		case O_REFWINDOW:
+			if (ref == NULL) goto error;
+			got = lzjody_decompress_ref(stream + ipos, out + opos, length, options, opos, ref, ref_size);
+			break;
+		default:
+			goto error;
+		}
+		if (got < 0 || (uint64_t)got != scan->sizes[rec]) goto error;
+		seen[type >> 5]++;
+		if (type != O_ZERORUN) {
+			ring_off[ndata % nslots] = opos;
+			ring_len[ndata % nslots] = got;
+			ndata++;
+		}
+		opos += (uint64_t)got;
+		ipos += length + ((options & O_CHECKSUM) && type != O_ZERORUN ? LZJODY_CHECK_LEN : 0);
+		rec++;
+	}
+	if (rec != scan->blocks) goto error;
+	free(ring_off); free(ring_len);
+	return (int64_t)opos;
+
+error:
+	free(ring_off); free(ring_len);
+	return -1;
+}
+
+
+/* Scanned record sizes must match what every record decodes to, for
+ * plain streams and for delta streams against a reference */
+static int test_scan(void)
+{
+	static const unsigned int opts[] = {
+		O_DEDUP | O_CHECKSUM,
+		O_DEDUP | O_LZ_REPEAT | O_BSIZE_16K,
+		O_DEDUP | O_CHECKSUM | O_ENTROPY | O_BSIZE_64K,
+		O_DEDUP | O_CHECKSUM | O_REFERENCE,
+		O_DEDUP | O_LZ_REPEAT | O_REFERENCE | O_BSIZE_16K
+	};
+	struct lzjody_scan_t scan;
+	struct lzjody_ref *ref = NULL;
+	unsigned char *ref_data, *in, *stream, *dec;
+	unsigned int seen[8], hdr;
+	uint64_t rng = TEST_SEED;
+	size_t pos, len;
+	int comp, fails = 0;
+
+	ref_data = (unsigned char *)malloc(SCAN_SIZE);
+	in = (unsigned char *)malloc(SCAN_SIZE);
+	stream = (unsigned char *)malloc(LZJODY_HEADER_LEN + lzjody_compress_bound(SCAN_SIZE, O_BSIZE_4K | O_CHECKSUM));
+	dec = (unsigned char *)malloc(SCAN_SIZE);
+	if (ref_data == NULL || in == NULL || stream == NULL || dec == NULL) goto oom;
+	fill_data(ref_data, SCAN_SIZE, &rng);
+	/* The new image keeps, shifts or patches pieces of the reference so
+	 * both reference block and reference window records are written */
+	for (pos = 0; pos < SCAN_SIZE; pos += len) {
+		len = CLUSTER * (1 + rng_next(&rng) % 8);
+		if (len > SCAN_SIZE - pos) len = SCAN_SIZE - pos;
+		switch (rng_next(&rng) % 3) {
+		case 0:
+			memcpy(in + pos, ref_data + pos, len);
+			break;
+		case 1:
+			memcpy(in + pos, ref_data + pos + ((pos + len + 37 <= SCAN_SIZE) ? 37 : 0), len);
+			break;
+		default:
+			memcpy(in + pos, ref_data + pos, len);
+			for (unsigned int i = 0; i < 16; i++) in[pos + rng_next(&rng) % len] ^= 0x5a;
+			break;
+		}
+	}
+
+	for (unsigned int i = 0; i < sizeof(opts) / sizeof(opts[0]); i++) {
+		hdr = (unsigned int)lzjody_write_header(stream, opts[i]);
+		if (opts[i] & O_REFERENCE) {
+			ref = lzjody_ref_create(ref_data, SCAN_SIZE, opts[i]);
+			if (ref == NULL) goto oom;
+			comp = lzjody_compress_ref(in, stream + hdr, opts[i], SCAN_SIZE, 0, ref);
+			lzjody_ref_free(ref);
+			ref = NULL;
+		} else comp = lzjody_compress(in, stream + hdr, opts[i], SCAN_SIZE);
+		if (hdr != LZJODY_HEADER_LEN || comp <= 0) {
+			fails += fail("scan", "compression failed", opts[i]);
+			continue;
+		}
+
+		if (lzjody_scan(stream, hdr + (uint64_t)comp, &scan) != 0) {
+			fails += fail("scan", "scan failed", opts[i]);
+			continue;
+		}
+		if (scan.total != SCAN_SIZE || scan.options != (opts[i] & O_FORMAT_MASK))
+			fails += fail("scan", "wrong stream total or options", opts[i]);
+		memset(seen, 0, sizeof(seen));
+		memset(dec, 0xa5, SCAN_SIZE);
+		if (scan_decode(stream, hdr + (uint64_t)comp, &scan, dec, SCAN_SIZE,
+					(opts[i] & O_REFERENCE) ? ref_data : NULL, SCAN_SIZE, seen) != SCAN_SIZE
+				|| memcmp(in, dec, SCAN_SIZE) != 0)
+			fails += fail("scan", "record sizes don't match the decoded data", opts[i]);
+		if ((opts[i] & O_REFERENCE) && (seen[O_REFBLOCK >> 5] == 0 || seen[O_REFWINDOW >> 5] == 0))
+			fails += fail("scan", "reference records were not exercised", opts[i]);
+		free(scan.sizes);
+
+		/* A stream cut inside a record is refused */
+		if (lzjody_scan(stream, hdr + (uint64_t)comp - 1, &scan) == 0) {
+			fails += fail("scan", "truncated stream accepted", opts[i]);
+			free(scan.sizes);
+		}
+	}
+
+	free(ref_data); free(in); free(stream); free(dec);
+	return fails;
+
+oom:
+	free(ref_data); free(in); free(stream); free(dec);
+	return fail("scan", "out of memory", 0);
+}
+
+
+static const struct {
+	const char *name;
+	int (*run)(void);
+} tests[] = {
+	{ "mt", test_mt },
+	{ "batch", test_batch },
+	{ "iov", test_iov },
+	{ "safe", test_safe },
+	{ "inplace", test_inplace },
+	{ "dict", test_dict },
+	{ "scan", test_scan }
+};
+#define TESTS (sizeof(tests) / sizeof(tests[0]))
+
+
+int main(int argc, char **argv)
+{
+	int fails = 0, found;
+
+	for (int i = 1; i < argc; i++) {
+		found = 0;
+		for (unsigned int t = 0; t < TESTS; t++) if (!strcmp(argv[i], tests[t].name)) found = 1;
+		if (!found) goto usage;
+	}
+
+	for (unsigned int t = 0; t < TESTS; t++) {
+		int err;
+
+		found = (argc < 2);
+		for (int i = 1; i < argc; i++) if (!strcmp(argv[i], tests[t].name)) found = 1;
+		if (!found) continue;
+		err = tests[t].run();
+		printf("%s: %s\n", tests[t].name, err ? "FAILED" : "ok");
+		fails += err;
+	}
+	return fails ? EXIT_FAILURE : EXIT_SUCCESS;
+
+usage:
+	fprintf(stderr, "usage: lzjody-apitest [test ...]\ntests:");
+	for (unsigned int t = 0; t < TESTS; t++) fprintf(stderr, " %s", tests[t].name);
+	fprintf(stderr, "\n");
+	return EXIT_FAILURE;
+}
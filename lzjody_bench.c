@@ -0,0 +1,610 @@
+/*
+ * lzjody benchmark harness
+ *
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * Released under The MIT License
+ *
+ * Times lzjody_compress() and lzjody_decompress() on files held in memory,
+ * so no I/O or process startup is measured. Files are cut into chunks the
+ * size the utility hands to lzjody_compress(); every chunk's records are
+ * decoded the way the utility decodes them. Each file and option set gets
+ * untimed warmup runs, then timed runs whose median and 99th percentile
+ * are reported along with MB/s and the compression ratio. The first
+ * decompression of every file is checked against the original.
+ *
+ * Synthetic files that look like parts of a disk image (zero runs, text,
+ * repeated clusters, counter tables and random data) are generated from a
+ * fixed seed, so results can be compared between builds and machines.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "lzjody.h"
+
+/* Input per lzjody_compress() call (the utility's UTIL_BSIZE) */
+#define BENCH_CHUNK 1048576
+#define BENCH_REPS 10
+#define BENCH_WARMUP 2
+#define BENCH_SYNTH_MIB 4
+#define BENCH_SETS "default,fast,entropy,64k"
+/* Synthetic data is laid out in filesystem clusters */
+#define CLUSTER 4096
+#define SYNTH_SEED 0x6c7a6a6f647962ULL
+
+struct bench_file {
+	char *name;
+	unsigned char *data;
+	size_t size;
+};
+
+struct bench_set {
+	const char *name;
+	unsigned int options;
+};
+
+static const struct bench_set presets[] = {
+	{ "default", O_DEDUP | O_LZ_REPEAT },
+	{ "fast", O_DEDUP | O_LZ_REPEAT | O_FAST_LZ },
+	{ "entropy", O_DEDUP | O_LZ_REPEAT | O_ENTROPY },
+	{ "checksum", O_DEDUP | O_LZ_REPEAT | O_CHECKSUM },
+	{ "16k", O_DEDUP | O_LZ_REPEAT | O_BSIZE_16K },
+	{ "64k", O_DEDUP | O_LZ_REPEAT | O_BSIZE_64K },
+	{ "256k", O_DEDUP | O_LZ_REPEAT | O_BSIZE_256K },
+	{ "nodedup", O_LZ_REPEAT },
+	{ NULL, 0 }
+};
+
+/* Files benchmarked along with the synthetic ones if none are named */
+static const char * const default_files[] = {
+	"testdata/standard", "testdata/cantcompress", "testdata/seq32", "testdata/seq8_256", NULL
+};
+
+/* Synthetic region types and how often each file type uses them */
+enum { R_ZERO, R_TEXT, R_REPEAT, R_SEQ, R_RANDOM, R_TYPES };
+
+static const struct {
+	const char *name;
+	unsigned int weight[R_TYPES];
+} synth[] = {
+	{ "synth-image", { 30, 25, 15, 10, 20 } },
+	{ "synth-zeroes", { 90, 10, 0, 0, 0 } },
+	{ "synth-repeats", { 0, 0, 80, 0, 20 } },
+	{ "synth-seq", { 0, 0, 0, 100, 0 } },
+	{ "synth-random", { 0, 0, 0, 0, 100 } }
+};
+#define SYNTH_FILES (sizeof(synth) / sizeof(synth[0]))
+
+static const char * const words[] = {
+	"the", "of", "and", "file", "system", "block", "data", "to", "in", "is",
+	"for", "on", "with", "root", "usr", "lib", "error", "config", "value", "true",
+	"false", "return", "int", "char", "static", "const", "struct", "if", "else",
+	"#include", "=", "0x0000", "/dev/sda1", "ext4", "defaults", "kernel"
+};
+#define WORDS (sizeof(words) / sizeof(words[0]))
+
+
+/* Monotonic clock in nanoseconds */
+static uint64_t bench_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000U + (uint64_t)ts.tv_nsec;
+}
+
+
+/* xorshift64* generator: same data on every machine */
+static uint64_t rng_next(uint64_t * const state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545f4914f6cdd1dULL;
+}
+
+
+/* Fill 'size' bytes (a multiple of CLUSTER) with one synthetic file type */
+static void synth_fill(unsigned char * const buf, const size_t size,
+		const unsigned int * const weight, uint64_t * const rng)
+{
+	unsigned int total = 0, pick, type, width, step;
+	size_t pos = 0, len, src;
+	uint32_t v;
+
+	for (type = 0; type < R_TYPES; type++) total += weight[type];
+	while (pos < size) {
+		pick = (unsigned int)(rng_next(rng) % total);
+		for (type = 0; pick >= weight[type]; type++) pick -= weight[type];
+		/* Repeats need something to repeat */
+		if (type == R_REPEAT && pos < CLUSTER) type = R_RANDOM;
+		len = CLUSTER * (1 + rng_next(rng) % ((type == R_ZERO) ? 64 : 8));
+		if (len > size - pos) len = size - pos;
+
+		switch (type) {
+		case R_ZERO:
+			memset(buf + pos, 0, len);
+			break;
+		case R_TEXT:
+			for (size_t i = 0; i < len; ) {
+				const char *w = words[rng_next(rng) % WORDS];
+
+				while (*w != '\0' && i < len) buf[pos + i++] = (unsigned char)*w++;
+				if (i < len) buf[pos + i++] = (rng_next(rng) % 10) ? ' ' : '\n';
+			}
+			break;
+		case R_REPEAT:
+			/* Copy whole clusters from the last megabyte or so */
+			src = (pos > BENCH_CHUNK) ? pos - BENCH_CHUNK : 0;
+			src += (size_t)(rng_next(rng) % (pos - src));
+			src -= src % CLUSTER;
+			if (src + len > pos) len = pos - src;
+			memmove(buf + pos, buf + src, len);
+			break;
+		case R_SEQ:
+			/* Counter tables: 8, 16 or 32-bit values with a small step */
+			width = 1U << (rng_next(rng) % 3);
+			step = 1 + (unsigned int)(rng_next(rng) % 4);
+			v = (uint32_t)rng_next(rng);
+			for (size_t i = 0; i + width <= len; i += width, v += step)
+				for (unsigned int b = 0; b < width; b++) buf[pos + i + b] = (unsigned char)(v >> (b * 8));
+			break;
+		case R_RANDOM:
+		default:
+			for (size_t i = 0; i < len; i++) buf[pos + i] = (unsigned char)rng_next(rng);
+			break;
+		}
+		pos += len;
+	}
+	return;
+}
+
+
+/* Add a file to the benchmark list; takes over name and data */
+static int add_file(struct bench_file ** const files, int * const nfiles,
+		char * const name, unsigned char * const data, const size_t size)
+{
+	struct bench_file *f;
+
+	f = (struct bench_file *)realloc(*files, sizeof(struct bench_file) * (size_t)(*nfiles + 1));
+	if (f == NULL) return -1;
+	*files = f;
+	f += *nfiles;
+	f->name = name;
+	f->data = data;
+	f->size = size;
+	(*nfiles)++;
+	return 0;
+}
+
+
+/* Read one file into memory */
+static int load_file(struct bench_file ** const files, int * const nfiles,
+		const char * const name, const off_t length)
+{
+	FILE *fp;
+	unsigned char *data;
+	char *copy;
+	size_t got;
+
+	if (length <= 0) return 0;
+	data = (unsigned char *)malloc((size_t)length);
+	copy = (char *)malloc(strlen(name) + 1);
+	if (data == NULL || copy == NULL) goto oom;
+	strcpy(copy, name);
+	fp = fopen(name, "rb");
+	if (fp == NULL) goto error_open;
+	got = fread(data, 1, (size_t)length, fp);
+	fclose(fp);
+	if (got != (size_t)length) goto error_read;
+	if (add_file(files, nfiles, copy, data, (size_t)length) != 0) goto oom;
+	return 0;
+
+error_open:
+	fprintf(stderr, "lzjody-bench: error: cannot open '%s': %s\n", name, strerror(errno));
+	free(data); free(copy);
+	return -2;
+error_read:
+	fprintf(stderr, "lzjody-bench: error: cannot read '%s'\n", name);
+	free(data); free(copy);
+	return -2;
+oom:
+	free(data); free(copy);
+	return -1;
+}
+
+
+/* Load a file, or every regular file below a directory */
+static int load_files(struct bench_file ** const files, int * const nfiles,
+		const char * const name)
+{
+	struct stat st;
+	DIR *dir;
+	struct dirent *de;
+	char *path;
+	int err = 0;
+
+	if (stat(name, &st) != 0) goto error_stat;
+	if (S_ISREG(st.st_mode)) return load_file(files, nfiles, name, st.st_size);
+	if (!S_ISDIR(st.st_mode)) return 0;
+
+	dir = opendir(name);
+	if (dir == NULL) goto error_stat;
+	while (err == 0 && (de = readdir(dir)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+		path = (char *)malloc(strlen(name) + strlen(de->d_name) + 2);
+		if (path == NULL) {
+			err = -1;
+			break;
+		}
+		sprintf(path, "%s/%s", name, de->d_name);
+		err = load_files(files, nfiles, path);
+		free(path);
+	}
+	closedir(dir);
+	return err;
+
+error_stat:
+	fprintf(stderr, "lzjody-bench: error: cannot read '%s': %s\n", name, strerror(errno));
+	return -2;
+}
+
+
+/* Compress a file chunk by chunk; chunk_len[] gets each chunk's output size */
+static int compress_file(const struct bench_file * const f, unsigned char * const out,
+		unsigned int * const chunk_len, const unsigned int options)
+{
+	unsigned int length;
+	size_t opos = 0;
+	int c = 0, err;
+
+	for (size_t pos = 0; pos < f->size; pos += length, c++) {
+		length = (f->size - pos < BENCH_CHUNK) ? (unsigned int)(f->size - pos) : BENCH_CHUNK;
+		err = lzjody_compress(f->data + pos, out + opos, options, length);
+		if (err < 0) return err;
+		chunk_len[c] = (unsigned int)err;
+		opos += (size_t)err;
+	}
+	return 0;
+}
+
+
+/* Decode the records of one compressed chunk; returns the decoded size
+ * Repeat records refer to earlier blocks of the same chunk */
+static int decompress_chunk(const unsigned char * const in, const unsigned int in_len,
+		unsigned char * const out, const unsigned int options,
+		unsigned int * const blk_off, unsigned int * const blk_len)
+{
+	const unsigned int prefix = LZJODY_PREFIX_LEN(options);
+	const unsigned int bsize = LZJODY_BSIZE_OF(options);
+	const unsigned char *rec;
+	unsigned int ipos = 0, opos = 0, nblk = 0, type, length, check;
+	uint64_t value = 0;
+	int err;
+
+	while (ipos + prefix <= in_len) {
+		rec = in + ipos;
+		type = *rec & O_RECORD_MASK;
+		length = ((unsigned int)(*rec & 0x1f) << 8) | *(rec + 1);
+		if (prefix > 2) length = (length << 8) | *(rec + 2);
+		check = ((options & O_CHECKSUM) && type != O_ZERORUN) ? LZJODY_CHECK_LEN : 0;
+		if (ipos + prefix + length + check > in_len) return -1;
+		rec += prefix;
+		if (type == O_ZERORUN || type == O_REPEAT) {
+			if (length < 1 || length > 8) return -1;
+			value = 0;
+			for (unsigned int i = 0; i < length; i++) value = (value << 8) | rec[i];
+		}
+		switch (type) {
+		case 0:
+			err = lzjody_decompress(rec, out + opos, length, options);
+			if (err < 0 || (unsigned int)err > bsize) return -1;
+			break;
+		case O_ZERORUN:
+			if (value > BENCH_CHUNK - opos) return -1;
+			memset(out + opos, 0, (size_t)value);
+			opos += (unsigned int)value;
+			ipos += prefix + length;
+			continue;
+		case O_REPEAT:
+			if (value == 0 || value > nblk) return -1;
+			err = (int)blk_len[nblk - value];
+			memcpy(out + opos, out + blk_off[nblk - value], (size_t)err);
+			break;
+		default:
+			return -1;
+		}
+		if (check != 0) {
+			rec += length;
+			if (lzjody_crc32c(out + opos, (size_t)err) != (((uint32_t)rec[0] << 24)
+					| ((uint32_t)rec[1] << 16) | ((uint32_t)rec[2] << 8) | rec[3]))
+				return -1;
+		}
+		if (nblk == BENCH_CHUNK / LZJODY_BSIZE) return -1;
+		blk_off[nblk] = opos;
+		blk_len[nblk] = (unsigned int)err;
+		nblk++;
+		opos += (unsigned int)err;
+		ipos += prefix + length + check;
+	}
+	return (int)opos;
+}
+
+
+static int decompress_file(const unsigned char * const in, const unsigned int * const chunk_len,
+		const int nchunks, unsigned char * const out, const unsigned int options,
+		unsigned int * const blk_off, unsigned int * const blk_len)
+{
+	size_t ipos = 0, opos = 0;
+	int err;
+
+	for (int c = 0; c < nchunks; c++) {
+		err = decompress_chunk(in + ipos, chunk_len[c], out + opos, options, blk_off, blk_len);
+		if (err < 0) return err;
+		ipos += chunk_len[c];
+		opos += (size_t)err;
+	}
+	return 0;
+}
+
+
+static int cmp_u64(const void *a, const void *b)
+{
+	const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+
+/* Median and 99th percentile (nearest rank) of n samples, which get sorted */
+static void percentiles(uint64_t * const t, const int n, uint64_t * const med, uint64_t * const p99)
+{
+	qsort(t, (size_t)n, sizeof(uint64_t), cmp_u64);
+	*med = (t[(n - 1) / 2] + t[n / 2]) / 2;
+	*p99 = t[(n * 99 + 99) / 100 - 1];
+	return;
+}
+
+
+/* Megabytes per second, or 0 for no time */
+static double mb_s(const uint64_t bytes, const uint64_t ns)
+{
+	if (ns == 0) return 0;
+	return ((double)bytes * 1000.0) / (double)ns;
+}
+
+
+/* Parse a comma-separated list of option set names or numeric masks */
+static int parse_sets(const char * const list, struct bench_set ** const sets, int * const nsets)
+{
+	const char *p = list, *end;
+	char name[32];
+	size_t len;
+	int i;
+
+	while (*p != '\0') {
+		end = strchr(p, ',');
+		if (end == NULL) end = p + strlen(p);
+		len = (size_t)(end - p);
+		if (len == 0 || len >= sizeof(name)) return -2;
+		memcpy(name, p, len);
+		name[len] = '\0';
+		if (!strcmp(name, "all")) {
+			for (i = 0; presets[i].name != NULL; i++)
+				if (parse_sets(presets[i].name, sets, nsets) != 0) return -1;
+		} else {
+			struct bench_set *s = (struct bench_set *)realloc(*sets, sizeof(struct bench_set) * (size_t)(*nsets + 1));
+			char *num_end;
+
+			if (s == NULL) return -1;
+			*sets = s;
+			s += *nsets;
+			for (i = 0; presets[i].name != NULL && strcmp(presets[i].name, name); i++);
+			if (presets[i].name != NULL) *s = presets[i];
+			else {
+				s->options = (unsigned int)strtoul(name, &num_end, 0);
+				if (*num_end != '\0') return -2;
+				/* Streams can't be walked without block prefixes */
+				if (s->options & (O_NOPREFIX | O_REFERENCE)) return -2;
+				s->name = NULL;
+			}
+			(*nsets)++;
+		}
+		p = (*end == ',') ? end + 1 : end;
+	}
+	return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+	struct bench_file *files = NULL;
+	struct bench_set *sets = NULL;
+	const char *gen_dir = NULL;
+	const char *set_list = BENCH_SETS;
+	unsigned char *packed = NULL, *out = NULL;
+	unsigned int *chunk_len = NULL, *blk_off = NULL, *blk_len = NULL;
+	uint64_t *ct = NULL, *dt = NULL;
+	uint64_t rng = SYNTH_SEED, start, c_med, c_p99, d_med, d_p99, packed_size;
+	uint64_t *tot_in = NULL, *tot_out = NULL, *tot_c = NULL, *tot_d = NULL;
+	size_t max_size = 0, synth_size;
+	int synth_mib = BENCH_SYNTH_MIB, reps = BENCH_REPS, warmup = BENCH_WARMUP, use_synth = 1;
+	int i, s, r, err = 0, nfiles = 0, nsets = 0, nchunks, nnames = 0;
+	const char **names = NULL;
+	char label[24];
+
+	names = (const char **)malloc(sizeof(char *) * (size_t)argc);
+	if (names == NULL) goto oom;
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-r") && (i + 1) < argc) reps = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-w") && (i + 1) < argc) warmup = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-o") && (i + 1) < argc) set_list = argv[++i];
+		else if (!strcmp(argv[i], "-s") && (i + 1) < argc) synth_mib = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-g") && (i + 1) < argc) gen_dir = argv[++i];
+		else if (!strcmp(argv[i], "-n")) use_synth = 0;
+		else if (!strcmp(argv[i], "-h")) goto usage;
+		else names[nnames++] = argv[i];
+	}
+	if (reps < 1 || warmup < 0 || synth_mib < 1) goto usage;
+	synth_size = (size_t)synth_mib << 20;
+	err = parse_sets(set_list, &sets, &nsets);
+	if (err == -1) goto oom;
+	if (err < 0 || nsets == 0) goto usage;
+
+	/* Synthetic files come first so their rows line up between runs */
+	if (use_synth || gen_dir != NULL) for (unsigned int k = 0; k < SYNTH_FILES; k++) {
+		unsigned char *data = (unsigned char *)malloc(synth_size);
+		char *name = (char *)malloc(strlen(synth[k].name) + 1);
+
+		if (data == NULL || name == NULL || add_file(&files, &nfiles, name, data, synth_size) != 0) {
+			free(data); free(name);
+			goto oom;
+		}
+		strcpy(name, synth[k].name);
+		synth_fill(data, synth_size, synth[k].weight, &rng);
+	}
+	if (gen_dir != NULL) {
+		for (i = 0; i < nfiles; i++) {
+			char *path = (char *)malloc(strlen(gen_dir) + strlen(files[i].name) + 2);
+			FILE *fp;
+
+			if (path == NULL) goto oom;
+			sprintf(path, "%s/%s", gen_dir, files[i].name);
+			fp = fopen(path, "wb");
+			if (fp == NULL || fwrite(files[i].data, 1, files[i].size, fp) != files[i].size
+					|| fclose(fp) != 0) {
+				fprintf(stderr, "lzjody-bench: error: cannot write '%s': %s\n", path, strerror(errno));
+				free(path);
+				err = -2;
+				goto cleanup;
+			}
+			free(path);
+		}
+		goto cleanup;
+	}
+
+	if (nnames == 0) {
+		struct stat st;
+
+		for (i = 0; default_files[i] != NULL; i++)
+			if (stat(default_files[i], &st) == 0) names[nnames++] = default_files[i];
+	}
+	for (i = 0; i < nnames; i++) {
+		err = load_files(&files, &nfiles, names[i]);
+		if (err == -1) goto oom;
+		if (err < 0) goto cleanup;
+	}
+	if (nfiles == 0) goto usage;
+
+	for (i = 0; i < nfiles; i++) if (files[i].size > max_size) max_size = files[i].size;
+	nchunks = (int)((max_size + BENCH_CHUNK - 1) / BENCH_CHUNK);
+	packed = (unsigned char *)malloc((size_t)nchunks * lzjody_compress_bound(BENCH_CHUNK, O_DEDUP | O_BSIZE_4K | O_CHECKSUM));
+	out = (unsigned char *)malloc(max_size);
+	chunk_len = (unsigned int *)malloc(sizeof(unsigned int) * (size_t)nchunks);
+	blk_off = (unsigned int *)malloc(sizeof(unsigned int) * (BENCH_CHUNK / LZJODY_BSIZE));
+	blk_len = (unsigned int *)malloc(sizeof(unsigned int) * (BENCH_CHUNK / LZJODY_BSIZE));
+	ct = (uint64_t *)malloc(sizeof(uint64_t) * (size_t)reps);
+	dt = (uint64_t *)malloc(sizeof(uint64_t) * (size_t)reps);
+	tot_in = (uint64_t *)calloc((size_t)nsets, sizeof(uint64_t));
+	tot_out = (uint64_t *)calloc((size_t)nsets, sizeof(uint64_t));
+	tot_c = (uint64_t *)calloc((size_t)nsets, sizeof(uint64_t));
+	tot_d = (uint64_t *)calloc((size_t)nsets, sizeof(uint64_t));
+	if (packed == NULL || out == NULL || chunk_len == NULL || blk_off == NULL || blk_len == NULL
+			|| ct == NULL || dt == NULL || tot_in == NULL || tot_out == NULL
+			|| tot_c == NULL || tot_d == NULL) goto oom;
+
+	printf("lzjody-bench: %d warmup + %d timed runs, %d KiB chunks\n", warmup, reps, BENCH_CHUNK >> 10);
+	printf("%-20s %-9s %10s %7s  %9s %9s %9s  %9s %9s %9s\n", "file", "options", "bytes", "ratio",
+			"comp MB/s", "median ms", "p99 ms", "dec MB/s", "median ms", "p99 ms");
+	for (s = 0; s < nsets; s++) {
+		const unsigned int options = sets[s].options;
+
+		if (sets[s].name != NULL) snprintf(label, sizeof(label), "%s", sets[s].name);
+		else snprintf(label, sizeof(label), "0x%x", options);
+		for (i = 0; i < nfiles; i++) {
+			const struct bench_file * const f = files + i;
+
+			nchunks = (int)((f->size + BENCH_CHUNK - 1) / BENCH_CHUNK);
+			for (r = -warmup; r < reps; r++) {
+				start = bench_clock();
+				if (compress_file(f, packed, chunk_len, options) != 0) goto error_compress;
+				if (r >= 0) ct[r] = bench_clock() - start;
+			}
+			packed_size = 0;
+			for (int c = 0; c < nchunks; c++) packed_size += chunk_len[c];
+			for (r = -warmup; r < reps; r++) {
+				if (r == -warmup) memset(out, 0x55, f->size);
+				start = bench_clock();
+				if (decompress_file(packed, chunk_len, nchunks, out, options, blk_off, blk_len) != 0)
+					goto error_decompress;
+				if (r >= 0) dt[r] = bench_clock() - start;
+				if (r == -warmup && memcmp(out, f->data, f->size) != 0) goto error_verify;
+			}
+			percentiles(ct, reps, &c_med, &c_p99);
+			percentiles(dt, reps, &d_med, &d_p99);
+			printf("%-20.20s %-9s %10zu %6.2f%%  %9.1f %9.3f %9.3f  %9.1f %9.3f %9.3f\n",
+					f->name, label, f->size, (double)packed_size * 100.0 / (double)f->size,
+					mb_s(f->size, c_med), (double)c_med / 1e6, (double)c_p99 / 1e6,
+					mb_s(f->size, d_med), (double)d_med / 1e6, (double)d_p99 / 1e6);
+			tot_in[s] += f->size;
+			tot_out[s] += packed_size;
+			tot_c[s] += c_med;
+			tot_d[s] += d_med;
+		}
+	}
+	/* Totals add up the medians of every file */
+	for (s = 0; s < nsets; s++) {
+		if (sets[s].name != NULL) snprintf(label, sizeof(label), "%s", sets[s].name);
+		else snprintf(label, sizeof(label), "0x%x", sets[s].options);
+		printf("%-20s %-9s %10" PRIu64 " %6.2f%%  %9.1f %9.3f %9s  %9.1f %9.3f %9s\n",
+				"total", label, tot_in[s], (double)tot_out[s] * 100.0 / (double)tot_in[s],
+				mb_s(tot_in[s], tot_c[s]), (double)tot_c[s] / 1e6, "",
+				mb_s(tot_in[s], tot_d[s]), (double)tot_d[s] / 1e6, "");
+	}
+	goto cleanup;
+
+error_compress:
+	fprintf(stderr, "lzjody-bench: error: cannot compress '%s' (%s)\n", files[i].name, label);
+	err = -2;
+	goto cleanup;
+error_decompress:
+	fprintf(stderr, "lzjody-bench: error: cannot decompress '%s' (%s)\n", files[i].name, label);
+	err = -2;
+	goto cleanup;
+error_verify:
+	fprintf(stderr, "lzjody-bench: error: '%s' (%s) did not round trip\n", files[i].name, label);
+	err = -2;
+	goto cleanup;
+oom:
+	fprintf(stderr, "lzjody-bench: error: out of memory\n");
+	err = -1;
+cleanup:
+	for (i = 0; i < nfiles; i++) {
+		free(files[i].name);
+		free(files[i].data);
+	}
+	free(files); free(sets); free(names);
+	free(packed); free(out); free(chunk_len); free(blk_off); free(blk_len);
+	free(ct); free(dt); free(tot_in); free(tot_out); free(tot_c); free(tot_d);
+	exit(err < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+
+usage:
+	fprintf(stderr, "usage: lzjody-bench [-r reps] [-w warmup] [-o set[,set...]] [-s MiB] [-n] [-g dir] [file...]\n");
+	fprintf(stderr, " file  a file, or a directory searched for files (default: testdata samples)\n");
+	fprintf(stderr, " -r  timed runs per file and option set (default %d)\n", BENCH_REPS);
+	fprintf(stderr, " -w  untimed warmup runs (default %d)\n", BENCH_WARMUP);
+	fprintf(stderr, " -o  option sets: default, fast, entropy, checksum, 16k, 64k, 256k, nodedup,\n");
+	fprintf(stderr, "     all, or a numeric compressor option mask (default %s)\n", BENCH_SETS);
+	fprintf(stderr, " -s  size of each synthetic disk-image-like file in MiB (default %d)\n", BENCH_SYNTH_MIB);
+	fprintf(stderr, " -n  don't benchmark the synthetic files\n");
+	fprintf(stderr, " -g  write the synthetic files to dir and exit\n");
+	free(files); free(sets); free(names);
+	exit(EXIT_FAILURE);
+}
@@ -0,0 +1,623 @@
+/*
+ * Lempel-Ziv-JodyBruchon compression library
+ *
+ * Asynchronous I/O engine for the lzjody utility
+ *
+ * Input is read ahead into a small pool of chunks and compressed output
+ * is written behind the compressor, so neither the main loop nor the
+ * worker threads wait on the device. Linux io_uring is used when it is
+ * available; otherwise POSIX reader/writer threads do the blocking calls
+ * (THREADED builds) or everything falls back to plain synchronous I/O.
+ *
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * Released under The MIT License
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "likely_unlikely.h"
+#include "lzjody.h"
+#include "lzjody_util.h"
+#include "lzjody_io.h"
+
+/* io_uring is used through raw system calls so liburing is not needed */
+#if defined __linux__ && !defined NO_IO_URING && defined __has_include
+ #if __has_include(<linux/io_uring.h>)
+  #include <linux/io_uring.h>
+  #include <sys/mman.h>
+  #include <sys/syscall.h>
+  /* FAST_POLL arrived with the kernel that has IORING_OP_READ/WRITE */
+  #if defined __NR_io_uring_setup && defined IORING_FEAT_FAST_POLL
+   #define HAVE_IO_URING 1
+  #endif
+ #endif
+#endif
+
+#ifdef THREADED
+ #include <pthread.h>
+static pthread_mutex_t io_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t reader_id, writer_id;
+#endif
+
+/* Chunk slot states */
+#define S_FREE 0	/* Available for a read */
+#define S_PENDING 1	/* Read in flight */
+#define S_READY 2	/* Filled, waiting for io_get_chunk() */
+#define S_HELD 3	/* Handed to the compressor */
+
+static struct io_chunk *slots;
+static int *slot_seq;	/* Input sequence number of each slot */
+static int nslots;
+static int next_get, next_fill;	/* Chunk sequence counters */
+static int read_mode, write_mode;
+static int read_done;	/* No more chunks will be filled */
+static int io_error;
+
+/* Queued writes for the writer thread and io_uring */
+struct io_wreq {
+	struct io_wreq *next;
+	unsigned char *data;
+	int length;
+	off_t off;
+};
+#ifdef THREADED
+static struct io_wreq *wq_head, *wq_tail;
+static int wq_count;
+static int stop;	/* Engine is shutting down */
+#endif
+
+
+/**** io_uring backend ****/
+
+#ifdef HAVE_IO_URING
+static struct {
+	int fd;
+	unsigned int entries;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len;
+	unsigned int to_submit;
+	unsigned int inflight;
+	unsigned int writes;	/* Writes in flight */
+	off_t out_pos;	/* Next output file offset */
+} ring = { -1, 0, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, 0, 0, 0, 0, 0 };
+
+
+static int uring_setup(unsigned int entries)
+{
+	struct io_uring_params p;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+	if (fd < 0) return -1;
+	if (!(p.features & IORING_FEAT_FAST_POLL)) goto error_close;
+
+	ring.fd = fd;
+	ring.entries = p.sq_entries;
+	ring.sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring.cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring.cq_len > ring.sq_len) ring.sq_len = ring.cq_len;
+		ring.cq_len = ring.sq_len;
+	}
+	ring.sq_ptr = mmap(NULL, ring.sq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ring.sq_ptr == MAP_FAILED) goto error_close;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) ring.cq_ptr = ring.sq_ptr;
+	else {
+		ring.cq_ptr = mmap(NULL, ring.cq_len, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (ring.cq_ptr == MAP_FAILED) goto error_unmap_sq;
+	}
+	ring.sqes = (struct io_uring_sqe *)mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED) goto error_unmap_cq;
+
+	ring.sq_head = (unsigned int *)((char *)ring.sq_ptr + p.sq_off.head);
+	ring.sq_tail = (unsigned int *)((char *)ring.sq_ptr + p.sq_off.tail);
+	ring.sq_mask = (unsigned int *)((char *)ring.sq_ptr + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned int *)((char *)ring.sq_ptr + p.sq_off.array);
+	ring.cq_head = (unsigned int *)((char *)ring.cq_ptr + p.cq_off.head);
+	ring.cq_tail = (unsigned int *)((char *)ring.cq_ptr + p.cq_off.tail);
+	ring.cq_mask = (unsigned int *)((char *)ring.cq_ptr + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)((char *)ring.cq_ptr + p.cq_off.cqes);
+	return 0;
+
+error_unmap_cq:
+	if (ring.cq_ptr != ring.sq_ptr) munmap(ring.cq_ptr, ring.cq_len);
+error_unmap_sq:
+	munmap(ring.sq_ptr, ring.sq_len);
+error_close:
+	close(fd);
+	ring.fd = -1;
+	return -1;
+}
+
+
+static void uring_close(void)
+{
+	if (ring.fd < 0) return;
+	munmap(ring.sqes, ring.entries * sizeof(struct io_uring_sqe));
+	if (ring.cq_ptr != ring.sq_ptr) munmap(ring.cq_ptr, ring.cq_len);
+	munmap(ring.sq_ptr, ring.sq_len);
+	close(ring.fd);
+	ring.fd = -1;
+}
+
+
+static int uring_enter(const unsigned int min_complete)
+{
+	int i;
+
+	do {
+		i = (int)syscall(__NR_io_uring_enter, ring.fd, ring.to_submit, min_complete,
+				min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (i < 0 && errno == EINTR);
+	if (i < 0) return -1;
+	ring.to_submit -= (unsigned int)i;
+	return 0;
+}
+
+
+/* Handle one completion */
+static void uring_complete(const struct io_uring_cqe * const cqe)
+{
+	struct io_chunk *chunk;
+	struct io_wreq *wr;
+	ssize_t i;
+	int got;
+
+	ring.inflight--;
+	if (cqe->user_data & 1) {
+		/* Output write; finish short writes synchronously */
+		wr = (struct io_wreq *)(uintptr_t)(cqe->user_data & ~(uint64_t)1);
+		ring.writes--;
+		if (cqe->res < 0) io_error = 1;
+		else for (got = cqe->res; got < wr->length; got += (int)i) {
+			i = pwrite(fileno(files.out), wr->data + got, (size_t)(wr->length - got), wr->off + got);
+			if (i < 0 && errno == EINTR) i = 0;
+			else if (i <= 0) {
+				io_error = 1;
+				break;
+			}
+		}
+		free(wr->data); free(wr);
+		return;
+	}
+
+	/* Input read; finish short reads synchronously */
+	chunk = (struct io_chunk *)(uintptr_t)cqe->user_data;
+	if (cqe->res < 0) {
+		io_error = 1;
+		return;
+	}
+	got = cqe->res;
+	/* O_DIRECT reads are rounded up and may return more than asked for */
+	if (got > chunk->length) got = chunk->length;
+	if (got < chunk->length) {
+		i = read_at(chunk->mem + got, chunk->pos + got, chunk->length - got);
+		if (i < 0) io_error = 1;
+		else got += (int)i;
+	}
+	chunk->length = got;
+	chunk->state = S_READY;
+}
+
+
+/* Reap completions, waiting for at least one if asked to */
+static int uring_reap(const int wait)
+{
+	unsigned int head, tail;
+
+	if ((wait || ring.to_submit) && uring_enter(wait ? 1 : 0) != 0) return -1;
+	head = *ring.cq_head;
+	tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		uring_complete(&ring.cqes[head & *ring.cq_mask]);
+		head++;
+	}
+	__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	return 0;
+}
+
+
+/* Get a cleared submission queue entry */
+static struct io_uring_sqe *uring_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail, idx;
+
+	while (ring.inflight >= ring.entries)
+		if (uring_reap(1) != 0) return NULL;
+	tail = *ring.sq_tail;
+	idx = tail & *ring.sq_mask;
+	sqe = &ring.sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ring.sq_array[idx] = idx;
+	__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring.to_submit++;
+	ring.inflight++;
+	return sqe;
+}
+
+
+/* Queue reads into every free slot */
+static int uring_fill(void)
+{
+	struct io_uring_sqe *sqe;
+	struct io_chunk *chunk;
+	int i;
+
+	for (i = 0; i < nslots && !read_done; i++) {
+		chunk = slots + i;
+		if (chunk->state != S_FREE) continue;
+		if (next_extent(&(chunk->pos), &(chunk->length), &(chunk->hole)) != 0) {
+			io_error = 1;
+			read_done = 1;
+			return -1;
+		}
+		chunk->buf = chunk->mem;
+		slot_seq[i] = next_fill++;
+		if (chunk->hole != 0 || chunk->length == 0) {
+			if (chunk->hole == 0) read_done = 1;
+			chunk->state = S_READY;
+			continue;
+		}
+		sqe = uring_sqe();
+		if (sqe == NULL) return -1;
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = files.fd;
+		sqe->off = (uint64_t)chunk->pos;
+		sqe->addr = (uint64_t)(uintptr_t)chunk->mem;
+		sqe->len = (unsigned int)(files.direct_in ? DIRECT_ROUND(chunk->length) : chunk->length);
+		sqe->user_data = (uint64_t)(uintptr_t)chunk;
+		chunk->state = S_PENDING;
+	}
+	return 0;
+}
+
+
+static int uring_write(unsigned char * const data, const int length)
+{
+	struct io_uring_sqe *sqe;
+	struct io_wreq *wr;
+
+	wr = (struct io_wreq *)malloc(sizeof(struct io_wreq));
+	if (wr == NULL) return -1;
+	wr->data = data;
+	wr->length = length;
+	wr->off = ring.out_pos;
+	ring.out_pos += length;
+	sqe = uring_sqe();
+	if (sqe == NULL) {
+		free(wr);
+		return -1;
+	}
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fileno(files.out);
+	sqe->off = (uint64_t)wr->off;
+	sqe->addr = (uint64_t)(uintptr_t)data;
+	sqe->len = (unsigned int)length;
+	sqe->user_data = (uint64_t)(uintptr_t)wr | 1;
+	ring.writes++;
+	/* Submit right away so the write overlaps with compression */
+	return uring_reap(0);
+}
+#endif /* HAVE_IO_URING */
+
+
+/**** POSIX thread backend ****/
+
+#ifdef THREADED
+static void *reader_thread(void *arg)
+{
+	struct io_chunk *chunk = NULL;
+	int i, length;
+	uint64_t hole;
+
+	(void)arg;
+	while (1) {
+		pthread_mutex_lock(&io_mtx);
+		while (!stop) {
+			for (i = 0; i < nslots; i++) if (slots[i].state == S_FREE) break;
+			if (i < nslots) break;
+			pthread_cond_wait(&io_cond, &io_mtx);
+		}
+		if (stop) {
+			pthread_mutex_unlock(&io_mtx);
+			break;
+		}
+		chunk = slots + i;
+		chunk->state = S_PENDING;
+		pthread_mutex_unlock(&io_mtx);
+
+		chunk->buf = chunk->mem;
+		length = read_chunk(&(chunk->buf), &hole);
+
+		pthread_mutex_lock(&io_mtx);
+		if (length < 0) io_error = 1;
+		chunk->length = length;
+		chunk->hole = hole;
+		chunk->state = S_READY;
+		slot_seq[i] = next_fill++;
+		if (length <= 0 && hole == 0) read_done = 1;
+		pthread_cond_broadcast(&io_cond);
+		pthread_mutex_unlock(&io_mtx);
+		if (read_done) break;
+	}
+	pthread_exit(NULL);
+}
+
+
+static void *writer_thread(void *arg)
+{
+	struct io_wreq *wr;
+
+	(void)arg;
+	while (1) {
+		pthread_mutex_lock(&io_mtx);
+		while (wq_head == NULL && !stop) pthread_cond_wait(&io_cond, &io_mtx);
+		wr = wq_head;
+		if (wr == NULL) {
+			pthread_mutex_unlock(&io_mtx);
+			break;
+		}
+		wq_head = wr->next;
+		if (wq_head == NULL) wq_tail = NULL;
+		pthread_mutex_unlock(&io_mtx);
+
+		errno = 0;
+		if (fwrite(wr->data, 1, (size_t)wr->length, files.out) != (size_t)wr->length)
+			io_error = 1;
+		free(wr->data); free(wr);
+
+		pthread_mutex_lock(&io_mtx);
+		wq_count--;
+		pthread_cond_broadcast(&io_cond);
+		pthread_mutex_unlock(&io_mtx);
+	}
+	pthread_exit(NULL);
+}
+#endif /* THREADED */
+
+
+/**** Engine interface ****/
+
+/* Start the I/O engine with 'depth' input chunks
+ * With 'sync' set all I/O is done in the caller, but every chunk can still
+ * be held at once (threaded compression holds one per worker) */
+extern int io_start(int depth, const int sync)
+{
+	struct stat st;
+	int want_uring_read = 0, want_uring_write = 0;
+	int i;
+
+	if (depth < 1) depth = 1;
+	nslots = depth;
+	slots = (struct io_chunk *)calloc((size_t)nslots, sizeof(struct io_chunk));
+	slot_seq = (int *)calloc((size_t)nslots, sizeof(int));
+	if (slots == NULL || slot_seq == NULL) return -1;
+	/* Chunk buffers are page aligned so they can be used for O_DIRECT */
+	for (i = 0; i < nslots; i++) {
+#ifdef _WIN32
+		slots[i].mem = (unsigned char *)malloc(UTIL_BSIZE);
+#else
+		if (posix_memalign((void **)&(slots[i].mem), UTIL_DIRECT_ALIGN, UTIL_BSIZE) != 0)
+			slots[i].mem = NULL;
+#endif
+		if (slots[i].mem == NULL) return -1;
+		slots[i].buf = slots[i].mem;
+	}
+	next_get = 0; next_fill = 0;
+	read_done = 0; io_error = 0;
+#ifdef THREADED
+	stop = 0;
+#endif
+	read_mode = IO_SYNC; write_mode = IO_SYNC;
+	if (sync || nslots == 1) return 0;
+
+	/* Mapped input needs no reads; other named files can use io_uring */
+	if (files.map == NULL && files.sparse) want_uring_read = 1;
+	if (fstat(fileno(files.out), &st) == 0 && S_ISREG(st.st_mode)) want_uring_write = 1;
+#ifdef HAVE_IO_URING
+	if ((want_uring_read || want_uring_write) && uring_setup((unsigned int)nslots * 2) == 0) {
+		if (want_uring_read) read_mode = IO_URING;
+		if (want_uring_write) {
+			if (fflush(files.out) != 0) return -1;
+			ring.out_pos = ftello(files.out);
+			if (ring.out_pos < 0) return -1;
+			write_mode = IO_URING;
+		}
+	}
+#else
+	(void)want_uring_read; (void)want_uring_write;
+#endif
+#ifdef THREADED
+	if (read_mode == IO_SYNC && files.map == NULL) {
+		if (pthread_create(&reader_id, NULL, reader_thread, NULL) != 0) return -1;
+		read_mode = IO_THREAD;
+	}
+	if (write_mode == IO_SYNC) {
+		if (pthread_create(&writer_id, NULL, writer_thread, NULL) != 0) return -1;
+		write_mode = IO_THREAD;
+	}
+#endif
+	return 0;
+}
+
+
+#if defined HAVE_IO_URING || defined THREADED
+/* Find the slot holding the next chunk in input order */
+static int find_next(void)
+{
+	int i;
+
+	for (i = 0; i < nslots; i++)
+		if (slots[i].state == S_READY && slot_seq[i] == next_get) return i;
+	return -1;
+}
+#endif
+
+
+/* Get the next input chunk in order; NULL on a read error */
+extern struct io_chunk *io_get_chunk(void)
+{
+	struct io_chunk *chunk;
+	int i;
+
+	switch (read_mode) {
+	default:
+	case IO_SYNC:
+		for (i = 0; i < nslots; i++) if (slots[i].state == S_FREE) break;
+		if (i == nslots) return NULL;
+		chunk = slots + i;
+		chunk->buf = chunk->mem;
+		chunk->length = read_chunk(&(chunk->buf), &(chunk->hole));
+		if (chunk->length < 0) return NULL;
+		chunk->state = S_HELD;
+		next_get++;
+		return chunk;
+#ifdef HAVE_IO_URING
+	case IO_URING:
+		while (1) {
+			if (uring_fill() != 0) return NULL;
+			if (io_error) return NULL;
+			i = find_next();
+			if (i >= 0) break;
+			if (uring_reap(1) != 0) return NULL;
+		}
+		break;
+#endif
+#ifdef THREADED
+	case IO_THREAD:
+		pthread_mutex_lock(&io_mtx);
+		while ((i = find_next()) < 0 && !io_error) pthread_cond_wait(&io_cond, &io_mtx);
+		pthread_mutex_unlock(&io_mtx);
+		if (i < 0 || slots[i].length < 0) return NULL;
+		break;
+#endif
+	}
+	slots[i].state = S_HELD;
+	next_get++;
+	return slots + i;
+}
+
+
+/* Give a chunk back to the engine for reuse */
+extern void io_put_chunk(struct io_chunk * const chunk)
+{
+#ifdef THREADED
+	pthread_mutex_lock(&io_mtx);
+	chunk->state = S_FREE;
+	pthread_cond_broadcast(&io_cond);
+	pthread_mutex_unlock(&io_mtx);
+#else
+	chunk->state = S_FREE;
+#endif
+	return;
+}
+
+
+/* Queue an ordered output write; the engine frees 'data' when done */
+extern int io_write(unsigned char * const data, const int length)
+{
+	struct io_wreq *wr;
+
+	if (io_error) goto error_free;
+	/* Mapped output is sized for the whole stream up front */
+	if (files.omap != NULL) {
+		if (length > files.osize - files.opos) goto error_free;
+		memcpy(files.omap + files.opos, data, (size_t)length);
+		files.opos += length;
+		free(data);
+		return 0;
+	}
+	switch (write_mode) {
+	default:
+	case IO_SYNC:
+		errno = 0;
+		if (fwrite(data, 1, (size_t)length, files.out) != (size_t)length) goto error_free;
+		free(data);
+		return 0;
+#ifdef HAVE_IO_URING
+	case IO_URING:
+		return uring_write(data, length);
+#endif
+#ifdef THREADED
+	case IO_THREAD:
+		wr = (struct io_wreq *)malloc(sizeof(struct io_wreq));
+		if (wr == NULL) goto error_free;
+		wr->data = data;
+		wr->length = length;
+		wr->next = NULL;
+		pthread_mutex_lock(&io_mtx);
+		/* Don't let a slow device pile up unbounded output */
+		while (wq_count >= nslots * 2 && !io_error) pthread_cond_wait(&io_cond, &io_mtx);
+		if (wq_tail == NULL) wq_head = wr;
+		else wq_tail->next = wr;
+		wq_tail = wr;
+		wq_count++;
+		pthread_cond_broadcast(&io_cond);
+		pthread_mutex_unlock(&io_mtx);
+		return io_error ? -1 : 0;
+#endif
+	}
+	(void)wr;
+error_free:
+	free(data);
+	return -1;
+}
+
+
+/* Wait for all writes to finish and shut the engine down */
+extern int io_finish(void)
+{
+	int i;
+
+#ifdef THREADED
+	pthread_mutex_lock(&io_mtx);
+	stop = 1;
+	pthread_cond_broadcast(&io_cond);
+	pthread_mutex_unlock(&io_mtx);
+	if (read_mode == IO_THREAD) pthread_join(reader_id, NULL);
+	if (write_mode == IO_THREAD) pthread_join(writer_id, NULL);
+#endif
+#ifdef HAVE_IO_URING
+	if (ring.fd >= 0) {
+		/* Reads still in flight point at slot memory; drain them too */
+		while (ring.inflight > 0) if (uring_reap(1) != 0) {
+			io_error = 1;
+			break;
+		}
+		uring_close();
+	}
+#endif
+	if (fflush(files.out) != 0) io_error = 1;
+	for (i = 0; i < nslots; i++) free(slots[i].mem);
+	free(slots); free(slot_seq);
+	slots = NULL; slot_seq = NULL;
+	return io_error ? -1 : 0;
+}
+
+
+/* Name the engine backends in use, for diagnostics */
+extern const char *io_engine_name(void)
+{
+	static const char * const names[] = { "sync", "threads", "io_uring" };
+	static char name[32];
+
+	snprintf(name, sizeof(name), "read %s, write %s", names[read_mode], names[write_mode]);
+	return name;
+}
@@ -0,0 +1,40 @@
+/*
+ * Lempel-Ziv-JodyBruchon compression library
+ *
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * Released under The MIT License
+ */
+
+#ifndef LZJODY_IO_H
+#define LZJODY_IO_H
+
+#include <stdint.h>
+
+/* Default number of input chunks read ahead of the compressor */
+#ifndef UTIL_QUEUE_DEPTH
+ #define UTIL_QUEUE_DEPTH 8
+#endif
+
+/* I/O engine backends; reads and writes pick theirs separately */
+#define IO_SYNC 0	/* Plain blocking calls from the main thread */
+#define IO_THREAD 1	/* POSIX reader/writer threads */
+#define IO_URING 2	/* Linux io_uring */
+
+/* Input chunk handed out by the I/O engine */
+struct io_chunk {
+	unsigned char *buf;	/* Chunk data (may point into a mapping) */
+	unsigned char *mem;	/* Read buffer owned by the engine */
+	int length;	/* Data length; 0 with no hole means end of input */
+	uint64_t hole;	/* Length of a sparse input hole */
+	int state;	/* Engine slot state */
+	off_t pos;	/* Input offset of an io_uring read */
+};
+
+extern int io_start(int depth, const int sync);
+extern struct io_chunk *io_get_chunk(void);
+extern void io_put_chunk(struct io_chunk * const chunk);
+extern int io_write(unsigned char * const data, const int length);
+extern int io_finish(void);
+extern const char *io_engine_name(void);
+
+#endif	/* LZJODY_IO_H */
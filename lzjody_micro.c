@@ -0,0 +1,406 @@
+/*
+ * lzjody kernel microbenchmarks
+ *
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * Released under The MIT License
+ *
+ * Times each compressor stage on its own, on inputs built to exercise it:
+ * the LZ byte indexer, the LZ match finder through its jump lists and
+ * through the linear search used once a byte's list is full, the RLE and
+ * sequence finders, the byte plane transform, and the decompressor on
+ * blocks made almost entirely of one command type. End-to-end numbers
+ * (lzjody-bench) can't show which of these got faster or slower.
+ *
+ * lzjody.c is compiled into this program so its static functions can be
+ * called directly; the rest of the library comes from liblzjody.a.
+ * Results are in time stamp counter ticks per byte on x86 (nanoseconds
+ * elsewhere), the median of the timed runs.
+ */
+
+#include <time.h>
+#include "lzjody.c"
+#include "byteplane_xfrm.h"
+
+#define MICRO_REPS 50
+#define MICRO_WARMUP 3
+#define MICRO_BLOCK LZJODY_BSIZE
+#define MICRO_SEED 0x6d6963726f626dULL
+
+/* Input and scratch space shared by all benchmarks */
+struct micro_t {
+	unsigned char in[MICRO_BLOCK];
+	unsigned char out[MICRO_BLOCK * 2];
+	unsigned char dec[MICRO_BLOCK];
+	unsigned int pos[MICRO_BLOCK];	/* Input positions a finder is called at */
+	unsigned int npos;
+	struct lz_index_t idx;
+	struct comp_data_t data;
+	uint64_t *ticks;
+	int reps;
+	int warmup;
+	uint64_t rng;
+};
+
+/* One input generator per benchmark case */
+enum { IN_RANDOM, IN_TEXT, IN_SKEWED, IN_RUNS, IN_SEQ8, IN_SEQ16, IN_SEQ32,
+	IN_PERIODIC, IN_COPIES, IN_RECORDS, IN_PLANES };
+
+static const char * const text_words[] = {
+	"the", "of", "and", "file", "system", "block", "data", "to", "in", "is",
+	"for", "on", "with", "root", "usr", "lib", "error", "config", "value",
+	"return", "int", "char", "static", "const", "struct", "if", "else"
+};
+#define TEXT_WORDS (sizeof(text_words) / sizeof(text_words[0]))
+
+
+/* Tick counter: the TSC on x86, nanoseconds elsewhere */
+static inline uint64_t micro_ticks(void)
+{
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000U + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+
+/* xorshift64* generator: same inputs on every machine */
+static unsigned int rnd(struct micro_t * const m, const unsigned int range)
+{
+	m->rng ^= m->rng >> 12;
+	m->rng ^= m->rng << 25;
+	m->rng ^= m->rng >> 27;
+	return (unsigned int)((m->rng * 0x2545f4914f6cdd1dULL) >> 32) % range;
+}
+
+
+/* Fill the input block for one benchmark case */
+static void make_input(struct micro_t * const m, const int type)
+{
+	unsigned char * const in = m->in;
+	unsigned int pos = 0, len, src, v;
+	int diff;
+
+	m->rng = MICRO_SEED;
+	while (pos < MICRO_BLOCK) {
+		switch (type) {
+		case IN_RANDOM:
+		default:
+			in[pos++] = (unsigned char)rnd(m, 256);
+			continue;
+		case IN_TEXT:
+			for (const char *w = text_words[rnd(m, TEXT_WORDS)]; *w != '\0' && pos < MICRO_BLOCK; w++)
+				in[pos++] = (unsigned char)*w;
+			if (pos < MICRO_BLOCK) in[pos++] = rnd(m, 10) ? ' ' : '\n';
+			continue;
+		case IN_SKEWED:
+			/* Few distinct bytes fill the LZ jump lists for 0 early */
+			in[pos++] = rnd(m, 8) ? 0 : (unsigned char)(1 + rnd(m, 3));
+			continue;
+		case IN_RUNS:
+			len = 1 + rnd(m, 64);
+			v = rnd(m, 256);
+			for (; len > 0 && pos < MICRO_BLOCK; len--) in[pos++] = (unsigned char)v;
+			continue;
+		case IN_SEQ8:
+			len = 1 + rnd(m, 64);
+			v = rnd(m, 256);
+			diff = (int)rnd(m, 7) - 3;
+			if (diff == 0) diff = 1;
+			for (; len > 0 && pos < MICRO_BLOCK; len--, v += (unsigned int)diff) in[pos++] = (unsigned char)v;
+			continue;
+		case IN_SEQ16:
+			/* Big-endian counters, as the finders expect */
+			len = 1 + rnd(m, 32);
+			v = rnd(m, 65536);
+			for (; len > 0 && pos + 2 <= MICRO_BLOCK; len--, v++) {
+				in[pos++] = (unsigned char)(v >> 8);
+				in[pos++] = (unsigned char)v;
+			}
+			if (pos + 2 > MICRO_BLOCK) while (pos < MICRO_BLOCK) in[pos++] = 0;
+			continue;
+		case IN_SEQ32:
+			len = 1 + rnd(m, 16);
+			v = (unsigned int)rnd(m, 65536) << 16;
+			for (; len > 0 && pos + 4 <= MICRO_BLOCK; len--, v++) {
+				in[pos++] = (unsigned char)(v >> 24);
+				in[pos++] = (unsigned char)(v >> 16);
+				in[pos++] = (unsigned char)(v >> 8);
+				in[pos++] = (unsigned char)v;
+			}
+			if (pos + 4 > MICRO_BLOCK) while (pos < MICRO_BLOCK) in[pos++] = 0;
+			continue;
+		case IN_PERIODIC:
+			/* Short patterns repeated: LZ copies that overlap themselves */
+			len = 2 + rnd(m, 7);
+			for (v = 0; v < len && pos < MICRO_BLOCK; v++) in[pos++] = (unsigned char)rnd(m, 256);
+			for (len = len * (4 + rnd(m, 32)); len > 0 && pos < MICRO_BLOCK; len--, pos++)
+				in[pos] = in[pos - v];
+			continue;
+		case IN_COPIES:
+			/* Long copies of earlier data that don't overlap */
+			for (len = 4; len > 0 && pos < MICRO_BLOCK; len--) in[pos++] = (unsigned char)rnd(m, 256);
+			if (pos < 512) continue;
+			len = 64 + rnd(m, 448);
+			src = rnd(m, pos - len);
+			for (; len > 0 && pos < MICRO_BLOCK; len--) in[pos++] = in[src++];
+			continue;
+		case IN_RECORDS:
+			/* 32-byte records differing in one field: LZ repeat commands */
+			if (pos < 32) {
+				in[pos++] = (unsigned char)rnd(m, 256);
+				continue;
+			}
+			for (len = 0; len < 32 && pos < MICRO_BLOCK; len++, pos++)
+				in[pos] = (len == 12) ? (unsigned char)rnd(m, 256) : in[pos - 32];
+			continue;
+		case IN_PLANES:
+			/* 32-bit values whose high bytes barely change */
+			v = 0x10203000U | rnd(m, 256);
+			in[pos++] = (unsigned char)v;
+			in[pos++] = (unsigned char)(v >> 8);
+			in[pos++] = (unsigned char)(v >> 16);
+			in[pos++] = (unsigned char)(v >> 24);
+			continue;
+		}
+	}
+	return;
+}
+
+
+/* Set up the compressor state for a 4 KiB block as compress_block() does */
+static void setup_data(struct micro_t * const m, const unsigned int options)
+{
+	struct comp_data_t * const d = &m->data;
+
+	memset(d, 0, sizeof(struct comp_data_t));
+	d->in = m->in;
+	d->out = m->out;
+	d->length = MICRO_BLOCK;
+	d->bsize = LZJODY_BSIZE_OF(options);
+	d->options = (int)options;
+	return;
+}
+
+
+/* Sort and report the timed runs; bytes is what one run processed */
+static int cmp_ticks(const void *a, const void *b)
+{
+	const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void report(struct micro_t * const m, const char * const kernel,
+		const char * const input, const uint64_t bytes, const char * const note)
+{
+	qsort(m->ticks, (size_t)m->reps, sizeof(uint64_t), cmp_ticks);
+	printf("%-18s %-22s %8" PRIu64 " %10.2f %10.2f  %s\n", kernel, input, bytes,
+			bytes ? (double)m->ticks[(m->reps - 1) / 2] / (double)bytes : 0.0,
+			bytes ? (double)m->ticks[0] / (double)bytes : 0.0, note);
+	return;
+}
+
+
+/* Time a statement over warmup plus timed runs */
+#define TIME_RUNS(m, stmt) do { \
+	for (int r_ = -(m)->warmup; r_ < (m)->reps; r_++) { \
+		const uint64_t t_ = micro_ticks(); \
+		stmt; \
+		if (r_ >= 0) (m)->ticks[r_] = micro_ticks() - t_; \
+	} \
+} while (0)
+
+
+static void bench_index(struct micro_t * const m, const int type, const char * const name)
+{
+	char note[64];
+
+	make_input(m, type);
+	setup_data(m, 0);
+	TIME_RUNS(m, index_bytes(&m->data, &m->idx, 0));
+	snprintf(note, sizeof(note), (m->idx.end < MICRO_BLOCK - MIN_LZ_MATCH) ?
+			"stopped at 0x%x: a byte list filled" : "indexed to 0x%x", m->idx.end);
+	report(m, "index_bytes", name, m->idx.end, note);
+	return;
+}
+
+
+/* Collect the positions whose first byte's jump list is (or isn't) full */
+static void lz_positions(struct micro_t * const m, const int linear)
+{
+	m->npos = 0;
+	for (unsigned int p = 0; p < MICRO_BLOCK - MIN_LZ_MATCH - 1; p++)
+		if ((m->idx.bytecnt[m->in[p]] >= MAX_LZ_BYTE_SCANS) == linear) m->pos[m->npos++] = p;
+	return;
+}
+
+
+/* Call a finder at every chosen position with no pending literals */
+#define FIND_AT_POSITIONS(m, call) do { \
+	for (unsigned int i_ = 0; i_ < (m)->npos; i_++) { \
+		(m)->data.ipos = (m)->pos[i_]; \
+		(m)->data.opos = 0; \
+		(m)->data.literals = 0; \
+		(m)->data.last_dist = 0; \
+		hits += (call) > 0; \
+	} \
+} while (0)
+
+
+static void bench_find_lz(struct micro_t * const m, const int type, const char * const name,
+		const int linear)
+{
+	unsigned int hits = 0;
+	char note[64];
+
+	make_input(m, type);
+	setup_data(m, 0);
+	index_bytes(&m->data, &m->idx, 0);
+	lz_positions(m, linear);
+	TIME_RUNS(m, FIND_AT_POSITIONS(m, lzjody_find_lz(&m->data, &m->idx, 0)));
+	snprintf(note, sizeof(note), "%u calls, %u%% hit", m->npos, m->npos ? hits * 100 / (m->npos * (unsigned int)(m->reps + m->warmup)) : 0);
+	report(m, linear ? "find_lz linear" : "find_lz jump", name, m->npos, note);
+	return;
+}
+
+
+static void bench_finder(struct micro_t * const m, const int type, const char * const kernel)
+{
+	unsigned int hits = 0;
+	char note[64];
+
+	make_input(m, type);
+	setup_data(m, 0);
+	m->npos = 0;
+	for (unsigned int p = 0; p < MICRO_BLOCK - 1; p++) m->pos[m->npos++] = p;
+	switch (type) {
+	case IN_RUNS:
+		TIME_RUNS(m, FIND_AT_POSITIONS(m, lzjody_find_rle(&m->data, 0)));
+		break;
+	case IN_SEQ8:
+		TIME_RUNS(m, FIND_AT_POSITIONS(m, lzjody_find_seq8(&m->data, 0)));
+		break;
+	case IN_SEQ16:
+		TIME_RUNS(m, FIND_AT_POSITIONS(m, lzjody_find_seq16(&m->data, 0)));
+		break;
+	case IN_SEQ32:
+	default:
+		TIME_RUNS(m, FIND_AT_POSITIONS(m, lzjody_find_seq32(&m->data, 0)));
+		break;
+	}
+	snprintf(note, sizeof(note), "%u calls, %u%% hit", m->npos, hits * 100 / (m->npos * (unsigned int)(m->reps + m->warmup)));
+	report(m, kernel, "every position", m->npos, note);
+	return;
+}
+
+
+static void bench_planes(struct micro_t * const m)
+{
+	make_input(m, IN_PLANES);
+	TIME_RUNS(m, byteplane_transform(m->in, m->out, MICRO_BLOCK, 4));
+	report(m, "byteplane_xfrm", "split, 4 planes", MICRO_BLOCK, "byteplane_transform()");
+	TIME_RUNS(m, byteplane_transform(m->out, m->dec, MICRO_BLOCK, -4));
+	report(m, "byteplane_xfrm", "join, 4 planes", MICRO_BLOCK, "byteplane_transform()");
+	TIME_RUNS(m, lzjody_kern.plane_split(m->in, m->out, MICRO_BLOCK));
+	report(m, "byteplane_xfrm", "split, 4 planes", MICRO_BLOCK, "kernel used by compressor");
+	TIME_RUNS(m, lzjody_kern.plane_join(m->out, m->dec, MICRO_BLOCK));
+	report(m, "byteplane_xfrm", "join, 4 planes", MICRO_BLOCK, "kernel used by decompressor");
+	return;
+}
+
+
+/* Decompress a block that the compressor turned into mostly one command */
+static int bench_decompress(struct micro_t * const m, const int type, const char * const name,
+		const unsigned int options)
+{
+	char note[64];
+	int size, err = 0;
+
+	make_input(m, type);
+	size = lzjody_real_compress(m->in, m->out, options | O_NOPREFIX, MICRO_BLOCK);
+	if (size < 0) return -1;
+	TIME_RUNS(m, err = lzjody_decompress(m->out, m->dec, (unsigned int)size, 0));
+	if (err != MICRO_BLOCK || memcmp(m->in, m->dec, MICRO_BLOCK) != 0) goto error_verify;
+	snprintf(note, sizeof(note), "%d byte block", size);
+	report(m, "decompress", name, MICRO_BLOCK, note);
+	return 0;
+
+error_verify:
+	fprintf(stderr, "lzjody-micro: error: '%s' block did not round trip\n", name);
+	return -1;
+}
+
+
+int main(int argc, char **argv)
+{
+	static struct micro_t m;
+	const char *only = NULL;
+	int i, err = 0;
+
+	m.reps = MICRO_REPS;
+	m.warmup = MICRO_WARMUP;
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-r") && (i + 1) < argc) m.reps = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-w") && (i + 1) < argc) m.warmup = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-k") && (i + 1) < argc) only = argv[++i];
+		else goto usage;
+	}
+	if (m.reps < 1 || m.warmup < 0) goto usage;
+	m.ticks = (uint64_t *)malloc(sizeof(uint64_t) * (size_t)m.reps);
+	if (m.ticks == NULL) goto oom;
+	lzjody_simd_init();
+
+	printf("lzjody-micro: %s kernels, %d KiB blocks, %d warmup + %d timed runs\n",
+			lzjody_kern.name, MICRO_BLOCK >> 10, m.warmup, m.reps);
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+	printf("%-18s %-22s %8s %10s %10s\n", "kernel", "input", "bytes", "TSC/byte", "min");
+#else
+	printf("%-18s %-22s %8s %10s %10s\n", "kernel", "input", "bytes", "ns/byte", "min");
+#endif
+
+#define RUN(kernel) (only == NULL || strstr(kernel, only) != NULL)
+	if (RUN("index_bytes")) {
+		bench_index(&m, IN_RANDOM, "random");
+		bench_index(&m, IN_TEXT, "text");
+		bench_index(&m, IN_SKEWED, "skewed (list fills)");
+	}
+	if (RUN("find_lz jump")) {
+		bench_find_lz(&m, IN_TEXT, "text", 0);
+		bench_find_lz(&m, IN_RANDOM, "random", 0);
+		bench_find_lz(&m, IN_COPIES, "long copies", 0);
+	}
+	if (RUN("find_lz linear")) bench_find_lz(&m, IN_SKEWED, "skewed (list full)", 1);
+	if (RUN("find_rle")) bench_finder(&m, IN_RUNS, "find_rle");
+	if (RUN("find_seq8")) bench_finder(&m, IN_SEQ8, "find_seq8");
+	if (RUN("find_seq16")) bench_finder(&m, IN_SEQ16, "find_seq16");
+	if (RUN("find_seq32")) bench_finder(&m, IN_SEQ32, "find_seq32");
+	if (RUN("byteplane_xfrm")) bench_planes(&m);
+	if (RUN("decompress")) {
+		err |= bench_decompress(&m, IN_RANDOM, "literals", O_NO_LZ | O_NO_RLE | O_NO_SEQ);
+		err |= bench_decompress(&m, IN_RUNS, "rle", O_NO_LZ | O_NO_SEQ);
+		err |= bench_decompress(&m, IN_SEQ8, "seq8", O_NO_LZ | O_NO_RLE);
+		err |= bench_decompress(&m, IN_SEQ16, "seq16", O_NO_LZ | O_NO_RLE);
+		err |= bench_decompress(&m, IN_SEQ32, "seq32", O_NO_LZ | O_NO_RLE);
+		err |= bench_decompress(&m, IN_PERIODIC, "lz overlapping", O_NO_RLE | O_NO_SEQ);
+		err |= bench_decompress(&m, IN_COPIES, "lz long copies", O_NO_RLE | O_NO_SEQ);
+		err |= bench_decompress(&m, IN_RECORDS, "lz repeat distance", O_NO_RLE | O_NO_SEQ | O_LZ_REPEAT);
+		err |= bench_decompress(&m, IN_PLANES, "byte planes", O_NO_LZ | O_NO_SEQ);
+		err |= bench_decompress(&m, IN_TEXT, "entropy coded text", O_ENTROPY);
+	}
+	free(m.ticks);
+	exit(err ? EXIT_FAILURE : EXIT_SUCCESS);
+
+oom:
+	fprintf(stderr, "lzjody-micro: error: out of memory\n");
+	exit(EXIT_FAILURE);
+usage:
+	fprintf(stderr, "usage: lzjody-micro [-r reps] [-w warmup] [-k kernel]\n");
+	fprintf(stderr, " -r  timed runs of each benchmark (default %d)\n", MICRO_REPS);
+	fprintf(stderr, " -w  untimed warmup runs (default %d)\n", MICRO_WARMUP);
+	fprintf(stderr, " -k  only run kernels whose name contains this (e.g. find_lz, decompress)\n");
+	exit(EXIT_FAILURE);
+}
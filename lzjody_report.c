@@ -0,0 +1,279 @@
+/*
+ * Lempel-Ziv-JodyBruchon compression library
+ *
+ * Pipeline timing and block statistics for the lzjody utility (--stats)
+ *
+ * The main thread times how long it waits for input, compresses or
+ * decompresses, waits for worker threads and writes output. Worker threads
+ * add up their own busy time. Every block record is counted by type and
+ * by how much it shrank. The report goes to stderr as text or as a single
+ * JSON object, since stdout may be the data stream.
+ *
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * Released under The MIT License
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+#include "lzjody.h"
+#include "lzjody_report.h"
+
+struct report_t report;
+
+static const char * const stage_names[STAGES] = { "read", "compute", "reorder", "write" };
+static const char * const finder_names[LZJODY_STAT_FINDERS] = {
+	"rle", "seq8", "seq16", "seq32", "lz_rep", "lz_jump", "lz_linear"
+};
+static const char * const lib_stage_names[LZJODY_STAGES] = {
+	"index", "scan", "plane", "entropy", "check"
+};
+
+
+/* Monotonic clock in nanoseconds, or 0 if no report was asked for */
+extern uint64_t report_clock(void)
+{
+	struct timespec ts;
+
+	if (!report.enabled) return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000U + (uint64_t)ts.tv_nsec;
+}
+
+
+extern void report_start(const int json, const int decompress)
+{
+	memset(&report, 0, sizeof(report));
+	report.enabled = 1;
+	report.json = json;
+	report.decompress = decompress;
+	report.nthreads = 1;
+	report.start = report_clock();
+	return;
+}
+
+
+/* Set up busy counters for the worker threads */
+extern int report_threads(const int nthreads)
+{
+	free(report.busy);
+	report.busy = (uint64_t *)calloc((size_t)nthreads, sizeof(uint64_t));
+	if (report.busy == NULL) return -1;
+	report.nthreads = nthreads;
+	report.workers = 1;
+	return 0;
+}
+
+
+/* Charge the time since 'since' (a report_clock() value) to a stage */
+extern void report_time(const int stage, const uint64_t since)
+{
+	if (!report.enabled) return;
+	report.stage[stage] += report_clock() - since;
+	return;
+}
+
+
+/* Count one block record: in_len bytes of data stored in out_len bytes */
+extern void report_record(const unsigned int type, const uint64_t in_len, const uint64_t out_len)
+{
+	uint64_t bucket;
+
+	if (!report.enabled) return;
+	report.bytes_in += in_len;
+	report.bytes_out += out_len;
+	switch (type) {
+	case O_ZERORUN:
+		report.zero_runs++;
+		report.zero_bytes += in_len;
+		return;
+	case O_REPEAT:
+	case O_REFBLOCK:
+		report.repeats++;
+		return;
+	default:
+		break;
+	}
+	if (in_len == 0) return;
+	if (out_len < in_len) report.compressed++;
+	else report.stored++;
+	bucket = (out_len * 10) / in_len;
+	if (bucket >= RATIO_BUCKETS) bucket = RATIO_BUCKETS - 1;
+	report.ratio[bucket]++;
+	return;
+}
+
+
+/* Count the records that lzjody_compress() made of in_len bytes
+ * Each record holds the next block of input except for zero runs,
+ * which hold their byte count */
+extern void report_chunk(const unsigned char * const out, const int out_len,
+		const int in_len, const unsigned int options)
+{
+	const unsigned int prefix = LZJODY_PREFIX_LEN(options);
+	const uint64_t bsize = LZJODY_BSIZE_OF(options);
+	unsigned int type, length, check;
+	uint64_t in_pos = 0, size;
+	int pos = 0;
+
+	if (!report.enabled) return;
+	while (pos + (int)prefix <= out_len) {
+		type = *(out + pos) & O_RECORD_MASK;
+		length = ((unsigned int)(*(out + pos) & 0x1f) << 8) | *(out + pos + 1);
+		if (prefix > 2) length = (length << 8) | *(out + pos + 2);
+		check = ((options & O_CHECKSUM) && type != O_ZERORUN) ? LZJODY_CHECK_LEN : 0;
+		if (type == O_ZERORUN) {
+			size = 0;
+			for (unsigned int i = 0; i < length && i < 8; i++) size = (size << 8) | *(out + pos + prefix + i);
+		} else {
+			size = (uint64_t)in_len - in_pos;
+			if (size > bsize) size = bsize;
+		}
+		in_pos += size;
+		report_record(type, size, prefix + length + check);
+		pos += (int)(prefix + length + check);
+	}
+	return;
+}
+
+
+/* Add a thread's library compressor counters */
+extern void report_lib(const struct lzjody_stats * const stats)
+{
+	int i;
+
+	if (!report.enabled) return;
+	report.have_lib = 1;
+	for (i = 0; i < LZJODY_STAT_FINDERS; i++) {
+		report.lib.calls[i] += stats->calls[i];
+		report.lib.hits[i] += stats->hits[i];
+		report.lib.bytes[i] += stats->bytes[i];
+	}
+	report.lib.plane_tried += stats->plane_tried;
+	report.lib.plane_used += stats->plane_used;
+	report.lib.index_full += stats->index_full;
+	report.lib.blocks += stats->blocks;
+	report.lib.bytes_in += stats->bytes_in;
+	for (i = 0; i < LZJODY_STAGES; i++) report.lib.ticks[i] += stats->ticks[i];
+	return;
+}
+
+
+/* Megabytes per second, or 0 for no time */
+static double mb_s(const uint64_t bytes, const uint64_t ns)
+{
+	if (ns == 0) return 0;
+	return ((double)bytes * 1000.0) / (double)ns;
+}
+
+
+static void print_json(const uint64_t wall, const uint64_t raw, const uint64_t packed)
+{
+	const uint64_t stage_bytes[STAGES] = { report.decompress ? packed : raw, raw, raw, report.decompress ? raw : packed };
+	int i;
+
+	fprintf(stderr, "{\"mode\":\"%s\",\"bytes_in\":%" PRIu64 ",\"bytes_out\":%" PRIu64
+			",\"wall_ns\":%" PRIu64 ",\"mb_s\":%.2f,\"stages\":{",
+			report.decompress ? "decompress" : "compress",
+			report.decompress ? packed : raw, report.decompress ? raw : packed,
+			wall, mb_s(raw, wall));
+	for (i = 0; i < STAGES; i++)
+		fprintf(stderr, "%s\"%s\":{\"ns\":%" PRIu64 ",\"mb_s\":%.2f}", i ? "," : "",
+				stage_names[i], report.stage[i], mb_s(stage_bytes[i], report.stage[i]));
+	fprintf(stderr, "},\"threads\":[");
+	for (i = 0; i < report.nthreads; i++)
+		fprintf(stderr, "%s%.1f", i ? "," : "",
+				wall ? (double)report.busy[i] * 100.0 / (double)wall : 0.0);
+	fprintf(stderr, "],\"blocks\":{\"compressed\":%" PRIu64 ",\"stored\":%" PRIu64
+			",\"zero_runs\":%" PRIu64 ",\"zero_bytes\":%" PRIu64 ",\"repeats\":%" PRIu64 "},\"ratio\":[",
+			report.compressed, report.stored, report.zero_runs, report.zero_bytes, report.repeats);
+	for (i = 0; i < RATIO_BUCKETS; i++) fprintf(stderr, "%s%" PRIu64, i ? "," : "", report.ratio[i]);
+	fprintf(stderr, "]");
+	if (report.have_lib) {
+		fprintf(stderr, ",\"finders\":{");
+		for (i = 0; i < LZJODY_STAT_FINDERS; i++)
+			fprintf(stderr, "%s\"%s\":{\"calls\":%" PRIu64 ",\"hits\":%" PRIu64 ",\"bytes\":%" PRIu64 "}",
+					i ? "," : "", finder_names[i], report.lib.calls[i],
+					report.lib.hits[i], report.lib.bytes[i]);
+		fprintf(stderr, "},\"plane_tried\":%" PRIu64 ",\"plane_used\":%" PRIu64
+				",\"index_full\":%" PRIu64 ",\"ticks\":{",
+				report.lib.plane_tried, report.lib.plane_used, report.lib.index_full);
+		for (i = 0; i < LZJODY_STAGES; i++)
+			fprintf(stderr, "%s\"%s\":%" PRIu64, i ? "," : "", lib_stage_names[i], report.lib.ticks[i]);
+		fprintf(stderr, "}");
+	}
+	fprintf(stderr, "}\n");
+	return;
+}
+
+
+static void print_text(const uint64_t wall, const uint64_t raw, const uint64_t packed)
+{
+	const uint64_t stage_bytes[STAGES] = { report.decompress ? packed : raw, raw, raw, report.decompress ? raw : packed };
+	uint64_t other = wall;
+	int i;
+
+	fprintf(stderr, "lzjody: %s %" PRIu64 " -> %" PRIu64 " bytes (%.1f%%) in %.3f s, %.1f MB/s\n",
+			report.decompress ? "decompressed" : "compressed",
+			report.decompress ? packed : raw, report.decompress ? raw : packed,
+			raw ? (double)packed * 100.0 / (double)raw : 0.0,
+			(double)wall / 1e9, mb_s(raw, wall));
+	fprintf(stderr, "stage      seconds   wall     MB/s\n");
+	for (i = 0; i < STAGES; i++) {
+		fprintf(stderr, "%-8s %9.3f %5.1f%% %8.1f\n", stage_names[i], (double)report.stage[i] / 1e9,
+				wall ? (double)report.stage[i] * 100.0 / (double)wall : 0.0,
+				mb_s(stage_bytes[i], report.stage[i]));
+		/* Worker compute time overlaps the main thread's waits */
+		if (i != STAGE_COMPUTE || !report.workers) other -= (report.stage[i] < other) ? report.stage[i] : other;
+	}
+	fprintf(stderr, "%-8s %9.3f %5.1f%%\n", "other", (double)other / 1e9,
+			wall ? (double)other * 100.0 / (double)wall : 0.0);
+	fprintf(stderr, "threads: %d, busy", report.nthreads);
+	for (i = 0; i < report.nthreads; i++)
+		fprintf(stderr, " %.1f%%", wall ? (double)report.busy[i] * 100.0 / (double)wall : 0.0);
+	fprintf(stderr, "\nblocks: %" PRIu64 " compressed, %" PRIu64 " stored, %" PRIu64
+			" zero runs (%" PRIu64 " bytes), %" PRIu64 " repeats\n",
+			report.compressed, report.stored, report.zero_runs, report.zero_bytes, report.repeats);
+	fprintf(stderr, "ratio:");
+	for (i = 0; i < RATIO_BUCKETS - 1; i++) fprintf(stderr, " <%d%% %" PRIu64, (i + 1) * 10, report.ratio[i]);
+	fprintf(stderr, " >=100%% %" PRIu64 "\n", report.ratio[RATIO_BUCKETS - 1]);
+	if (report.have_lib) {
+		fprintf(stderr, "finder       calls       hits        bytes\n");
+		for (i = 0; i < LZJODY_STAT_FINDERS; i++)
+			fprintf(stderr, "%-9s %10" PRIu64 " %10" PRIu64 " %12" PRIu64 "\n", finder_names[i],
+					report.lib.calls[i], report.lib.hits[i], report.lib.bytes[i]);
+		fprintf(stderr, "byte plane: %" PRIu64 " of %" PRIu64 " kept; full LZ indexes: %" PRIu64 "\ncycles:",
+				report.lib.plane_used, report.lib.plane_tried, report.lib.index_full);
+		for (i = 0; i < LZJODY_STAGES; i++)
+			fprintf(stderr, " %s %" PRIu64, lib_stage_names[i], report.lib.ticks[i]);
+		fprintf(stderr, "\n");
+	}
+	return;
+}
+
+
+/* Print the report to stderr */
+extern void report_print(void)
+{
+	const uint64_t wall = report_clock() - report.start;
+	uint64_t raw, packed;
+
+	if (!report.enabled) return;
+	/* Without workers the main thread is busy exactly while it computes */
+	if (!report.workers) {
+		if (report_threads(1) != 0) return;
+		report.workers = 0;
+		report.busy[0] = report.stage[STAGE_COMPUTE];
+	}
+	raw = report.bytes_in;
+	packed = report.bytes_out;
+	if (report.json) print_json(wall, raw, packed);
+	else print_text(wall, raw, packed);
+	free(report.busy);
+	report.busy = NULL;
+	return;
+}
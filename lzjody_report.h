@@ -0,0 +1,58 @@
+/*
+ * Lempel-Ziv-JodyBruchon compression library
+ *
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * Released under The MIT License
+ */
+
+#ifndef LZJODY_REPORT_H
+#define LZJODY_REPORT_H
+
+#include <stdint.h>
+#include "lzjody.h"
+
+/* Where the utility's main thread spends its time */
+#define STAGE_READ 0	/* Waiting for input */
+#define STAGE_COMPUTE 1	/* Compressing or decompressing (summed over workers) */
+#define STAGE_REORDER 2	/* Waiting for workers to hand back blocks in order */
+#define STAGE_WRITE 3	/* Writing or queueing output */
+#define STAGES 4
+
+/* Block ratio histogram: tenths of the input size, then 100% and over */
+#define RATIO_BUCKETS 11
+
+/* Pipeline timing and block statistics for --stats */
+struct report_t {
+	int enabled;
+	int json;	/* --stats=json */
+	int decompress;
+	uint64_t start;	/* report_clock() at report_start() */
+	uint64_t stage[STAGES];	/* Nanoseconds per stage */
+	uint64_t bytes_in;	/* Uncompressed bytes */
+	uint64_t bytes_out;	/* Compressed bytes (header included) */
+	uint64_t compressed;	/* Blocks that got smaller */
+	uint64_t stored;	/* Blocks that didn't (kept as literals) */
+	uint64_t zero_runs;
+	uint64_t zero_bytes;
+	uint64_t repeats;	/* Repeat and reference block records */
+	uint64_t ratio[RATIO_BUCKETS];
+	int nthreads;
+	int workers;	/* Worker threads compute, not the main thread */
+	uint64_t *busy;	/* Nanoseconds each worker spent compressing */
+	int have_lib;	/* lib holds compressor counters (STATS=1 library) */
+	struct lzjody_stats lib;
+};
+
+extern struct report_t report;
+
+extern uint64_t report_clock(void);
+extern void report_start(const int json, const int decompress);
+extern int report_threads(const int nthreads);
+extern void report_time(const int stage, const uint64_t since);
+extern void report_record(const unsigned int type, const uint64_t in_len, const uint64_t out_len);
+extern void report_chunk(const unsigned char * const out, const int out_len,
+		const int in_len, const unsigned int options);
+extern void report_lib(const struct lzjody_stats * const stats);
+extern void report_print(void);
+
+#endif	/* LZJODY_REPORT_H */
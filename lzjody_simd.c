@@ -0,0 +1,540 @@
+/*
+ * Lempel-Ziv-JodyBruchon compression library
+ *
+ * CPU feature dispatch for the hot loops
+ *
+ * One binary has to run well on every x86 machine it lands on, so the
+ * library is built for a generic target and the loops that dominate
+ * compression and decompression come in scalar, SSE4.2 and AVX2 versions.
+ * The CPU is checked once when the library is loaded and lzjody_kern is
+ * pointed at the fastest set it supports. Other compilers and CPUs always
+ * get the scalar set, which is also the reference for the others: every
+ * set must give exactly the same results.
+ *
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * Released under The MIT License
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lzjody_simd.h"
+
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+ #define SIMD_DISPATCH
+ #include <immintrin.h>
+ #define TARGET_SSE42 __attribute__((target("sse4.2,popcnt")))
+ #define TARGET_AVX2 __attribute__((target("avx2,sse4.2,popcnt,bmi")))
+#endif
+
+/* Whole 64-bit words are compared where the byte order makes the first
+ * differing byte easy to find */
+#if defined __GNUC__ && defined __BYTE_ORDER__ && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+ #define SCALAR_WORDS
+#endif
+
+/* CRC32C (Castagnoli) lookup table for block checksums */
+static const uint32_t crc32c_table[256] = {
+	0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c,
+	0x26a1e7e8, 0xd4ca64eb, 0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b,
+	0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24, 0x105ec76f, 0xe235446c,
+	0xf165b798, 0x030e349b, 0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+	0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54, 0x5d1d08bf, 0xaf768bbc,
+	0xbc267848, 0x4e4dfb4b, 0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a,
+	0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35, 0xaa64d611, 0x580f5512,
+	0x4b5fa6e6, 0xb93425e5, 0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+	0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45, 0xf779deae, 0x05125dad,
+	0x1642ae59, 0xe4292d5a, 0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a,
+	0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595, 0x417b1dbc, 0xb3109ebf,
+	0xa0406d4b, 0x522bee48, 0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+	0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687, 0x0c38d26c, 0xfe53516f,
+	0xed03a29b, 0x1f682198, 0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927,
+	0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38, 0xdbfc821c, 0x2997011f,
+	0x3ac7f2eb, 0xc8ac71e8, 0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+	0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096, 0xa65c047d, 0x5437877e,
+	0x4767748a, 0xb50cf789, 0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859,
+	0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46, 0x7198540d, 0x83f3d70e,
+	0x90a324fa, 0x62c8a7f9, 0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+	0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36, 0x3cdb9bdd, 0xceb018de,
+	0xdde0eb2a, 0x2f8b6829, 0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c,
+	0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93, 0x082f63b7, 0xfa44e0b4,
+	0xe9141340, 0x1b7f9043, 0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+	0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3, 0x55326b08, 0xa759e80b,
+	0xb4091bff, 0x466298fc, 0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c,
+	0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033, 0xa24bb5a6, 0x502036a5,
+	0x4370c551, 0xb11b4652, 0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+	0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d, 0xef087a76, 0x1d63f975,
+	0x0e330a81, 0xfc588982, 0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d,
+	0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622, 0x38cc2a06, 0xcaa7a905,
+	0xd9f75af1, 0x2b9cd9f2, 0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+	0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530, 0x0417b1db, 0xf67c32d8,
+	0xe52cc12c, 0x1747422f, 0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff,
+	0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0, 0xd3d3e1ab, 0x21b862a8,
+	0x32e8915c, 0xc083125f, 0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+	0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90, 0x9e902e7b, 0x6cfbad78,
+	0x7fab5e8c, 0x8dc0dd8f, 0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee,
+	0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1, 0x69e9f0d5, 0x9b8273d6,
+	0x88d28022, 0x7ab90321, 0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+	0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81, 0x34f4f86a, 0xc69f7b69,
+	0xd5cf889d, 0x27a40b9e, 0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e,
+	0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351
+};
+
+
+/* Where each of the four planes starts in byte plane transformed data */
+static void plane_offsets(const unsigned int length, unsigned int * const off)
+{
+	const unsigned int quads = length >> 2, extra = length & 3;
+
+	off[0] = 0;
+	off[1] = quads + (extra > 0);
+	off[2] = off[1] + quads + (extra > 1);
+	off[3] = off[2] + quads + (extra > 2);
+	return;
+}
+
+
+/**** Scalar kernels ****/
+
+static unsigned int match_len_scalar(const unsigned char * const a,
+		const unsigned char * const b, const unsigned int limit)
+{
+	unsigned int i = 0;
+#ifdef SCALAR_WORDS
+	uint64_t wa, wb;
+
+	for (; (i + 8) <= limit; i += 8) {
+		memcpy(&wa, a + i, 8);
+		memcpy(&wb, b + i, 8);
+		if (wa != wb) return i + ((unsigned int)__builtin_ctzll(wa ^ wb) >> 3);
+	}
+#endif
+	while (i < limit && *(a + i) == *(b + i)) i++;
+	return i;
+}
+
+static unsigned int run_len_scalar(const unsigned char * const p,
+		const unsigned char c, const unsigned int limit)
+{
+	unsigned int i = 0;
+#ifdef SCALAR_WORDS
+	const uint64_t wc = c * 0x0101010101010101ULL;
+	uint64_t w;
+
+	for (; (i + 8) <= limit; i += 8) {
+		memcpy(&w, p + i, 8);
+		if (w != wc) return i + ((unsigned int)__builtin_ctzll(w ^ wc) >> 3);
+	}
+#endif
+	while (i < limit && *(p + i) == c) i++;
+	return i;
+}
+
+/* Finish a sequence scan at i, where the byte should be p[0] + i * diff */
+static unsigned int seq8_tail(const unsigned char * const p, const unsigned char diff,
+		unsigned int i, const unsigned int limit)
+{
+	unsigned char v = (unsigned char)(*p + i * diff);
+
+	while (i < limit && *(p + i) == v) {
+		i++;
+		v = (unsigned char)(v + diff);
+	}
+	return i;
+}
+
+static unsigned int seq8_len_scalar(const unsigned char * const p,
+		const unsigned char diff, const unsigned int limit)
+{
+	return seq8_tail(p, diff, 0, limit);
+}
+
+static int is_zero_scalar(const unsigned char * const in, const unsigned int length)
+{
+	unsigned int i = 0;
+	uint64_t w;
+
+	for (; (i + 8) <= length; i += 8) {
+		memcpy(&w, in + i, 8);
+		if (w != 0) return 0;
+	}
+	for (; i < length; i++) if (*(in + i) != 0) return 0;
+	return 1;
+}
+
+static void copy_scalar(unsigned char * const dst, const unsigned char * const src,
+		const unsigned int length)
+{
+	unsigned int i = 0;
+	uint64_t w;
+
+	/* Words can be moved unless the source is less than a word behind */
+	if ((uintptr_t)src > (uintptr_t)dst || ((uintptr_t)dst - (uintptr_t)src) >= 8) {
+		for (; (i + 8) <= length; i += 8) {
+			memcpy(&w, src + i, 8);
+			memcpy(dst + i, &w, 8);
+		}
+	}
+	for (; i < length; i++) *(dst + i) = *(src + i);
+	return;
+}
+
+/* Plane transforms pick up at byte 'start' (a multiple of 4) */
+static void plane_split_tail(const unsigned char * const in, unsigned char * const out,
+		const unsigned int length, const unsigned int start)
+{
+	unsigned int off[4], plane, i;
+
+	plane_offsets(length, off);
+	for (plane = 0; plane < 4; plane++)
+		for (i = start + plane; i < length; i += 4) *(out + off[plane] + (i >> 2)) = *(in + i);
+	return;
+}
+
+static void plane_join_tail(const unsigned char * const in, unsigned char * const out,
+		const unsigned int length, const unsigned int start)
+{
+	unsigned int off[4], plane, i;
+
+	plane_offsets(length, off);
+	for (plane = 0; plane < 4; plane++)
+		for (i = start + plane; i < length; i += 4) *(out + i) = *(in + off[plane] + (i >> 2));
+	return;
+}
+
+static void plane_split_scalar(const unsigned char * const in, unsigned char * const out,
+		const unsigned int length)
+{
+	plane_split_tail(in, out, length, 0);
+	return;
+}
+
+static void plane_join_scalar(const unsigned char * const in, unsigned char * const out,
+		const unsigned int length)
+{
+	plane_join_tail(in, out, length, 0);
+	return;
+}
+
+static uint32_t crc32c_scalar(uint32_t crc, const unsigned char * const data,
+		const size_t length)
+{
+	size_t i;
+
+	for (i = 0; i < length; i++) crc = crc32c_table[(crc ^ *(data + i)) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+
+#ifdef SIMD_DISPATCH
+/**** SSE4.2 kernels (16 bytes at a time) ****/
+
+#define LOAD128(a) _mm_loadu_si128((const __m128i *)(const void *)(a))
+#define STORE128(a, b) _mm_storeu_si128((__m128i *)(void *)(a), (b))
+
+/* 4x4 byte transpose: one quad per row in, one plane per row out (and back) */
+#define PLANE_SHUFFLE 0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15
+
+TARGET_SSE42 static unsigned int match_len_sse42(const unsigned char * const a,
+		const unsigned char * const b, const unsigned int limit)
+{
+	unsigned int i = 0, m;
+
+	for (; (i + 16) <= limit; i += 16) {
+		m = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(LOAD128(a + i), LOAD128(b + i)));
+		if (m != 0xffff) return i + (unsigned int)__builtin_ctz(~m);
+	}
+	return i + match_len_scalar(a + i, b + i, limit - i);
+}
+
+TARGET_SSE42 static unsigned int run_len_sse42(const unsigned char * const p,
+		const unsigned char c, const unsigned int limit)
+{
+	const __m128i vc = _mm_set1_epi8((char)c);
+	unsigned int i = 0, m;
+
+	for (; (i + 16) <= limit; i += 16) {
+		m = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(LOAD128(p + i), vc));
+		if (m != 0xffff) return i + (unsigned int)__builtin_ctz(~m);
+	}
+	return i + run_len_scalar(p + i, c, limit - i);
+}
+
+TARGET_SSE42 static unsigned int seq8_len_sse42(const unsigned char * const p,
+		const unsigned char diff, const unsigned int limit)
+{
+	const __m128i step = _mm_set1_epi8((char)(diff * 16));
+	unsigned char first[16];
+	__m128i want;
+	unsigned int i, m;
+
+	/* Most sequences end within a few bytes; don't build a vector for those */
+	i = seq8_tail(p, diff, 0, limit < 16 ? limit : 16);
+	if (i < 16) return i;
+	for (i = 0; i < 16; i++) first[i] = (unsigned char)(*p + i * diff);
+	want = LOAD128(first);
+	for (i = 0; (i + 16) <= limit; i += 16) {
+		m = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(LOAD128(p + i), want));
+		if (m != 0xffff) return i + (unsigned int)__builtin_ctz(~m);
+		want = _mm_add_epi8(want, step);
+	}
+	return seq8_tail(p, diff, i, limit);
+}
+
+TARGET_SSE42 static int is_zero_sse42(const unsigned char * const in, const unsigned int length)
+{
+	unsigned int i = 0;
+	__m128i acc;
+
+	/* Test 64 bytes per pass so non-zero blocks are rejected quickly */
+	for (; (i + 64) <= length; i += 64) {
+		acc = _mm_or_si128(_mm_or_si128(LOAD128(in + i), LOAD128(in + i + 16)),
+				_mm_or_si128(LOAD128(in + i + 32), LOAD128(in + i + 48)));
+		if (!_mm_testz_si128(acc, acc)) return 0;
+	}
+	return is_zero_scalar(in + i, length - i);
+}
+
+TARGET_SSE42 static void copy_sse42(unsigned char * const dst, const unsigned char * const src,
+		const unsigned int length)
+{
+	unsigned int i = 0;
+
+	if ((uintptr_t)src > (uintptr_t)dst || ((uintptr_t)dst - (uintptr_t)src) >= 16)
+		for (; (i + 16) <= length; i += 16) STORE128(dst + i, LOAD128(src + i));
+	copy_scalar(dst + i, src + i, length - i);
+	return;
+}
+
+TARGET_SSE42 static void plane_split_sse42(const unsigned char * const in,
+		unsigned char * const out, const unsigned int length)
+{
+	const __m128i shuf = _mm_setr_epi8(PLANE_SHUFFLE);
+	unsigned int off[4], i;
+	uint32_t w;
+	__m128i v;
+
+	plane_offsets(length, off);
+	for (i = 0; (i + 16) <= length; i += 16) {
+		v = _mm_shuffle_epi8(LOAD128(in + i), shuf);
+		w = (uint32_t)_mm_cvtsi128_si32(v);
+		memcpy(out + off[0] + (i >> 2), &w, 4);
+		w = (uint32_t)_mm_extract_epi32(v, 1);
+		memcpy(out + off[1] + (i >> 2), &w, 4);
+		w = (uint32_t)_mm_extract_epi32(v, 2);
+		memcpy(out + off[2] + (i >> 2), &w, 4);
+		w = (uint32_t)_mm_extract_epi32(v, 3);
+		memcpy(out + off[3] + (i >> 2), &w, 4);
+	}
+	plane_split_tail(in, out, length, i);
+	return;
+}
+
+TARGET_SSE42 static void plane_join_sse42(const unsigned char * const in,
+		unsigned char * const out, const unsigned int length)
+{
+	const __m128i shuf = _mm_setr_epi8(PLANE_SHUFFLE);
+	unsigned char quad[16];
+	unsigned int off[4], i, plane;
+
+	plane_offsets(length, off);
+	for (i = 0; (i + 16) <= length; i += 16) {
+		for (plane = 0; plane < 4; plane++)
+			memcpy(quad + (plane << 2), in + off[plane] + (i >> 2), 4);
+		STORE128(out + i, _mm_shuffle_epi8(LOAD128(quad), shuf));
+	}
+	plane_join_tail(in, out, length, i);
+	return;
+}
+
+TARGET_SSE42 static uint32_t crc32c_sse42(uint32_t crc, const unsigned char * const data,
+		const size_t length)
+{
+	size_t i = 0;
+#ifdef __x86_64__
+	uint64_t c64 = crc, w;
+
+	for (; (i + 8) <= length; i += 8) {
+		memcpy(&w, data + i, 8);
+		c64 = _mm_crc32_u64(c64, w);
+	}
+	crc = (uint32_t)c64;
+#endif
+	for (; i < length; i++) crc = _mm_crc32_u8(crc, *(data + i));
+	return crc;
+}
+
+
+/**** AVX2 kernels (32 bytes at a time) ****/
+
+#define LOAD256(a) _mm256_loadu_si256((const __m256i *)(const void *)(a))
+#define STORE256(a, b) _mm256_storeu_si256((__m256i *)(void *)(a), (b))
+
+/* The SSE4.2 kernels that finish off a tail use legacy SSE encodings;
+ * running those with dirty upper ymm halves costs a state transition on
+ * every call, so clear them first */
+
+TARGET_AVX2 static unsigned int match_len_avx2(const unsigned char * const a,
+		const unsigned char * const b, const unsigned int limit)
+{
+	unsigned int i = 0, m;
+
+	for (; (i + 32) <= limit; i += 32) {
+		m = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(LOAD256(a + i), LOAD256(b + i)));
+		if (m != 0xffffffffU) return i + (unsigned int)__builtin_ctz(~m);
+	}
+	_mm256_zeroupper();
+	return i + match_len_sse42(a + i, b + i, limit - i);
+}
+
+TARGET_AVX2 static unsigned int run_len_avx2(const unsigned char * const p,
+		const unsigned char c, const unsigned int limit)
+{
+	const __m256i vc = _mm256_set1_epi8((char)c);
+	unsigned int i = 0, m;
+
+	for (; (i + 32) <= limit; i += 32) {
+		m = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(LOAD256(p + i), vc));
+		if (m != 0xffffffffU) return i + (unsigned int)__builtin_ctz(~m);
+	}
+	_mm256_zeroupper();
+	return i + run_len_sse42(p + i, c, limit - i);
+}
+
+TARGET_AVX2 static unsigned int seq8_len_avx2(const unsigned char * const p,
+		const unsigned char diff, const unsigned int limit)
+{
+	const __m256i step = _mm256_set1_epi8((char)(diff * 32));
+	unsigned char first[32];
+	__m256i want;
+	unsigned int i, m;
+
+	i = seq8_tail(p, diff, 0, limit < 32 ? limit : 32);
+	if (i < 32) return i;
+	for (i = 0; i < 32; i++) first[i] = (unsigned char)(*p + i * diff);
+	want = LOAD256(first);
+	for (i = 0; (i + 32) <= limit; i += 32) {
+		m = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(LOAD256(p + i), want));
+		if (m != 0xffffffffU) return i + (unsigned int)__builtin_ctz(~m);
+		want = _mm256_add_epi8(want, step);
+	}
+	return seq8_tail(p, diff, i, limit);
+}
+
+TARGET_AVX2 static int is_zero_avx2(const unsigned char * const in, const unsigned int length)
+{
+	unsigned int i = 0;
+	__m256i acc;
+
+	for (; (i + 128) <= length; i += 128) {
+		acc = _mm256_or_si256(_mm256_or_si256(LOAD256(in + i), LOAD256(in + i + 32)),
+				_mm256_or_si256(LOAD256(in + i + 64), LOAD256(in + i + 96)));
+		if (!_mm256_testz_si256(acc, acc)) return 0;
+	}
+	_mm256_zeroupper();
+	return is_zero_sse42(in + i, length - i);
+}
+
+TARGET_AVX2 static void copy_avx2(unsigned char * const dst, const unsigned char * const src,
+		const unsigned int length)
+{
+	unsigned int i = 0;
+
+	if ((uintptr_t)src > (uintptr_t)dst || ((uintptr_t)dst - (uintptr_t)src) >= 32)
+		for (; (i + 32) <= length; i += 32) STORE256(dst + i, LOAD256(src + i));
+	_mm256_zeroupper();
+	copy_sse42(dst + i, src + i, length - i);
+	return;
+}
+
+/* 32 bytes are two transposes, one per 128-bit lane; the dword permute
+ * then puts each plane's two halves next to each other */
+TARGET_AVX2 static void plane_split_avx2(const unsigned char * const in,
+		unsigned char * const out, const unsigned int length)
+{
+	const __m256i shuf = _mm256_setr_epi8(PLANE_SHUFFLE, PLANE_SHUFFLE);
+	const __m256i perm = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	unsigned char planes[32];
+	unsigned int off[4], i, plane;
+
+	plane_offsets(length, off);
+	for (i = 0; (i + 32) <= length; i += 32) {
+		STORE256(planes, _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(LOAD256(in + i), shuf), perm));
+		for (plane = 0; plane < 4; plane++)
+			memcpy(out + off[plane] + (i >> 2), planes + (plane << 3), 8);
+	}
+	plane_split_tail(in, out, length, i);
+	return;
+}
+
+TARGET_AVX2 static void plane_join_avx2(const unsigned char * const in,
+		unsigned char * const out, const unsigned int length)
+{
+	const __m256i shuf = _mm256_setr_epi8(PLANE_SHUFFLE, PLANE_SHUFFLE);
+	const __m256i perm = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+	unsigned char planes[32];
+	unsigned int off[4], i, plane;
+
+	plane_offsets(length, off);
+	for (i = 0; (i + 32) <= length; i += 32) {
+		for (plane = 0; plane < 4; plane++)
+			memcpy(planes + (plane << 3), in + off[plane] + (i >> 2), 8);
+		STORE256(out + i, _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(LOAD256(planes), perm), shuf));
+	}
+	plane_join_tail(in, out, length, i);
+	return;
+}
+
+static const struct lzjody_kernels kern_sse42 = {
+	SIMD_SSE42, "sse4.2",
+	match_len_sse42, run_len_sse42, seq8_len_sse42, is_zero_sse42,
+	copy_sse42, plane_split_sse42, plane_join_sse42, crc32c_sse42
+};
+
+static const struct lzjody_kernels kern_avx2 = {
+	SIMD_AVX2, "avx2",
+	match_len_avx2, run_len_avx2, seq8_len_avx2, is_zero_avx2,
+	copy_avx2, plane_split_avx2, plane_join_avx2, crc32c_sse42
+};
+#endif	/* SIMD_DISPATCH */
+
+
+#define KERN_SCALAR { \
+	SIMD_SCALAR, "scalar", \
+	match_len_scalar, run_len_scalar, seq8_len_scalar, is_zero_scalar, \
+	copy_scalar, plane_split_scalar, plane_join_scalar, crc32c_scalar \
+}
+static const struct lzjody_kernels kern_scalar = KERN_SCALAR;
+
+/* Scalar until lzjody_simd_init() has looked at the CPU */
+struct lzjody_kernels lzjody_kern = KERN_SCALAR;
+
+/* Bind the fastest kernel set the CPU supports; runs when the library
+ * is loaded, before any thread can call into it */
+#ifdef __GNUC__
+__attribute__((constructor))
+#endif
+extern void lzjody_simd_init(void)
+{
+	const char *cap = getenv("LZJODY_SIMD");
+	int max = SIMD_AVX2;
+
+	if (cap != NULL) {
+		if (!strcmp(cap, "scalar")) max = SIMD_SCALAR;
+		else if (!strcmp(cap, "sse4.2")) max = SIMD_SSE42;
+	}
+	lzjody_kern = kern_scalar;
+#ifdef SIMD_DISPATCH
+	__builtin_cpu_init();
+	/* Each set may use every extension its TARGET_xxx attribute names */
+	if (max >= SIMD_AVX2 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi")
+			&& __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt"))
+		lzjody_kern = kern_avx2;
+	else if (max >= SIMD_SSE42 && __builtin_cpu_supports("sse4.2")
+			&& __builtin_cpu_supports("popcnt"))
+		lzjody_kern = kern_sse42;
+#else
+	(void)max;
+#endif
+	return;
+}
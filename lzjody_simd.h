@@ -0,0 +1,44 @@
+/*
+ * Lempel-Ziv-JodyBruchon compression library
+ *
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * Released under The MIT License
+ */
+
+#ifndef LZJODY_SIMD_H
+#define LZJODY_SIMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Kernel sets, slowest first; LZJODY_SIMD=scalar|sse4.2|avx2 in the
+ * environment caps the set picked at startup */
+#define SIMD_SCALAR 0
+#define SIMD_SSE42  1
+#define SIMD_AVX2   2
+
+/* Hot loops bound to the fastest version the CPU supports */
+struct lzjody_kernels {
+	int level;	/* SIMD_xxx */
+	const char *name;
+	/* Number of equal leading bytes of a and b, at most limit */
+	unsigned int (*match_len)(const unsigned char *, const unsigned char *, unsigned int);
+	/* Number of leading bytes equal to c, at most limit */
+	unsigned int (*run_len)(const unsigned char *, unsigned char, unsigned int);
+	/* Number of leading bytes equal to the first plus diff per byte */
+	unsigned int (*seq8_len)(const unsigned char *, unsigned char, unsigned int);
+	/* 1 if all bytes are zero */
+	int (*is_zero)(const unsigned char *, unsigned int);
+	/* Copy exactly like a forward byte loop, overlap included */
+	void (*copy)(unsigned char *, const unsigned char *, unsigned int);
+	/* 4-plane byte plane transform and its reverse (byteplane_transform()) */
+	void (*plane_split)(const unsigned char *, unsigned char *, unsigned int);
+	void (*plane_join)(const unsigned char *, unsigned char *, unsigned int);
+	/* CRC32C update without the initial or final inversion */
+	uint32_t (*crc32c)(uint32_t, const unsigned char *, size_t);
+};
+
+extern struct lzjody_kernels lzjody_kern;
+extern void lzjody_simd_init(void);
+
+#endif	/* LZJODY_SIMD_H */
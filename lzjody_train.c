@@ -0,0 +1,429 @@
+/*
+ * lzjody dictionary trainer
+ *
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * Released under The MIT License
+ *
+ * Builds a preset dictionary for lzjody_compress_dict() from sample files.
+ * Every sample is cut into compression blocks and each TRAIN_K-byte string
+ * is counted once per block that contains it: a string that starts many
+ * blocks' worth of data is one that lzjody_find_lz() cannot match from an
+ * empty history but could match from a dictionary. Segments of the samples
+ * with the most such strings are picked and ranked by estimated savings;
+ * the best ones go at the end of the dictionary where LZ distances into it
+ * are shortest and cheapest to encode.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef THREADED
+ #include <pthread.h>
+#endif
+#include "lzjody.h"
+
+/* Length of counted strings; longer than MIN_LZ_MATCH so that
+ * a dictionary match pays for its command bytes */
+#define TRAIN_K 8
+/* Counter table size (hashed strings, collisions are tolerated) */
+#define TRAIN_HASH_BITS 20
+#define TRAIN_HASH_SIZE (1U << TRAIN_HASH_BITS)
+/* Default dictionary and segment sizes */
+#define TRAIN_DICT_SIZE 4096
+#define TRAIN_SEG_LEN 64
+/* Sample data is split into epochs of at least this many segments,
+ * each of which offers its best segment to the dictionary */
+#define TRAIN_EPOCH_SEGS 16
+#define TRAIN_EPOCHS_MAX 65536
+/* lzjody token cost model: an LZ match into the dictionary is a command
+ * byte, one distance byte (two for wide distances over 0x7ff) and a
+ * length byte; 4 KiB blocks reach back 0xfff bytes */
+#define TRAIN_NEAR_DIST 0x7ff
+#define TRAIN_LEGACY_DIST 0xfff
+#define TRAIN_NEAR_COST 3
+#define TRAIN_FAR_COST 4
+
+struct sample_blk {
+	size_t start;
+	unsigned int length;
+};
+
+struct segment {
+	size_t start;
+	uint64_t score;	/* Sum of block counts of the segment's strings */
+};
+
+struct trainer {
+	unsigned char *data;	/* All samples back to back */
+	size_t size;
+	struct sample_blk *blks;
+	size_t nblks;
+	unsigned int seg_len;
+	uint32_t *counts;	/* Blocks containing each string */
+	struct segment *segs;	/* Best segment of each epoch */
+	size_t nepochs;
+	int nthreads;
+};
+
+/* Per-thread counting state */
+struct count_job {
+	struct trainer *t;
+	uint32_t *counts;
+	uint32_t *last;	/* Last block (plus one) that counted each string */
+	int thread;
+};
+
+
+static inline uint32_t kgram_hash(const unsigned char * const p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return (uint32_t)((v * 0x9e3779b97f4a7c15ULL) >> (64 - TRAIN_HASH_BITS));
+}
+
+
+/* Range of work items [*first, *end) for one thread */
+static void thread_range(const size_t n, const int nthreads, const int thread,
+		size_t * const first, size_t * const end)
+{
+	const size_t per = n / (size_t)nthreads;
+	const size_t rem = n % (size_t)nthreads;
+	const size_t t = (size_t)thread;
+
+	*first = t * per + ((t < rem) ? t : rem);
+	*end = *first + per + ((t < rem) ? 1 : 0);
+	return;
+}
+
+
+/* Count every string once per block in this thread's share of blocks */
+static void *count_task(void *arg)
+{
+	struct count_job * const job = (struct count_job *)arg;
+	const struct trainer * const t = job->t;
+	size_t first, end;
+	uint32_t h;
+
+	thread_range(t->nblks, t->nthreads, job->thread, &first, &end);
+	for (size_t b = first; b < end; b++) {
+		const unsigned char *p = t->data + t->blks[b].start;
+
+		if (t->blks[b].length < TRAIN_K) continue;
+		for (unsigned int i = 0; i <= t->blks[b].length - TRAIN_K; i++) {
+			h = kgram_hash(p + i);
+			if (job->last[h] == b + 1) continue;
+			job->last[h] = (uint32_t)(b + 1);
+			job->counts[h]++;
+		}
+	}
+	return NULL;
+}
+
+
+/* Score of the segment at pos: block counts of all strings it holds */
+static uint64_t segment_score(const struct trainer * const t, const size_t pos)
+{
+	uint64_t score = 0;
+
+	for (unsigned int i = 0; i <= t->seg_len - TRAIN_K; i++)
+		score += t->counts[kgram_hash(t->data + pos + i)];
+	return score;
+}
+
+
+/* Find the best segment of an epoch by sliding a window of string counts */
+static void epoch_best(const struct trainer * const t, const size_t e)
+{
+	const size_t epoch_len = t->size / t->nepochs;
+	const unsigned int grams = t->seg_len - TRAIN_K + 1;
+	const size_t lo = e * epoch_len;
+	const size_t hi = (e + 1 == t->nepochs) ? t->size : lo + epoch_len;
+	uint64_t score;
+
+	t->segs[e].start = 0;
+	t->segs[e].score = 0;
+	if (hi - lo < t->seg_len) return;
+	score = segment_score(t, lo);
+	for (size_t pos = lo; ; pos++) {
+		if (score > t->segs[e].score) {
+			t->segs[e].score = score;
+			t->segs[e].start = pos;
+		}
+		if (pos + t->seg_len >= hi) break;
+		score -= t->counts[kgram_hash(t->data + pos)];
+		score += t->counts[kgram_hash(t->data + pos + grams)];
+	}
+	return;
+}
+
+
+/* Score every epoch in this thread's share of epochs */
+static void *select_task(void *arg)
+{
+	struct count_job * const job = (struct count_job *)arg;
+	size_t first, end;
+
+	thread_range(job->t->nepochs, job->t->nthreads, job->thread, &first, &end);
+	for (size_t e = first; e < end; e++) epoch_best(job->t, e);
+	return NULL;
+}
+
+
+/* Run a task on every thread (the calling thread included) */
+static int run_threads(void *(*task)(void *), struct count_job * const jobs,
+		const int nthreads)
+{
+#ifdef THREADED
+	pthread_t *thr;
+	int started;
+
+	thr = (pthread_t *)malloc(sizeof(pthread_t) * (size_t)nthreads);
+	if (thr == NULL) return -1;
+	for (started = 1; started < nthreads; started++)
+		if (pthread_create(thr + started, NULL, task, jobs + started) != 0) break;
+	task(jobs);
+	for (int i = 1; i < started; i++) pthread_join(thr[i], NULL);
+	free(thr);
+	/* Shares of threads that failed to start run here */
+	for (int i = started; i < nthreads; i++) task(jobs + i);
+	return 0;
+#else
+	for (int i = 0; i < nthreads; i++) task(jobs + i);
+	return 0;
+#endif
+}
+
+
+/* Read one sample file onto the end of the sample data */
+static int load_file(struct trainer * const t, const char * const name,
+		const off_t length, const unsigned int bsize)
+{
+	FILE *fp;
+	size_t got, blocks, size;
+	unsigned char *data;
+	struct sample_blk *blks;
+
+	if (length <= 0) return 0;
+	size = (size_t)length;
+	data = (unsigned char *)realloc(t->data, t->size + size);
+	if (data == NULL) return -1;
+	t->data = data;
+	fp = fopen(name, "rb");
+	if (fp == NULL) goto error_open;
+	got = fread(t->data + t->size, 1, size, fp);
+	fclose(fp);
+	if (got != size) goto error_read;
+
+	blocks = (size + bsize - 1) / bsize;
+	blks = (struct sample_blk *)realloc(t->blks, sizeof(struct sample_blk) * (t->nblks + blocks));
+	if (blks == NULL) return -1;
+	t->blks = blks;
+	for (size_t i = 0; i < size; i += bsize) {
+		t->blks[t->nblks].start = t->size + i;
+		t->blks[t->nblks].length = (size - i < bsize) ? (unsigned int)(size - i) : bsize;
+		t->nblks++;
+	}
+	t->size += size;
+	return 0;
+
+error_open:
+	fprintf(stderr, "lzjody-train: error: cannot open '%s': %s\n", name, strerror(errno));
+	return -2;
+error_read:
+	fprintf(stderr, "lzjody-train: error: cannot read '%s'\n", name);
+	return -2;
+}
+
+
+/* Load a sample file, or every regular file below a directory */
+static int load_samples(struct trainer * const t, const char * const name,
+		const unsigned int bsize)
+{
+	struct stat st;
+	DIR *dir;
+	struct dirent *de;
+	char *path;
+	int err = 0;
+
+	if (stat(name, &st) != 0) goto error_stat;
+	if (S_ISREG(st.st_mode)) return load_file(t, name, st.st_size, bsize);
+	if (!S_ISDIR(st.st_mode)) return 0;
+
+	dir = opendir(name);
+	if (dir == NULL) goto error_stat;
+	while (err == 0 && (de = readdir(dir)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+		path = (char *)malloc(strlen(name) + strlen(de->d_name) + 2);
+		if (path == NULL) {
+			err = -1;
+			break;
+		}
+		sprintf(path, "%s/%s", name, de->d_name);
+		err = load_samples(t, path, bsize);
+		free(path);
+	}
+	closedir(dir);
+	return err;
+
+error_stat:
+	fprintf(stderr, "lzjody-train: error: cannot read '%s': %s\n", name, strerror(errno));
+	return -2;
+}
+
+
+int main(int argc, char **argv)
+{
+	struct trainer t;
+	struct count_job *jobs = NULL;
+	unsigned char *dict = NULL;
+	struct segment *picks = NULL;
+	const char *out_name = NULL;
+	const char **names = NULL;
+	FILE *out = stdout;
+	unsigned int dict_size = TRAIN_DICT_SIZE, bsize = LZJODY_BSIZE;
+	unsigned int pos, grams, cost, reach, nsegs = 0;
+	size_t best;
+	uint64_t total_savings = 0;
+	int i, err = 0, nsamples = 0;
+
+	memset(&t, 0, sizeof(t));
+	t.seg_len = TRAIN_SEG_LEN;
+	t.nthreads = 1;
+#if defined THREADED && defined _SC_NPROCESSORS_ONLN
+	t.nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (t.nthreads < 1) t.nthreads = 1;
+#endif
+
+	if (argc < 2) goto usage;
+	names = (const char **)malloc(sizeof(char *) * (size_t)argc);
+	if (names == NULL) goto oom;
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-o") && (i + 1) < argc) out_name = argv[++i];
+		else if (!strcmp(argv[i], "-s") && (i + 1) < argc) dict_size = (unsigned int)atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-l") && (i + 1) < argc) t.seg_len = (unsigned int)atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-b") && (i + 1) < argc) bsize = (unsigned int)atoi(argv[++i]) * 1024;
+		else if (!strcmp(argv[i], "-t") && (i + 1) < argc) t.nthreads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-h")) goto usage;
+		else names[nsamples++] = argv[i];
+	}
+	if (nsamples == 0 || dict_size == 0 || dict_size > LZJODY_DICT_MAX) goto usage;
+	if (t.seg_len < TRAIN_K || t.seg_len > dict_size || t.nthreads < 1) goto usage;
+	if (bsize != LZJODY_BSIZE && LZJODY_BSIZE_OF(O_BSIZE_16K) != bsize
+			&& LZJODY_BSIZE_OF(O_BSIZE_64K) != bsize && LZJODY_BSIZE_OF(O_BSIZE_256K) != bsize)
+		goto usage;
+	for (i = 0; i < nsamples; i++) {
+		err = load_samples(&t, names[i], bsize);
+		if (err == -1) goto oom;
+		if (err < 0) goto cleanup;
+	}
+	if (t.size < t.seg_len) goto error_no_data;
+
+	/* Count strings per block on every thread, then merge the counts */
+	jobs = (struct count_job *)calloc((size_t)t.nthreads, sizeof(struct count_job));
+	if (jobs == NULL) goto oom;
+	for (i = 0; i < t.nthreads; i++) {
+		jobs[i].t = &t;
+		jobs[i].thread = i;
+		jobs[i].counts = (uint32_t *)calloc(TRAIN_HASH_SIZE, sizeof(uint32_t));
+		jobs[i].last = (uint32_t *)calloc(TRAIN_HASH_SIZE, sizeof(uint32_t));
+		if (jobs[i].counts == NULL || jobs[i].last == NULL) goto oom;
+	}
+	if (run_threads(count_task, jobs, t.nthreads) < 0) goto oom;
+	t.counts = jobs[0].counts;
+	for (i = 1; i < t.nthreads; i++)
+		for (uint32_t h = 0; h < TRAIN_HASH_SIZE; h++) t.counts[h] += jobs[i].counts[h];
+	/* A string found in only one block gains nothing from a dictionary */
+	for (uint32_t h = 0; h < TRAIN_HASH_SIZE; h++) if (t.counts[h] < 2) t.counts[h] = 0;
+
+	/* Find the best segment of every epoch on all threads */
+	t.nepochs = t.size / ((size_t)t.seg_len * TRAIN_EPOCH_SEGS);
+	if (t.nepochs == 0) t.nepochs = 1;
+	if (t.nepochs > TRAIN_EPOCHS_MAX) t.nepochs = TRAIN_EPOCHS_MAX;
+	t.segs = (struct segment *)calloc(t.nepochs, sizeof(struct segment));
+	picks = (struct segment *)calloc(dict_size / t.seg_len, sizeof(struct segment));
+	if (t.segs == NULL || picks == NULL) goto oom;
+	if (run_threads(select_task, jobs, t.nthreads) < 0) goto oom;
+
+	/* Take the best segment overall until the dictionary is full. Taking
+	 * a segment clears its strings so that copies of it are worth nothing;
+	 * scores only fall, so a stale best is rescored before it is taken */
+	grams = t.seg_len - TRAIN_K + 1;
+	while (nsegs < dict_size / t.seg_len) {
+		best = 0;
+		for (size_t e = 1; e < t.nepochs; e++)
+			if (t.segs[e].score > t.segs[best].score) best = e;
+		if (t.segs[best].score == 0) break;
+		if (segment_score(&t, t.segs[best].start) == t.segs[best].score) {
+			picks[nsegs++] = t.segs[best];
+			for (unsigned int k = 0; k < grams; k++)
+				t.counts[kgram_hash(t.data + t.segs[best].start + k)] = 0;
+		}
+		epoch_best(&t, best);
+	}
+	if (nsegs == 0) goto error_no_data;
+
+	/* Lay out the best segments from the end of the dictionary back, so
+	 * the most valuable ones are the cheapest to reach */
+	dict = (unsigned char *)malloc(dict_size);
+	if (dict == NULL) goto oom;
+	reach = (bsize == LZJODY_BSIZE) ? TRAIN_LEGACY_DIST : TRAIN_NEAR_DIST;
+	pos = dict_size;
+	for (unsigned int s = 0; s < nsegs; s++) {
+		pos -= t.seg_len;
+		memcpy(dict + pos, t.data + picks[s].start, t.seg_len);
+		/* Blocks per string on average times the bytes a match saves */
+		cost = (dict_size - pos <= reach) ? TRAIN_NEAR_COST : TRAIN_FAR_COST;
+		total_savings += picks[s].score * (t.seg_len - cost) / grams;
+	}
+
+	if (out_name != NULL && strcmp(out_name, "-")) {
+		out = fopen(out_name, "wb");
+		if (out == NULL) goto error_open_out;
+	}
+	if (fwrite(dict + pos, 1, dict_size - pos, out) != dict_size - pos) goto error_write;
+	if (out != stdout && fclose(out) != 0) goto error_write;
+	fprintf(stderr, "lzjody-train: %u byte dictionary from %zu blocks (%zu bytes), ~%llu bytes saved\n",
+			dict_size - pos, t.nblks, t.size, (unsigned long long)total_savings);
+	goto cleanup;
+
+error_no_data:
+	fprintf(stderr, "lzjody-train: error: samples have no repeated data to train on\n");
+	err = -2;
+	goto cleanup;
+error_open_out:
+	fprintf(stderr, "lzjody-train: error: cannot open '%s': %s\n", out_name, strerror(errno));
+	err = -2;
+	goto cleanup;
+error_write:
+	fprintf(stderr, "lzjody-train: error: cannot write dictionary\n");
+	err = -2;
+	goto cleanup;
+oom:
+	fprintf(stderr, "lzjody-train: error: out of memory\n");
+	err = -1;
+cleanup:
+	if (jobs != NULL) for (i = 0; i < t.nthreads; i++) {
+		free(jobs[i].counts);
+		free(jobs[i].last);
+	}
+	free(names); free(jobs); free(dict); free(picks);
+	free(t.segs); free(t.blks); free(t.data);
+	exit(err < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+
+usage:
+	fprintf(stderr, "usage: lzjody-train [-o dictfile] [-s size] [-l seglen] [-b size] [-t threads] sample...\n");
+	fprintf(stderr, " sample  a sample file, or a directory searched for sample files\n");
+	fprintf(stderr, " -o  write the dictionary to dictfile (default stdout)\n");
+	fprintf(stderr, " -s  dictionary size in bytes (default %d, maximum %d)\n", TRAIN_DICT_SIZE, LZJODY_DICT_MAX);
+	fprintf(stderr, " -l  length of each dictionary segment (default %d)\n", TRAIN_SEG_LEN);
+	fprintf(stderr, " -b  compression block size in KiB: 4 (default), 16, 64, 256\n");
+	fprintf(stderr, " -t  number of threads (THREADED builds; default one per CPU)\n");
+	exit(EXIT_FAILURE);
+}
@@ -5,6 +5,11 @@
  * Released under The MIT License
  */
 
+/* SEEK_DATA/SEEK_HOLE are GNU extensions */
+#ifndef _GNU_SOURCE
+ #define _GNU_SOURCE
+#endif
+
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,12 +17,20 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef ON_WINDOWS
+ #include <sys/mman.h>
+#endif
 
 #include "likely_unlikely.h"
 #include "lzjody.h"
+#include "lzjody_simd.h"
 #include "lzjody_util.h"
+#include "lzjody_io.h"
+#include "lzjody_report.h"
 
-#define UTIL_BSIZE_ALLOC (UTIL_BSIZE + ((UTIL_BSIZE / LZJODY_BSIZE) * 4))
+#define UTIL_BSIZE_ALLOC (UTIL_BSIZE + ((UTIL_BSIZE / LZJODY_BSIZE) * (4 + LZJODY_CHECK_LEN)))
 
 /* Detect Windows and modify as needed */
 #if defined _WIN32 || defined __CYGWIN__
@@ -46,14 +59,493 @@ struct thread_writes *writes;
 /**** End definitions, start code ****/
 
 
+/* Open a file with O_DIRECT, falling back to stdio where it is missing */
+static FILE *open_direct(const char * const name, const int out)
+{
+#ifdef O_DIRECT
+	int fd;
+	FILE *fp;
+
+	if (out) fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0666);
+	else fd = open(name, O_RDONLY | O_DIRECT);
+	if (fd < 0) return NULL;
+	fp = fdopen(fd, out ? "wb" : "rb");
+	if (fp == NULL) close(fd);
+	return fp;
+#else
+	return fopen(name, out ? "wb" : "rb");
+#endif
+}
+
+
+/* Open named input/output files; sparse input is detected here
+ * mode is a mask of OPEN_* flags for memory-mapping and O_DIRECT */
+static int open_files(const char * const in_name, const char * const out_name,
+		const int mode)
+{
+	struct stat st;
+
+	files.in_name = "stdin";
+	files.out_name = "stdout";
+#ifndef O_DIRECT
+	if (mode & (OPEN_DIRECT_IN | OPEN_DIRECT_OUT))
+		fprintf(stderr, "warning: O_DIRECT is not supported on this platform\n");
+#endif
+	if (in_name != NULL && strcmp(in_name, "-") != 0) {
+		if ((mode & OPEN_DIRECT_IN) && !(mode & OPEN_MAP_IN)) {
+			files.in = open_direct(in_name, 0);
+#ifdef O_DIRECT
+			files.direct_in = 1;
+#endif
+		} else files.in = fopen(in_name, "rb");
+		if (files.in == NULL) return -1;
+		files.in_name = in_name;
+#ifndef ON_WINDOWS
+		/* Regular files are read extent by extent so holes can be skipped
+		 * Block devices take the same path so they can use pread() */
+		files.fd = fileno(files.in);
+		if (fstat(files.fd, &st) == 0 && (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode))) {
+			files.size = st.st_size;
+			if (S_ISBLK(st.st_mode)) {
+				files.size = lseek(files.fd, 0, SEEK_END);
+				if (files.size < 0 || lseek(files.fd, 0, SEEK_SET) != 0) return -1;
+			}
+ #ifdef SEEK_DATA
+			files.sparse = 1;
+ #else
+			/* pread() is still needed for aligned O_DIRECT reads */
+			files.data_end = files.size;
+			files.sparse = files.direct_in;
+ #endif
+			if ((mode & OPEN_MAP_IN) && files.size > 0) {
+				files.map = (unsigned char *)mmap(NULL, (size_t)files.size,
+						PROT_READ, MAP_SHARED, files.fd, 0);
+				if (files.map == MAP_FAILED) return -1;
+				madvise(files.map, (size_t)files.size, MADV_SEQUENTIAL);
+				/* Mapped reads use the sparse read path */
+				if (!files.sparse) files.data_end = files.size;
+				files.sparse = 1;
+			}
+		}
+#else
+		(void)st;
+#endif
+	}
+	if (out_name != NULL && strcmp(out_name, "-") != 0) {
+		/* Shared output mappings need a read/write descriptor */
+		if (mode & OPEN_MAP_OUT) files.out = fopen(out_name, "w+b");
+		else if (mode & OPEN_DIRECT_OUT) {
+			files.out = open_direct(out_name, 1);
+#if defined O_DIRECT && !defined ON_WINDOWS
+			if (files.out != NULL) {
+				if (posix_memalign((void **)&files.dbuf, UTIL_DIRECT_ALIGN, UTIL_BSIZE) != 0)
+					return -2;
+				files.direct_out = 1;
+			}
+#endif
+		} else files.out = fopen(out_name, "wb");
+		if (files.out == NULL) return -2;
+		files.out_name = out_name;
+#ifndef ON_WINDOWS
+		/* Regular output files get holes instead of written zeroes */
+		if (fstat(fileno(files.out), &st) == 0 && S_ISREG(st.st_mode)) {
+			files.out_sparse = 1;
+			files.map_out = mode & OPEN_MAP_OUT;
+		}
+#endif
+	}
+	return 0;
+}
+
+
+/* Map a reference image for delta mode; returns NULL on error */
+static unsigned char *map_reference(const char * const name, uint64_t * const size)
+{
+#ifndef ON_WINDOWS
+	unsigned char *map;
+	off_t end;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) return NULL;
+	/* lseek() also finds the size of a block device */
+	end = lseek(fd, 0, SEEK_END);
+	if (end <= 0) {
+		if (end == 0) errno = EINVAL;
+		close(fd);
+		return NULL;
+	}
+	map = (unsigned char *)mmap(NULL, (size_t)end, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return NULL;
+	*size = (uint64_t)end;
+	return map;
+#else
+	(void)name; (void)size;
+	errno = ENOSYS;
+	return NULL;
+#endif
+}
+
+
+/* Get the next 'len' bytes of compressed input
+ * Mapped input is not copied; *buf is pointed into the mapping instead */
+static int get_input(unsigned char ** const buf, const int len)
+{
+	int got;
+
+	if (files.map != NULL) {
+		got = ((files.size - files.pos) < len) ? (int)(files.size - files.pos) : len;
+		*buf = files.map + files.pos;
+		files.pos += got;
+		return got;
+	}
+	errno = 0;
+	got = fread(*buf, 1, len, files.in);
+	if (ferror(files.in)) return -1;
+	return got;
+}
+
+
+#ifndef ON_WINDOWS
+/* Size the output file to 'size' bytes once and map all of it; the file
+ * is trimmed to the bytes actually written by unmap_output() */
+static int map_output(const uint64_t size)
+{
+	if ((uint64_t)(off_t)size != size || (uint64_t)(size_t)size != size) {
+		errno = EFBIG;
+		return -1;
+	}
+	if (ftruncate(fileno(files.out), (off_t)size) != 0) return -1;
+	files.omap = (unsigned char *)mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fileno(files.out), 0);
+	if (files.omap == MAP_FAILED) {
+		files.omap = NULL;
+		return -1;
+	}
+	madvise(files.omap, (size_t)size, MADV_SEQUENTIAL);
+	files.osize = (off_t)size;
+	files.opos = 0;
+	return 0;
+}
+
+
+/* Worst-case stream size for 'size' bytes of input compressed in UTIL_BSIZE
+ * chunks; a hole costs a zero run record instead of a filesystem block or
+ * more of input, so sparse input can only come in under it */
+static uint64_t stream_bound(const uint64_t size, const unsigned int options)
+{
+	return LZJODY_HEADER_LEN
+		+ (size / UTIL_BSIZE) * lzjody_compress_bound(UTIL_BSIZE, options)
+		+ lzjody_compress_bound((unsigned int)(size % UTIL_BSIZE), options);
+}
+
+
+/* Unmap the output and trim the file to the bytes written */
+static int unmap_output(void)
+{
+	if (files.omap != NULL && munmap(files.omap, (size_t)files.osize) != 0) return -1;
+	files.omap = NULL;
+	if (ftruncate(fileno(files.out), files.opos) != 0) return -1;
+	return 0;
+}
+#endif /* ON_WINDOWS */
+
+
+#ifndef ON_WINDOWS
+/* Plan the next chunk of sparse input at files.pos: either a hole or up
+ * to UTIL_BSIZE bytes of data at *pos; files.pos is moved past it */
+int next_extent(off_t * const pos, int * const length, uint64_t * const hole)
+{
+	*hole = 0;
+	*length = 0;
+	*pos = files.pos;
+	if (files.eof) return 0;
+
+ #ifdef SEEK_DATA
+	if (files.pos >= files.data_end) {
+		off_t next;
+
+		/* Find the next data extent; everything before it is a hole */
+		errno = 0;
+		next = lseek(files.fd, files.pos, SEEK_DATA);
+		if (next < 0 && errno == ENXIO) next = files.size;
+		else if (next < 0) {
+			/* No hole support: treat the whole file as data */
+			if (errno != EINVAL) return -1;
+			next = files.pos;
+			files.data_end = files.size;
+		} else {
+			files.data_end = lseek(files.fd, next, SEEK_HOLE);
+			if (files.data_end < 0) return -1;
+		}
+		if (next >= files.size) files.eof = 1;
+		if (next > files.pos) {
+			*hole = (uint64_t)(next - files.pos);
+			files.pos = next;
+			return 0;
+		}
+		if (files.eof) return 0;
+	}
+ #endif /* SEEK_DATA */
+
+	*length = ((files.data_end - files.pos) < UTIL_BSIZE) ?
+		(int)(files.data_end - files.pos) : UTIL_BSIZE;
+	files.pos += *length;
+	if (files.pos >= files.size) files.eof = 1;
+	return 0;
+}
+
+
+/* Stop using O_DIRECT on a descriptor (for unaligned leftovers) */
+static int drop_direct(const int fd)
+{
+#ifdef O_DIRECT
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags < 0 || fcntl(fd, F_SETFL, flags & ~O_DIRECT) != 0) return -1;
+#else
+	(void)fd;
+#endif
+	return 0;
+}
+
+
+/* Read 'length' bytes of input at 'pos'; a short count means the file shrank
+ * O_DIRECT reads are rounded up to UTIL_DIRECT_ALIGN, so buf must have room */
+int read_at(unsigned char * const buf, const off_t pos, const int length)
+{
+	int got = 0;
+	size_t want;
+	ssize_t i;
+
+	while (got < length) {
+		want = (size_t)(length - got);
+		if (files.direct_in) {
+			if (((pos + got) | (off_t)(uintptr_t)(buf + got)) & (UTIL_DIRECT_ALIGN - 1)) {
+				/* Only a short read can leave us unaligned */
+				if (drop_direct(files.fd) != 0) return -1;
+				files.direct_in = 0;
+			} else want = (size_t)DIRECT_ROUND(want);
+		}
+		i = pread(files.fd, buf + got, want, pos + got);
+		if (i < 0 && errno == EINTR) continue;
+		if (i < 0) return -1;
+		if (i == 0) break;
+		if (i > length - got) i = length - got;
+		got += (int)i;
+	}
+	return got;
+}
+#endif /* ON_WINDOWS */
+
+
+/* Read the next chunk of input (up to UTIL_BSIZE bytes) into *buf
+ * In sparse mode a hole is not read; its size is returned in *hole instead
+ * Mapped input is not read either; *buf is pointed into the mapping */
+int read_chunk(unsigned char ** const buf, uint64_t * const hole)
+{
+	int length = 0;
+
+	*hole = 0;
+	if (files.eof) return 0;
+	if (!files.sparse) {
+		errno = 0;
+		length = fread(*buf, 1, UTIL_BSIZE, files.in);
+		if (ferror(files.in)) return -1;
+		if (feof(files.in)) files.eof = 1;
+		return length;
+	}
+
+#ifndef ON_WINDOWS
+	{
+		off_t pos;
+		int got;
+
+		if (next_extent(&pos, &length, hole) != 0) return -1;
+		if (length == 0) return 0;
+		if (files.map != NULL) {
+			*buf = files.map + pos;
+			return length;
+		}
+		got = read_at(*buf, pos, length);
+		if (got < 0) return -1;
+		/* File shrank while reading */
+		if (got < length) files.eof = 1;
+		length = got;
+	}
+#endif
+	return length;
+}
+
+
+#ifndef ON_WINDOWS
+/* Write all of buf at pos, dropping O_DIRECT if a short write unaligns it */
+static int direct_pwrite(const unsigned char *buf, size_t len, off_t pos)
+{
+	const int fd = fileno(files.out);
+	ssize_t i;
+
+	while (len > 0) {
+		if ((len | (size_t)pos | (size_t)(uintptr_t)buf) & (UTIL_DIRECT_ALIGN - 1))
+			if (drop_direct(fd) != 0) return -1;
+		i = pwrite(fd, buf, len, pos);
+		if (i < 0 && errno == EINTR) continue;
+		if (i <= 0) return -1;
+		buf += i; pos += i; len -= (size_t)i;
+	}
+	return 0;
+}
+
+
+/* Write out the aligned part of the O_DIRECT buffer */
+static int direct_flush(void)
+{
+	const int aligned = files.dlen & ~(UTIL_DIRECT_ALIGN - 1);
+
+	if (aligned == 0) return 0;
+	if (direct_pwrite(files.dbuf, (size_t)aligned, files.dpos) != 0) return -1;
+	files.dpos += aligned;
+	files.dlen -= aligned;
+	memmove(files.dbuf, files.dbuf + aligned, (size_t)files.dlen);
+	return 0;
+}
+
+
+/* Queue data (or zeroes if data is NULL) in the O_DIRECT buffer */
+static int direct_write(const unsigned char *data, uint64_t len)
+{
+	int chunk;
+
+	while (len > 0) {
+		chunk = UTIL_BSIZE - files.dlen;
+		if ((uint64_t)chunk > len) chunk = (int)len;
+		if (data != NULL) {
+			memcpy(files.dbuf + files.dlen, data, (size_t)chunk);
+			data += chunk;
+		} else memset(files.dbuf + files.dlen, 0, (size_t)chunk);
+		files.dlen += chunk;
+		len -= (uint64_t)chunk;
+		if (files.dlen == UTIL_BSIZE && direct_flush() != 0) return -1;
+	}
+	return 0;
+}
+#endif /* ON_WINDOWS */
+
+
+/* Seek over any pending output hole before writing data */
+static int seek_hole(void)
+{
+	off_t gap;
+
+	if (files.skip == 0) return 0;
+#ifndef ON_WINDOWS
+	if (files.direct_out) {
+		/* Zero-fill up to an aligned offset, then skip aligned blocks */
+		gap = (-(files.dpos + files.dlen)) & (UTIL_DIRECT_ALIGN - 1);
+		if (gap > files.skip) gap = files.skip;
+		if (direct_write(NULL, (uint64_t)gap) != 0) return -1;
+		files.skip -= gap;
+		if (files.skip >= UTIL_DIRECT_ALIGN) {
+			if (direct_flush() != 0) return -1;
+			files.dpos += files.skip & ~(off_t)(UTIL_DIRECT_ALIGN - 1);
+			files.skip &= UTIL_DIRECT_ALIGN - 1;
+		}
+		if (direct_write(NULL, (uint64_t)files.skip) != 0) return -1;
+		files.skip = 0;
+		return 0;
+	}
+#else
+	(void)gap;
+#endif
+	if (fseeko(files.out, files.skip, SEEK_CUR) != 0) return -1;
+	files.skip = 0;
+	return 0;
+}
+
+
+/* Extend a sparse output file over a trailing hole and finish O_DIRECT
+ * output, writing the unaligned tail without O_DIRECT */
+static int finish_output(void)
+{
+	off_t end;
+
+#ifndef ON_WINDOWS
+	if (files.direct_out) {
+		end = files.dpos + files.dlen + files.skip;
+		if (seek_hole() != 0 || direct_flush() != 0) return -1;
+		if (files.dlen > 0 && direct_pwrite(files.dbuf, (size_t)files.dlen, files.dpos) != 0) return -1;
+		files.dpos += files.dlen;
+		files.dlen = 0;
+		if (files.out_sparse && ftruncate(fileno(files.out), end) != 0) return -1;
+		free(files.dbuf);
+		files.dbuf = NULL;
+		return 0;
+	}
+#endif
+	if (!files.out_sparse || files.skip == 0) return 0;
+	if (fflush(files.out) != 0) return -1;
+	end = ftello(files.out) + files.skip;
+	if (ftruncate(fileno(files.out), end) != 0) return -1;
+	return seek_hole();
+}
+
+
+/* Write decompressed data; zero blocks become holes in sparse output */
+static int write_data(const unsigned char * const data, const int length)
+{
+	if (files.out_sparse) {
+		/* Same zero test the compressor uses for zero run records */
+		if (lzjody_kern.is_zero(data, (unsigned int)length)) {
+			files.skip += length;
+			return 0;
+		}
+		if (seek_hole() != 0) return -1;
+	}
+#ifndef ON_WINDOWS
+	if (files.direct_out) return direct_write(data, (uint64_t)length);
+#endif
+	if (fwrite(data, 1, length, files.out) != (size_t)length) return -1;
+	return 0;
+}
+
+
+/* Write a run of zero bytes */
+static int write_zeroes(uint64_t count)
+{
+	static const unsigned char zeroes[65536];
+	size_t chunk;
+
+	if (files.out_sparse) {
+		files.skip += (off_t)count;
+		return 0;
+	}
+#ifndef ON_WINDOWS
+	if (files.direct_out) return direct_write(NULL, count);
+#endif
+	while (count > 0) {
+		chunk = (count > sizeof(zeroes)) ? sizeof(zeroes) : (size_t)count;
+		if (fwrite(zeroes, 1, chunk, files.out) != chunk) return -1;
+		count -= chunk;
+	}
+	return 0;
+}
+
+
 #ifdef THREADED
 static void *compress_thread(void *arg)
 {
 	struct thread_info * const thr = arg;
+	const uint64_t start = report_clock();
 	int bytes;
 
 	thr->out_length = 0;
-	bytes = lzjody_compress(thr->in, thr->out, thr->options, thr->in_length);
+	lzjody_stats_reset();
+	if (thr->ref != NULL)
+		bytes = lzjody_compress_ref(thr->in, thr->out, thr->options, thr->in_length, thr->offset, thr->ref);
+	else bytes = lzjody_compress(thr->in, thr->out, thr->options, thr->in_length);
+	thr->busy = report_clock() - start;
+	if (lzjody_stats_get(&thr->stats) != 0) thr->stats.blocks = 0;
 	if (bytes < 0) {
 		thread_error = 1;
 		pthread_mutex_lock(&mtx);
@@ -125,9 +617,8 @@ write_only:
 			break;
 		}
 		if (cur->block == blocknum) {
-			errno = 0;
-			fwrite(cur->data, cur->length, 1, files.out);
-			if (unlikely(errno != 0 || ferror(files.out))) return -1;
+			/* The I/O engine frees the data once it is written */
+			if (unlikely(io_write(cur->data, cur->length) != 0)) return -1;
 			// Remove from list
 			if (cur == writes) {
 				// Head of list
@@ -141,7 +632,7 @@ write_only:
 			}
 			del = cur;
 			cur = cur->next;
-			free(del->data); free(del);
+			free(del);
 			blocknum++;
 		} else {
 			prev = cur;
@@ -162,13 +653,38 @@ int main(int argc, char **argv)
 	int length = 0;	/* Incoming data block length counter */
 	int c_length;   /* Compressed block length temp variable */
 	int blocknum = 0;	/* Current block number */
-	unsigned char options = 0;	/* Compressor options */
+	unsigned int options = 0;	/* Compressor options */
+	unsigned int format = 0;	/* Stream format options (from header) */
+	int bsize = LZJODY_BSIZE;	/* Stream block size */
+	int prefix_len;	/* Block prefix length */
+	int rec_len;	/* Stored size of the current record */
+	unsigned char *ring = NULL;	/* Recent blocks for repeat records */
+	int *ring_len = NULL;
+	off_t *ring_off = NULL;	/* Output offsets of recent blocks (mmap mode) */
+#ifndef ON_WINDOWS
+	struct lzjody_scan_t scan;	/* Stream size for mapped output */
+#endif
+	unsigned char *cur_blk, *rec, *p;
+	unsigned char check[LZJODY_CHECK_LEN], *chk;
+	int nslots = 0, recnum = 0;
+	int use_mmap = 0;
+	int use_direct = 0;
+	int queue_depth = UTIL_QUEUE_DEPTH;	/* I/O engine read-ahead */
+	struct io_chunk *chunk;
+	uint64_t value = 0;
+	const char *in_name = NULL, *out_name = NULL;
+	const char *ref_name = NULL;	/* Reference image for delta mode */
+	unsigned char *ref_map = NULL;
+	uint64_t ref_size = 0, stream_pos = 0;
+	struct lzjody_ref *ref = NULL;
+	uint64_t t0;	/* report_clock() at the start of a timed stage */
 #ifdef THREADED
 	struct thread_info *thrs; /* Thread states */
-	unsigned char *in_blks;	/* Thread data blocks */
 	int nprocs = 1;		/* Number of processors */
 	int t_open;	/* Number of available threads */
 	int eof = 0;	/* End of file? */
+#else
+	struct lzjody_stats lib_stats;	/* Compressor counters (STATS=1 library) */
 #endif /* THREADED */
 
 	if (argc < 2) goto usage;
@@ -186,24 +702,153 @@ int main(int argc, char **argv)
 		printf("lzjody utility %s (%s)%s, using lzjody %s (%s)\n",
 				LZJODY_UTIL_VER, LZJODY_UTIL_VERDATE,
 				LZJODY_UTIL_THREADED, LZJODY_VER, LZJODY_VERDATE);
-		printf("usage: lzjody -c|-d\n");
-		printf(" -c  compress data from stdin to stdout\n");
-		printf(" -d  decompress compressed data from stdin to stdout\n");
+		printf("usage: lzjody -c|-d [-b size] [-C] [-e] [-m] [-D] [-q depth] [--ref file] [--stats[=json]]\n");
+		printf("              [infile [outfile]]\n");
+		printf("       lzjody --verify [infile]\n");
+		printf(" -c  compress data from infile (or stdin) to outfile (or stdout)\n");
+		printf(" -d  decompress compressed data from infile (or stdin) to outfile (or stdout)\n");
+		printf(" --verify  check every block of compressed data without writing output\n");
+		printf(" -b  compression block size in KiB: 4 (default), 16, 64, 256\n");
+		printf(" -C  store a CRC32C checksum with every block\n");
+		printf(" -e  entropy code compressed blocks (smaller output, slower)\n");
+		printf(" -m  memory-map named input and output files instead of copying\n");
+		printf(" -D  bypass the page cache (O_DIRECT) for the named raw data file\n");
+		printf(" -q  compression I/O queue depth (default %d, 0 = synchronous I/O)\n", UTIL_QUEUE_DEPTH);
+		printf(" --ref  store blocks as changes against a reference file (needed again\n");
+		printf("        to decompress)\n");
+		printf(" --stats  report time spent per stage, thread load and block ratios on\n");
+		printf("          stderr; --stats=json prints the same as one JSON object\n");
+		printf("A file name of '-' means stdin or stdout. Holes in a named input\n");
+		printf("file are not read and are stored as zero run records.\n");
 		exit(EXIT_SUCCESS);
 	}
+
+	/* Zero runs, repeat records and LZ repeats are always used when
+	 * compressing; the stream header tells decompressors about the last */
+	options = O_DEDUP | O_LZ_REPEAT;
+
+	/* Parse options following the mode switch */
+	for (i = 2; i < argc; i++) {
+		if (!strcmp(argv[i], "-b") && (i + 1) < argc) {
+			i++;
+			switch (atoi(argv[i])) {
+				case 4:
+					options |= O_BSIZE_4K;
+					break;
+				case 16:
+					options |= O_BSIZE_16K;
+					break;
+				case 64:
+					options |= O_BSIZE_64K;
+					break;
+				case 256:
+					options |= O_BSIZE_256K;
+					break;
+				default:
+					goto usage;
+			}
+		} else if (!strcmp(argv[i], "-q") && (i + 1) < argc) {
+			i++;
+			queue_depth = atoi(argv[i]);
+			if (queue_depth < 0 || queue_depth > 1024) goto usage;
+		} else if (!strcmp(argv[i], "-C")) options |= O_CHECKSUM;
+		else if (!strcmp(argv[i], "-e")) options |= O_ENTROPY;
+		else if (!strcmp(argv[i], "-m")) use_mmap = 1;
+		else if (!strcmp(argv[i], "-D")) use_direct = 1;
+		else if (!strcmp(argv[i], "--stats")) report_start(0, strncmp(argv[1], "-d", 2) == 0);
+		else if (!strcmp(argv[i], "--stats=json")) report_start(1, strncmp(argv[1], "-d", 2) == 0);
+		else if (!strcmp(argv[i], "--ref") && (i + 1) < argc) {
+			i++;
+			ref_name = argv[i];
+		} else if (in_name == NULL) in_name = argv[i];
+		else if (out_name == NULL) out_name = argv[i];
+		else goto usage;
+	}
+	/* Verifying never writes anything */
+	if (!strcmp(argv[1], "--verify") && out_name != NULL) goto usage;
+	/* Only the input is read directly when compressing, and only the
+	 * output is written directly when decompressing */
+	if (!strcmp(argv[1], "--verify")) i = OPEN_MAP_IN;
+	else if (!strncmp(argv[1], "-d", 2)) i = (use_mmap ? OPEN_MAP_IN | OPEN_MAP_OUT : 0) | (use_direct ? OPEN_DIRECT_OUT : 0);
+	else i = (use_mmap ? OPEN_MAP_IN | OPEN_MAP_OUT : 0) | (use_direct ? OPEN_DIRECT_IN : 0);
+	i = open_files(in_name, out_name, i);
+	if (i == -1) goto error_open_in;
+	if (i == -2) goto error_open_out;
+	if (ref_name != NULL) {
+		ref_map = map_reference(ref_name, &ref_size);
+		if (ref_map == NULL) goto error_open_ref;
+	}
+
 	if (!strncmp(argv[1], "-c", 2)) {
+		/* The reference's blocks are indexed once for all threads */
+		if (ref_map != NULL) {
+			options |= O_REFERENCE;
+			ref = lzjody_ref_create(ref_map, ref_size, options);
+			if (ref == NULL) goto error_compression;
+		}
+
+#ifndef ON_WINDOWS
+		/* Mapped output is sized once for the worst case of the mapped input */
+		if (files.map_out && files.map == NULL) files.map_out = 0;
+		if (files.map_out && map_output(stream_bound((uint64_t)files.size, options)) != 0) goto error_write;
+#endif
+
+		/* Write the stream header */
+		i = lzjody_write_header(out, options);
+		if (i < 0) goto error_compression;
+		if (files.map_out) {
+			memcpy(files.omap, out, i);
+			files.opos = i;
+		} else if (unlikely(!fwrite(out, i, 1, files.out))) goto error_write;
+		report.bytes_out += (uint64_t)i;
+
 #ifndef THREADED
-		/* Non-threaded compression */
-		errno = 0;
-		while ((length = fread(blk, 1, UTIL_BSIZE, files.in))) {
-			if (ferror(files.in)) goto error_read;
-			i = lzjody_compress(blk, out, options, length);
+		/* Non-threaded compression; the I/O engine reads ahead and writes behind */
+		if (io_start(queue_depth + 1, queue_depth == 0) != 0) goto oom;
+		DLOG("I/O engine: %s\n", io_engine_name());
+		while (1) {
+			t0 = report_clock();
+			chunk = io_get_chunk();
+			report_time(STAGE_READ, t0);
+			if (chunk == NULL) goto error_read;
+			if (chunk->hole != 0) {
+				/* Skipped hole: store it as a zero run */
+				p = (unsigned char *)malloc(LZJODY_RECORD_MAX);
+				if (p == NULL) goto oom;
+				i = lzjody_zero_run(p, chunk->hole, options);
+				stream_pos += chunk->hole;
+				if (i > 0) report_record(O_ZERORUN, chunk->hole, (uint64_t)i);
+				io_put_chunk(chunk);
+				if (i < 0) goto error_compression;
+				t0 = report_clock();
+				if (unlikely(io_write(p, i) != 0)) goto error_write;
+				report_time(STAGE_WRITE, t0);
+				continue;
+			}
+			length = chunk->length;
+			if (length == 0) {
+				io_put_chunk(chunk);
+				break;
+			}
+			p = (unsigned char *)malloc(UTIL_BSIZE_ALLOC);
+			if (p == NULL) goto oom;
+			t0 = report_clock();
+			if (ref != NULL) i = lzjody_compress_ref(chunk->buf, p, options, length, stream_pos, ref);
+			else i = lzjody_compress(chunk->buf, p, options, length);
+			report_time(STAGE_COMPUTE, t0);
+			stream_pos += length;
+			io_put_chunk(chunk);
 			if (i < 0) goto error_compression;
-			i = fwrite(out, i, 1, files.out);
-			if (unlikely(!i)) goto error_write;
+			report_chunk(p, i, length, options);
+			t0 = report_clock();
+			if (unlikely(io_write(p, i) != 0)) goto error_write;
+			report_time(STAGE_WRITE, t0);
 			blocknum++;
-			errno = 0;
 		}
+		t0 = report_clock();
+		if (io_finish() != 0) goto error_write;
+		report_time(STAGE_WRITE, t0);
+		if (lzjody_stats_get(&lib_stats) == 0) report_lib(&lib_stats);
 
 #else /* Using POSIX threads */
 
@@ -220,16 +865,13 @@ int main(int argc, char **argv)
 		fprintf(stderr, "lzjody: compressing with %d worker threads\n", nprocs);
  #endif
 
-		/* Allocate per-thread input/output memory and control blocks */
+		/* Allocate per-thread control blocks; input comes from the I/O engine,
+		 * which needs a chunk for every worker plus the read-ahead queue */
 		thrs = (struct thread_info *)calloc(nprocs, sizeof(struct thread_info));
 		if (thrs == NULL) goto oom;
-		in_blks = (unsigned char *)malloc(UTIL_BSIZE * nprocs);
-		if (in_blks == NULL) goto oom;
-
-		/* Assign compressor input blocks */
-		for (i = 0; i < nprocs; i++) {
-			(thrs + i)->in = in_blks + (UTIL_BSIZE * i);
-		};
+		if (report.enabled && report_threads(nprocs) != 0) goto oom;
+		if (io_start(queue_depth + nprocs, queue_depth == 0) != 0) goto oom;
+		DLOG("I/O engine: %s\n", io_engine_name());
 
 		thread_error = 0;
 		while (1) {
@@ -245,7 +887,16 @@ int main(int argc, char **argv)
 				}
 				if (cur->working == -1) {
 					// Reap thread
+					if (report.enabled) {
+						report.busy[i] += cur->busy;
+						report.stage[STAGE_COMPUTE] += cur->busy;
+						report_chunk(cur->out, cur->out_length, cur->in_length, options);
+						if (cur->stats.blocks != 0) report_lib(&cur->stats);
+					}
+					t0 = report_clock();
 					if (unlikely(thread_write_and_free(cur) < 0)) goto error_write;
+					report_time(STAGE_WRITE, t0);
+					io_put_chunk(cur->chunk);
 					pthread_detach(cur->id);
 					if (thread_error != 0) goto error_compression;
 					cur->working = 0;
@@ -256,7 +907,9 @@ int main(int argc, char **argv)
 			// If no threads are open and not EOF then wait for one
 			// If EOF then wait for a thread too
 			if (t_open == 0 || unlikely(t_open != nprocs && eof == 1)) {
+				t0 = report_clock();
 				pthread_cond_wait(&thread_change, &mtx);
+				report_time(STAGE_REORDER, t0);
 				pthread_mutex_unlock(&mtx);
 				continue;
 			}
@@ -268,15 +921,42 @@ int main(int argc, char **argv)
 			if (eof == 0) for (i = 0; i < nprocs; i++) {
 				cur = thrs + i;
 				if (cur->working == 0) {
-//					cur->out = (unsigned char *)malloc(LZJODY_BSIZE + 8);
+					t0 = report_clock();
+					chunk = io_get_chunk();
+					report_time(STAGE_READ, t0);
+					if (unlikely(chunk == NULL)) goto error_read;
+					if (chunk->hole != 0) {
+						/* Holes are queued directly as zero run records */
+						struct thread_info zr;
+
+						zr.out = (unsigned char *)malloc(LZJODY_RECORD_MAX);
+						if (zr.out == NULL) goto oom;
+						zr.out_length = lzjody_zero_run(zr.out, chunk->hole, options);
+						stream_pos += chunk->hole;
+						if (zr.out_length > 0) report_record(O_ZERORUN, chunk->hole, (uint64_t)zr.out_length);
+						io_put_chunk(chunk);
+						if (zr.out_length < 0) goto error_compression;
+						zr.block = blocknum;
+						blocknum++;
+						if (unlikely(thread_write_and_free(&zr) < 0)) goto error_write;
+						i--;
+						continue;
+					}
+					if (chunk->length == 0) {
+						io_put_chunk(chunk);
+						eof = 1;
+						break;
+					}
+					cur->chunk = chunk;
+					cur->in = chunk->buf;
+					cur->in_length = chunk->length;
 					cur->out = (unsigned char *)malloc(UTIL_BSIZE_ALLOC);
-					errno = 0;
-//					cur->in_length = fread(cur->in, 1, LZJODY_BSIZE, files.in);
-					cur->in_length = fread(cur->in, 1, UTIL_BSIZE, files.in);
-					if (unlikely(errno != 0 || ferror(files.in))) goto error_read;
-					if (feof(files.in)) eof = 1;
-					if (cur->in_length == 0) break;
+					if (cur->out == NULL) goto oom;
 					cur->block = blocknum;
+					cur->options = options;
+					cur->offset = stream_pos;
+					cur->ref = ref;
+					stream_pos += chunk->length;
 					blocknum++;
 					cur->working = 1;
 					pthread_create(&(cur->id), NULL, compress_thread, (void *)cur);
@@ -284,59 +964,216 @@ int main(int argc, char **argv)
 				if (eof == 1) break;
 			}
 		}
+		t0 = report_clock();
 		if (unlikely(thread_write_and_free(NULL) < 0)) goto error_write;
-		free(thrs); free(in_blks);
+		if (io_finish() != 0) goto error_write;
+		report_time(STAGE_WRITE, t0);
+		free(thrs);
 #endif /* THREADED */
+#ifndef ON_WINDOWS
+		if (files.map_out && unmap_output() != 0) goto error_write;
+#endif
+		lzjody_ref_free(ref);
 	}
 
 	/* Decompress */
 	if (!strncmp(argv[1], "-d", 2)) {
-		errno = 0;
-		while(fread(blk, 1, 2, files.in)) {
+		/* Version 0 streams have no header, so peek at the first byte */
+		if (files.map != NULL) {
+			i = (files.map[0] == (unsigned char)LZJODY_MAGIC[0]) ?
+				lzjody_read_header(files.map, (files.size < LZJODY_HEADER_LEN) ?
+						(unsigned int)files.size : LZJODY_HEADER_LEN, &format) : 0;
+			if (i < 0 || (i == 0 && files.map[0] == (unsigned char)LZJODY_MAGIC[0])) goto error_header;
+			files.pos = i;
+			report.bytes_out += (uint64_t)i;
+		} else if ((i = fgetc(files.in)) == (unsigned char)LZJODY_MAGIC[0]) {
+			*blk = (unsigned char)i;
+			i = fread(blk + 1, 1, LZJODY_HEADER_LEN - 1, files.in);
+			if (ferror(files.in)) goto error_read;
+			if (lzjody_read_header(blk, i + 1, &format) <= 0) goto error_header;
+			report.bytes_out += (uint64_t)i + 1;
+		} else if (i != EOF) ungetc(i, files.in);
+		bsize = LZJODY_BSIZE_OF(format);
+		prefix_len = LZJODY_PREFIX_LEN(format);
+		if ((format & O_REFERENCE) && ref_map == NULL) goto error_need_ref;
+
+#ifndef ON_WINDOWS
+		/* Mapped output is sized once from a scan of the mapped input, with
+		 * a block to spare because blocks decode in place at the end of it */
+		if (files.map_out && files.map == NULL) files.map_out = 0;
+		if (files.map_out) {
+			if (lzjody_scan(files.map, (uint64_t)files.size, &scan) != 0) goto error_verify;
+			free(scan.sizes);
+			if (map_output(scan.total + (uint64_t)bsize) != 0) goto error_write;
+		}
+#endif
+
+		/* Keep the most recent blocks around for repeat records
+		 * Mapped output already holds them, so only offsets are kept */
+		nslots = LZJODY_REPEAT_BLOCKS(format);
+		ring_len = (int *)calloc(nslots, sizeof(int));
+		if (ring_len == NULL) goto oom;
+		if (files.map_out) ring_off = (off_t *)calloc(nslots, sizeof(off_t));
+		else ring = (unsigned char *)malloc((size_t)nslots * bsize);
+		if (ring == NULL && ring_off == NULL) goto oom;
+
+		rec = blk;
+		t0 = report_clock();
+		while ((i = get_input(&rec, prefix_len)) > 0) {
 			/* Get block-level decompression options */
-			options = *blk & 0xc0;
+			options = *rec & O_RECORD_MASK;
 
 			/* Read the length of the compressed data */
-			length = *(blk + 1);
-			length |= ((*blk & 0x1f) << 8);
-			if (length > (LZJODY_BSIZE + 4)) goto error_blocksize_d_prefix;
+			length = *(rec + 1);
+			length |= ((*rec & 0x1f) << 8);
+			if (prefix_len > 2) length = (length << 8) | *(rec + 2);
+			if (length > (bsize + LZJODY_MAX_EXPAND(format))) goto error_blocksize_d_prefix;
+			rec_len = prefix_len + length;
 
-			i = fread(blk, 1, length, files.in);
-			if (ferror(files.in)) goto error_read;
+			i = get_input(&rec, length);
+			if (i < 0) goto error_read;
 			if (i != length) goto error_shortread;
+			if ((format & O_CHECKSUM) && options != O_ZERORUN) {
+				chk = check;
+				if (get_input(&chk, LZJODY_CHECK_LEN) != LZJODY_CHECK_LEN) goto error_shortread;
+				rec_len += LZJODY_CHECK_LEN;
+			}
+			report_time(STAGE_READ, t0);
+			t0 = report_clock();
+
+			/* Zero runs, repeats and reference blocks carry a big-endian value */
+			if (options == O_ZERORUN || options == O_REPEAT || options == O_REFBLOCK) {
+				if (length < 1 || length > 8) goto error_record;
+				value = 0;
+				for (i = 0; i < length; i++) value = (value << 8) | *(rec + i);
+			}
 
-			if (options & O_NOCOMPRESS) {
-				c_length = *(blk + 1);
-				c_length |= ((*blk & 0x1f) << 8);
-				if (c_length > LZJODY_BSIZE) goto error_unc_length;
-				i = fwrite((blk + 2), 1, c_length, files.out);
-				if (i != c_length) {
-					length = c_length;
-					goto error_write;
+			if (options == O_ZERORUN) {
+				/* Mapped output is pre-sized, so the zeroes are already there */
+				if (files.map_out) {
+					if (value > (uint64_t)(files.osize - files.opos)) goto error_record;
+					files.opos += (off_t)value;
 				}
-			} else {
-				length = lzjody_decompress(blk, out, i, options);
-				if (length < 0) goto error_decompress;
-				if (length > LZJODY_BSIZE) goto error_blocksize_decomp;
-				i = fwrite(out, 1, length, files.out);
-				if (i != length) goto error_write;
+				else if (write_zeroes(value) != 0) goto error_write;
+				report_time(STAGE_WRITE, t0);
+				report_record(O_ZERORUN, value, (uint64_t)rec_len);
+				stream_pos += value;
+				blocknum++;
+				t0 = report_clock();
+				continue;
 			}
 
+#ifndef ON_WINDOWS
+			if (files.map_out) {
+				if (files.osize - files.opos < bsize) goto error_record;
+				cur_blk = files.omap + files.opos;
+			} else
+#endif
+			cur_blk = ring + (size_t)(recnum % nslots) * bsize;
+			if (options == O_REPEAT) {
+				if (value == 0 || value > (uint64_t)recnum || value > (uint64_t)nslots) goto error_record;
+				i = (int)((recnum - value) % nslots);
+				length = ring_len[i];
+				if (files.map_out) p = files.omap + ring_off[i];
+				else p = ring + (size_t)i * bsize;
+				memcpy(cur_blk, p, length);
+			} else if (options == O_NOCOMPRESS) {
+				c_length = *(rec + 1);
+				c_length |= ((*rec & 0x1f) << 8);
+				if (c_length > bsize) goto error_unc_length;
+				memcpy(cur_blk, rec + 2, c_length);
+				length = c_length;
+			} else if (options == 0) {
+				length = lzjody_decompress(rec, cur_blk, i, format);
+				if (length < 0) goto error_decompress;
+				if (length > bsize) goto error_blocksize_decomp;
+			} else if (options == O_REFBLOCK && (format & O_REFERENCE)) {
+				if (value >= ref_size / (uint64_t)bsize) goto error_record;
+				memcpy(cur_blk, ref_map + value * bsize, bsize);
+				length = bsize;
+			} else if (options == O_REFWINDOW && (format & O_REFERENCE)) {
+				length = lzjody_decompress_ref(rec, cur_blk, i, format, stream_pos, ref_map, ref_size);
+				if (length < 0) goto error_decompress;
+				if (length > bsize) goto error_blocksize_decomp;
+			} else goto error_record;
+
+			if ((format & O_CHECKSUM) && lzjody_crc32c(cur_blk, length) !=
+					(((uint32_t)chk[0] << 24) | ((uint32_t)chk[1] << 16) | ((uint32_t)chk[2] << 8) | chk[3]))
+				goto error_checksum;
+			report_time(STAGE_COMPUTE, t0);
+			report_record(options, (uint64_t)length, (uint64_t)rec_len);
+
+			t0 = report_clock();
+			if (files.map_out) {
+				ring_off[recnum % nslots] = files.opos;
+				files.opos += length;
+			} else if (write_data(cur_blk, length) != 0) goto error_write;
+			report_time(STAGE_WRITE, t0);
+			ring_len[recnum % nslots] = length;
+			stream_pos += length;
+			recnum++;
 			blocknum++;
-			errno = 0;
+			rec = blk;
+			t0 = report_clock();
 		}
+		report_time(STAGE_READ, t0);
+		if (i < 0) goto error_read;
+		t0 = report_clock();
+#ifndef ON_WINDOWS
+		if (files.map_out && unmap_output() != 0) goto error_write;
+#endif
+		if (finish_output() != 0) goto error_write;
+		report_time(STAGE_WRITE, t0);
+		free(ring); free(ring_off); free(ring_len);
 	}
 
+	/* Check a whole compressed stream without writing anything */
+	if (!strcmp(argv[1], "--verify")) {
+		p = files.map;
+		if (p == NULL) {
+			/* Not mappable (a pipe): read the whole stream into memory */
+			size_t size = 0, alloc = 0, got;
+
+			while (1) {
+				if (size == alloc) {
+					alloc = alloc ? alloc * 2 : UTIL_BSIZE;
+					p = (unsigned char *)realloc(p, alloc);
+					if (p == NULL) goto oom;
+				}
+				got = fread(p + size, 1, alloc - size, files.in);
+				if (ferror(files.in)) goto error_read;
+				if (got == 0) break;
+				size += got;
+			}
+			files.size = size;
+		}
+		if (lzjody_verify(p, (uint64_t)files.size, NULL) != 0) goto error_verify;
+		if (p != files.map) free(p);
+	}
+
+	report_print();
 	exit(EXIT_SUCCESS);
 
 error_compression:
 	fprintf(stderr, "Fatal error during compression, aborting.\n");
 	exit(EXIT_FAILURE);
+error_open_in:
+	fprintf(stderr, "Error opening file '%s': %s\n", in_name, strerror(errno));
+	exit(EXIT_FAILURE);
+error_open_out:
+	fprintf(stderr, "Error opening file '%s': %s\n", out_name, strerror(errno));
+	exit(EXIT_FAILURE);
+error_open_ref:
+	fprintf(stderr, "Error opening reference file '%s': %s\n", ref_name, strerror(errno));
+	exit(EXIT_FAILURE);
+error_need_ref:
+	fprintf(stderr, "Error: this stream was compressed against a reference file (use --ref)\n");
+	exit(EXIT_FAILURE);
 error_read:
-	fprintf(stderr, "Error reading file '%s': %s\n", "stdin", strerror(errno));
+	fprintf(stderr, "Error reading file '%s': %s\n", files.in_name, strerror(errno));
 	exit(EXIT_FAILURE);
 error_write:
-	fprintf(stderr, "Error writing file %s\n", "stdout");
+	fprintf(stderr, "Error writing file %s\n", files.out_name);
 	exit(EXIT_FAILURE);
 error_shortread:
 	fprintf(stderr, "Error: short read: %d < %d (eof %d, error %d)\n",
@@ -344,24 +1181,34 @@ error_shortread:
 	exit(EXIT_FAILURE);
 error_unc_length:
 	fprintf(stderr, "Error: uncompressed length too large (%d > %d)\n",
-			c_length, LZJODY_BSIZE);
+			c_length, bsize);
 	exit(EXIT_FAILURE);
 error_blocksize_d_prefix:
 	fprintf(stderr, "Error: decompressor prefix too large (%d > %d)\n",
-			length, (LZJODY_BSIZE + 4));
+			length, (bsize + LZJODY_MAX_EXPAND(format)));
 	exit(EXIT_FAILURE);
 error_blocksize_decomp:
 	fprintf(stderr, "Error: decompressor overflow (%d > %d)\n",
-			length, LZJODY_BSIZE);
+			length, bsize);
+	exit(EXIT_FAILURE);
+error_header:
+	fprintf(stderr, "Error: not a valid lzjody stream header\n");
 	exit(EXIT_FAILURE);
 error_decompress:
 	fprintf(stderr, "Error: cannot decompress block %d\n", blocknum);
 	exit(EXIT_FAILURE);
-#ifdef THREADED
+error_record:
+	fprintf(stderr, "Error: invalid block record 0x%x at block %d\n", options, blocknum);
+	exit(EXIT_FAILURE);
+error_checksum:
+	fprintf(stderr, "Error: checksum mismatch at block %d\n", blocknum);
+	exit(EXIT_FAILURE);
+error_verify:
+	fprintf(stderr, "Error: compressed data in '%s' is damaged\n", files.in_name);
+	exit(EXIT_FAILURE);
 oom:
 	fprintf(stderr, "Error: out of memory\n");
 	exit(EXIT_FAILURE);
-#endif
 usage:
 	fprintf(stderr, "lzjody %s, a compression utility by Jody Bruchon (%s)%s\n",
 			LZJODY_UTIL_VER, LZJODY_UTIL_VERDATE,
@@ -371,7 +1218,7 @@ usage:
 			""
 #endif
 			);
-	fprintf(stderr, "\nlzjody -c   compress stdin to stdout\n");
-	fprintf(stderr, "\nlzjody -d   decompress stdin to stdout\n");
+	fprintf(stderr, "\nlzjody -c [-b size] [-e] [-m] [-D] [-q depth] [--ref file] [infile [outfile]]   compress stdin to stdout\n");
+	fprintf(stderr, "\nlzjody -d [-m] [-D] [--ref file] [infile [outfile]]             decompress stdin to stdout\n");
 	exit(EXIT_FAILURE);
 }
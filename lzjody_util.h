@@ -10,8 +10,8 @@
 
 #include <lzjody.h>
 
-#define LZJODY_UTIL_VER "0.4"
-#define LZJODY_UTIL_VERDATE "2023-08-09"
+#define LZJODY_UTIL_VER "0.5"
+#define LZJODY_UTIL_VERDATE "development"
 
 /* Debugging stuff */
 #ifndef DLOG
@@ -28,8 +28,40 @@
 struct files_t {
 	FILE *in;
 	FILE *out;
+	const char *in_name;
+	const char *out_name;
+	int eof;	/* Input is exhausted */
+	int sparse;	/* Input holes are found with SEEK_DATA/SEEK_HOLE */
+	int fd;	/* Input descriptor for sparse reads */
+	off_t pos;	/* Sparse read position */
+	off_t data_end;	/* End of the current data extent */
+	off_t size;	/* Input file size */
+	int out_sparse;	/* Zero output is skipped with a seek */
+	off_t skip;	/* Pending output hole length */
+	unsigned char *map;	/* Memory-mapped input file */
+	int map_out;	/* Output is written to a pre-sized mapping */
+	unsigned char *omap;	/* Mapped output file */
+	off_t opos;	/* Mapped output position */
+	off_t osize;	/* Mapped output size */
+	int direct_in;	/* Input is read with O_DIRECT */
+	int direct_out;	/* Output is written with O_DIRECT */
+	unsigned char *dbuf;	/* Aligned O_DIRECT output buffer */
+	int dlen;	/* Bytes waiting in dbuf */
+	off_t dpos;	/* File offset of dbuf */
 };
 
+/* open_files() modes */
+#define OPEN_MAP_IN 0x01
+#define OPEN_MAP_OUT 0x02
+#define OPEN_DIRECT_IN 0x04
+#define OPEN_DIRECT_OUT 0x08
+
+extern struct files_t files;
+
+extern int next_extent(off_t * const pos, int * const length, uint64_t * const hole);
+extern int read_at(unsigned char * const buf, const off_t pos, const int length);
+extern int read_chunk(unsigned char ** const buf, uint64_t * const hole);
+
 /* File read chunk size */
 #ifndef UTIL_BSIZE
  #define UTIL_BSIZE 1048576
@@ -37,10 +69,17 @@ struct files_t {
 #define MIN_BSIZE 4096
 #define IDEAL_BSIZE 1048576
 
+/* O_DIRECT buffer and transfer alignment */
+#ifndef UTIL_DIRECT_ALIGN
+ #define UTIL_DIRECT_ALIGN 4096
+#endif
+#define DIRECT_ROUND(a) (((a) + UTIL_DIRECT_ALIGN - 1) & ~(off_t)(UTIL_DIRECT_ALIGN - 1))
+
 #ifdef THREADED
  #include <pthread.h>
 /* Per-thread working state */
 struct thread_info {
+	struct io_chunk *chunk;	/* I/O engine chunk holding the input */
 	unsigned char *in;	/* Thread input blocks */
 	unsigned char *out;	/* Thread output blocks */
 	pthread_t id;	/* Thread ID */
@@ -48,7 +87,11 @@ struct thread_info {
 	int in_length;	/* Input size */
 	int out_length;	/* Output size */
 	int working;	/* 0 = idle, 1 = working, -1 = completed */
-	char options;	/* Compressor options */
+	unsigned int options;	/* Compressor options */
+	uint64_t offset;	/* Stream offset of the input */
+	const struct lzjody_ref *ref;	/* Reference index for delta mode */
+	uint64_t busy;	/* Nanoseconds spent compressing (--stats) */
+	struct lzjody_stats stats;	/* Compressor counters (STATS=1 library) */
 };
 
 /* List of blocks to write */
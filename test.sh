@@ -47,6 +47,164 @@ S1="$(sha1sum $IN | cut -d' ' -f1)"; S2="$(sha1sum $OUT | cut -d' ' -f1)"
 test "$S1" != "$S2" && echo -e "\nCompressor/decompressor oversize tests FAILED: mismatched hashes\n" && clean_exit 1
 echo "Oversize tests PASSED"
 
+# Wide format (large block size) tests
+for BS in 16 64 256
+	do
+	CFAIL=0; DFAIL=0
+	IN=testdata/standard
+	$LZJODY -c -b $BS < $IN > $COMP 2>testdata/log.compress3 || CFAIL=1
+	[ $CFAIL -eq 0 ] && $LZJODY -d < $COMP > $OUT 2>testdata/log.decompress3 || DFAIL=1
+	[ $CFAIL -eq 1 ] && echo -e "\nCompressor $BS KiB block test FAILED\n" && clean_exit 1
+	[ $DFAIL -eq 1 ] && echo -e "\nDecompressor $BS KiB block test FAILED\n" && clean_exit 1
+	S1="$(sha1sum $IN | cut -d' ' -f1)"; S2="$(sha1sum $OUT | cut -d' ' -f1)"
+	test "$S1" != "$S2" && echo -e "\nCompressor/decompressor $BS KiB block tests FAILED: mismatched hashes\n" && clean_exit 1
+done
+echo "Wide block tests PASSED"
+
+# Zero block and repeated block records
+CFAIL=0; DFAIL=0
+IN=testdata/cantcompress
+( cat $IN; dd if=/dev/zero bs=4096 count=16 2>/dev/null; cat $IN $IN ) > $TF
+$LZJODY -c < $TF > $COMP 2>testdata/log.compress4 || CFAIL=1
+[ $CFAIL -eq 0 ] && $LZJODY -d < $COMP > $OUT 2>testdata/log.decompress4 || DFAIL=1
+[ $CFAIL -eq 1 ] && echo -e "\nCompressor zero/repeat block test FAILED\n" && clean_exit 1
+[ $DFAIL -eq 1 ] && echo -e "\nDecompressor zero/repeat block test FAILED\n" && clean_exit 1
+S1="$(sha1sum $TF | cut -d' ' -f1)"; S2="$(sha1sum $OUT | cut -d' ' -f1)"
+test "$S1" != "$S2" && echo -e "\nZero/repeat block tests FAILED: mismatched hashes\n" && clean_exit 1
+test "$(wc -c < $COMP)" -gt 4200 && echo -e "\nZero/repeat block tests FAILED: records not used\n" && clean_exit 1
+echo "Zero/repeat block tests PASSED"
+
+# Sparse input read by file name, sparse output written by file name
+CFAIL=0; DFAIL=0
+rm -f $TF; dd if=$IN of=$TF bs=4096 seek=1000 2>/dev/null; truncate -s 8M $TF
+$LZJODY -c $TF $COMP 2>testdata/log.compress5 || CFAIL=1
+rm -f $OUT; [ $CFAIL -eq 0 ] && $LZJODY -d $COMP $OUT 2>testdata/log.decompress5 || DFAIL=1
+[ $CFAIL -eq 1 ] && echo -e "\nCompressor sparse file test FAILED\n" && clean_exit 1
+[ $DFAIL -eq 1 ] && echo -e "\nDecompressor sparse file test FAILED\n" && clean_exit 1
+S1="$(sha1sum $TF | cut -d' ' -f1)"; S2="$(sha1sum $OUT | cut -d' ' -f1)"
+test "$S1" != "$S2" && echo -e "\nSparse file tests FAILED: mismatched hashes\n" && clean_exit 1
+echo "Sparse file tests PASSED"
+
+# Memory-mapped input and output
+CFAIL=0; DFAIL=0
+$LZJODY -c -m $TF $COMP 2>testdata/log.compress6 || CFAIL=1
+rm -f $OUT; [ $CFAIL -eq 0 ] && $LZJODY -d -m $COMP $OUT 2>testdata/log.decompress6 || DFAIL=1
+[ $CFAIL -eq 1 ] && echo -e "\nCompressor mmap test FAILED\n" && clean_exit 1
+[ $DFAIL -eq 1 ] && echo -e "\nDecompressor mmap test FAILED\n" && clean_exit 1
+S2="$(sha1sum $OUT | cut -d' ' -f1)"
+test "$S1" != "$S2" && echo -e "\nMmap tests FAILED: mismatched hashes\n" && clean_exit 1
+echo "Mmap tests PASSED"
+
+# Synchronous I/O must produce the same stream as the I/O engine
+$LZJODY -c -q 0 $TF 2>testdata/log.compress7 | cmp -s - $COMP
+[ $? -ne 0 ] && echo -e "\nSynchronous I/O test FAILED: streams differ\n" && clean_exit 1
+echo "Synchronous I/O tests PASSED"
+
+# O_DIRECT input and output (skipped where the filesystem refuses it)
+if $LZJODY -c -D $TF 2>testdata/log.compress8 | cmp -s - $COMP; then
+	rm -f $OUT; $LZJODY -d -D $COMP $OUT 2>testdata/log.decompress8
+	S2="$(sha1sum $OUT | cut -d' ' -f1)"
+	test "$S1" != "$S2" && echo -e "\nO_DIRECT tests FAILED: mismatched hashes\n" && clean_exit 1
+	echo "O_DIRECT tests PASSED"
+else echo "O_DIRECT tests SKIPPED"
+fi
+
+# Block checksums: round trip, --verify, and a damaged block
+CFAIL=0; DFAIL=0
+$LZJODY -c -C $TF $COMP 2>testdata/log.compress9 || CFAIL=1
+rm -f $OUT; [ $CFAIL -eq 0 ] && $LZJODY -d $COMP $OUT 2>testdata/log.decompress9 || DFAIL=1
+[ $CFAIL -eq 1 ] && echo -e "\nCompressor checksum test FAILED\n" && clean_exit 1
+[ $DFAIL -eq 1 ] && echo -e "\nDecompressor checksum test FAILED\n" && clean_exit 1
+S2="$(sha1sum $OUT | cut -d' ' -f1)"
+test "$S1" != "$S2" && echo -e "\nChecksum tests FAILED: mismatched hashes\n" && clean_exit 1
+! $LZJODY --verify $COMP 2>>testdata/log.decompress9 && echo -e "\nChecksum tests FAILED: good stream rejected\n" && clean_exit 1
+OFF=$(( $(wc -c < $COMP) / 2 )); B=$(od -An -tu1 -j $OFF -N1 $COMP)
+printf "\\$(printf %o $(( B ^ 1 )))" | dd of=$COMP bs=1 seek=$OFF count=1 conv=notrunc 2>/dev/null
+$LZJODY --verify $COMP 2>>testdata/log.decompress9 && echo -e "\nChecksum tests FAILED: damage not found\n" && clean_exit 1
+echo "Checksum tests PASSED"
+
+# Delta compression against a reference file
+CFAIL=0; DFAIL=0
+IN=testdata/standard
+( head -c 100000 $IN; echo "inserted line"; tail -c +100001 $IN ) > $TF
+printf 'XYZ' | dd of=$TF bs=1 seek=300000 count=3 conv=notrunc 2>/dev/null
+$LZJODY -c --ref $IN $TF $COMP 2>testdata/log.compress10 || CFAIL=1
+rm -f $OUT; [ $CFAIL -eq 0 ] && $LZJODY -d --ref $IN $COMP $OUT 2>testdata/log.decompress10 || DFAIL=1
+[ $CFAIL -eq 1 ] && echo -e "\nCompressor reference delta test FAILED\n" && clean_exit 1
+[ $DFAIL -eq 1 ] && echo -e "\nDecompressor reference delta test FAILED\n" && clean_exit 1
+S1="$(sha1sum $TF | cut -d' ' -f1)"; S2="$(sha1sum $OUT | cut -d' ' -f1)"
+test "$S1" != "$S2" && echo -e "\nReference delta tests FAILED: mismatched hashes\n" && clean_exit 1
+test "$(wc -c < $COMP)" -gt 16384 && echo -e "\nReference delta tests FAILED: reference not used\n" && clean_exit 1
+$LZJODY -d $COMP $OUT 2>>testdata/log.decompress10 && echo -e "\nReference delta tests FAILED: no reference needed\n" && clean_exit 1
+echo "Reference delta tests PASSED"
+
+# Entropy coded blocks must round trip and be smaller than plain ones
+CFAIL=0; DFAIL=0
+IN=testdata/standard
+$LZJODY -c -b 64 < $IN > $TF
+$LZJODY -c -e -b 64 $IN $COMP 2>testdata/log.compress11 || CFAIL=1
+rm -f $OUT; [ $CFAIL -eq 0 ] && $LZJODY -d $COMP $OUT 2>testdata/log.decompress11 || DFAIL=1
+[ $CFAIL -eq 1 ] && echo -e "\nCompressor entropy coding test FAILED\n" && clean_exit 1
+[ $DFAIL -eq 1 ] && echo -e "\nDecompressor entropy coding test FAILED\n" && clean_exit 1
+S1="$(sha1sum $IN | cut -d' ' -f1)"; S2="$(sha1sum $OUT | cut -d' ' -f1)"
+test "$S1" != "$S2" && echo -e "\nEntropy coding tests FAILED: mismatched hashes\n" && clean_exit 1
+test "$(wc -c < $COMP)" -ge "$(wc -c < $TF)" && echo -e "\nEntropy coding tests FAILED: blocks not smaller\n" && clean_exit 1
+echo "Entropy coding tests PASSED"
+
+# Scalar and CPU-specific kernels must produce and accept the same streams
+CFAIL=0; DFAIL=0
+IN=testdata/standard
+LZJODY_SIMD=scalar $LZJODY -c -b 64 < $IN > $TF
+$LZJODY -c -b 64 $IN $COMP 2>testdata/log.compress12 || CFAIL=1
+rm -f $OUT; [ $CFAIL -eq 0 ] && LZJODY_SIMD=scalar $LZJODY -d $COMP $OUT 2>testdata/log.decompress12 || DFAIL=1
+[ $CFAIL -eq 1 ] && echo -e "\nCompressor kernel dispatch test FAILED\n" && clean_exit 1
+[ $DFAIL -eq 1 ] && echo -e "\nDecompressor kernel dispatch test FAILED\n" && clean_exit 1
+cmp -s $TF $COMP || { echo -e "\nKernel dispatch tests FAILED: streams differ\n"; clean_exit 1; }
+S1="$(sha1sum $IN | cut -d' ' -f1)"; S2="$(sha1sum $OUT | cut -d' ' -f1)"
+test "$S1" != "$S2" && echo -e "\nKernel dispatch tests FAILED: mismatched hashes\n" && clean_exit 1
+echo "Kernel dispatch tests PASSED"
+
+# --stats must not change the stream and must count the same bytes both ways
+CFAIL=0; DFAIL=0
+IN=testdata/standard
+$LZJODY -c < $IN > $TF
+$LZJODY -c --stats $IN $COMP 2>testdata/log.compress13 || CFAIL=1
+rm -f $OUT; [ $CFAIL -eq 0 ] && $LZJODY -d --stats=json $COMP $OUT 2>testdata/log.decompress13 || DFAIL=1
+[ $CFAIL -eq 1 ] && echo -e "\nCompressor stats report test FAILED\n" && clean_exit 1
+[ $DFAIL -eq 1 ] && echo -e "\nDecompressor stats report test FAILED\n" && clean_exit 1
+cmp -s $TF $COMP || { echo -e "\nStats report tests FAILED: streams differ\n"; clean_exit 1; }
+S1="$(sha1sum $IN | cut -d' ' -f1)"; S2="$(sha1sum $OUT | cut -d' ' -f1)"
+test "$S1" != "$S2" && echo -e "\nStats report tests FAILED: mismatched hashes\n" && clean_exit 1
+S1="$(wc -c < $IN) -> $(wc -c < $COMP) bytes"
+grep -q "compressed $S1" testdata/log.compress13 || { echo -e "\nStats report tests FAILED: bad text report\n"; clean_exit 1; }
+S1="\"mode\":\"decompress\",\"bytes_in\":$(wc -c < $COMP),\"bytes_out\":$(wc -c < $IN),"
+grep -q "$S1" testdata/log.decompress13 || { echo -e "\nStats report tests FAILED: bad JSON report\n"; clean_exit 1; }
+echo "Stats report tests PASSED"
+
+# The benchmark harness checks its own round trips
+if [ -x ./lzjody-bench$EXT ]; then
+	./lzjody-bench$EXT -r 1 -w 0 -s 1 -o all > testdata/log.compress14 2>&1 || \
+		{ echo -e "\nBenchmark harness tests FAILED\n"; clean_exit 1; }
+	echo "Benchmark harness tests PASSED"
+else echo "Benchmark harness tests SKIPPED"
+fi
+
+# The kernel microbenchmarks round trip their decompressor blocks
+if [ -x ./lzjody-micro$EXT ]; then
+	./lzjody-micro$EXT -r 1 -w 0 > testdata/log.compress15 2>&1 || \
+		{ echo -e "\nKernel microbenchmark tests FAILED\n"; clean_exit 1; }
+	echo "Kernel microbenchmark tests PASSED"
+else echo "Kernel microbenchmark tests SKIPPED"
+fi
+
+# Round trips of the library APIs the utility doesn't use
+if [ -x ./lzjody-apitest$EXT ]; then
+	./lzjody-apitest$EXT > testdata/log.compress16 2>&1 || \
+		{ echo -e "\nLibrary API tests FAILED\n"; cat testdata/log.compress16; clean_exit 1; }
+	echo "Library API tests PASSED"
+else echo "Library API tests SKIPPED"
+fi
+
 
 ### Decompressor error tests
 